@@ -0,0 +1,530 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// USnavBatch - runs the USnav logic on sequences without the Slicer GUI.
+// Each sequence gets its own logic; sequences are spread over a pool of
+// worker threads and the reports are printed in the order given.
+
+// USnav Logic includes
+#include "vtkSlicerUSnavLogic.h"
+#include "USnavMatchPolicies.h"
+#include "USnavNativeSequence.h"
+#include "USnavParallel.h"
+#include "USnavSequenceEditor.h"
+
+// VTK includes
+#include <vtkSmartPointer.h>
+#include <vtkTimerLog.h>
+#include <vtksys/Directory.hxx>
+#include <vtksys/SystemTools.hxx>
+
+// STD includes
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace
+{
+struct Options
+{
+  string command;
+  int threads;
+  size_t memoryBudget;
+  string calibration;
+  string transform;
+  int results;
+  double maxAngle;
+  string metric;
+  USnavNativeSequence::Options packing;
+  int first;
+  int last;
+  string output;
+  bool imageMotion;
+  vector<double> poses; // 16 row-major doubles per stylus pose
+  vector<string> sequences;
+};
+
+struct BatchData
+{
+  const Options* options;
+  vector<string>* reports;
+  vector<unsigned char>* failed;
+};
+
+void printUsage()
+{
+  cerr << "Usage: USnavBatch <command> [options] <sequence.mha | sequence.usn | directory>...\n"
+          "Commands:\n"
+          "  index     parse each header and report frames and transforms\n"
+          "  cache     build the downsampled frame cache next to each sequence\n"
+          "  validate  report the tracking status, fail on sequences without valid frames\n"
+          "  match     rank frames for each stylus pose of --poses, as CSV\n"
+          "  stats     per sequence statistics, as CSV\n"
+          "  pack      convert each .mha to a compressed .usn next to it\n"
+          "  unpack    convert each .usn back to the original .mha\n"
+          "  trim      write frames --first to --last of each sequence to <name>_trim.mha\n"
+          "  clean     write the frames with a valid --transform to <name>_valid.mha\n"
+          "  concat    write every frame of the sequences, in order, to --output\n"
+          "Options:\n"
+          "  --threads N          worker threads, 0 for every core (default)\n"
+          "  --memory MB          memory budget of each sequence (default 512)\n"
+          "  --calibration FILE   ImageToProbe matrix, as read by the module\n"
+          "  --transform NAME     tracked transform (default ProbeToTracker)\n"
+          "  --poses FILE         stylus poses, 3 (tip), 12 or 16 numbers per line\n"
+          "  --results N          matches per pose (default 10)\n"
+          "  --max-angle DEGREES  only match frames seen from the stylus direction\n"
+          "  --metric NAME        match metric, see below (default plane)\n"
+          "  --block N            pack: frames per compressed block (default 1)\n"
+          "  --delta              pack: code frames as differences within a block\n"
+          "  --first N, --last N  trim: frame range, both included\n"
+          "  --output FILE        concat: sequence written\n"
+          "  --image-motion       validate: also check the poses against the image motion\n"
+          "Metrics:\n";
+  for(int i=0; i<USnavMatchFrames::getNumberOfMetrics(); i++)
+    cerr << "  " << USnavMatchFrames::getMetricName(i) << ": " << USnavMatchFrames::getMetricDescription(i) << "\n";
+}
+
+// Every .mha and .usn of a directory, sorted, or the file itself
+void addSequences(const string& path, vector<string>& sequences)
+{
+  if(!vtksys::SystemTools::FileIsDirectory(path.c_str()))
+  {
+    sequences.push_back(path);
+    return;
+  }
+  vtksys::Directory directory;
+  if(!directory.Load(path.c_str()))
+    return;
+  vector<string> found;
+  for(unsigned long i=0; i<directory.GetNumberOfFiles(); i++)
+  {
+    string name = directory.GetFile(i);
+    string extension = vtksys::SystemTools::LowerCase(vtksys::SystemTools::GetFilenameLastExtension(name));
+    if(extension == ".mha" || extension == USnavNativeSequence::getExtension())
+      found.push_back(path + "/" + name);
+  }
+  sort(found.begin(), found.end());
+  sequences.insert(sequences.end(), found.begin(), found.end());
+}
+
+bool readPoses(const string& filename, vector<double>& poses)
+{
+  ifstream file( filename.c_str() );
+  if ( !file.is_open() )
+    return false;
+  while( !file.eof() )
+  {
+    string str; getline( file, str );
+    vector<double> values;
+    const char* pch = str.c_str();
+    while( true )
+    {
+      char* next = NULL;
+      double v = strtod( pch, &next );
+      if( next == pch )
+        break;
+      values.push_back( v );
+      // Accept comma separated values too
+      pch = next;
+      while( *pch == ',' || *pch == ';' )
+        pch++;
+    }
+    double pose[16] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 };
+    if( values.size() == 3 )
+    {
+      pose[3] = values[0];
+      pose[7] = values[1];
+      pose[11] = values[2];
+    }
+    else if( values.size() == 12 || values.size() == 16 )
+      copy( values.begin(), values.end(), pose );
+    else if( values.empty() )
+      continue;
+    else
+      return false;
+    poses.insert( poses.end(), pose, pose+16 );
+  }
+  return true;
+}
+
+void reportIndex(vtkSlicerUSnavLogic* logic, const string& path, double seconds, ostringstream& oss)
+{
+  set<string> transforms = logic->getAvailableTransforms();
+  int valid = 0;
+  for(int i=0; i<logic->getNumberOfFrames(); i++)
+    if(logic->isFrameValid(i))
+      valid++;
+  oss << path << ": " << logic->getNumberOfFrames() << " frames " << logic->getImageWidth() << "x"
+      << logic->getImageHeight() << ", transforms";
+  for(set<string>::iterator it=transforms.begin(); it!=transforms.end(); it++)
+    oss << " " << *it;
+  oss << ", " << valid << " valid " << logic->getTrackedTransformName() << " frames in "
+      << logic->getNumberOfSweeps() << " sweeps, indexed in "
+      << seconds << " s\n";
+}
+
+bool reportValidation(vtkSlicerUSnavLogic* logic, const Options& options, const string& path, ostringstream& oss)
+{
+  if(logic->getTrackedTransformName().empty())
+  {
+    oss << path << ": FAILED, no tracked transform\n";
+    return false;
+  }
+  if(options.imageMotion)
+    // Sequences are already spread over the workers; frames the pyramid
+    // does not hold yet are read in full
+    logic->computeImageMotion(1, true);
+  int frames = logic->getNumberOfFrames();
+  int valid = 0, longestGap = 0, gapStart = -1, longestGapStart = -1;
+  for(int i=0; i<=frames; i++)
+  {
+    if(i < frames && !logic->isFrameValid(i))
+    {
+      if(gapStart < 0)
+        gapStart = i;
+      continue;
+    }
+    if(i < frames)
+      valid++;
+    if(gapStart >= 0 && i - gapStart > longestGap)
+    {
+      longestGap = i - gapStart;
+      longestGapStart = gapStart;
+    }
+    gapStart = -1;
+  }
+  oss << path << ": " << (valid > 0 ? "OK" : "FAILED") << ", " << valid << "/" << frames << " valid "
+      << logic->getTrackedTransformName() << " frames";
+  if(longestGap > 0)
+    oss << ", longest invalid run " << longestGap << " frames from frame " << longestGapStart;
+  if(logic->getNumberOfUnstableFrames() > 0)
+    oss << ", " << logic->getNumberOfUnstableFrames() << " flagged for motion, jumps, repeated poses or gaps";
+  if(options.imageMotion)
+    oss << ", " << logic->getNumberOfImageMismatches() << " with images disagreeing with their poses";
+  oss << "\n";
+  return valid > 0;
+}
+
+void reportMatches(vtkSlicerUSnavLogic* logic, const Options& options, const string& path, ostringstream& oss)
+{
+  vector<vector<pair<double,int> > > results;
+  // Sequences are already spread over the workers
+  logic->findMatchingUSBatch(&options.poses[0], (int)(options.poses.size()/16), results, 1);
+  for(size_t p=0; p<results.size(); p++)
+    for(size_t r=0; r<results[p].size(); r++)
+      oss << path << "," << p << "," << r << "," << results[p][r].second << "," << results[p][r].first << "\n";
+}
+
+void reportStatistics(vtkSlicerUSnavLogic* logic, const string& path, ostringstream& oss)
+{
+  int frames = logic->getNumberOfFrames();
+  int valid = 0;
+  double pathLength = 0.0;
+  const double* previous = NULL;
+  for(int i=0; i<frames; i++)
+  {
+    if(!logic->isFrameValid(i))
+      continue;
+    valid++;
+    const double* m = logic->getImageToTrackerMatrix(i);
+    if(previous)
+    {
+      double dx = m[3] - previous[3], dy = m[7] - previous[7], dz = m[11] - previous[11];
+      pathLength += sqrt(dx*dx + dy*dy + dz*dz);
+    }
+    previous = m;
+  }
+  double first = 0.0, last = 0.0;
+  bool timed = frames > 1 && logic->getFrameTimestamp(0, first) && logic->getFrameTimestamp(frames-1, last) && last > first;
+  oss << path << "," << frames << "," << logic->getImageWidth() << "," << logic->getImageHeight() << ","
+      << valid << "," << (timed ? last - first : 0.0) << "," << (timed ? (frames-1)/(last - first) : 0.0) << ","
+      << pathLength << "," << logic->getAvailableTransforms().size() << "\n";
+}
+
+// Converts between .mha and .usn, the output next to the input
+bool convertSequence(const Options& options, const string& path, string& report)
+{
+  bool native = USnavNativeSequence::isNativeFile(path);
+  string output = vtksys::SystemTools::GetFilenameWithoutLastExtension(path);
+  string dir = vtksys::SystemTools::GetFilenamePath(path);
+  if(!dir.empty())
+    output = dir + "/" + output;
+  double start = vtkTimerLog::GetUniversalTime();
+  bool ok = false;
+  if(options.command == "pack")
+  {
+    if(native)
+    {
+      report = path + ": already packed\n";
+      return true;
+    }
+    output += USnavNativeSequence::getExtension();
+    ok = USnavNativeSequence::convertFromMha(path, output, options.packing);
+  }
+  else
+  {
+    if(!native)
+    {
+      report = path + ": not a packed sequence\n";
+      return false;
+    }
+    output += ".mha";
+    // Never overwrite a recording
+    if(vtksys::SystemTools::FileExists(output.c_str()))
+    {
+      report = path + ": " + output + " already exists\n";
+      return false;
+    }
+    ok = USnavNativeSequence::convertToMha(path, output);
+  }
+  ostringstream oss;
+  if(ok)
+    oss << path << ": wrote " << output << " (" << vtksys::SystemTools::FileLength(output) << " bytes from "
+        << vtksys::SystemTools::FileLength(path) << ") in " << vtkTimerLog::GetUniversalTime() - start << " s\n";
+  else
+    oss << path << ": FAILED, " << (options.command == "pack" ? "not an uncompressed 8 bit sequence or " : "")
+        << "could not write " << output << "\n";
+  report = oss.str();
+  return ok;
+}
+
+// Writes an edited copy of a sequence next to it; only the header is
+// rewritten, frames are copied as they are
+bool editSequence(const Options& options, const string& path, string& report)
+{
+  string output = vtksys::SystemTools::GetFilenameWithoutLastExtension(path);
+  string dir = vtksys::SystemTools::GetFilenamePath(path);
+  if(!dir.empty())
+    output = dir + "/" + output;
+  output += options.command == "trim" ? "_trim.mha" : "_valid.mha";
+  if(vtksys::SystemTools::FileExists(output.c_str()))
+  {
+    report = path + ": " + output + " already exists\n";
+    return false;
+  }
+  double start = vtkTimerLog::GetUniversalTime();
+  bool ok;
+  if(options.command == "trim")
+    ok = USnavSequenceEditor::trim(path, options.first, options.last, output);
+  else
+    ok = USnavSequenceEditor::keepValidFrames(path, options.transform.empty() ? "ProbeToTracker" : options.transform,
+                                              output);
+  ostringstream oss;
+  if(ok)
+    oss << path << ": wrote " << output << " (" << vtksys::SystemTools::FileLength(output) << " bytes) in "
+        << vtkTimerLog::GetUniversalTime() - start << " s\n";
+  else
+    oss << path << ": FAILED, not an 8 bit sequence, no frame kept or could not write " << output << "\n";
+  report = oss.str();
+  return ok;
+}
+
+// Loads one sequence and runs the command on it
+bool processSequence(const Options& options, const string& path, string& report)
+{
+  if(options.command == "pack" || options.command == "unpack")
+    return convertSequence(options, path, report);
+  if(options.command == "trim" || options.command == "clean")
+    return editSequence(options, path, report);
+  ostringstream oss;
+  vtkSmartPointer<vtkSlicerUSnavLogic> logic = vtkSmartPointer<vtkSlicerUSnavLogic>::New();
+  logic->setAutoDetectROI(false);
+  // Only the cache command needs the pyramid
+  logic->setMemoryBudget(options.command == "cache" ? options.memoryBudget : 0);
+  if(!options.calibration.empty() && !logic->loadCalibrationFile(options.calibration))
+  {
+    report = path + ": could not read calibration from " + options.calibration + "\n";
+    return false;
+  }
+  if(!options.transform.empty())
+    logic->setTrackedTransformName(options.transform);
+  logic->setMatchingResultCount(options.results);
+  logic->setMatchingMaxAngle(options.maxAngle);
+  logic->setMatchingMetric(options.metric);
+
+  double start = vtkTimerLog::GetUniversalTime();
+  logic->setMhaPath(path);
+  if(logic->getNumberOfFrames() <= 0)
+  {
+    report = path + ": could not read the sequence header\n";
+    return false;
+  }
+
+  bool ok = true;
+  if(options.command == "index")
+    reportIndex(logic, path, vtkTimerLog::GetUniversalTime() - start, oss);
+  else if(options.command == "cache")
+  {
+    ok = logic->waitForPyramid();
+    if(ok)
+      oss << path << ": cached in " << vtkTimerLog::GetUniversalTime() - start << " s\n";
+    else
+      oss << path << ": FAILED, frame cache not built (too large for the memory budget or unreadable)\n";
+  }
+  else if(options.command == "validate")
+    ok = reportValidation(logic, options, path, oss);
+  else if(options.command == "match")
+    reportMatches(logic, options, path, oss);
+  else if(options.command == "stats")
+    reportStatistics(logic, path, oss);
+  report = oss.str();
+  return ok;
+}
+
+void processChunk(int begin, int end, int vtkNotUsed(threadId), void* userData)
+{
+  BatchData* data = static_cast<BatchData*>(userData);
+  for(int i=begin; i<end; i++)
+    (*data->failed)[i] = !processSequence(*data->options, data->options->sequences[i], (*data->reports)[i]);
+}
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc < 3)
+  {
+    printUsage();
+    return EXIT_FAILURE;
+  }
+  Options options;
+  options.command = argv[1];
+  options.threads = 0;
+  options.memoryBudget = 512*1024*1024;
+  options.results = 10;
+  options.maxAngle = 0.0;
+  options.metric = USnavMatchFrames::getMetricName(0);
+  // Sequences are already spread over the workers
+  options.packing.numberOfThreads = 1;
+  options.first = 0;
+  options.last = INT_MAX;
+  options.imageMotion = false;
+  string posesFile;
+  for(int i=2; i<argc; i++)
+  {
+    string arg = argv[i];
+    bool hasValue = i+1 < argc;
+    if(arg == "--threads" && hasValue)
+      options.threads = atoi(argv[++i]);
+    else if(arg == "--memory" && hasValue)
+      options.memoryBudget = (size_t)atoi(argv[++i])*1024*1024;
+    else if(arg == "--calibration" && hasValue)
+      options.calibration = argv[++i];
+    else if(arg == "--transform" && hasValue)
+      options.transform = argv[++i];
+    else if(arg == "--poses" && hasValue)
+      posesFile = argv[++i];
+    else if(arg == "--results" && hasValue)
+      options.results = atoi(argv[++i]);
+    else if(arg == "--max-angle" && hasValue)
+      options.maxAngle = atof(argv[++i]);
+    else if(arg == "--metric" && hasValue)
+      options.metric = argv[++i];
+    else if(arg == "--block" && hasValue)
+      options.packing.framesPerBlock = atoi(argv[++i]);
+    else if(arg == "--delta")
+      options.packing.delta = true;
+    else if(arg == "--first" && hasValue)
+      options.first = atoi(argv[++i]);
+    else if(arg == "--last" && hasValue)
+      options.last = atoi(argv[++i]);
+    else if(arg == "--output" && hasValue)
+      options.output = argv[++i];
+    else if(arg == "--image-motion")
+      options.imageMotion = true;
+    else if(arg.compare(0, 2, "--") == 0)
+    {
+      cerr << "Unknown option " << arg << "\n";
+      printUsage();
+      return EXIT_FAILURE;
+    }
+    else
+      addSequences(arg, options.sequences);
+  }
+
+  const char* commands[] = { "index", "cache", "validate", "match", "stats", "pack", "unpack", "trim", "clean",
+                             "concat" };
+  if(find(commands, commands+10, options.command) == commands+10)
+  {
+    cerr << "Unknown command " << options.command << "\n";
+    printUsage();
+    return EXIT_FAILURE;
+  }
+  if(options.command == "match")
+  {
+    if(posesFile.empty() || !readPoses(posesFile, options.poses) || options.poses.empty())
+    {
+      cerr << "match needs a --poses file with 3, 12 or 16 numbers per line\n";
+      return EXIT_FAILURE;
+    }
+  }
+  if(USnavMatchFrames::findMetric(options.metric.c_str()) < 0)
+  {
+    cerr << "Unknown metric " << options.metric << "\n";
+    printUsage();
+    return EXIT_FAILURE;
+  }
+  if(options.sequences.empty())
+  {
+    cerr << "No sequence found\n";
+    return EXIT_FAILURE;
+  }
+
+  // One output from every sequence, nothing to spread over workers
+  if(options.command == "concat")
+  {
+    if(options.output.empty() || vtksys::SystemTools::FileExists(options.output.c_str()))
+    {
+      cerr << "concat needs an --output file that does not exist yet\n";
+      return EXIT_FAILURE;
+    }
+    double start = vtkTimerLog::GetUniversalTime();
+    if(!USnavSequenceEditor::concatenate(options.sequences, options.output))
+    {
+      cerr << "FAILED, the sequences must hold 8 bit frames of the same size\n";
+      return EXIT_FAILURE;
+    }
+    cout << options.output << ": wrote " << vtksys::SystemTools::FileLength(options.output) << " bytes from "
+         << options.sequences.size() << " sequences in " << vtkTimerLog::GetUniversalTime() - start << " s\n";
+    return EXIT_SUCCESS;
+  }
+
+  vector<string> reports(options.sequences.size());
+  vector<unsigned char> failed(options.sequences.size(), 0);
+  BatchData data;
+  data.options = &options;
+  data.reports = &reports;
+  data.failed = &failed;
+  usnavParallelFor((int)options.sequences.size(), 1, processChunk, &data, options.threads);
+
+  if(options.command == "match")
+    cout << "sequence,pose,rank,frame,distance\n";
+  else if(options.command == "stats")
+    cout << "sequence,frames,width,height,valid,duration,frame_rate,path_length,transforms\n";
+  int failures = 0;
+  for(size_t i=0; i<reports.size(); i++)
+  {
+    // Errors go to stderr so that CSV output stays parseable
+    (failed[i] && options.command != "validate" ? cerr : cout) << reports[i];
+    failures += failed[i];
+  }
+  return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
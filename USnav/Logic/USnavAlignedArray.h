@@ -0,0 +1,82 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavAlignedArray - fixed size POD buffer aligned for SIMD loads
+// .SECTION Description
+// Elements are not initialized. Resizing discards the previous content.
+
+#ifndef __USnavAlignedArray_h
+#define __USnavAlignedArray_h
+
+#include <cstddef>
+#include <cstdlib>
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+template <class T, size_t Alignment = 64>
+class USnavAlignedArray
+{
+public:
+  USnavAlignedArray() : data(NULL), count(0) {}
+  ~USnavAlignedArray() { this->release(); }
+
+  void resize(size_t n)
+  {
+    if(n == this->count)
+      return;
+    this->release();
+    if(n == 0)
+      return;
+    void* p = NULL;
+    #ifdef WIN32
+    p = _aligned_malloc(n*sizeof(T), Alignment);
+    #else
+    if(posix_memalign(&p, Alignment, n*sizeof(T)) != 0)
+      p = NULL;
+    #endif
+    this->data = static_cast<T*>(p);
+    this->count = this->data ? n : 0;
+  }
+
+  void release()
+  {
+    #ifdef WIN32
+    _aligned_free(this->data);
+    #else
+    free(this->data);
+    #endif
+    this->data = NULL;
+    this->count = 0;
+  }
+
+  size_t size() const { return this->count; }
+  bool empty() const { return this->count == 0; }
+  T* get() { return this->data; }
+  const T* get() const { return this->data; }
+  T& operator[](size_t i) { return this->data[i]; }
+  const T& operator[](size_t i) const { return this->data[i]; }
+
+private:
+  USnavAlignedArray(const USnavAlignedArray&); // Not implemented
+  void operator=(const USnavAlignedArray&);    // Not implemented
+
+  T* data;
+  size_t count;
+};
+
+#endif
@@ -0,0 +1,355 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavCinePlayer.h"
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+// Frames read ahead of the display
+const int readAheadDepth = 8;
+}
+
+//----------------------------------------------------------------------------
+USnavCinePlayer::USnavCinePlayer()
+{
+  this->width = 0;
+  this->height = 0;
+  this->frames = 0;
+  this->duration = 0.0;
+  this->nominalFrameRate = 30.0;
+  this->speed = 1.0;
+  this->looping = true;
+  this->playing = false;
+  this->clockStart = 0.0;
+  this->playStart = 0.0;
+  this->startPosition = 0;
+  this->shownPosition = -1;
+  this->lastUpdate = 0.0;
+  this->shownFrames = 0;
+  this->droppedFrames = 0;
+  this->prefetchMisses = 0;
+  this->latenessSum = 0.0;
+  this->latenessSquares = 0.0;
+  this->head = 0;
+  this->count = 0;
+  this->readPosition = 0;
+  this->wantedPosition = 0;
+  this->readStride = 1;
+  this->stopping = false;
+  this->changed = vtkSmartPointer<vtkConditionVariable>::New();
+  this->threader = vtkSmartPointer<vtkMultiThreader>::New();
+  this->threadId = -1;
+}
+
+//----------------------------------------------------------------------------
+USnavCinePlayer::~USnavCinePlayer()
+{
+  this->stop();
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::setSource(const USnavFrameSource& s)
+{
+  this->stop();
+  this->source = s;
+  this->width = s.width;
+  this->height = s.height;
+  this->frames = s.frames > 0 ? s.frames : 0;
+  this->frameTimes.clear();
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::setTimestamps(const std::vector<double>& seconds)
+{
+  this->stop();
+  this->frameTimes.clear();
+  if(this->frames < 2 || (int)seconds.size() != this->frames)
+    return;
+  for(int i=1; i<this->frames; i++)
+    if(seconds[i] < seconds[i-1])
+      return;
+  double span = seconds.back() - seconds.front();
+  if(span <= 0.0)
+    return;
+  this->frameTimes.resize(this->frames);
+  for(int i=0; i<this->frames; i++)
+    this->frameTimes[i] = seconds[i] - seconds.front();
+  // The last frame lasts one mean frame interval before looping
+  this->duration = span + span/(this->frames-1);
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::setNominalFrameRate(double framesPerSecond)
+{
+  if(framesPerSecond > 0.0)
+    this->nominalFrameRate = framesPerSecond;
+}
+
+//----------------------------------------------------------------------------
+double USnavCinePlayer::getRecordedFrameRate() const
+{
+  if(this->frameTimes.empty())
+    return this->nominalFrameRate;
+  return (this->frames-1) / this->frameTimes.back();
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::setSpeed(double s)
+{
+  if(s <= 0.0)
+    return;
+  if(this->playing && this->shownPosition >= this->startPosition)
+  {
+    // Restart the clock on the frame on screen
+    this->startPosition = this->shownPosition;
+    this->clockStart = this->lastUpdate;
+  }
+  this->speed = s;
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::setLooping(bool loop)
+{
+  // The reader waits at the end of the sequence unless looping
+  this->lock.Lock();
+  this->looping = loop;
+  this->changed->Broadcast();
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+int USnavCinePlayer::frameOf(vtkTypeInt64 position) const
+{
+  return (int)(position % this->frames);
+}
+
+//----------------------------------------------------------------------------
+double USnavCinePlayer::timeOf(vtkTypeInt64 position) const
+{
+  if(this->frameTimes.empty())
+    return position / this->nominalFrameRate;
+  vtkTypeInt64 loops = position / this->frames;
+  return loops*this->duration + this->frameTimes[this->frameOf(position)];
+}
+
+//----------------------------------------------------------------------------
+vtkTypeInt64 USnavCinePlayer::positionAt(double time) const
+{
+  if(this->frameTimes.empty())
+    return (vtkTypeInt64)floor(time * this->nominalFrameRate);
+  vtkTypeInt64 loops = (vtkTypeInt64)floor(time / this->duration);
+  double t = time - loops*this->duration;
+  int index = (int)(std::upper_bound(this->frameTimes.begin(), this->frameTimes.end(), t) - this->frameTimes.begin()) - 1;
+  return loops*this->frames + std::max(index, 0);
+}
+
+//----------------------------------------------------------------------------
+double USnavCinePlayer::wallTimeOf(vtkTypeInt64 position) const
+{
+  return this->clockStart + (this->timeOf(position) - this->timeOf(this->startPosition)) / this->speed;
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::play(int frame, double now)
+{
+  this->stop();
+  if(this->frames <= 0)
+    return;
+  frame = std::max(0, std::min(frame, this->frames-1));
+  this->playing = true;
+  this->clockStart = now;
+  this->playStart = now;
+  this->lastUpdate = now;
+  this->startPosition = frame;
+  this->shownPosition = frame-1;
+  this->shownFrames = 0;
+  this->droppedFrames = 0;
+  this->prefetchMisses = 0;
+  this->latenessSum = 0.0;
+  this->latenessSquares = 0.0;
+  this->startReader(frame);
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::stop()
+{
+  this->playing = false;
+  this->stopReader();
+}
+
+//----------------------------------------------------------------------------
+int USnavCinePlayer::update(double now)
+{
+  if(!this->playing)
+    return -1;
+  this->lastUpdate = now;
+  vtkTypeInt64 position = this->positionAt(this->timeOf(this->startPosition) + (now - this->clockStart)*this->speed);
+  bool last = !this->looping && position >= this->frames-1;
+  if(last)
+    position = this->frames-1;
+  if(position <= this->shownPosition)
+  {
+    if(last)
+      this->playing = false;
+    return -1;
+  }
+
+  vtkTypeInt64 step = this->shownFrames > 0 ? position - this->shownPosition : 1;
+  this->droppedFrames += (int)(step - 1);
+  double lateness = now - this->wallTimeOf(position);
+  this->latenessSum += lateness;
+  this->latenessSquares += lateness*lateness;
+  this->shownFrames++;
+  this->shownPosition = position;
+  if(last)
+    this->playing = false;
+
+  // Read ahead at the pace the display keeps
+  this->lock.Lock();
+  this->wantedPosition = position;
+  this->readStride = (int)std::min<vtkTypeInt64>(step, readAheadDepth);
+  if(this->readPosition < position)
+    this->readPosition = position;
+  this->changed->Signal();
+  this->lock.Unlock();
+  return this->frameOf(position);
+}
+
+//----------------------------------------------------------------------------
+double USnavCinePlayer::getNextDueTime() const
+{
+  return this->wallTimeOf(this->shownPosition + 1);
+}
+
+//----------------------------------------------------------------------------
+bool USnavCinePlayer::copyFrame(unsigned char* pixels)
+{
+  bool found = false;
+  this->lock.Lock();
+  while(this->count > 0 && this->ring[this->head].position <= this->shownPosition)
+  {
+    Slot& slot = this->ring[this->head];
+    if(slot.position == this->shownPosition)
+    {
+      memcpy(pixels, &slot.pixels[0], slot.pixels.size());
+      found = true;
+    }
+    this->head = (this->head + 1) % readAheadDepth;
+    this->count--;
+  }
+  this->changed->Signal();
+  this->lock.Unlock();
+  if(!found)
+    this->prefetchMisses++;
+  return found;
+}
+
+//----------------------------------------------------------------------------
+USnavCinePlayer::Statistics USnavCinePlayer::getStatistics() const
+{
+  Statistics stats;
+  stats.shownFrames = this->shownFrames;
+  stats.droppedFrames = this->droppedFrames;
+  stats.prefetchMisses = this->prefetchMisses;
+  double elapsed = this->lastUpdate - this->playStart;
+  stats.framesPerSecond = elapsed > 0.0 ? (this->shownFrames - 1) / elapsed : 0.0;
+  stats.meanLateness = 0.0;
+  stats.jitter = 0.0;
+  if(this->shownFrames > 0)
+  {
+    stats.meanLateness = this->latenessSum / this->shownFrames;
+    double variance = this->latenessSquares / this->shownFrames - stats.meanLateness*stats.meanLateness;
+    stats.jitter = variance > 0.0 ? sqrt(variance) : 0.0;
+  }
+  return stats;
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::startReader(vtkTypeInt64 position)
+{
+  this->stopReader();
+  size_t frameSize = (size_t)this->width*this->height;
+  this->ring.resize(readAheadDepth);
+  for(int i=0; i<readAheadDepth; i++)
+    this->ring[i].pixels.resize(frameSize);
+  this->head = 0;
+  this->count = 0;
+  this->readPosition = position;
+  this->wantedPosition = position;
+  this->readStride = 1;
+  this->stopping = false;
+  if(frameSize > 0)
+    this->threadId = this->threader->SpawnThread(&USnavCinePlayer::run, this);
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::stopReader()
+{
+  if(this->threadId < 0)
+    return;
+  this->lock.Lock();
+  this->stopping = true;
+  this->changed->Broadcast();
+  this->lock.Unlock();
+  this->threader->TerminateThread(this->threadId);
+  this->threadId = -1;
+}
+
+//----------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE USnavCinePlayer::run(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* info = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  USnavCinePlayer* self = static_cast<USnavCinePlayer*>(info->UserData);
+  self->read();
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+void USnavCinePlayer::read()
+{
+  USnavFrameReader reader(this->source);
+  this->lock.Lock();
+  while(true)
+  {
+    while(!this->stopping && (this->count >= readAheadDepth
+          || (!this->looping && this->readPosition >= this->frames)))
+      this->changed->Wait(this->lock);
+    if(this->stopping)
+      break;
+    vtkTypeInt64 position = std::max(this->readPosition, this->wantedPosition);
+    this->readPosition = position + this->readStride;
+    int slotIndex = (this->head + this->count) % readAheadDepth;
+    this->lock.Unlock();
+
+    // The slot after the queue is the reader's until it is pushed
+    Slot& slot = this->ring[slotIndex];
+    bool ok = reader.readFrame(this->frameOf(position), &slot.pixels[0]);
+
+    this->lock.Lock();
+    if(!ok)
+      break;
+    slot.position = position;
+    this->count++;
+  }
+  this->lock.Unlock();
+}
@@ -0,0 +1,154 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavCinePlayer - plays a sequence at its recorded frame rate
+// .SECTION Description
+// Playback follows a clock: the frame on screen is the last one whose
+// time, measured from the first frame played and scaled by the speed, has
+// passed. The owner calls update() whenever it can show a frame, ideally
+// at getNextDueTime(); frames whose time has passed in between are dropped
+// rather than shown late. Frame times come from the sequence timestamps,
+// or from a fixed rate when there are none.
+//
+// A background thread reads the frames coming up into a small queue,
+// skipping as many frames as the display drops, so showing a frame is a
+// copy. The player is driven from a single thread; statistics report the
+// achieved rate and how late frames were shown.
+
+#ifndef __USnavCinePlayer_h
+#define __USnavCinePlayer_h
+
+// VTK includes
+#include <vtkConditionVariable.h>
+#include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
+#include <vtkSmartPointer.h>
+
+// STD includes
+#include <string>
+#include <vector>
+
+#include "USnavFrameReader.h"
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavCinePlayer
+{
+public:
+  struct Statistics
+  {
+    int shownFrames;
+    int droppedFrames;
+    int prefetchMisses;
+    double framesPerSecond;  // frames shown per second of playback
+    double meanLateness;     // seconds between due and shown
+    double jitter;           // standard deviation of the lateness
+  };
+
+  USnavCinePlayer();
+  ~USnavCinePlayer();
+
+  /// Sequence to read from; stops playback.
+  void setSource(const USnavFrameSource& source);
+  /// One time in seconds per frame. Used when increasing and spanning some
+  /// time, otherwise frames are spaced by the nominal frame rate.
+  void setTimestamps(const std::vector<double>& seconds);
+  bool hasTimestamps() const { return !this->frameTimes.empty(); }
+  void setNominalFrameRate(double framesPerSecond);
+  /// Frames per second of the recording
+  double getRecordedFrameRate() const;
+  /// Playback rate relative to the recording; takes effect from the frame
+  /// on screen.
+  void setSpeed(double speed);
+  double getSpeed() const { return this->speed; }
+  void setLooping(bool loop);
+  bool getLooping() const { return this->looping; }
+
+  /// Starts the clock at `now` (seconds) on `frame`.
+  void play(int frame, double now);
+  void stop();
+  bool isPlaying() const { return this->playing; }
+
+  /// Frame to show at `now`, or -1 if the one on screen is still current.
+  /// Playback stops after the last frame unless looping.
+  int update(double now);
+  /// Time at which the next frame is due.
+  double getNextDueTime() const;
+  /// Pixels of the frame returned by the last update(); false when it was
+  /// not read ahead in time, in which case the caller reads it.
+  bool copyFrame(unsigned char* pixels);
+
+  Statistics getStatistics() const;
+
+private:
+  USnavCinePlayer(const USnavCinePlayer&); // Not implemented
+  void operator=(const USnavCinePlayer&);  // Not implemented
+
+  // Positions count frames played from the start of the sequence, going on
+  // past the end when looping
+  int frameOf(vtkTypeInt64 position) const;
+  double timeOf(vtkTypeInt64 position) const;
+  vtkTypeInt64 positionAt(double time) const;
+  double wallTimeOf(vtkTypeInt64 position) const;
+  void startReader(vtkTypeInt64 position);
+  void stopReader();
+
+  static VTK_THREAD_RETURN_TYPE run(void* arg);
+  void read();
+
+  USnavFrameSource source;
+  int width;
+  int height;
+  int frames;
+  std::vector<double> frameTimes; // from the first frame, empty for nominal
+  double duration;                // of one pass through the sequence
+  double nominalFrameRate;
+  double speed;
+  bool looping;
+
+  bool playing;
+  double clockStart; // wall time of startPosition
+  double playStart;
+  vtkTypeInt64 startPosition;
+  vtkTypeInt64 shownPosition;
+  double lastUpdate;
+  int shownFrames;
+  int droppedFrames;
+  int prefetchMisses;
+  double latenessSum;
+  double latenessSquares;
+
+  // Read-ahead queue: slots used as a ring of `count` frames from
+  // `head`; the reader fills the slot after the last one
+  struct Slot
+  {
+    vtkTypeInt64 position;
+    std::vector<unsigned char> pixels;
+  };
+  std::vector<Slot> ring;
+  int head;
+  int count;
+  vtkTypeInt64 readPosition;   // next position the reader fetches
+  vtkTypeInt64 wantedPosition; // earliest position still useful
+  int readStride;              // positions between two reads
+  bool stopping;
+  vtkSimpleMutexLock lock;
+  vtkSmartPointer<vtkConditionVariable> changed;
+  vtkSmartPointer<vtkMultiThreader> threader;
+  int threadId;
+};
+
+#endif
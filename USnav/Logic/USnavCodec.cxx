@@ -0,0 +1,202 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavCodec.h"
+
+// VTK includes
+#include <vtkType.h>
+
+// STD includes
+#include <cstring>
+#include <vector>
+
+namespace
+{
+const size_t minimumMatch = 4;
+const int hashBits = 14;
+// The format ends on literals: matches stop 5 bytes before the end and
+// start at least 12 bytes before it
+const size_t lastLiterals = 5;
+const size_t matchStartMargin = 12;
+const size_t maximumOffset = 65535;
+
+inline vtkTypeUInt32 read32(const unsigned char* p)
+{
+  vtkTypeUInt32 v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+inline int hash32(vtkTypeUInt32 v)
+{
+  return (int)((v * 2654435761u) >> (32 - hashBits));
+}
+
+unsigned char* writeLength(unsigned char* op, size_t length)
+{
+  while(length >= 255)
+  {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (unsigned char)length;
+  return op;
+}
+
+bool readLength(const unsigned char*& ip, const unsigned char* end, size_t& length)
+{
+  unsigned char b;
+  do
+  {
+    if(ip >= end)
+      return false;
+    b = *ip++;
+    length += b;
+  } while(b == 255);
+  return true;
+}
+
+unsigned char* writeSequence(unsigned char* op, const unsigned char* literals, size_t literalLength)
+{
+  unsigned char* token = op++;
+  *token = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4);
+  if(literalLength >= 15)
+    op = writeLength(op, literalLength - 15);
+  if(literalLength > 0)
+    memcpy(op, literals, literalLength);
+  return op + literalLength;
+}
+}
+
+//----------------------------------------------------------------------------
+size_t usnavCompressBound(size_t size)
+{
+  return size + size/255 + 16;
+}
+
+//----------------------------------------------------------------------------
+size_t usnavCompress(const unsigned char* src, size_t size, unsigned char* dst)
+{
+  const unsigned char* anchor = src;
+  const unsigned char* end = src + size;
+  unsigned char* op = dst;
+  if(size > matchStartMargin)
+  {
+    const unsigned char* matchLimit = end - lastLiterals;
+    const unsigned char* startLimit = end - matchStartMargin;
+    std::vector<int> table((size_t)1 << hashBits, -1);
+    const unsigned char* ip = src;
+    while(ip < startLimit)
+    {
+      vtkTypeUInt32 sequence = read32(ip);
+      int h = hash32(sequence);
+      int candidate = table[h];
+      table[h] = (int)(ip - src);
+      if(candidate < 0 || (size_t)(ip - (src + candidate)) > maximumOffset || read32(src + candidate) != sequence)
+      {
+        ip++;
+        continue;
+      }
+      const unsigned char* match = src + candidate;
+      // Extend backwards over pending literals, then forwards
+      while(ip > anchor && match > src && ip[-1] == match[-1])
+      {
+        ip--;
+        match--;
+      }
+      const unsigned char* matchEnd = ip + minimumMatch;
+      const unsigned char* reference = match + minimumMatch;
+      while(matchEnd < matchLimit && *matchEnd == *reference)
+      {
+        matchEnd++;
+        reference++;
+      }
+
+      unsigned char* token = op;
+      op = writeSequence(op, anchor, (size_t)(ip - anchor));
+      size_t offset = (size_t)(ip - match);
+      *op++ = (unsigned char)(offset & 255);
+      *op++ = (unsigned char)(offset >> 8);
+      size_t matchLength = (size_t)(matchEnd - ip) - minimumMatch;
+      *token |= (unsigned char)(matchLength < 15 ? matchLength : 15);
+      if(matchLength >= 15)
+        op = writeLength(op, matchLength - 15);
+      ip = matchEnd;
+      anchor = ip;
+    }
+  }
+  op = writeSequence(op, anchor, (size_t)(end - anchor));
+  return (size_t)(op - dst);
+}
+
+//----------------------------------------------------------------------------
+bool usnavDecompress(const unsigned char* src, size_t size, unsigned char* dst, size_t decodedSize)
+{
+  const unsigned char* ip = src;
+  const unsigned char* end = src + size;
+  unsigned char* op = dst;
+  unsigned char* outputEnd = dst + decodedSize;
+  while(ip < end)
+  {
+    unsigned int token = *ip++;
+    size_t literalLength = token >> 4;
+    if(literalLength == 15 && !readLength(ip, end, literalLength))
+      return false;
+    if(literalLength > (size_t)(end - ip) || literalLength > (size_t)(outputEnd - op))
+      return false;
+    memcpy(op, ip, literalLength);
+    op += literalLength;
+    ip += literalLength;
+    if(ip == end)
+      break; // The last sequence has no match
+
+    if(end - ip < 2)
+      return false;
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if(offset == 0 || offset > (size_t)(op - dst))
+      return false;
+    size_t matchLength = token & 15;
+    if(matchLength == 15 && !readLength(ip, end, matchLength))
+      return false;
+    matchLength += minimumMatch;
+    if(matchLength > (size_t)(outputEnd - op))
+      return false;
+    const unsigned char* match = op - offset;
+    if(offset >= matchLength)
+      memcpy(op, match, matchLength);
+    else
+      for(size_t i=0; i<matchLength; i++) // Overlapping: repeats the last `offset` bytes
+        op[i] = match[i];
+    op += matchLength;
+  }
+  return op == outputEnd;
+}
+
+//----------------------------------------------------------------------------
+void usnavDeltaEncode(unsigned char* frame, const unsigned char* previous, size_t size)
+{
+  for(size_t i=0; i<size; i++)
+    frame[i] = (unsigned char)(frame[i] - previous[i]);
+}
+
+//----------------------------------------------------------------------------
+void usnavDeltaDecode(unsigned char* frame, const unsigned char* previous, size_t size)
+{
+  for(size_t i=0; i<size; i++)
+    frame[i] = (unsigned char)(frame[i] + previous[i]);
+}
@@ -0,0 +1,54 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavCodec - fast lossless block compression for frame data
+// .SECTION Description
+// Byte oriented LZ77 in the LZ4 block format: each sequence is a token
+// (literal and match length nibbles), the literals, a 16 bit offset and
+// the rest of the match length. A greedy single probe hash search keeps
+// compression fast; decompression is a loop of copies. Blocks are
+// independent, so any block of a file can be decoded on its own.
+//
+// Delta coding replaces a frame by its byte-wise difference with the
+// previous one, which turns the static parts of ultrasound frames (black
+// background, annotations) into long runs of zeros.
+
+#ifndef __USnavCodec_h
+#define __USnavCodec_h
+
+// STD includes
+#include <cstddef>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+/// Largest compressed size of `size` bytes.
+VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT size_t usnavCompressBound(size_t size);
+
+/// Compresses `size` bytes of `src` into `dst`, which holds at least
+/// usnavCompressBound(size) bytes. Returns the compressed size.
+VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT size_t usnavCompress(const unsigned char* src, size_t size, unsigned char* dst);
+
+/// Decompresses `size` bytes of `src` into exactly `decodedSize` bytes of
+/// `dst`; false if the data is corrupt or does not decode to that size.
+VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT bool usnavDecompress(const unsigned char* src, size_t size,
+                                                          unsigned char* dst, size_t decodedSize);
+
+/// frame[i] -= previous[i] (modulo 256), and back.
+VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT void usnavDeltaEncode(unsigned char* frame, const unsigned char* previous, size_t size);
+VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT void usnavDeltaDecode(unsigned char* frame, const unsigned char* previous, size_t size);
+
+#endif
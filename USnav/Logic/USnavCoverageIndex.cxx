@@ -0,0 +1,258 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavCoverageIndex.h"
+#include "USnavGeometry.h"
+#include "USnavParallel.h"
+
+// VTK includes
+#include <vtkType.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+// Frames per task: a frame is a few hundred cells
+const int coverageGrain = 32;
+
+struct RasterData
+{
+  const double* imageToTracker;
+  const std::vector<int>* frames;
+  int width;
+  int height;
+  const double* trackerToGrid;
+  const int* size;
+  std::vector<std::vector<int> >* frameCells;
+};
+
+int cellOf(double x)
+{
+  return (int)floor(x + 0.5);
+}
+
+// Cells crossed by one image, in no particular order, each once
+void rasterizeFrame(const double imageToGrid[16], int width, int height, const int size[3], std::vector<int>& cells)
+{
+  cells.clear();
+  const double* m = imageToGrid;
+  double origin[3] = { m[3], m[7], m[11] };
+  double a[3] = { m[0], m[4], m[8] };
+  double b[3] = { m[1], m[5], m[9] };
+  double normal[3];
+  usnavCross3(a, b, normal);
+  double aa = usnavDot3(a, a), ab = usnavDot3(a, b), bb = usnavDot3(b, b);
+  double det = aa*bb - ab*ab;
+  if(usnavNormalize3(normal) == 0 || det <= 0)
+    return;
+
+  // Dual axes: (p-origin).ua is the image column of p projected on the
+  // plane, (p-origin).vb its row. A cell's half extent along each of them
+  // is the sum of the absolute components over 2.
+  double ua[3], vb[3];
+  for(int k=0; k<3; k++)
+  {
+    ua[k] = (bb*a[k] - ab*b[k])/det;
+    vb[k] = (aa*b[k] - ab*a[k])/det;
+  }
+  double ru = 0.5*(fabs(ua[0]) + fabs(ua[1]) + fabs(ua[2]));
+  double rv = 0.5*(fabs(vb[0]) + fabs(vb[1]) + fabs(vb[2]));
+
+  // Cell range of the image corners
+  int lo[3] = { size[0], size[1], size[2] };
+  int hi[3] = { -1, -1, -1 };
+  for(int c=0; c<4; c++)
+  {
+    double x = (c & 1) ? width - 0.5 : -0.5;
+    double y = (c & 2) ? height - 0.5 : -0.5;
+    for(int k=0; k<3; k++)
+    {
+      int cell = cellOf(origin[k] + x*a[k] + y*b[k]);
+      lo[k] = std::min(lo[k], cell);
+      hi[k] = std::max(hi[k], cell);
+    }
+  }
+  for(int k=0; k<3; k++)
+  {
+    lo[k] = std::max(lo[k], 0);
+    hi[k] = std::min(hi[k], size[k] - 1);
+    if(lo[k] > hi[k])
+      return;
+  }
+
+  // Walk the columns along the axis the plane is most perpendicular to
+  int d = 0;
+  for(int k=1; k<3; k++)
+    if(fabs(normal[k]) > fabs(normal[d]))
+      d = k;
+  int e1 = (d + 1) % 3;
+  int e2 = (d + 2) % 3;
+  double spread = 0.5*(fabs(normal[e1]) + fabs(normal[e2]))/fabs(normal[d]);
+  int index[3];
+  for(index[e2]=lo[e2]; index[e2]<=hi[e2]; index[e2]++)
+    for(index[e1]=lo[e1]; index[e1]<=hi[e1]; index[e1]++)
+    {
+      // Where the plane crosses the column, over the whole column width
+      double t = origin[d] - (normal[e1]*(index[e1] - origin[e1]) + normal[e2]*(index[e2] - origin[e2]))/normal[d];
+      int first = std::max(cellOf(t - spread), lo[d]);
+      int last = std::min(cellOf(t + spread), hi[d]);
+      for(index[d]=first; index[d]<=last; index[d]++)
+      {
+        double p[3] = { index[0] - origin[0], index[1] - origin[1], index[2] - origin[2] };
+        double u = usnavDot3(p, ua);
+        double v = usnavDot3(p, vb);
+        if(u + ru < -0.5 || u - ru > width - 0.5 || v + rv < -0.5 || v - rv > height - 0.5)
+          continue;
+        cells.push_back(index[0] + size[0]*(index[1] + size[1]*index[2]));
+      }
+    }
+}
+
+void rasterChunk(int begin, int end, int vtkNotUsed(threadId), void* userData)
+{
+  RasterData* data = static_cast<RasterData*>(userData);
+  for(int i=begin; i<end; i++)
+  {
+    double imageToGrid[16];
+    usnavMultiply4x4(data->trackerToGrid, data->imageToTracker + 16*(size_t)(*data->frames)[i], imageToGrid);
+    rasterizeFrame(imageToGrid, data->width, data->height, data->size, (*data->frameCells)[i]);
+  }
+}
+}
+
+//----------------------------------------------------------------------------
+USnavCoverageIndex::USnavCoverageIndex()
+{
+  this->size[0] = this->size[1] = this->size[2] = 0;
+}
+
+//----------------------------------------------------------------------------
+void USnavCoverageIndex::clear()
+{
+  this->size[0] = this->size[1] = this->size[2] = 0;
+  this->offsets.clear();
+  this->cellFrames.clear();
+}
+
+//----------------------------------------------------------------------------
+void USnavCoverageIndex::build(const double* imageToTracker, const std::vector<int>& frames, int width,
+                               int height, const double trackerToGrid[16], const int gridSize[3],
+                               int numberOfThreads)
+{
+  this->clear();
+  if(gridSize[0] <= 0 || gridSize[1] <= 0 || gridSize[2] <= 0)
+    return;
+  for(int k=0; k<3; k++)
+    this->size[k] = gridSize[k];
+  int cells = this->getNumberOfCells();
+
+  std::vector<std::vector<int> > frameCells(frames.size());
+  RasterData data;
+  data.imageToTracker = imageToTracker;
+  data.frames = &frames;
+  data.width = width;
+  data.height = height;
+  data.trackerToGrid = trackerToGrid;
+  data.size = this->size;
+  data.frameCells = &frameCells;
+  if(width > 0 && height > 0)
+    usnavParallelFor((int)frames.size(), coverageGrain, rasterChunk, &data, numberOfThreads);
+
+  // Counting sort by cell; frames go in increasing order, so every cell
+  // lists them sorted
+  this->offsets.assign((size_t)cells + 1, 0);
+  for(size_t i=0; i<frameCells.size(); i++)
+    for(size_t c=0; c<frameCells[i].size(); c++)
+      this->offsets[frameCells[i][c] + 1]++;
+  for(int c=0; c<cells; c++)
+    this->offsets[c+1] += this->offsets[c];
+  this->cellFrames.resize(this->offsets[cells]);
+  std::vector<int> next(this->offsets.begin(), this->offsets.end() - 1);
+  for(size_t i=0; i<frameCells.size(); i++)
+    for(size_t c=0; c<frameCells[i].size(); c++)
+      this->cellFrames[next[frameCells[i][c]]++] = frames[i];
+}
+
+//----------------------------------------------------------------------------
+void USnavCoverageIndex::getSize(int gridSize[3]) const
+{
+  for(int k=0; k<3; k++)
+    gridSize[k] = this->size[k];
+}
+
+//----------------------------------------------------------------------------
+int USnavCoverageIndex::findCell(const double p[3]) const
+{
+  int index[3];
+  for(int k=0; k<3; k++)
+  {
+    index[k] = cellOf(p[k]);
+    if(index[k] < 0 || index[k] >= this->size[k])
+      return -1;
+  }
+  return index[0] + this->size[0]*(index[1] + this->size[1]*index[2]);
+}
+
+//----------------------------------------------------------------------------
+const int* USnavCoverageIndex::getCellFrames(int cell) const
+{
+  return this->cellFrames.empty() ? NULL : &this->cellFrames[0] + this->offsets[cell];
+}
+
+//----------------------------------------------------------------------------
+int USnavCoverageIndex::getNumberOfCoveredCells() const
+{
+  int covered = 0;
+  for(int c=0; c<this->getNumberOfCells(); c++)
+    if(this->offsets[c+1] > this->offsets[c])
+      covered++;
+  return covered;
+}
+
+//----------------------------------------------------------------------------
+void USnavCoverageIndex::findFramesInCells(const int lo[3], const int hi[3], std::vector<int>& frames) const
+{
+  frames.clear();
+  if(this->isEmpty())
+    return;
+  int first[3], last[3];
+  for(int k=0; k<3; k++)
+  {
+    first[k] = std::max(lo[k], 0);
+    last[k] = std::min(hi[k], this->size[k] - 1);
+    if(first[k] > last[k])
+      return;
+  }
+  for(int z=first[2]; z<=last[2]; z++)
+    for(int y=first[1]; y<=last[1]; y++)
+    {
+      int row = this->size[0]*(y + this->size[1]*z);
+      frames.insert(frames.end(), this->cellFrames.begin() + this->offsets[row + first[0]],
+                    this->cellFrames.begin() + this->offsets[row + last[0] + 1]);
+    }
+  std::sort(frames.begin(), frames.end());
+  frames.erase(std::unique(frames.begin(), frames.end()), frames.end());
+}
+
+//----------------------------------------------------------------------------
+void USnavCoverageIndex::getCoverage(unsigned short* counts) const
+{
+  for(int c=0; c<this->getNumberOfCells(); c++)
+    counts[c] = (unsigned short)std::min(this->getCellCount(c), 65535);
+}
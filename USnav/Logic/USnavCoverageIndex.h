@@ -0,0 +1,77 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavCoverageIndex - frames crossing each cell of a coarse grid
+// .SECTION Description
+// Inverted index from the cells of a coarse voxel grid to the frames whose
+// image rectangle crosses them. Each frame is rasterized conservatively:
+// along its dominant normal axis only the cells the plane passes through
+// are visited, then kept when they overlap the image rectangle, so the
+// cost per frame follows its footprint and not its bounding box. Frames are
+// rasterized in parallel and stored cell by cell in one array (an offset per
+// cell), sorted by frame number. Region queries and the number of frames
+// per cell then read the index only.
+
+#ifndef __USnavCoverageIndex_h
+#define __USnavCoverageIndex_h
+
+// STD includes
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavCoverageIndex
+{
+public:
+  USnavCoverageIndex();
+
+  /// Indexes `frames` (sorted), each a width x height image placed by 16
+  /// row-major doubles at imageToTracker + 16*frame. trackerToGrid maps
+  /// tracker space to grid coordinates, where cell (i,j,k) is the unit cube
+  /// centred on (i,j,k). 0 threads = all cores.
+  void build(const double* imageToTracker, const std::vector<int>& frames, int width, int height,
+             const double trackerToGrid[16], const int size[3], int numberOfThreads = 0);
+  void clear();
+  bool isEmpty() const { return this->offsets.empty(); }
+
+  void getSize(int size[3]) const;
+  int getNumberOfCells() const { return this->size[0]*this->size[1]*this->size[2]; }
+  /// Cell holding a point in grid coordinates, -1 outside the grid
+  int findCell(const double p[3]) const;
+  /// Frames crossing a cell, sorted
+  int getCellCount(int cell) const { return this->offsets[cell+1] - this->offsets[cell]; }
+  const int* getCellFrames(int cell) const;
+  int getNumberOfCoveredCells() const;
+
+  /// Frames crossing any cell of [lo,hi] (inclusive, clamped to the grid),
+  /// sorted and without duplicates
+  void findFramesInCells(const int lo[3], const int hi[3], std::vector<int>& frames) const;
+
+  /// Number of frames of every cell, x fastest as in vtkImageData,
+  /// saturated at 65535
+  void getCoverage(unsigned short* counts) const;
+
+private:
+  USnavCoverageIndex(const USnavCoverageIndex&); // Not implemented
+  void operator=(const USnavCoverageIndex&); // Not implemented
+
+  int size[3];
+  std::vector<int> offsets;    // getNumberOfCells()+1, into cellFrames
+  std::vector<int> cellFrames;
+};
+
+#endif
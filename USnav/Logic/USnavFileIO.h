@@ -0,0 +1,59 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavFileIO - 64 bit safe stdio helpers shared by the readers
+
+#ifndef __USnavFileIO_h
+#define __USnavFileIO_h
+
+#include <vtkType.h>
+
+#include <stdio.h>
+
+/// Absolute seek that works past 2GB on every platform.
+inline int usnavSeek(FILE* file, vtkTypeInt64 offset)
+{
+  #ifdef WIN32
+  return _fseeki64(file, (__int64)offset, SEEK_SET);
+  #else
+  return fseeko(file, (off_t)offset, SEEK_SET);
+  #endif
+}
+
+inline vtkTypeInt64 usnavTell(FILE* file)
+{
+  #ifdef WIN32
+  return (vtkTypeInt64)_ftelli64(file);
+  #else
+  return (vtkTypeInt64)ftello(file);
+  #endif
+}
+
+/// Size of an open file; the position is left at the start.
+inline vtkTypeInt64 usnavFileSize(FILE* file)
+{
+  #ifdef WIN32
+  _fseeki64(file, 0, SEEK_END);
+  #else
+  fseeko(file, 0, SEEK_END);
+  #endif
+  vtkTypeInt64 size = usnavTell(file);
+  usnavSeek(file, 0);
+  return size;
+}
+
+#endif
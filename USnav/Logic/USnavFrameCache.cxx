@@ -0,0 +1,214 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavFrameCache.h"
+
+// STD includes
+#include <cstring>
+
+//----------------------------------------------------------------------------
+USnavFrameCache::USnavFrameCache()
+{
+  this->inflation = 0.0;
+  this->accesses = 0;
+  this->budget = 256*1024*1024;
+  this->residentBytes = 0;
+  this->hits = 0;
+  this->misses = 0;
+  this->evictions = 0;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::setBudget(size_t bytes)
+{
+  this->lock.Lock();
+  this->budget = bytes;
+  this->evictUntil(bytes);
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+size_t USnavFrameCache::getBudget()
+{
+  this->lock.Lock();
+  size_t bytes = this->budget;
+  this->lock.Unlock();
+  return bytes;
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameCache::fetch(Key key, void* buffer, size_t bytes)
+{
+  this->lock.Lock();
+  std::map<Key, Entry>::iterator it = this->entries.find(key);
+  if(it == this->entries.end() || it->second.data.size() != bytes)
+  {
+    this->misses++;
+    this->lock.Unlock();
+    return false;
+  }
+  Entry& entry = it->second;
+  memcpy(buffer, &entry.data[0], bytes);
+  this->hits++;
+  if(!this->pinned.count(key))
+    this->queue.erase(entry.priority);
+  this->refresh(entry);
+  if(!this->pinned.count(key))
+    this->queue[entry.priority] = key;
+  this->lock.Unlock();
+  return true;
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameCache::contains(Key key)
+{
+  this->lock.Lock();
+  bool found = this->entries.count(key) > 0;
+  this->lock.Unlock();
+  return found;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::insert(Key key, const void* data, size_t bytes, double cost)
+{
+  this->lock.Lock();
+  std::map<Key, Entry>::iterator it = this->entries.find(key);
+  if(it != this->entries.end())
+    this->removeEntry(it);
+  if(bytes == 0 || bytes > this->budget)
+  {
+    this->lock.Unlock();
+    return;
+  }
+  this->evictUntil(this->budget - bytes);
+
+  Entry& entry = this->entries[key];
+  entry.data.assign(static_cast<const unsigned char*>(data), static_cast<const unsigned char*>(data) + bytes);
+  entry.costPerByte = (cost > 0 ? cost : 1e-9) / bytes;
+  this->refresh(entry);
+  if(!this->pinned.count(key))
+    this->queue[entry.priority] = key;
+  this->residentBytes += bytes;
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::remove(Key key)
+{
+  this->lock.Lock();
+  std::map<Key, Entry>::iterator it = this->entries.find(key);
+  if(it != this->entries.end())
+    this->removeEntry(it);
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::clear()
+{
+  this->lock.Lock();
+  this->entries.clear();
+  this->queue.clear();
+  this->residentBytes = 0;
+  this->inflation = 0.0;
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::pin(Key key)
+{
+  this->lock.Lock();
+  if(this->pinned.insert(key).second)
+  {
+    std::map<Key, Entry>::iterator it = this->entries.find(key);
+    if(it != this->entries.end())
+      this->queue.erase(it->second.priority);
+  }
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::unpin(Key key)
+{
+  this->lock.Lock();
+  if(this->pinned.erase(key))
+  {
+    std::map<Key, Entry>::iterator it = this->entries.find(key);
+    if(it != this->entries.end())
+    {
+      this->refresh(it->second);
+      this->queue[it->second.priority] = key;
+      this->evictUntil(this->budget);
+    }
+  }
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+USnavFrameCache::Statistics USnavFrameCache::getStatistics()
+{
+  this->lock.Lock();
+  Statistics stats;
+  stats.budget = this->budget;
+  stats.residentBytes = this->residentBytes;
+  stats.entries = (int)this->entries.size();
+  stats.hits = this->hits;
+  stats.misses = this->misses;
+  stats.evictions = this->evictions;
+  this->lock.Unlock();
+  return stats;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::resetStatistics()
+{
+  this->lock.Lock();
+  this->hits = 0;
+  this->misses = 0;
+  this->evictions = 0;
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::refresh(Entry& entry)
+{
+  // Lock held by the caller. H = L + cost/size; the access count breaks
+  // ties, oldest first
+  entry.priority = Priority(this->inflation + entry.costPerByte, ++this->accesses);
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::evictUntil(size_t bytes)
+{
+  // Lock held by the caller
+  while(this->residentBytes > bytes && !this->queue.empty())
+  {
+    PriorityQueue::iterator victim = this->queue.begin();
+    this->inflation = victim->first.first;
+    Key key = victim->second;
+    this->removeEntry(this->entries.find(key));
+    this->evictions++;
+  }
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameCache::removeEntry(std::map<Key, Entry>::iterator it)
+{
+  if(!this->pinned.count(it->first))
+    this->queue.erase(it->second.priority);
+  this->residentBytes -= it->second.data.size();
+  this->entries.erase(it);
+}
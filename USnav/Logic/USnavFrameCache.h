@@ -0,0 +1,119 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavFrameCache - byte budgeted, thread safe cache of frame buffers
+// .SECTION Description
+// Entries are keyed by frame and variant (raw, ROI, enhanced, ...) and
+// evicted with GreedyDual-Size: each entry has priority L + cost/bytes,
+// hits refresh it, the lowest priority goes first and L rises to the
+// priority of the last victim. Equal priorities go least recently used
+// first, so with equal costs this is plain LRU; entries that are expensive
+// to recompute per byte survive longer. Pinned keys (the frame on screen)
+// are never evicted.
+
+#ifndef __USnavFrameCache_h
+#define __USnavFrameCache_h
+
+// VTK includes
+#include <vtkMutexLock.h>
+#include <vtkType.h>
+
+// STD includes
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavFrameCache
+{
+public:
+  typedef vtkTypeUInt64 Key;
+
+  struct Statistics
+  {
+    size_t budget;
+    size_t residentBytes;
+    int entries;
+    vtkTypeUInt64 hits;
+    vtkTypeUInt64 misses;
+    vtkTypeUInt64 evictions;
+    double hitRate() const { return hits + misses > 0 ? (double)hits / (hits + misses) : 0.0; }
+  };
+
+  static Key makeKey(int frame, unsigned int variant = 0)
+  {
+    return ((Key)variant << 32) | (vtkTypeUInt32)frame;
+  }
+
+  USnavFrameCache();
+
+  /// Bytes the entries may use; shrinking evicts right away.
+  void setBudget(size_t bytes);
+  size_t getBudget();
+
+  /// Copies the entry into `buffer` if it is cached with exactly `bytes`.
+  bool fetch(Key key, void* buffer, size_t bytes);
+  bool contains(Key key);
+  /// Caches a copy of `data`. `cost` is what recomputing it would cost
+  /// (e.g. seconds spent reading); entries larger than the budget are
+  /// ignored.
+  void insert(Key key, const void* data, size_t bytes, double cost);
+  void remove(Key key);
+  void clear();
+
+  /// Pinned keys stay resident; a key may be pinned before it is inserted.
+  void pin(Key key);
+  void unpin(Key key);
+
+  Statistics getStatistics();
+  void resetStatistics();
+
+private:
+  USnavFrameCache(const USnavFrameCache&); // Not implemented
+  void operator=(const USnavFrameCache&);  // Not implemented
+
+  // Priority, then the access that set it
+  typedef std::pair<double, vtkTypeUInt64> Priority;
+  typedef std::map<Priority, Key> PriorityQueue;
+  struct Entry
+  {
+    std::vector<unsigned char> data;
+    double costPerByte;
+    Priority priority;
+  };
+
+  void refresh(Entry& entry);
+
+  void evictUntil(size_t bytes);
+  void removeEntry(std::map<Key, Entry>::iterator it);
+
+  std::map<Key, Entry> entries;
+  PriorityQueue queue;   // unpinned entries only
+  std::set<Key> pinned;
+  double inflation;      // L
+  vtkTypeUInt64 accesses;
+  size_t budget;
+  size_t residentBytes;
+  vtkTypeUInt64 hits;
+  vtkTypeUInt64 misses;
+  vtkTypeUInt64 evictions;
+  vtkSimpleMutexLock lock;
+};
+
+#endif
@@ -0,0 +1,480 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavFrameExporter.h"
+#include "USnavParallel.h"
+
+// VTK includes
+#include <vtkImageImport.h>
+#include <vtkPNGWriter.h>
+#include <vtkUnsignedCharArray.h>
+
+// STD includes
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+void putShort(std::vector<unsigned char>& out, unsigned int v)
+{
+  out.push_back((unsigned char)(v & 0xff));
+  out.push_back((unsigned char)((v >> 8) & 0xff));
+}
+
+void putLong(std::vector<unsigned char>& out, unsigned int v)
+{
+  putShort(out, v & 0xffff);
+  putShort(out, (v >> 16) & 0xffff);
+}
+
+void putTag(std::vector<unsigned char>& out, unsigned int tag, unsigned int type, unsigned int value)
+{
+  // Type 3 is SHORT, 4 is LONG; single values are stored in place
+  putShort(out, tag);
+  putShort(out, type);
+  putLong(out, 1);
+  if(type == 3)
+  {
+    putShort(out, value);
+    putShort(out, 0);
+  }
+  else
+    putLong(out, value);
+}
+}
+
+//----------------------------------------------------------------------------
+USnavFrameExporter::Queue::Queue()
+{
+  this->capacity = 1;
+  this->producers = 0;
+  this->aborted = false;
+  this->notEmpty = vtkSmartPointer<vtkConditionVariable>::New();
+  this->notFull = vtkSmartPointer<vtkConditionVariable>::New();
+}
+
+//----------------------------------------------------------------------------
+USnavFrameExporter::Queue::~Queue()
+{
+  this->open(1, 0);
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::Queue::open(size_t cap, int producerCount)
+{
+  this->lock.Lock();
+  for(size_t i=0; i<this->items.size(); i++)
+    delete this->items[i];
+  this->items.clear();
+  this->capacity = cap > 0 ? cap : 1;
+  this->producers = producerCount;
+  this->aborted = false;
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameExporter::Queue::push(Item* item)
+{
+  this->lock.Lock();
+  while(this->items.size() >= this->capacity && !this->aborted)
+    this->notFull->Wait(this->lock);
+  bool accepted = !this->aborted;
+  if(accepted)
+  {
+    this->items.push_back(item);
+    this->notEmpty->Signal();
+  }
+  this->lock.Unlock();
+  return accepted;
+}
+
+//----------------------------------------------------------------------------
+USnavFrameExporter::Item* USnavFrameExporter::Queue::pop()
+{
+  this->lock.Lock();
+  while(this->items.empty() && this->producers > 0 && !this->aborted)
+    this->notEmpty->Wait(this->lock);
+  Item* item = NULL;
+  if(!this->aborted && !this->items.empty())
+  {
+    item = this->items.front();
+    this->items.pop_front();
+    this->notFull->Signal();
+  }
+  this->lock.Unlock();
+  return item;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::Queue::producerDone()
+{
+  this->lock.Lock();
+  this->producers--;
+  // Wake every consumer so they can see the end of the stream
+  this->notEmpty->Broadcast();
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::Queue::abort()
+{
+  this->lock.Lock();
+  this->aborted = true;
+  this->notEmpty->Broadcast();
+  this->notFull->Broadcast();
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+USnavFrameExporter::USnavFrameExporter()
+{
+  this->encoders = 1;
+  this->written = 0;
+  this->failures = 0;
+  this->running = false;
+  this->threadId = -1;
+  this->threader = vtkSmartPointer<vtkMultiThreader>::New();
+}
+
+//----------------------------------------------------------------------------
+USnavFrameExporter::~USnavFrameExporter()
+{
+  this->cancel();
+}
+
+//----------------------------------------------------------------------------
+const char* USnavFrameExporter::getExtension(Format format)
+{
+  return format == TIFF ? ".tiff" : ".png";
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameExporter::start(const Job& newJob)
+{
+  if(this->isRunning())
+    return false;
+  this->wait();
+  if(newJob.frames.size() != newJob.filenames.size() || newJob.source.width <= 0 || newJob.source.height <= 0)
+    return false;
+
+  // Stages are assigned by thread id and vtkMultiThreader silently clamps
+  // its thread count, so the reader, the writer and the encoders must all
+  // fit under its maximum or a stage would never run
+  int maximumThreads = vtkMultiThreader::GetGlobalMaximumNumberOfThreads();
+  if(maximumThreads <= 0 || maximumThreads > VTK_MAX_THREADS)
+    maximumThreads = VTK_MAX_THREADS;
+  if(maximumThreads < 3)
+    return false;
+
+  this->job = newJob;
+  this->encoders = newJob.numberOfEncoders;
+  if(this->encoders <= 0)
+    this->encoders = usnavDefaultNumberOfThreads() - 2;
+  if(this->encoders > maximumThreads - 2)
+    this->encoders = maximumThreads - 2;
+  if(this->encoders < 1)
+    this->encoders = 1;
+  // Opened here rather than in the thread so that an early cancel() sticks.
+  // A couple of frames in flight per encoder keeps every stage busy.
+  this->rawQueue.open(2*this->encoders, 1);
+  this->encodedQueue.open(2*this->encoders, this->encoders);
+  this->written = 0;
+  this->failures = 0;
+  this->firstFailure.clear();
+  this->running = true;
+  this->threadId = this->threader->SpawnThread(&USnavFrameExporter::run, this);
+  return true;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::cancel()
+{
+  this->rawQueue.abort();
+  this->encodedQueue.abort();
+  this->wait();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::wait()
+{
+  if(this->threadId >= 0)
+  {
+    this->threader->TerminateThread(this->threadId);
+    this->threadId = -1;
+  }
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameExporter::isRunning()
+{
+  this->lock.Lock();
+  bool r = this->running;
+  this->lock.Unlock();
+  return r;
+}
+
+//----------------------------------------------------------------------------
+double USnavFrameExporter::getProgress()
+{
+  this->lock.Lock();
+  double progress = this->job.frames.empty() ? 1.0 : (double)this->written / this->job.frames.size();
+  this->lock.Unlock();
+  return progress;
+}
+
+//----------------------------------------------------------------------------
+int USnavFrameExporter::getNumberOfFailures()
+{
+  this->lock.Lock();
+  int n = this->failures;
+  this->lock.Unlock();
+  return n;
+}
+
+//----------------------------------------------------------------------------
+std::string USnavFrameExporter::getFirstFailure()
+{
+  this->lock.Lock();
+  std::string f = this->firstFailure;
+  this->lock.Unlock();
+  return f;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::fail(int index)
+{
+  this->lock.Lock();
+  if(this->failures++ == 0)
+    this->firstFailure = this->job.filenames[index];
+  this->written++;
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE USnavFrameExporter::run(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* info = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  USnavFrameExporter* self = static_cast<USnavFrameExporter*>(info->UserData);
+
+  vtkSmartPointer<vtkMultiThreader> stages = vtkSmartPointer<vtkMultiThreader>::New();
+  stages->SetNumberOfThreads(self->encoders + 2);
+  if(stages->GetNumberOfThreads() == self->encoders + 2)
+  {
+    stages->SetSingleMethod(&USnavFrameExporter::runStage, self);
+    stages->SingleMethodExecute();
+  }
+  else
+  {
+    // The maximum was lowered since start(): fail rather than wait on a
+    // stage that never runs
+    self->lock.Lock();
+    self->failures = (int)self->job.frames.size();
+    self->written = self->failures;
+    if(!self->job.filenames.empty())
+      self->firstFailure = self->job.filenames[0];
+    self->lock.Unlock();
+  }
+
+  self->lock.Lock();
+  self->running = false;
+  self->lock.Unlock();
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE USnavFrameExporter::runStage(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* info = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  USnavFrameExporter* self = static_cast<USnavFrameExporter*>(info->UserData);
+  if(info->ThreadID == 0)
+    self->read();
+  else if(info->ThreadID == 1)
+    self->write();
+  else
+    self->encode();
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::read()
+{
+  // Frames in order are the reader's fast path
+  USnavFrameReader reader(this->job.source);
+  for(size_t i=0; i<this->job.frames.size(); i++)
+  {
+    Item* item = new Item;
+    item->index = (int)i;
+    item->data.resize(this->job.source.getFrameSize());
+    if(!reader.readFrame(this->job.frames[i], &item->data[0]))
+    {
+      delete item;
+      this->fail((int)i);
+      continue;
+    }
+    if(!this->rawQueue.push(item))
+    {
+      delete item;
+      break;
+    }
+  }
+  this->rawQueue.producerDone();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::encode()
+{
+  std::vector<unsigned char> encoded;
+  while(Item* item = this->rawQueue.pop())
+  {
+    bool ok = true;
+    if(this->job.format == TIFF)
+      encodeTIFF(&item->data[0], this->job.source.width, this->job.source.height, encoded);
+    else
+      ok = encodePNG(&item->data[0], this->job.source.width, this->job.source.height, encoded);
+    if(!ok)
+    {
+      this->fail(item->index);
+      delete item;
+      continue;
+    }
+    item->data.swap(encoded);
+    if(!this->encodedQueue.push(item))
+    {
+      delete item;
+      break;
+    }
+  }
+  this->encodedQueue.producerDone();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::write()
+{
+  while(Item* item = this->encodedQueue.pop())
+  {
+    const std::string& filename = this->job.filenames[item->index];
+    FILE* outfile = fopen(filename.c_str(), "wb");
+    bool ok = outfile != NULL;
+    if(outfile)
+    {
+      ok = fwrite(&item->data[0], 1, item->data.size(), outfile) == item->data.size();
+      ok = fclose(outfile) == 0 && ok;
+    }
+    if(ok)
+    {
+      this->lock.Lock();
+      this->written++;
+      this->lock.Unlock();
+    }
+    else
+      this->fail(item->index);
+    delete item;
+  }
+  // Every frame went through unless the export was cancelled
+  this->lock.Lock();
+  bool complete = this->written == (int)this->job.frames.size();
+  this->lock.Unlock();
+  if(complete && !this->job.sidecarFilename.empty())
+    this->writeSidecar();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::writeSidecar()
+{
+  FILE* outfile = fopen(this->job.sidecarFilename.c_str(), "w");
+  if(!outfile)
+  {
+    this->lock.Lock();
+    if(this->failures++ == 0)
+      this->firstFailure = this->job.sidecarFilename;
+    this->lock.Unlock();
+    return;
+  }
+  fprintf(outfile, "frame,filename,valid");
+  for(int r=0; r<3; r++)
+    for(int c=0; c<4; c++)
+      fprintf(outfile, ",m%d%d", r, c);
+  fprintf(outfile, "\n");
+  bool hasPoses = this->job.poses.size() >= 12*this->job.frames.size();
+  for(size_t i=0; i<this->job.frames.size(); i++)
+  {
+    std::string name = this->job.filenames[i];
+    size_t slash = name.find_last_of("/\\");
+    if(slash != std::string::npos)
+      name = name.substr(slash+1);
+    int valid = i < this->job.valid.size() ? this->job.valid[i] : 0;
+    fprintf(outfile, "%d,%s,%d", this->job.frames[i], name.c_str(), valid);
+    for(int k=0; k<12; k++)
+      fprintf(outfile, ",%.9g", hasPoses ? this->job.poses[12*i+k] : 0.0);
+    fprintf(outfile, "\n");
+  }
+  fclose(outfile);
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameExporter::encodeTIFF(const unsigned char* pixels, int width, int height, std::vector<unsigned char>& output)
+{
+  const unsigned int entries = 9;
+  const unsigned int dataStart = 8 + 2 + 12*entries + 4;
+  const unsigned int dataSize = (unsigned int)width*height;
+  output.clear();
+  output.reserve(dataStart + dataSize);
+  // Little endian header, first directory right after it
+  output.push_back('I');
+  output.push_back('I');
+  putShort(output, 42);
+  putLong(output, 8);
+  putShort(output, entries);
+  putTag(output, 256, 4, width);      // ImageWidth
+  putTag(output, 257, 4, height);     // ImageLength
+  putTag(output, 258, 3, 8);          // BitsPerSample
+  putTag(output, 259, 3, 1);          // Compression: none
+  putTag(output, 262, 3, 1);          // Photometric: black is zero
+  putTag(output, 273, 4, dataStart);  // StripOffsets
+  putTag(output, 277, 3, 1);          // SamplesPerPixel
+  putTag(output, 278, 4, height);     // RowsPerStrip: one strip
+  putTag(output, 279, 4, dataSize);   // StripByteCounts
+  putLong(output, 0);                 // No next directory
+  output.insert(output.end(), pixels, pixels + dataSize);
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameExporter::encodePNG(const unsigned char* pixels, int width, int height, std::vector<unsigned char>& output)
+{
+  // vtkPNGWriter writes the last VTK row first, the .mha stores the top
+  // row first: flip so the files look like the sequence
+  std::vector<unsigned char> flipped((size_t)width*height);
+  for(int y=0; y<height; y++)
+    memcpy(&flipped[(size_t)(height-1-y)*width], pixels + (size_t)y*width, width);
+
+  vtkSmartPointer<vtkImageImport> importer = vtkSmartPointer<vtkImageImport>::New();
+  importer->SetDataScalarTypeToUnsignedChar();
+  importer->SetImportVoidPointer(&flipped[0], 1);
+  importer->SetWholeExtent(0, width-1, 0, height-1, 0, 0);
+  importer->SetDataExtentToWholeExtent();
+
+  vtkSmartPointer<vtkPNGWriter> writer = vtkSmartPointer<vtkPNGWriter>::New();
+  writer->SetInputConnection(importer->GetOutputPort());
+  writer->WriteToMemoryOn();
+  writer->Write();
+  vtkUnsignedCharArray* result = writer->GetResult();
+  if(!result || result->GetNumberOfTuples() == 0)
+    return false;
+  const unsigned char* bytes = result->GetPointer(0);
+  output.assign(bytes, bytes + result->GetNumberOfTuples()*result->GetNumberOfComponents());
+  return true;
+}
@@ -0,0 +1,147 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavFrameExporter - writes sequence frames as PNG or TIFF files
+// .SECTION Description
+// Export runs in the background as a pipeline: one reader streams frames
+// from the sequence file in order, a pool of encoders compresses them and one
+// writer puts the results on disk. Stages are linked by bounded queues so
+// memory stays at a few frames per thread whatever the sequence length.
+// A CSV sidecar lists the file and ImageToTracker pose of every frame.
+
+#ifndef __USnavFrameExporter_h
+#define __USnavFrameExporter_h
+
+// VTK includes
+#include <vtkConditionVariable.h>
+#include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
+#include <vtkSmartPointer.h>
+
+// STD includes
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "USnavFrameReader.h"
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavFrameExporter
+{
+public:
+  enum Format
+  {
+    PNG,
+    TIFF
+  };
+
+  USnavFrameExporter();
+  ~USnavFrameExporter();
+
+  /// Frames of the sequence to export, the file written for each and the
+  /// row of the sidecar: validity and 12 doubles (3x4 row-major
+  /// ImageToTracker) per exported frame.
+  struct Job
+  {
+    USnavFrameSource source;
+    Format format;
+    std::vector<int> frames;
+    std::vector<std::string> filenames;
+    std::vector<unsigned char> valid;
+    std::vector<double> poses;
+    std::string sidecarFilename;
+    int numberOfEncoders; // 0 = all cores but the reader and the writer
+  };
+
+  /// Starts exporting in the background; false if an export is running or
+  /// vtkMultiThreader allows fewer than three threads (reader, encoder,
+  /// writer). Encoders beyond its maximum are dropped.
+  bool start(const Job& job);
+  /// Stops the export; files already written are kept.
+  void cancel();
+  /// Blocks until the export is over.
+  void wait();
+
+  bool isRunning();
+  /// Fraction of the frames written, in [0,1].
+  double getProgress();
+  int getNumberOfFailures();
+  /// First file that could not be read, encoded or written.
+  std::string getFirstFailure();
+
+  static const char* getExtension(Format format);
+
+  /// Baseline uncompressed 8 bit grayscale TIFF, top row first.
+  static void encodeTIFF(const unsigned char* pixels, int width, int height, std::vector<unsigned char>& output);
+  /// PNG through vtkPNGWriter, top row first.
+  static bool encodePNG(const unsigned char* pixels, int width, int height, std::vector<unsigned char>& output);
+
+private:
+  USnavFrameExporter(const USnavFrameExporter&); // Not implemented
+  void operator=(const USnavFrameExporter&);     // Not implemented
+
+  struct Item
+  {
+    int index; // into job.frames
+    std::vector<unsigned char> data;
+  };
+
+  // Bounded FIFO between two stages. pop() returns NULL once every
+  // producer is done and the queue is drained, or on abort.
+  class Queue
+  {
+  public:
+    Queue();
+    ~Queue();
+    void open(size_t capacity, int producers);
+    bool push(Item* item);
+    Item* pop();
+    void producerDone();
+    void abort();
+  private:
+    std::deque<Item*> items;
+    size_t capacity;
+    int producers;
+    bool aborted;
+    vtkSimpleMutexLock lock;
+    vtkSmartPointer<vtkConditionVariable> notEmpty;
+    vtkSmartPointer<vtkConditionVariable> notFull;
+  };
+
+  static VTK_THREAD_RETURN_TYPE run(void* arg);
+  static VTK_THREAD_RETURN_TYPE runStage(void* arg);
+  void read();
+  void encode();
+  void write();
+  void writeSidecar();
+  void fail(int index);
+
+  Job job;
+  Queue rawQueue;
+  Queue encodedQueue;
+  int encoders;
+  int written;
+  int failures;
+  std::string firstFailure;
+  bool running;
+
+  vtkSimpleMutexLock lock;
+  vtkSmartPointer<vtkMultiThreader> threader;
+  int threadId;
+};
+
+#endif
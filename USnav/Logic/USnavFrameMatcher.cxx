@@ -0,0 +1,216 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavFrameMatcher.h"
+#include "USnavGeometry.h"
+#include "USnavMatchPolicies.h"
+
+// STD includes
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace
+{
+// Distances are computed this many frames at a time, on the stack
+const int distanceBlock = 256;
+}
+
+//----------------------------------------------------------------------------
+USnavFrameMatcher::USnavFrameMatcher()
+{
+  this->temporalRadius = 2;
+  this->scanBudget = 0.25;
+  this->globalSearches = 0;
+  this->clear();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameMatcher::clear()
+{
+  this->nx.release();
+  this->ny.release();
+  this->nz.release();
+  this->offset.release();
+  this->frames.clear();
+  this->resetIncremental();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameMatcher::resetIncremental()
+{
+  this->anchored = false;
+  this->anchorSorted.clear();
+  this->previousBest.clear();
+  this->visited.assign(this->frames.size(), 0u);
+  this->stamp = 0;
+  this->lastEvaluated = 0;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameMatcher::build(const double* imageToTracker, const std::vector<int>& indexedFrames)
+{
+  this->clear();
+  size_t n = indexedFrames.size();
+  this->frames = indexedFrames;
+  this->nx.resize(n);
+  this->ny.resize(n);
+  this->nz.resize(n);
+  this->offset.resize(n);
+  for(size_t i=0; i<n; i++)
+  {
+    const double* m = imageToTracker + 16*(size_t)indexedFrames[i];
+    // Normal: third column, i.e. the image z axis; point: the origin
+    double w[3];
+    usnavImagePlane(m, w, this->offset[i]);
+    this->nx[i] = w[0];
+    this->ny[i] = w[1];
+    this->nz[i] = w[2];
+  }
+  this->visited.assign(n, 0u);
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameMatcher::computeDistances(const double tip[3], int begin, int end, double* distances) const
+{
+  const double* x = this->nx.get() + begin;
+  const double* y = this->ny.get() + begin;
+  const double* z = this->nz.get() + begin;
+  const double* o = this->offset.get() + begin;
+  const double px = tip[0], py = tip[1], pz = tip[2];
+  const int n = end - begin;
+  for(int i=0; i<n; i++)
+    distances[i] = fabs(x[i]*px + y[i]*py + z[i]*pz + o[i]);
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameMatcher::findNearest(const double tip[3], int count, MatchList& matches) const
+{
+  matches.clear();
+  int n = (int)this->frames.size();
+  if(n == 0 || count <= 0)
+    return;
+  double distances[distanceBlock];
+  for(int begin=0; begin<n; begin+=distanceBlock)
+  {
+    int end = std::min(begin + distanceBlock, n);
+    this->computeDistances(tip, begin, end, distances);
+    for(int i=begin; i<end; i++)
+      usnavPushMatch(matches, count, distances[i-begin], this->frames[i]);
+  }
+  std::sort_heap(matches.begin(), matches.end());
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameMatcher::globalSearch(const double tip[3], int count, MatchList& matches)
+{
+  int n = (int)this->frames.size();
+  double distances[distanceBlock];
+  this->anchorSorted.resize(n);
+  for(int begin=0; begin<n; begin+=distanceBlock)
+  {
+    int end = std::min(begin + distanceBlock, n);
+    this->computeDistances(tip, begin, end, distances);
+    for(int i=begin; i<end; i++)
+      this->anchorSorted[i] = std::pair<double,int>(distances[i-begin], i);
+  }
+  std::sort(this->anchorSorted.begin(), this->anchorSorted.end());
+  for(int k=0; k<3; k++)
+    this->anchorTip[k] = tip[k];
+  this->anchored = true;
+  this->globalSearches++;
+  this->lastEvaluated = n;
+
+  int m = std::min(count, n);
+  matches.resize(m);
+  this->previousBest.resize(m);
+  for(int i=0; i<m; i++)
+  {
+    matches[i] = std::pair<double,int>(this->anchorSorted[i].first, this->frames[this->anchorSorted[i].second]);
+    this->previousBest[i] = this->anchorSorted[i].second;
+  }
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameMatcher::consider(int item, const double tip[3], int count)
+{
+  if(this->visited[item] == this->stamp)
+    return;
+  this->visited[item] = this->stamp;
+  this->lastEvaluated++;
+  // The `count` best items so far
+  usnavPushMatch(this->heap, count, this->getDistance(item, tip), item);
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameMatcher::findNearestIncremental(const double tip[3], int count, MatchList& matches)
+{
+  matches.clear();
+  int n = (int)this->frames.size();
+  if(n == 0 || count <= 0)
+    return;
+  if(!this->anchored)
+  {
+    this->globalSearch(tip, count, matches);
+    return;
+  }
+
+  double delta = usnavDistance3(tip, this->anchorTip);
+
+  if(++this->stamp == 0)
+  {
+    // Stamp wrapped around, old marks could collide with the new one
+    std::fill(this->visited.begin(), this->visited.end(), 0u);
+    this->stamp = 1;
+  }
+  this->lastEvaluated = 0;
+  this->heap.clear();
+
+  // Seed with the previous best frames and their temporal neighbours
+  for(size_t b=0; b<this->previousBest.size(); b++)
+  {
+    int first = std::max(0, this->previousBest[b] - this->temporalRadius);
+    int last = std::min(n-1, this->previousBest[b] + this->temporalRadius);
+    for(int item=first; item<=last; item++)
+      this->consider(item, tip, count);
+  }
+
+  // Walk by distance to the anchor while the lower bound can still beat
+  // the current k-th best
+  int budget = std::max(4*count, (int)(this->scanBudget*n));
+  for(size_t s=0; s<this->anchorSorted.size(); s++)
+  {
+    double bound = this->anchorSorted[s].first - delta;
+    if((int)this->heap.size() == count && bound > this->heap.front().first)
+      break;
+    this->consider(this->anchorSorted[s].second, tip, count);
+    if(this->lastEvaluated > budget)
+    {
+      this->globalSearch(tip, count, matches);
+      return;
+    }
+  }
+
+  std::sort_heap(this->heap.begin(), this->heap.end());
+  matches.resize(this->heap.size());
+  this->previousBest.resize(this->heap.size());
+  for(size_t i=0; i<this->heap.size(); i++)
+  {
+    matches[i] = std::pair<double,int>(this->heap[i].first, this->frames[this->heap[i].second]);
+    this->previousBest[i] = this->heap[i].second;
+  }
+}
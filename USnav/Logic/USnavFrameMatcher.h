@@ -0,0 +1,108 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavFrameMatcher - ranks frames by distance from a point to their plane
+// .SECTION Description
+// Each frame is reduced to its image plane (unit normal n, offset d) stored
+// as structure of arrays, so the distance |n.p + d| of every frame to a
+// stylus tip p is one tight loop.
+//
+// findNearestIncremental() exploits that the stylus moves smoothly. The
+// distance is 1-Lipschitz in p, so with the distances D0 of every frame to
+// an anchor tip p0, |p - p0| = delta gives D(i) >= D0(i) - delta. A query
+// seeds the k best from the previous result and its temporal neighbours,
+// then walks frames by increasing D0 and stops as soon as D0 - delta
+// exceeds the current k-th best. The result is exact; when the walk grows
+// past a budget the anchor is too far away and a global search re-anchors.
+
+#ifndef __USnavFrameMatcher_h
+#define __USnavFrameMatcher_h
+
+#include "USnavAlignedArray.h"
+
+// STD includes
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavFrameMatcher
+{
+public:
+  typedef std::vector<std::pair<double,int> > MatchList;
+
+  USnavFrameMatcher();
+
+  /// Indexes `frames` (sorted), reading each image plane from the 16
+  /// row-major doubles of its ImageToTracker matrix.
+  void build(const double* imageToTracker, const std::vector<int>& frames);
+  void clear();
+  int getNumberOfFrames() const { return (int)this->frames.size(); }
+
+  /// Items are the indexed frames in order, 0 to getNumberOfFrames()-1.
+  int getFrame(int item) const { return this->frames[item]; }
+  /// Distance from `tip` to the image plane of an item.
+  double getDistance(int item, const double tip[3]) const
+  {
+    return fabs(this->nx[item]*tip[0] + this->ny[item]*tip[1] + this->nz[item]*tip[2] + this->offset[item]);
+  }
+
+  /// The `count` closest frames to `tip`, as (distance, frame), closest first.
+  void findNearest(const double tip[3], int count, MatchList& matches) const;
+  /// Same result as findNearest(), warm started from the previous query.
+  void findNearestIncremental(const double tip[3], int count, MatchList& matches);
+  /// Forgets the previous query; the next incremental one is global.
+  void resetIncremental();
+
+  /// Frames evaluated by the last incremental query
+  int getLastEvaluatedFrames() const { return this->lastEvaluated; }
+  /// Incremental queries that fell back to a global search
+  int getNumberOfGlobalSearches() const { return this->globalSearches; }
+
+  /// Frames on each side of a previous best that seed the next query
+  void setTemporalRadius(int radius) { this->temporalRadius = radius; }
+  /// Fraction of the frames an incremental query may evaluate before
+  /// falling back to a global search
+  void setScanBudget(double fraction) { this->scanBudget = fraction; }
+
+private:
+  void computeDistances(const double tip[3], int begin, int end, double* distances) const;
+  void globalSearch(const double tip[3], int count, MatchList& matches);
+  void consider(int item, const double tip[3], int count);
+
+  USnavAlignedArray<double> nx;
+  USnavAlignedArray<double> ny;
+  USnavAlignedArray<double> nz;
+  USnavAlignedArray<double> offset;
+  std::vector<int> frames; // item -> frame
+
+  // Warm start state
+  bool anchored;
+  double anchorTip[3];
+  std::vector<std::pair<double,int> > anchorSorted; // (distance to anchor, item)
+  std::vector<int> previousBest;                    // items
+  MatchList heap;                                   // (distance, item) of the query
+  std::vector<unsigned int> visited;
+  unsigned int stamp;
+  int lastEvaluated;
+  int globalSearches;
+  int temporalRadius;
+  double scanBudget;
+};
+
+#endif
@@ -0,0 +1,403 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavFramePyramid.h"
+#include "USnavParallel.h"
+
+// VTK includes
+#include <vtksys/SystemTools.hxx>
+
+// STD includes
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+const char pyramidMagic[8] = {'U','S','N','A','V','P','Y','R'};
+const vtkTypeInt32 pyramidVersion = 1;
+
+// Frames handed to a worker at once; they are read sequentially from disk.
+const int pyramidGrain = 16;
+
+// Box filter: each destination pixel is the rounded mean of a f x f block.
+// Levels are at least 1 pixel wide and high, so a source smaller than f is
+// averaged whole instead.
+void downsample(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst, int dstWidth,
+                int dstHeight, int f, std::vector<unsigned int>& sums)
+{
+  const int blockWidth = std::min(f, srcWidth);
+  const int blockHeight = std::min(f, srcHeight);
+  const unsigned int area = blockWidth*blockHeight;
+  sums.resize(dstWidth);
+  for(int y=0; y<dstHeight; y++)
+  {
+    std::fill(sums.begin(), sums.end(), 0u);
+    for(int r=0; r<blockHeight; r++)
+    {
+      const unsigned char* line = src + (size_t)(y*f+r)*srcWidth;
+      for(int x=0; x<dstWidth; x++)
+      {
+        const unsigned char* block = line + x*f;
+        unsigned int s = 0;
+        for(int k=0; k<blockWidth; k++)
+          s += block[k];
+        sums[x] += s;
+      }
+    }
+    unsigned char* out = dst + (size_t)y*dstWidth;
+    for(int x=0; x<dstWidth; x++)
+      out[x] = (unsigned char)((sums[x] + area/2) / area);
+  }
+}
+}
+
+//----------------------------------------------------------------------------
+USnavFramePyramid::USnavFramePyramid()
+{
+  this->width = 0;
+  this->height = 0;
+  this->numberOfFrames = 0;
+  this->readyFrames = 0;
+  this->aborted = false;
+  this->threadId = -1;
+  this->threader = vtkSmartPointer<vtkMultiThreader>::New();
+  // 1/4 for scrubbing, 1/16 for filmstrip thumbnails
+  this->factors.push_back(4);
+  this->factors.push_back(16);
+}
+
+//----------------------------------------------------------------------------
+USnavFramePyramid::~USnavFramePyramid()
+{
+  this->stop();
+}
+
+//----------------------------------------------------------------------------
+std::string USnavFramePyramid::getCacheFilename(const std::string& mhaPath)
+{
+  return mhaPath + ".pyr";
+}
+
+//----------------------------------------------------------------------------
+void USnavFramePyramid::start(const USnavFrameSource& s)
+{
+  this->stop();
+  int frames = s.frames;
+  if(s.width <= 0 || s.height <= 0 || frames <= 0)
+    return;
+
+  this->source = s;
+  this->width = s.width;
+  this->height = s.height;
+  this->numberOfFrames = frames;
+  this->levels.resize(this->factors.size());
+  for(int l=1; l<=this->getNumberOfLevels(); l++)
+    this->levels[l-1].assign((size_t)this->getLevelWidth(l)*this->getLevelHeight(l)*frames, 0);
+  this->ready.assign(frames, 0);
+  this->readyFrames = 0;
+  this->aborted = false;
+  this->threadId = this->threader->SpawnThread(&USnavFramePyramid::run, this);
+}
+
+//----------------------------------------------------------------------------
+void USnavFramePyramid::stop()
+{
+  if(this->threadId >= 0)
+  {
+    this->lock.Lock();
+    this->aborted = true;
+    this->lock.Unlock();
+    this->threader->TerminateThread(this->threadId);
+    this->threadId = -1;
+  }
+  this->levels.clear();
+  this->ready.clear();
+  this->readyFrames = 0;
+  this->numberOfFrames = 0;
+}
+
+//----------------------------------------------------------------------------
+void USnavFramePyramid::wait()
+{
+  if(this->threadId >= 0)
+  {
+    this->threader->TerminateThread(this->threadId);
+    this->threadId = -1;
+  }
+}
+
+//----------------------------------------------------------------------------
+int USnavFramePyramid::getNumberOfLevels() const
+{
+  return (int)this->factors.size();
+}
+
+//----------------------------------------------------------------------------
+int USnavFramePyramid::getLevelFactor(int level) const
+{
+  if(level <= 0 || level > this->getNumberOfLevels())
+    return 1;
+  return this->factors[level-1];
+}
+
+//----------------------------------------------------------------------------
+int USnavFramePyramid::getLevelWidth(int level) const
+{
+  int w = this->width / this->getLevelFactor(level);
+  return w > 0 ? w : 1;
+}
+
+//----------------------------------------------------------------------------
+int USnavFramePyramid::getLevelHeight(int level) const
+{
+  int h = this->height / this->getLevelFactor(level);
+  return h > 0 ? h : 1;
+}
+
+//----------------------------------------------------------------------------
+size_t USnavFramePyramid::estimateMemorySize(int w, int h, int frames) const
+{
+  size_t bytes = 0;
+  for(size_t l=0; l<this->factors.size(); l++)
+  {
+    int lw = w / this->factors[l];
+    int lh = h / this->factors[l];
+    bytes += (size_t)(lw > 0 ? lw : 1)*(lh > 0 ? lh : 1)*frames;
+  }
+  return bytes;
+}
+
+//----------------------------------------------------------------------------
+size_t USnavFramePyramid::getMemorySize() const
+{
+  size_t bytes = 0;
+  for(size_t l=0; l<this->levels.size(); l++)
+    bytes += this->levels[l].size();
+  return bytes;
+}
+
+//----------------------------------------------------------------------------
+const unsigned char* USnavFramePyramid::getFrame(int level, int frame)
+{
+  if(level <= 0 || level > this->getNumberOfLevels() || frame < 0 || frame >= this->numberOfFrames)
+    return NULL;
+  this->lock.Lock();
+  bool isReady = this->ready[frame] != 0;
+  this->lock.Unlock();
+  if(!isReady)
+    return NULL;
+  size_t frameSize = (size_t)this->getLevelWidth(level)*this->getLevelHeight(level);
+  return &this->levels[level-1][frameSize*frame];
+}
+
+//----------------------------------------------------------------------------
+void USnavFramePyramid::reduceFrame(const unsigned char* frame, int w, int h, int level,
+                                    std::vector<unsigned char>& pixels, int& levelWidth, int& levelHeight) const
+{
+  levelWidth = w;
+  levelHeight = h;
+  pixels.assign(frame, frame + (size_t)w*h);
+  std::vector<unsigned char> reduced;
+  std::vector<unsigned int> sums;
+  int srcFactor = 1;
+  for(int l=1; l<=level && l<=this->getNumberOfLevels(); l++)
+  {
+    // Same cascade and level sizes as buildChunk()
+    int factor = this->factors[l-1];
+    int lw = std::max(w / factor, 1);
+    int lh = std::max(h / factor, 1);
+    reduced.resize((size_t)lw*lh);
+    downsample(&pixels[0], levelWidth, levelHeight, &reduced[0], lw, lh, factor / srcFactor, sums);
+    pixels.swap(reduced);
+    levelWidth = lw;
+    levelHeight = lh;
+    srcFactor = factor;
+  }
+}
+
+//----------------------------------------------------------------------------
+double USnavFramePyramid::getProgress()
+{
+  if(this->numberOfFrames <= 0)
+    return 0.0;
+  this->lock.Lock();
+  double progress = (double)this->readyFrames / this->numberOfFrames;
+  this->lock.Unlock();
+  return progress;
+}
+
+//----------------------------------------------------------------------------
+bool USnavFramePyramid::isComplete()
+{
+  return this->numberOfFrames > 0 && this->getProgress() >= 1.0;
+}
+
+//----------------------------------------------------------------------------
+bool USnavFramePyramid::isAborted()
+{
+  this->lock.Lock();
+  bool a = this->aborted;
+  this->lock.Unlock();
+  return a;
+}
+
+//----------------------------------------------------------------------------
+void USnavFramePyramid::markReady(int begin, int end)
+{
+  this->lock.Lock();
+  for(int i=begin; i<end; i++)
+  {
+    if(!this->ready[i])
+    {
+      this->ready[i] = 1;
+      this->readyFrames++;
+    }
+  }
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE USnavFramePyramid::run(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* info = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  USnavFramePyramid* self = static_cast<USnavFramePyramid*>(info->UserData);
+
+  if(self->readCache())
+    return VTK_THREAD_RETURN_VALUE;
+
+  // Leave one core to the GUI
+  int threads = usnavDefaultNumberOfThreads() - 1;
+  usnavParallelFor(self->numberOfFrames, pyramidGrain, &USnavFramePyramid::buildChunk, self, threads > 0 ? threads : 1);
+
+  if(self->isAborted())
+    return VTK_THREAD_RETURN_VALUE;
+  // Frames that could not be read (truncated file) stay missing; a cache
+  // would serve them as built, so none is kept
+  if(self->isComplete())
+    self->writeCache();
+  else
+    vtksys::SystemTools::RemoveFile(getCacheFilename(self->source.path));
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+void USnavFramePyramid::buildChunk(int begin, int end, int vtkNotUsed(threadId), void* userData)
+{
+  USnavFramePyramid* self = static_cast<USnavFramePyramid*>(userData);
+  if(self->isAborted())
+    return;
+
+  USnavFrameReader reader(self->source);
+  std::vector<unsigned char> frame(self->source.getFrameSize());
+  std::vector<unsigned int> sums;
+  for(int i=begin; i<end; i++)
+  {
+    if(self->isAborted())
+      break;
+    if(!reader.readFrame(i, &frame[0]))
+      continue;
+    const unsigned char* src = &frame[0];
+    int srcWidth = self->width;
+    int srcHeight = self->height;
+    int srcFactor = 1;
+    for(int l=1; l<=self->getNumberOfLevels(); l++)
+    {
+      int w = self->getLevelWidth(l);
+      int h = self->getLevelHeight(l);
+      unsigned char* dst = &self->levels[l-1][(size_t)w*h*i];
+      // Each level is built from the previous one, not from full resolution
+      int f = self->getLevelFactor(l) / srcFactor;
+      downsample(src, srcWidth, srcHeight, dst, w, h, f, sums);
+      src = dst;
+      srcWidth = w;
+      srcHeight = h;
+      srcFactor = self->getLevelFactor(l);
+    }
+    self->markReady(i, i+1);
+  }
+}
+
+//----------------------------------------------------------------------------
+bool USnavFramePyramid::readCache()
+{
+  std::string cacheFile = getCacheFilename(this->source.path);
+  FILE* infile = fopen(cacheFile.c_str(), "rb");
+  if(!infile)
+    return false;
+
+  char magic[8];
+  vtkTypeInt32 header[5];
+  vtkTypeInt64 source[2];
+  bool valid = fread(magic, 1, 8, infile) == 8 && memcmp(magic, pyramidMagic, 8) == 0
+    && fread(header, sizeof(vtkTypeInt32), 5, infile) == 5
+    && header[0] == pyramidVersion && header[1] == this->width && header[2] == this->height
+    && header[3] == this->numberOfFrames && header[4] == this->getNumberOfLevels();
+  for(int l=0; valid && l<this->getNumberOfLevels(); l++)
+  {
+    vtkTypeInt32 factor = 0;
+    valid = fread(&factor, sizeof(factor), 1, infile) == 1 && factor == this->factors[l];
+  }
+  // A stale cache of a sequence that was rewritten in place is rebuilt
+  valid = valid && fread(source, sizeof(vtkTypeInt64), 2, infile) == 2
+    && source[0] == (vtkTypeInt64)vtksys::SystemTools::FileLength(this->source.path)
+    && source[1] == (vtkTypeInt64)vtksys::SystemTools::ModifiedTime(this->source.path);
+  for(size_t l=0; valid && l<this->levels.size(); l++)
+  {
+    std::vector<unsigned char>& level = this->levels[l];
+    valid = fread(&level[0], 1, level.size(), infile) == level.size() && !this->isAborted();
+  }
+  fclose(infile);
+
+  if(valid)
+    this->markReady(0, this->numberOfFrames);
+  return valid;
+}
+
+//----------------------------------------------------------------------------
+void USnavFramePyramid::writeCache()
+{
+  std::string cacheFile = getCacheFilename(this->source.path);
+  std::string tmpFile = cacheFile + ".tmp";
+  FILE* outfile = fopen(tmpFile.c_str(), "wb");
+  if(!outfile)
+    return;
+
+  vtkTypeInt32 header[5] = { pyramidVersion, this->width, this->height, this->numberOfFrames, this->getNumberOfLevels() };
+  vtkTypeInt64 source[2] = {
+    (vtkTypeInt64)vtksys::SystemTools::FileLength(this->source.path),
+    (vtkTypeInt64)vtksys::SystemTools::ModifiedTime(this->source.path) };
+  bool ok = fwrite(pyramidMagic, 1, 8, outfile) == 8
+    && fwrite(header, sizeof(vtkTypeInt32), 5, outfile) == 5;
+  for(int l=0; ok && l<this->getNumberOfLevels(); l++)
+  {
+    vtkTypeInt32 factor = this->factors[l];
+    ok = fwrite(&factor, sizeof(factor), 1, outfile) == 1;
+  }
+  ok = ok && fwrite(source, sizeof(vtkTypeInt64), 2, outfile) == 2;
+  for(size_t l=0; ok && l<this->levels.size(); l++)
+    ok = fwrite(&this->levels[l][0], 1, this->levels[l].size(), outfile) == this->levels[l].size();
+  fclose(outfile);
+
+  // Publish atomically so a reader never sees a half written cache
+  if(ok)
+  {
+    vtksys::SystemTools::RemoveFile(cacheFile);
+    ok = vtksys::SystemTools::RenameFile(tmpFile.c_str(), cacheFile.c_str());
+  }
+  if(!ok)
+    vtksys::SystemTools::RemoveFile(tmpFile);
+}
@@ -0,0 +1,103 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavFramePyramid - downsampled copies of every frame of a sequence
+// .SECTION Description
+// Level 0 is the full resolution frame stored in the sequence file and is
+// not kept here. Levels 1..N are box-filtered copies reduced by getLevelFactor()
+// in each direction. The pyramid is built in the background with one chunk
+// of frames per worker and saved next to the sequence (see
+// getCacheFilename()) so that reopening the sequence only reads it back.
+
+#ifndef __USnavFramePyramid_h
+#define __USnavFramePyramid_h
+
+// VTK includes
+#include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
+#include <vtkSmartPointer.h>
+
+// STD includes
+#include <string>
+#include <vector>
+
+#include "USnavFrameReader.h"
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavFramePyramid
+{
+public:
+  USnavFramePyramid();
+  ~USnavFramePyramid();
+
+  /// Loads the pyramid of the sequence from its cache file, or builds it,
+  /// on a background thread. Any previous build is stopped first.
+  void start(const USnavFrameSource& source);
+  /// Stops the background thread and releases every level.
+  void stop();
+  /// Blocks until the background thread has loaded or built the pyramid.
+  void wait();
+
+  /// Number of reduced levels (level 0, full resolution, is not counted).
+  int getNumberOfLevels() const;
+  int getLevelFactor(int level) const;
+  int getLevelWidth(int level) const;
+  int getLevelHeight(int level) const;
+  /// Pixels of `frame` at `level` (>=1), or NULL if not built yet or the
+  /// frame could not be read.
+  const unsigned char* getFrame(int level, int frame);
+  /// Reduces a width x height frame to `level` the way the pyramid is
+  /// built, for frames it does not hold; sets levelWidth x levelHeight.
+  void reduceFrame(const unsigned char* frame, int width, int height, int level,
+                   std::vector<unsigned char>& pixels, int& levelWidth, int& levelHeight) const;
+  /// Fraction of frames available, in [0,1].
+  double getProgress();
+  bool isComplete();
+  /// Bytes held by the levels of a width x height x numberOfFrames sequence.
+  size_t estimateMemorySize(int width, int height, int numberOfFrames) const;
+  /// Bytes held by the levels currently allocated.
+  size_t getMemorySize() const;
+
+  static std::string getCacheFilename(const std::string& mhaPath);
+
+private:
+  USnavFramePyramid(const USnavFramePyramid&); // Not implemented
+  void operator=(const USnavFramePyramid&);    // Not implemented
+
+  static VTK_THREAD_RETURN_TYPE run(void* arg);
+  static void buildChunk(int begin, int end, int threadId, void* userData);
+  bool readCache();
+  void writeCache();
+  void markReady(int begin, int end);
+  bool isAborted();
+
+  USnavFrameSource source;
+  int width;
+  int height;
+  int numberOfFrames;
+  std::vector<int> factors;
+  std::vector<std::vector<unsigned char> > levels;
+  std::vector<unsigned char> ready;
+  int readyFrames;
+  bool aborted;
+
+  vtkSimpleMutexLock lock;
+  vtkSmartPointer<vtkMultiThreader> threader;
+  int threadId;
+};
+
+#endif
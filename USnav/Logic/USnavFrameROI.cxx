@@ -0,0 +1,195 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavFrameROI.h"
+
+// STD includes
+#include <algorithm>
+#include <cstring>
+
+//----------------------------------------------------------------------------
+USnavFrameROI::USnavFrameROI()
+{
+  this->reset(0, 0);
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameROI::reset(int w, int h)
+{
+  this->width = w > 0 ? w : 0;
+  this->height = h > 0 ? h : 0;
+  this->firstRow = 0;
+  this->endRow = this->height;
+  this->rowBegin.assign(this->height, 0);
+  this->rowEnd.assign(this->height, this->width);
+  this->update();
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameROI::setRectangle(int x0, int y0, int x1, int y1)
+{
+  x0 = std::max(0, std::min(x0, this->width));
+  x1 = std::max(x0, std::min(x1, this->width));
+  y0 = std::max(0, std::min(y0, this->height));
+  y1 = std::max(y0, std::min(y1, this->height));
+  this->firstRow = y0;
+  this->endRow = y1;
+  for(int y=0; y<this->height; y++)
+  {
+    bool inside = y >= y0 && y < y1;
+    this->rowBegin[y] = inside ? x0 : 0;
+    this->rowEnd[y] = inside ? x1 : 0;
+  }
+  this->update();
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameROI::detect(const std::vector<const unsigned char*>& samples, int threshold, int margin)
+{
+  if(samples.size() < 2 || this->width <= 0 || this->height <= 0)
+    return false;
+  size_t n = (size_t)this->width*this->height;
+  std::vector<unsigned char> lo(samples[0], samples[0] + n), hi(samples[0], samples[0] + n);
+  for(size_t s=1; s<samples.size(); s++)
+  {
+    const unsigned char* p = samples[s];
+    for(size_t i=0; i<n; i++)
+    {
+      lo[i] = std::min(lo[i], p[i]);
+      hi[i] = std::max(hi[i], p[i]);
+    }
+  }
+
+  std::vector<int> begin(this->height, this->width), end(this->height, 0);
+  int first = this->height, last = -1;
+  for(int y=0; y<this->height; y++)
+  {
+    const unsigned char* l = &lo[(size_t)y*this->width];
+    const unsigned char* h = &hi[(size_t)y*this->width];
+    for(int x=0; x<this->width; x++)
+      if(h[x] - l[x] > threshold)
+      {
+        begin[y] = std::min(begin[y], x);
+        end[y] = x+1;
+      }
+    if(end[y] > 0)
+    {
+      first = std::min(first, y);
+      last = y;
+    }
+  }
+  if(last < 0)
+    return false;
+
+  // Rows inside the fan where nothing moved take the span of the row above
+  for(int y=first+1; y<=last; y++)
+    if(end[y] == 0)
+    {
+      begin[y] = begin[y-1];
+      end[y] = end[y-1];
+    }
+
+  this->firstRow = std::max(0, first - margin);
+  this->endRow = std::min(this->height, last + 1 + margin);
+  for(int y=0; y<this->height; y++)
+  {
+    this->rowBegin[y] = 0;
+    this->rowEnd[y] = 0;
+    if(y < this->firstRow || y >= this->endRow)
+      continue;
+    // Widest span within `margin` rows
+    int b = this->width, e = 0;
+    for(int r=std::max(first, y-margin); r<=std::min(last, y+margin); r++)
+    {
+      b = std::min(b, begin[r]);
+      e = std::max(e, end[r]);
+    }
+    if(e > b)
+    {
+      this->rowBegin[y] = std::max(0, b - margin);
+      this->rowEnd[y] = std::min(this->width, e + margin);
+    }
+  }
+  this->update();
+  return true;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameROI::update()
+{
+  this->packedSize = 0;
+  for(int y=this->firstRow; y<this->endRow; y++)
+    this->packedSize += this->rowEnd[y] - this->rowBegin[y];
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameROI::isFullFrame() const
+{
+  return this->packedSize == (size_t)this->width*this->height;
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameROI::contains(int x, int y) const
+{
+  return y >= this->firstRow && y < this->endRow && x >= this->rowBegin[y] && x < this->rowEnd[y];
+}
+
+//----------------------------------------------------------------------------
+double USnavFrameROI::getCoverage() const
+{
+  size_t n = (size_t)this->width*this->height;
+  return n > 0 ? (double)this->packedSize / n : 1.0;
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameROI::pack(const unsigned char* frame, unsigned char* packed) const
+{
+  for(int y=this->firstRow; y<this->endRow; y++)
+  {
+    int count = this->rowEnd[y] - this->rowBegin[y];
+    memcpy(packed, frame + (size_t)y*this->width + this->rowBegin[y], count);
+    packed += count;
+  }
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameROI::unpack(const unsigned char* packed, unsigned char* frame) const
+{
+  memset(frame, 0, (size_t)this->width*this->height);
+  for(int y=this->firstRow; y<this->endRow; y++)
+  {
+    int count = this->rowEnd[y] - this->rowBegin[y];
+    memcpy(frame + (size_t)y*this->width + this->rowBegin[y], packed, count);
+    packed += count;
+  }
+}
+
+//----------------------------------------------------------------------------
+void USnavFrameROI::mask(unsigned char* frame) const
+{
+  for(int y=0; y<this->height; y++)
+  {
+    unsigned char* row = frame + (size_t)y*this->width;
+    if(y < this->firstRow || y >= this->endRow)
+    {
+      memset(row, 0, this->width);
+      continue;
+    }
+    memset(row, 0, this->rowBegin[y]);
+    memset(row + this->rowEnd[y], 0, this->width - this->rowEnd[y]);
+  }
+}
@@ -0,0 +1,82 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavFrameROI - the part of the frames that holds ultrasound data
+// .SECTION Description
+// The region is one span of columns per row between a first and a last
+// row, which describes rectangles as well as sector and convex fans.
+// detect() finds it on a few sample frames: the image changes over time
+// inside the fan while the black background and static overlays (text,
+// scales, logos) do not. Frames can be packed to the pixels of the region
+// only, and unpacked back to a full frame with zeros outside.
+
+#ifndef __USnavFrameROI_h
+#define __USnavFrameROI_h
+
+// STD includes
+#include <cstddef>
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavFrameROI
+{
+public:
+  USnavFrameROI();
+
+  /// Whole width x height frame.
+  void reset(int width, int height);
+  /// Rectangle [x0,x1) x [y0,y1), clamped to the frame.
+  void setRectangle(int x0, int y0, int x1, int y1);
+  /// Pixels whose range over the samples exceeds `threshold`, spread by
+  /// `margin` pixels. False, and no change, if nothing moves.
+  bool detect(const std::vector<const unsigned char*>& samples, int threshold = 8, int margin = 2);
+
+  bool isFullFrame() const;
+  int getWidth() const { return this->width; }
+  int getHeight() const { return this->height; }
+  /// Rows [getFirstRow(), getEndRow()) hold the region
+  int getFirstRow() const { return this->firstRow; }
+  int getEndRow() const { return this->endRow; }
+  /// Columns [getRowBegin(y), getRowEnd(y)) of row y
+  int getRowBegin(int y) const { return this->rowBegin[y]; }
+  int getRowEnd(int y) const { return this->rowEnd[y]; }
+  bool contains(int x, int y) const;
+  /// Fraction of the frame in the region
+  double getCoverage() const;
+
+  size_t getPackedSize() const { return this->packedSize; }
+  /// Region pixels of a full frame, row by row
+  void pack(const unsigned char* frame, unsigned char* packed) const;
+  /// Full frame from packed pixels, zero outside the region
+  void unpack(const unsigned char* packed, unsigned char* frame) const;
+  /// Zeroes a full frame outside the region
+  void mask(unsigned char* frame) const;
+
+private:
+  void update();
+
+  int width;
+  int height;
+  int firstRow;
+  int endRow;
+  std::vector<int> rowBegin;
+  std::vector<int> rowEnd;
+  size_t packedSize;
+};
+
+#endif
@@ -0,0 +1,133 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavFrameReader.h"
+#include "USnavCodec.h"
+#include "USnavFileIO.h"
+
+// STD includes
+#include <algorithm>
+#include <cstring>
+
+//----------------------------------------------------------------------------
+USnavFrameSource::USnavFrameSource()
+{
+  this->format = RawFrames;
+  this->width = 0;
+  this->height = 0;
+  this->frames = 0;
+  this->dataOffset = 0;
+  this->framesPerBlock = 1;
+  this->delta = false;
+}
+
+//----------------------------------------------------------------------------
+USnavFrameReader::USnavFrameReader(const USnavFrameSource& s)
+  : source(s)
+{
+  this->file = NULL;
+  this->failed = false;
+  this->position = -1;
+  this->decodedBlock = -1;
+}
+
+//----------------------------------------------------------------------------
+USnavFrameReader::~USnavFrameReader()
+{
+  if(this->file)
+    fclose(this->file);
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameReader::open()
+{
+  if(!this->file && !this->failed)
+  {
+    this->file = fopen(this->source.path.c_str(), "rb");
+    this->failed = this->file == NULL;
+  }
+  return this->file != NULL;
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameReader::readFrame(int frame, unsigned char* pixels)
+{
+  return this->readRows(frame, 0, this->source.height, pixels);
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameReader::readRows(int frame, int firstRow, int endRow, unsigned char* rows)
+{
+  const USnavFrameSource& s = this->source;
+  if(frame < 0 || frame >= s.frames || firstRow < 0 || endRow > s.height || firstRow >= endRow || !this->open())
+    return false;
+  size_t frameSize = s.getFrameSize();
+  size_t rowsOffset = (size_t)firstRow*s.width;
+  size_t rowsSize = (size_t)(endRow - firstRow)*s.width;
+
+  if(s.format == USnavFrameSource::RawFrames)
+  {
+    vtkTypeInt64 offset = (vtkTypeInt64)frameSize*frame + (vtkTypeInt64)rowsOffset;
+    if(offset != this->position && usnavSeek(this->file, s.dataOffset + offset) != 0)
+    {
+      this->position = -1;
+      return false;
+    }
+    bool ok = fread(rows, 1, rowsSize, this->file) == rowsSize;
+    this->position = ok ? offset + (vtkTypeInt64)rowsSize : -1;
+    return ok;
+  }
+
+  int block = frame / s.framesPerBlock;
+  if(!this->decodeBlock(block))
+    return false;
+  memcpy(rows, &this->decoded[frameSize*(frame - block*s.framesPerBlock) + rowsOffset], rowsSize);
+  return true;
+}
+
+//----------------------------------------------------------------------------
+bool USnavFrameReader::decodeBlock(int block)
+{
+  if(block == this->decodedBlock)
+    return true;
+  const USnavFrameSource& s = this->source;
+  if(block < 0 || block >= s.getNumberOfBlocks())
+    return false;
+  this->decodedBlock = -1;
+  size_t frameSize = s.getFrameSize();
+  int blockFrames = std::min(s.framesPerBlock, s.frames - block*s.framesPerBlock);
+  size_t decodedSize = frameSize*blockFrames;
+  vtkTypeInt64 begin = s.blockOffsets[block];
+  vtkTypeInt64 end = s.blockOffsets[block+1];
+  if(end < begin || end - begin > (vtkTypeInt64)usnavCompressBound(decodedSize))
+    return false;
+  size_t size = (size_t)(end - begin);
+  this->compressed.resize(size + 1);
+  this->decoded.resize(decodedSize);
+  if(usnavSeek(this->file, begin) != 0 || fread(&this->compressed[0], 1, size, this->file) != size)
+    return false;
+  // Blocks that did not compress are stored as they are
+  if(size == decodedSize)
+    memcpy(&this->decoded[0], &this->compressed[0], size);
+  else if(!usnavDecompress(&this->compressed[0], size, &this->decoded[0], decodedSize))
+    return false;
+  if(s.delta)
+    for(int i=1; i<blockFrames; i++)
+      usnavDeltaDecode(&this->decoded[frameSize*i], &this->decoded[frameSize*(i-1)], frameSize);
+  this->decodedBlock = block;
+  return true;
+}
@@ -0,0 +1,100 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavFrameReader - reads 8 bit frames of an MHA or native sequence
+// .SECTION Description
+// A USnavFrameSource describes where the frames of a sequence are: raw
+// after the header of an MHA file, or in compressed blocks of a native
+// .usn file (see USnavNativeSequence) listed by a block offset table.
+// Readers that run on their own thread (pyramid, cine, export) keep a copy
+// of the source and open one USnavFrameReader each.
+//
+// Reading frames in order is the fast path: raw frames are not sought
+// between consecutive reads, and the last decoded block is kept so the
+// other frames of a block cost a copy.
+
+#ifndef __USnavFrameReader_h
+#define __USnavFrameReader_h
+
+// VTK includes
+#include <vtkType.h>
+
+// STD includes
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+struct VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavFrameSource
+{
+  enum Format
+  {
+    RawFrames,
+    CompressedBlocks
+  };
+
+  USnavFrameSource();
+  size_t getFrameSize() const { return (size_t)this->width*this->height; }
+  int getNumberOfBlocks() const { return (int)this->blockOffsets.size() - 1; }
+
+  std::string path;
+  Format format;
+  int width;
+  int height;
+  int frames;
+  // RawFrames: offset of the first frame
+  vtkTypeInt64 dataOffset;
+  // CompressedBlocks: frames per block, whether frames after the first of
+  // a block are differences with the previous one, and where each block
+  // starts, plus the end of the last one
+  int framesPerBlock;
+  bool delta;
+  std::vector<vtkTypeInt64> blockOffsets;
+};
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavFrameReader
+{
+public:
+  /// `source` must outlive the reader.
+  explicit USnavFrameReader(const USnavFrameSource& source);
+  ~USnavFrameReader();
+
+  /// Whole width x height frame; false if the file cannot be read.
+  bool readFrame(int frame, unsigned char* pixels);
+  /// Rows [firstRow, endRow) of `frame`, one after the other.
+  bool readRows(int frame, int firstRow, int endRow, unsigned char* rows);
+
+private:
+  USnavFrameReader(const USnavFrameReader&); // Not implemented
+  void operator=(const USnavFrameReader&);   // Not implemented
+
+  bool open();
+  bool decodeBlock(int block);
+
+  const USnavFrameSource& source;
+  FILE* file;
+  bool failed;
+  // Raw frames: where the file position is, in bytes from dataOffset
+  vtkTypeInt64 position;
+  // Compressed blocks: the block held decoded
+  int decodedBlock;
+  std::vector<unsigned char> compressed;
+  std::vector<unsigned char> decoded;
+};
+
+#endif
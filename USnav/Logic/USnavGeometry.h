@@ -0,0 +1,172 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavGeometry - fixed size vector and matrix kernels
+// .SECTION Description
+// Inline functions on the layouts the module stores poses in: 4x4
+// matrices as 16 row-major doubles, the transform store's 12 floats, 3x3
+// rotations as 9 row-major doubles and planes as a unit normal and an
+// offset. Everything works on caller provided arrays, on the stack, so the
+// per-frame and per-query paths never allocate. Outputs may alias inputs.
+
+#ifndef __USnavGeometry_h
+#define __USnavGeometry_h
+
+// STD includes
+#include <cmath>
+#include <cstring>
+
+//----------------------------------------------------------------------------
+// 3-vectors
+
+inline double usnavDot3(const double a[3], const double b[3])
+{
+  return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+inline double usnavNorm3(const double a[3])
+{
+  return sqrt(usnavDot3(a, a));
+}
+
+inline double usnavDistance3(const double a[3], const double b[3])
+{
+  double d[3] = { a[0] - b[0], a[1] - b[1], a[2] - b[2] };
+  return usnavNorm3(d);
+}
+
+inline void usnavCross3(const double a[3], const double b[3], double out[3])
+{
+  double c[3] = { a[1]*b[2] - a[2]*b[1], a[2]*b[0] - a[0]*b[2], a[0]*b[1] - a[1]*b[0] };
+  out[0] = c[0];
+  out[1] = c[1];
+  out[2] = c[2];
+}
+
+// Returns the norm before normalization; a null vector is left as is
+inline double usnavNormalize3(double a[3])
+{
+  double n = usnavNorm3(a);
+  if(n > 0)
+  {
+    a[0] /= n;
+    a[1] /= n;
+    a[2] /= n;
+  }
+  return n;
+}
+
+//----------------------------------------------------------------------------
+// 4x4 row-major matrices
+
+inline void usnavIdentity4x4(double m[16])
+{
+  for(int k=0; k<16; k++)
+    m[k] = (k%5 == 0) ? 1.0 : 0.0;
+}
+
+// out = a*b
+inline void usnavMultiply4x4(const double a[16], const double b[16], double out[16])
+{
+  double m[16];
+  for(int r=0; r<4; r++)
+    for(int c=0; c<4; c++)
+      m[4*r+c] = a[4*r]*b[c] + a[4*r+1]*b[4+c] + a[4*r+2]*b[8+c] + a[4*r+3]*b[12+c];
+  memcpy(out, m, sizeof(m));
+}
+
+// Inverse of an affine matrix (last row 0 0 0 1), scaling and shear
+// included. False and the identity when the linear part is singular.
+inline bool usnavInvertAffine4x4(const double m[16], double out[16])
+{
+  double a = m[0], b = m[1], c = m[2];
+  double d = m[4], e = m[5], f = m[6];
+  double g = m[8], h = m[9], i = m[10];
+  double c00 = e*i - f*h, c01 = c*h - b*i, c02 = b*f - c*e;
+  double c10 = f*g - d*i, c11 = a*i - c*g, c12 = c*d - a*f;
+  double c20 = d*h - e*g, c21 = b*g - a*h, c22 = a*e - b*d;
+  double det = a*c00 + b*c10 + c*c20;
+  if(det == 0.0)
+  {
+    usnavIdentity4x4(out);
+    return false;
+  }
+  double s = 1.0/det;
+  double r[9] = { c00*s, c01*s, c02*s, c10*s, c11*s, c12*s, c20*s, c21*s, c22*s };
+  double t[3] = { m[3], m[7], m[11] };
+  for(int row=0; row<3; row++)
+  {
+    out[4*row] = r[3*row];
+    out[4*row+1] = r[3*row+1];
+    out[4*row+2] = r[3*row+2];
+    out[4*row+3] = -(r[3*row]*t[0] + r[3*row+1]*t[1] + r[3*row+2]*t[2]);
+  }
+  out[12] = out[13] = out[14] = 0.0;
+  out[15] = 1.0;
+  return true;
+}
+
+inline void usnavTransformPoint(const double m[16], const double p[3], double out[3])
+{
+  double q[3];
+  for(int r=0; r<3; r++)
+    q[r] = m[4*r]*p[0] + m[4*r+1]*p[1] + m[4*r+2]*p[2] + m[4*r+3];
+  out[0] = q[0];
+  out[1] = q[1];
+  out[2] = q[2];
+}
+
+// The first 3 rows of a matrix as stored by USnavTransformStore
+inline void usnavMatrixFromFloat12(const float* src, double m[16])
+{
+  for(int k=0; k<12; k++)
+    m[k] = src[k];
+  m[12] = m[13] = m[14] = 0.0;
+  m[15] = 1.0;
+}
+
+// Rotation part of a matrix with its columns normalized, 9 row-major
+// doubles: calibrated matrices carry the pixel spacing
+inline void usnavNormalizedRotation(const double m[16], double r[9])
+{
+  for(int j=0; j<3; j++)
+  {
+    double n = sqrt(m[j]*m[j] + m[4+j]*m[4+j] + m[8+j]*m[8+j]);
+    for(int i=0; i<3; i++)
+      r[3*i+j] = n > 0 ? m[4*i+j]/n : 0.0;
+  }
+}
+
+//----------------------------------------------------------------------------
+// Planes: normal.p + offset = 0, normal of unit length
+
+// Plane of an image, its z axis as normal through the image origin
+inline void usnavImagePlane(const double m[16], double normal[3], double& offset)
+{
+  normal[0] = m[2];
+  normal[1] = m[6];
+  normal[2] = m[10];
+  usnavNormalize3(normal);
+  offset = -(normal[0]*m[3] + normal[1]*m[7] + normal[2]*m[11]);
+}
+
+inline double usnavSignedDistanceToPlane(const double normal[3], double offset, const double p[3])
+{
+  return usnavDot3(normal, p) + offset;
+}
+
+#endif
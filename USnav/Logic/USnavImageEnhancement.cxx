@@ -0,0 +1,180 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavImageEnhancement.h"
+#include "USnavParallel.h"
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+// Gain is a smooth function of depth: 256 bins are finer than a step
+// anyone could see
+const int depthBins = 256;
+// Rows per chunk of work
+const int enhancementGrain = 16;
+
+inline unsigned char min8(unsigned char a, unsigned char b) { return a < b ? a : b; }
+inline unsigned char max8(unsigned char a, unsigned char b) { return a < b ? b : a; }
+inline unsigned char med3(unsigned char a, unsigned char b, unsigned char c)
+{
+  return max8(min8(a, b), min8(max8(a, b), c));
+}
+
+// Median of the 3x3 neighbourhood, edges replicated. Each column of three
+// is sorted first; the median of nine is then the median of the largest
+// low, the median middle and the smallest high of three neighbour columns.
+void medianRow(const unsigned char* above, const unsigned char* row, const unsigned char* below, int width,
+               unsigned char* lo, unsigned char* mid, unsigned char* hi, unsigned char* out)
+{
+  for(int x=0; x<width; x++)
+  {
+    unsigned char a = min8(above[x], row[x]);
+    unsigned char b = max8(above[x], row[x]);
+    unsigned char c = max8(a, below[x]);
+    lo[x] = min8(a, below[x]);
+    mid[x] = min8(b, c);
+    hi[x] = max8(b, c);
+  }
+  for(int x=1; x<width-1; x++)
+  {
+    unsigned char maxLo = max8(max8(lo[x-1], lo[x]), lo[x+1]);
+    unsigned char minHi = min8(min8(hi[x-1], hi[x]), hi[x+1]);
+    out[x] = med3(maxLo, med3(mid[x-1], mid[x], mid[x+1]), minHi);
+  }
+  // First and last columns, with the edge column repeated
+  int edges[2] = { 0, width-1 };
+  for(int i=0; i<2; i++)
+  {
+    int x = edges[i];
+    int l = std::max(x-1, 0);
+    int r = std::min(x+1, width-1);
+    unsigned char maxLo = max8(max8(lo[l], lo[x]), lo[r]);
+    unsigned char minHi = min8(min8(hi[l], hi[x]), hi[r]);
+    out[x] = med3(maxLo, med3(mid[l], mid[x], mid[r]), minHi);
+  }
+}
+
+struct ApplyData
+{
+  const USnavImageEnhancement::Parameters* parameters;
+  const unsigned char* tables;
+  const unsigned char* src;
+  unsigned char* dst;
+  int width;
+  int height;
+};
+
+// Linear interpolation of the TGC control points at depth t in [0,1]
+double tgcAt(const std::vector<double>& tgc, double t)
+{
+  if(tgc.empty())
+    return 0.0;
+  if(tgc.size() == 1)
+    return tgc[0];
+  double position = t*(tgc.size() - 1);
+  size_t i = std::min((size_t)position, tgc.size() - 2);
+  double f = position - i;
+  return (1.0 - f)*tgc[i] + f*tgc[i+1];
+}
+}
+
+//----------------------------------------------------------------------------
+USnavImageEnhancement::USnavImageEnhancement()
+{
+  this->setParameters(Parameters());
+}
+
+//----------------------------------------------------------------------------
+void USnavImageEnhancement::setParameters(const Parameters& p)
+{
+  this->parameters = p;
+  double low = p.windowMinimum;
+  double range = p.windowMaximum - p.windowMinimum;
+  double gamma = p.gamma > 0.0 ? p.gamma : 1.0;
+  this->tables.resize(256*depthBins);
+  bool identity = !p.median;
+  for(int bin=0; bin<depthBins; bin++)
+  {
+    double scale = pow(10.0, (p.gain + tgcAt(p.tgc, (double)bin/(depthBins-1)))/20.0);
+    unsigned char* table = &this->tables[256*bin];
+    for(int v=0; v<256; v++)
+    {
+      double t = range > 0.0 ? (v*scale - low)/range : (v*scale >= low ? 1.0 : 0.0);
+      t = std::max(0.0, std::min(t, 1.0));
+      if(gamma != 1.0)
+        t = pow(t, gamma);
+      table[v] = (unsigned char)floor(255.0*t + 0.5);
+      identity = identity && table[v] == v;
+    }
+  }
+  this->enabled = !identity;
+
+  // FNV-1a over what the processing does, not how it was asked for
+  vtkTypeUInt32 h = 2166136261u;
+  h = (h ^ (p.median ? 1u : 0u)) * 16777619u;
+  for(size_t i=0; i<this->tables.size(); i++)
+    h = (h ^ this->tables[i]) * 16777619u;
+  h &= 0x7fffffffu;
+  this->hash = h ? h : 1;
+}
+
+//----------------------------------------------------------------------------
+void USnavImageEnhancement::apply(const unsigned char* src, unsigned char* dst, int width, int height,
+                                  int numberOfThreads) const
+{
+  if(width <= 0 || height <= 0)
+    return;
+  ApplyData data;
+  data.parameters = &this->parameters;
+  data.tables = &this->tables[0];
+  data.src = src;
+  data.dst = dst;
+  data.width = width;
+  data.height = height;
+  usnavParallelFor(height, enhancementGrain, &USnavImageEnhancement::applyChunk, &data, numberOfThreads);
+}
+
+//----------------------------------------------------------------------------
+void USnavImageEnhancement::applyChunk(int begin, int end, int vtkNotUsed(threadId), void* userData)
+{
+  const ApplyData* data = static_cast<const ApplyData*>(userData);
+  int width = data->width;
+  int height = data->height;
+  std::vector<unsigned char> scratch(data->parameters->median ? 3*(size_t)width : 0);
+  for(int y=begin; y<end; y++)
+  {
+    const unsigned char* row = data->src + (size_t)y*width;
+    unsigned char* out = data->dst + (size_t)y*width;
+    // Bands read the rows around them from the source, so they are
+    // independent of each other
+    if(data->parameters->median)
+    {
+      const unsigned char* above = data->src + (size_t)std::max(y-1, 0)*width;
+      const unsigned char* below = data->src + (size_t)std::min(y+1, height-1)*width;
+      medianRow(above, row, below, width, &scratch[0], &scratch[width], &scratch[2*(size_t)width], out);
+      row = out;
+    }
+    int bin = height > 1 ? (int)((vtkTypeInt64)y*(depthBins-1)/(height-1)) : 0;
+    const unsigned char* table = data->tables + 256*bin;
+    for(int x=0; x<width; x++)
+      out[x] = table[row[x]];
+  }
+}
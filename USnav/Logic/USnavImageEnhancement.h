@@ -0,0 +1,78 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavImageEnhancement - display processing of 8 bit frames
+// .SECTION Description
+// An optional 3x3 median against speckle, followed by an intensity
+// mapping that depends on depth only: overall gain and a time gain
+// compensation curve (both in dB), then a window and gamma. The mapping is
+// folded into one 256 entry table per depth bin when the parameters are
+// set, so each pixel costs a median (min/max only, vectorizable along the
+// row) and one table lookup. Frames are processed in bands of rows on
+// several threads.
+//
+// getHash() identifies the effective processing, so that processed frames
+// can be cached next to the raw ones.
+
+#ifndef __USnavImageEnhancement_h
+#define __USnavImageEnhancement_h
+
+// VTK includes
+#include <vtkType.h>
+
+// STD includes
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavImageEnhancement
+{
+public:
+  struct Parameters
+  {
+    bool median;             // 3x3 median
+    double gain;             // dB over the whole frame
+    std::vector<double> tgc; // dB at evenly spaced depths, first row to last
+    double windowMinimum;    // intensities mapped to 0..255 after the gains
+    double windowMaximum;
+    double gamma;
+    Parameters() : median(false), gain(0.0), windowMinimum(0.0), windowMaximum(255.0), gamma(1.0) {}
+  };
+
+  USnavImageEnhancement();
+
+  void setParameters(const Parameters& parameters);
+  const Parameters& getParameters() const { return this->parameters; }
+  /// False when frames would come out unchanged.
+  bool isEnabled() const { return this->enabled; }
+  /// Non zero 31 bit value, equal for parameters with the same effect.
+  vtkTypeUInt32 getHash() const { return this->hash; }
+
+  /// Processes a width x height frame into `dst` (not `src`); frames of
+  /// any size, e.g. reduced levels, share the depth curve.
+  void apply(const unsigned char* src, unsigned char* dst, int width, int height, int numberOfThreads = 0) const;
+
+private:
+  static void applyChunk(int begin, int end, int threadId, void* userData);
+
+  Parameters parameters;
+  bool enabled;
+  vtkTypeUInt32 hash;
+  std::vector<unsigned char> tables; // 256 entries per depth bin
+};
+
+#endif
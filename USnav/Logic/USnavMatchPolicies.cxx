@@ -0,0 +1,130 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavMatchPolicies.h"
+
+// STD includes
+#include <cstring>
+
+namespace
+{
+// 10 mm of plane distance weigh as much as one unit of orientation
+// distance, i.e. about 41 degrees apart
+typedef USnavSumTerm<USnavPlaneTerm, USnavWeightedTerm<USnavOrientationTerm, 10> > PlaneAndOrientation;
+
+struct Metric
+{
+  const char* name;
+  const char* description;
+  USnavMatchFrames::MatchFunction function;
+};
+
+const Metric metrics[] =
+{
+  { "plane", "distance from the tip to the image plane",
+    &usnavScoreFrames<USnavPlaneTerm, USnavAcceptAll> },
+  { "plane-in-image", "distance to the image plane, the tip inside the image",
+    &usnavScoreFrames<USnavPlaneTerm, USnavRejectOutsideImage> },
+  { "plane-orientation", "distance to the image plane and to the stylus orientation, the tip inside the image",
+    &usnavScoreFrames<PlaneAndOrientation, USnavRejectOutsideImage> },
+  { "pose", "distance between the image and the stylus matrices",
+    &usnavScoreFrames<USnavPoseTerm, USnavAcceptAll> }
+};
+const int numberOfMetrics = sizeof(metrics)/sizeof(metrics[0]);
+}
+
+//----------------------------------------------------------------------------
+void USnavMatchFrames::clear()
+{
+  this->items.clear();
+  this->width = 0;
+  this->height = 0;
+}
+
+//----------------------------------------------------------------------------
+void USnavMatchFrames::build(const double* imageToTracker, const std::vector<int>& frames, int imageWidth,
+                             int imageHeight)
+{
+  this->clear();
+  this->width = imageWidth;
+  this->height = imageHeight;
+  size_t n = frames.size();
+  this->items.resize(n);
+  for(size_t i=0; i<n; i++)
+  {
+    const double* m = imageToTracker + 16*(size_t)frames[i];
+    USnavMatchFrame& f = this->items[i];
+    memcpy(f.matrix, m, sizeof(f.matrix));
+    usnavNormalizedRotation(m, f.rotation);
+    usnavImagePlane(m, f.normal, f.offset);
+    for(int k=0; k<3; k++)
+      f.origin[k] = m[4*k+3];
+    double uu = m[0]*m[0] + m[4]*m[4] + m[8]*m[8];
+    double vv = m[1]*m[1] + m[5]*m[5] + m[9]*m[9];
+    for(int k=0; k<3; k++)
+    {
+      f.u[k] = uu > 0 ? m[4*k]/uu : 0.0;
+      f.v[k] = vv > 0 ? m[4*k+1]/vv : 0.0;
+    }
+    f.frame = frames[i];
+  }
+}
+
+//----------------------------------------------------------------------------
+void USnavMatchFrames::makeQuery(const double pose[16], USnavMatchQuery& query) const
+{
+  memcpy(query.pose, pose, sizeof(query.pose));
+  usnavNormalizedRotation(pose, query.rotation);
+  query.tip[0] = pose[3];
+  query.tip[1] = pose[7];
+  query.tip[2] = pose[11];
+  query.width = this->width;
+  query.height = this->height;
+}
+
+//----------------------------------------------------------------------------
+int USnavMatchFrames::getNumberOfMetrics()
+{
+  return numberOfMetrics;
+}
+
+//----------------------------------------------------------------------------
+const char* USnavMatchFrames::getMetricName(int metric)
+{
+  return metric >= 0 && metric < numberOfMetrics ? metrics[metric].name : NULL;
+}
+
+//----------------------------------------------------------------------------
+const char* USnavMatchFrames::getMetricDescription(int metric)
+{
+  return metric >= 0 && metric < numberOfMetrics ? metrics[metric].description : NULL;
+}
+
+//----------------------------------------------------------------------------
+int USnavMatchFrames::findMetric(const char* name)
+{
+  for(int i=0; name && i<numberOfMetrics; i++)
+    if(strcmp(metrics[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+//----------------------------------------------------------------------------
+USnavMatchFrames::MatchFunction USnavMatchFrames::getMetricFunction(int metric)
+{
+  return metric >= 0 && metric < numberOfMetrics ? metrics[metric].function : NULL;
+}
@@ -0,0 +1,217 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavMatchPolicies - match metrics composed at compile time
+// .SECTION Description
+// A match metric is a score, lower is better, and a rejection test, both
+// given as policy classes with a static inline function of one frame and
+// the query. Terms are combined with USnavSumTerm and USnavWeightedTerm
+// (integer weights, C++98 has no floating point template arguments), so
+// usnavScoreFrames<Score, Reject>() compiles to a single loop with the
+// whole metric inlined and no branch on which terms are in use.
+//
+// The combinations the module offers are instantiated once in
+// USnavMatchPolicies.cxx and chosen at run time by name. Which frames are
+// scored is up to the caller (see USnavSweepIndex), the same for every
+// metric.
+
+#ifndef __USnavMatchPolicies_h
+#define __USnavMatchPolicies_h
+
+// STD includes
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "USnavGeometry.h"
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+// Everything a metric may need of a frame, precomputed from its
+// ImageToTracker matrix
+struct USnavMatchFrame
+{
+  double matrix[16];   // ImageToTracker, row-major
+  double rotation[9];  // its rotation part, columns normalized, row-major
+  double normal[3];    // unit normal of the image plane
+  double offset;       // plane: normal.p + offset = 0
+  double origin[3];    // image origin
+  double u[3];         // image x axis over its squared length: (p-origin).u is the column
+  double v[3];         // same for the row
+  int frame;
+};
+
+struct USnavMatchQuery
+{
+  double pose[16];     // StylusToTracker, row-major
+  double rotation[9];  // its rotation part, columns normalized
+  double tip[3];
+  double width;        // image size in pixels
+  double height;
+};
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavMatchFrames
+{
+public:
+  typedef std::vector<std::pair<double,int> > MatchList;
+  /// Scores items begin..end-1, or items[begin..end) when `items` is not
+  /// NULL, into `heap`: the `count` best (score, frame) so far as a max-heap
+  /// (see usnavPushMatch()).
+  typedef void (*MatchFunction)(const USnavMatchFrames& frames, const USnavMatchQuery& query, const int* items,
+                                int begin, int end, int count, MatchList& heap);
+
+  USnavMatchFrames() : width(0), height(0) {}
+
+  /// Precomputes `frames` from 16 row-major doubles per frame; item i is
+  /// frames[i].
+  void build(const double* imageToTracker, const std::vector<int>& frames, int width, int height);
+  void clear();
+  int getNumberOfFrames() const { return (int)this->items.size(); }
+  const USnavMatchFrame& getItem(int item) const { return this->items[item]; }
+
+  /// Fills a query from a 4x4 row-major stylus pose.
+  void makeQuery(const double pose[16], USnavMatchQuery& query) const;
+
+  // Registry of the precompiled metrics, 0 being the default
+  static int getNumberOfMetrics();
+  static const char* getMetricName(int metric);
+  static const char* getMetricDescription(int metric);
+  /// -1 if unknown
+  static int findMetric(const char* name);
+  static MatchFunction getMetricFunction(int metric);
+
+private:
+  std::vector<USnavMatchFrame> items;
+  int width;
+  int height;
+};
+
+//----------------------------------------------------------------------------
+// Score terms
+
+// Distance from the stylus tip to the image plane, mm
+struct USnavPlaneTerm
+{
+  static inline double evaluate(const USnavMatchFrame& f, const USnavMatchQuery& q)
+  {
+    double d = usnavSignedDistanceToPlane(f.normal, f.offset, q.tip);
+    return d < 0 ? -d : d;
+  }
+};
+
+// Squared Frobenius distance between the normalized rotations, 0 to 8
+struct USnavOrientationTerm
+{
+  static inline double evaluate(const USnavMatchFrame& f, const USnavMatchQuery& q)
+  {
+    double sum = 0.0;
+    for(int k=0; k<9; k++)
+    {
+      double d = f.rotation[k] - q.rotation[k];
+      sum += d*d;
+    }
+    return sum;
+  }
+};
+
+// Squared Frobenius distance between the whole matrices
+struct USnavPoseTerm
+{
+  static inline double evaluate(const USnavMatchFrame& f, const USnavMatchQuery& q)
+  {
+    double sum = 0.0;
+    for(int k=0; k<16; k++)
+    {
+      double d = f.matrix[k] - q.pose[k];
+      sum += d*d;
+    }
+    return sum;
+  }
+};
+
+template <class A, class B>
+struct USnavSumTerm
+{
+  static inline double evaluate(const USnavMatchFrame& f, const USnavMatchQuery& q)
+  {
+    return A::evaluate(f, q) + B::evaluate(f, q);
+  }
+};
+
+// Term times Numerator/Denominator
+template <class T, int Numerator, int Denominator = 1>
+struct USnavWeightedTerm
+{
+  static inline double evaluate(const USnavMatchFrame& f, const USnavMatchQuery& q)
+  {
+    return T::evaluate(f, q)*((double)Numerator/Denominator);
+  }
+};
+
+//----------------------------------------------------------------------------
+// Rejection tests
+
+struct USnavAcceptAll
+{
+  static inline bool reject(const USnavMatchFrame&, const USnavMatchQuery&) { return false; }
+};
+
+// The tip, projected on the image plane, falls outside the image
+struct USnavRejectOutsideImage
+{
+  static inline bool reject(const USnavMatchFrame& f, const USnavMatchQuery& q)
+  {
+    double p[3] = { q.tip[0] - f.origin[0], q.tip[1] - f.origin[1], q.tip[2] - f.origin[2] };
+    double x = p[0]*f.u[0] + p[1]*f.u[1] + p[2]*f.u[2];
+    double y = p[0]*f.v[0] + p[1]*f.v[1] + p[2]*f.v[2];
+    return x < -0.5 || y < -0.5 || x > q.width - 0.5 || y > q.height - 0.5;
+  }
+};
+
+//----------------------------------------------------------------------------
+// Adds (score, frame) to `heap`, a max-heap on score holding the `count`
+// (> 0) best matches so far; std::sort_heap() then puts them best first.
+inline void usnavPushMatch(USnavMatchFrames::MatchList& heap, int count, double score, int frame)
+{
+  if((int)heap.size() < count)
+  {
+    heap.push_back(std::pair<double,int>(score, frame));
+    std::push_heap(heap.begin(), heap.end());
+  }
+  else if(score < heap.front().first)
+  {
+    std::pop_heap(heap.begin(), heap.end());
+    heap.back() = std::pair<double,int>(score, frame);
+    std::push_heap(heap.begin(), heap.end());
+  }
+}
+
+// MatchFunction scoring frames under Score among those Reject keeps
+template <class Score, class Reject>
+void usnavScoreFrames(const USnavMatchFrames& frames, const USnavMatchQuery& query, const int* items, int begin,
+                      int end, int count, USnavMatchFrames::MatchList& heap)
+{
+  for(int i=begin; i<end; i++)
+  {
+    const USnavMatchFrame& f = frames.getItem(items ? items[i] : i);
+    if(Reject::reject(f, query))
+      continue;
+    usnavPushMatch(heap, count, Score::evaluate(f, query), f.frame);
+  }
+}
+
+#endif
@@ -0,0 +1,335 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavNativeSequence.h"
+#include "USnavCodec.h"
+#include "USnavFileIO.h"
+#include "USnavParallel.h"
+#include "USnavSequenceLoader.h"
+
+// STD includes
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+const char nativeMagic[8] = { 'U', 'S', 'N', 'A', 'V', 'S', 'E', 'Q' };
+const vtkTypeInt32 nativeVersion = 1;
+const int nativeHeaderSize = 64;
+const vtkTypeInt32 deltaFlag = 1;
+// An LZ4 sequence expands to at most 255 bytes per byte of input, so
+// metadata claiming more is corrupt and is not allocated
+const vtkTypeInt64 maxExpansion = 255;
+
+// Fixed layout of the first 64 bytes
+struct NativeHeader
+{
+  vtkTypeInt32 version;
+  vtkTypeInt32 width;
+  vtkTypeInt32 height;
+  vtkTypeInt32 frames;
+  vtkTypeInt32 framesPerBlock;
+  vtkTypeInt32 flags;
+  vtkTypeInt64 blockTableOffset;
+  vtkTypeInt64 metadataOffset;
+  vtkTypeInt64 metadataSize;
+  vtkTypeInt64 metadataDecodedSize;
+};
+
+void encodeHeader(const NativeHeader& h, unsigned char bytes[nativeHeaderSize])
+{
+  memset(bytes, 0, nativeHeaderSize);
+  memcpy(bytes, nativeMagic, 8);
+  vtkTypeInt32 ints[6] = { h.version, h.width, h.height, h.frames, h.framesPerBlock, h.flags };
+  memcpy(bytes + 8, ints, sizeof(ints));
+  vtkTypeInt64 offsets[4] = { h.blockTableOffset, h.metadataOffset, h.metadataSize, h.metadataDecodedSize };
+  memcpy(bytes + 32, offsets, sizeof(offsets));
+}
+
+bool decodeHeader(const unsigned char bytes[nativeHeaderSize], NativeHeader& h)
+{
+  if(memcmp(bytes, nativeMagic, 8) != 0)
+    return false;
+  vtkTypeInt32 ints[6];
+  memcpy(ints, bytes + 8, sizeof(ints));
+  vtkTypeInt64 offsets[4];
+  memcpy(offsets, bytes + 32, sizeof(offsets));
+  h.version = ints[0];
+  h.width = ints[1];
+  h.height = ints[2];
+  h.frames = ints[3];
+  h.framesPerBlock = ints[4];
+  h.flags = ints[5];
+  h.blockTableOffset = offsets[0];
+  h.metadataOffset = offsets[1];
+  h.metadataSize = offsets[2];
+  h.metadataDecodedSize = offsets[3];
+  return h.version == nativeVersion && h.width > 0 && h.height > 0 && h.frames > 0 && h.framesPerBlock > 0
+      && h.blockTableOffset >= nativeHeaderSize && h.metadataOffset >= h.blockTableOffset
+      && h.metadataSize >= 0 && h.metadataDecodedSize >= 0;
+}
+
+// Blocks compressed together between two sequential reads and writes
+struct CompressionData
+{
+  size_t frameSize;
+  int framesPerBlock;
+  int frames;
+  int firstBlock;
+  bool delta;
+  std::vector<unsigned char>* raw; // frames of the batch, in order
+  std::vector<std::vector<unsigned char> >* encoded;
+};
+
+void compressChunk(int begin, int end, int vtkNotUsed(threadId), void* userData)
+{
+  CompressionData* data = static_cast<CompressionData*>(userData);
+  for(int b=begin; b<end; b++)
+  {
+    int firstFrame = (data->firstBlock + b)*data->framesPerBlock;
+    int blockFrames = std::min(data->framesPerBlock, data->frames - firstFrame);
+    size_t size = data->frameSize*blockFrames;
+    unsigned char* block = &(*data->raw)[data->frameSize*(size_t)b*data->framesPerBlock];
+    // Last frame first, each one still has its original predecessor
+    if(data->delta)
+      for(int i=blockFrames-1; i>0; i--)
+        usnavDeltaEncode(block + data->frameSize*i, block + data->frameSize*(i-1), data->frameSize);
+    std::vector<unsigned char>& out = (*data->encoded)[b];
+    out.resize(usnavCompressBound(size));
+    size_t compressedSize = usnavCompress(block, size, &out[0]);
+    if(compressedSize < size)
+      out.resize(compressedSize);
+    else
+      out.assign(block, block + size); // Stored as is
+  }
+}
+
+bool writeAll(FILE* file, const void* data, size_t size)
+{
+  return size == 0 || fwrite(data, 1, size, file) == size;
+}
+}
+
+//----------------------------------------------------------------------------
+const char* USnavNativeSequence::getExtension()
+{
+  return ".usn";
+}
+
+//----------------------------------------------------------------------------
+bool USnavNativeSequence::isNativeFile(const std::string& path)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file)
+    return false;
+  char magic[8];
+  bool native = fread(magic, 1, 8, file) == 8 && memcmp(magic, nativeMagic, 8) == 0;
+  fclose(file);
+  return native;
+}
+
+//----------------------------------------------------------------------------
+bool USnavNativeSequence::read(const std::string& path, USnavFrameSource& source, USnavTransformStore& transforms,
+                               std::string* mhaHeader)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file)
+    return false;
+  vtkTypeInt64 fileSize = usnavFileSize(file);
+  unsigned char bytes[nativeHeaderSize];
+  NativeHeader header;
+  if(fread(bytes, 1, nativeHeaderSize, file) != (size_t)nativeHeaderSize || !decodeHeader(bytes, header)
+     || header.metadataOffset + header.metadataSize > fileSize
+     || header.metadataDecodedSize > maxExpansion*(header.metadataSize + 1))
+  {
+    fclose(file);
+    return false;
+  }
+
+  // The block table lies between its offset and the metadata
+  int blocks = (int)(((vtkTypeInt64)header.frames + header.framesPerBlock - 1) / header.framesPerBlock);
+  if((blocks + 1)*(vtkTypeInt64)sizeof(vtkTypeInt64) > header.metadataOffset - header.blockTableOffset)
+  {
+    fclose(file);
+    return false;
+  }
+  std::vector<vtkTypeInt64> offsets(blocks + 1);
+  std::vector<unsigned char> metadata((size_t)header.metadataSize + 1);
+  std::vector<unsigned char> decoded((size_t)header.metadataDecodedSize + 1);
+  bool ok = usnavSeek(file, header.blockTableOffset) == 0
+         && fread(&offsets[0], sizeof(vtkTypeInt64), offsets.size(), file) == offsets.size()
+         && usnavSeek(file, header.metadataOffset) == 0
+         && fread(&metadata[0], 1, (size_t)header.metadataSize, file) == (size_t)header.metadataSize;
+  fclose(file);
+  for(int b=0; ok && b<blocks; b++)
+    ok = offsets[b] >= nativeHeaderSize && offsets[b] <= offsets[b+1];
+  ok = ok && offsets[blocks] <= header.blockTableOffset
+          && usnavDecompress(&metadata[0], (size_t)header.metadataSize, &decoded[0], (size_t)header.metadataDecodedSize);
+
+  // Metadata: MHA header size and text, then the transform store
+  vtkTypeInt64 textSize = 0;
+  if(ok && header.metadataDecodedSize >= (vtkTypeInt64)sizeof(textSize))
+    memcpy(&textSize, &decoded[0], sizeof(textSize));
+  size_t storeBegin = sizeof(textSize) + (size_t)textSize;
+  ok = ok && textSize >= 0 && (vtkTypeInt64)storeBegin <= header.metadataDecodedSize
+          && transforms.deserialize(&decoded[storeBegin], (size_t)header.metadataDecodedSize - storeBegin)
+          && transforms.getNumberOfFrames() == header.frames;
+  if(!ok)
+    return false;
+  if(mhaHeader)
+    mhaHeader->assign(reinterpret_cast<const char*>(&decoded[sizeof(textSize)]), (size_t)textSize);
+
+  source = USnavFrameSource();
+  source.path = path;
+  source.format = USnavFrameSource::CompressedBlocks;
+  source.width = header.width;
+  source.height = header.height;
+  source.frames = header.frames;
+  source.framesPerBlock = header.framesPerBlock;
+  source.delta = (header.flags & deltaFlag) != 0;
+  source.blockOffsets.swap(offsets);
+  return true;
+}
+
+//----------------------------------------------------------------------------
+bool USnavNativeSequence::convertFromMha(const std::string& mhaPath, const std::string& path, const Options& options)
+{
+  // The header is parsed the way the module loads it
+  USnavSequenceLoader loader;
+  loader.start(mhaPath);
+  loader.wait();
+  USnavFrameSource mha;
+  if(loader.getState() != USnavSequenceLoader::Done || !loader.getFrameSource(mha)
+     || mha.format != USnavFrameSource::RawFrames)
+    return false;
+  USnavTransformStore transforms;
+  transforms.reset(mha.frames);
+  loader.mergeTransforms(transforms);
+
+  FILE* infile = fopen(mhaPath.c_str(), "rb");
+  if(!infile)
+    return false;
+  vtkTypeInt64 fileSize = usnavFileSize(infile);
+  std::string text((size_t)mha.dataOffset, '\0');
+  bool ok = fread(&text[0], 1, text.size(), infile) == text.size()
+         // Only 8 bit pixels, and nothing after them, convert without loss
+         && text.find("ElementType = MET_UCHAR") != std::string::npos
+         && fileSize == mha.dataOffset + (vtkTypeInt64)mha.getFrameSize()*mha.frames;
+  FILE* outfile = ok ? fopen(path.c_str(), "wb") : NULL;
+  if(!outfile)
+  {
+    fclose(infile);
+    return false;
+  }
+
+  NativeHeader header;
+  header.version = nativeVersion;
+  header.width = mha.width;
+  header.height = mha.height;
+  header.frames = mha.frames;
+  header.framesPerBlock = std::max(options.framesPerBlock, 1);
+  header.flags = options.delta ? deltaFlag : 0;
+  unsigned char bytes[nativeHeaderSize];
+  encodeHeader(header, bytes);
+  ok = writeAll(outfile, bytes, nativeHeaderSize);
+
+  // Batches of blocks: read in order, compressed in parallel, written in order
+  int blocks = (mha.frames + header.framesPerBlock - 1) / header.framesPerBlock;
+  int threads = options.numberOfThreads > 0 ? options.numberOfThreads : usnavDefaultNumberOfThreads();
+  int batchBlocks = 4*threads;
+  size_t frameSize = mha.getFrameSize();
+  std::vector<unsigned char> raw(frameSize*batchBlocks*header.framesPerBlock);
+  std::vector<std::vector<unsigned char> > encoded(batchBlocks);
+  std::vector<vtkTypeInt64> offsets;
+  vtkTypeInt64 position = nativeHeaderSize;
+  for(int first=0; ok && first<blocks; first+=batchBlocks)
+  {
+    int count = std::min(batchBlocks, blocks - first);
+    int firstFrame = first*header.framesPerBlock;
+    size_t frames = (size_t)std::min(count*header.framesPerBlock, mha.frames - firstFrame);
+    if(fread(&raw[0], frameSize, frames, infile) != frames)
+    {
+      ok = false;
+      break;
+    }
+    CompressionData data;
+    data.frameSize = frameSize;
+    data.framesPerBlock = header.framesPerBlock;
+    data.frames = mha.frames;
+    data.firstBlock = first;
+    data.delta = options.delta;
+    data.raw = &raw;
+    data.encoded = &encoded;
+    usnavParallelFor(count, 1, compressChunk, &data, threads);
+    for(int b=0; ok && b<count; b++)
+    {
+      offsets.push_back(position);
+      ok = writeAll(outfile, &encoded[b][0], encoded[b].size());
+      position += (vtkTypeInt64)encoded[b].size();
+    }
+  }
+  fclose(infile);
+  offsets.push_back(position);
+
+  // Tables: block offsets, then the compressed metadata
+  std::vector<unsigned char> metadata;
+  vtkTypeInt64 textSize = (vtkTypeInt64)text.size();
+  metadata.insert(metadata.end(), reinterpret_cast<unsigned char*>(&textSize),
+                  reinterpret_cast<unsigned char*>(&textSize) + sizeof(textSize));
+  metadata.insert(metadata.end(), text.begin(), text.end());
+  transforms.serialize(metadata);
+  std::vector<unsigned char> compressedMetadata(usnavCompressBound(metadata.size()));
+  size_t metadataSize = usnavCompress(&metadata[0], metadata.size(), &compressedMetadata[0]);
+  header.blockTableOffset = position;
+  header.metadataOffset = position + (vtkTypeInt64)(offsets.size()*sizeof(vtkTypeInt64));
+  header.metadataSize = (vtkTypeInt64)metadataSize;
+  header.metadataDecodedSize = (vtkTypeInt64)metadata.size();
+  encodeHeader(header, bytes);
+  ok = ok && (int)offsets.size() == blocks + 1
+          && writeAll(outfile, &offsets[0], offsets.size()*sizeof(vtkTypeInt64))
+          && writeAll(outfile, &compressedMetadata[0], metadataSize)
+          && usnavSeek(outfile, 0) == 0
+          && writeAll(outfile, bytes, nativeHeaderSize);
+  ok = fclose(outfile) == 0 && ok;
+  if(!ok)
+    remove(path.c_str());
+  return ok;
+}
+
+//----------------------------------------------------------------------------
+bool USnavNativeSequence::convertToMha(const std::string& path, const std::string& mhaPath)
+{
+  USnavFrameSource source;
+  USnavTransformStore transforms;
+  std::string text;
+  if(!read(path, source, transforms, &text))
+    return false;
+  FILE* outfile = fopen(mhaPath.c_str(), "wb");
+  if(!outfile)
+    return false;
+  bool ok = writeAll(outfile, text.c_str(), text.size());
+  USnavFrameReader reader(source);
+  std::vector<unsigned char> frame(source.getFrameSize());
+  for(int i=0; ok && i<source.frames; i++)
+    ok = reader.readFrame(i, &frame[0]) && writeAll(outfile, &frame[0], frame.size());
+  ok = fclose(outfile) == 0 && ok;
+  if(!ok)
+    remove(mhaPath.c_str());
+  return ok;
+}
@@ -0,0 +1,69 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavNativeSequence - compressed, randomly accessible sequence files
+// .SECTION Description
+// A .usn file holds the 8 bit frames of an MHA sequence in independently
+// compressed blocks (see USnavCodec), optionally delta coded within each
+// block, followed by a table of block offsets and a compressed metadata
+// record: the original MHA header and the packed transform store (poses,
+// validity, timestamps). A 64 byte header at the start points at both.
+//
+// Opening reads the header and the two tables, without parsing any text;
+// any frame is then one seek and the decoding of one block. The MHA
+// header is kept verbatim, so converting back gives the original file.
+// Files are written in native byte order (little endian in practice).
+
+#ifndef __USnavNativeSequence_h
+#define __USnavNativeSequence_h
+
+// STD includes
+#include <string>
+
+#include "USnavFrameReader.h"
+#include "USnavTransformStore.h"
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavNativeSequence
+{
+public:
+  struct Options
+  {
+    int framesPerBlock;  // 1 gives per frame access without decoding neighbours
+    bool delta;          // code frames as differences within a block
+    int numberOfThreads; // compressing blocks, 0 for every core
+    Options() : framesPerBlock(1), delta(false), numberOfThreads(0) {}
+  };
+
+  /// Extension of native files, ".usn"
+  static const char* getExtension();
+  /// True if `path` starts like a native file.
+  static bool isNativeFile(const std::string& path);
+
+  /// Frame source and transforms of a native file, and its original MHA
+  /// header when asked; false if it is not a valid native file.
+  static bool read(const std::string& path, USnavFrameSource& source, USnavTransformStore& transforms,
+                   std::string* mhaHeader = NULL);
+
+  /// Converts an uncompressed MET_UCHAR MHA sequence; false if the file is
+  /// not one or could not be written.
+  static bool convertFromMha(const std::string& mhaPath, const std::string& path, const Options& options);
+  /// Writes the original MHA file back.
+  static bool convertToMha(const std::string& path, const std::string& mhaPath);
+};
+
+#endif
@@ -0,0 +1,233 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavOrientationIndex.h"
+#include "USnavGeometry.h"
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+const double radiansToDegrees = 57.29577951308232;
+
+double geodesic(const double* q1, const double* q2)
+{
+  double d = fabs(q1[0]*q2[0] + q1[1]*q2[1] + q1[2]*q2[2] + q1[3]*q2[3]);
+  if(d > 1.0)
+    d = 1.0;
+  return 2.0*acos(d);
+}
+
+// Orders items by their distance to the vantage point
+struct DistanceLess
+{
+  const std::vector<double>* distances;
+  bool operator()(int a, int b) const { return (*distances)[a] < (*distances)[b]; }
+};
+}
+
+//----------------------------------------------------------------------------
+USnavOrientationIndex::USnavOrientationIndex()
+{
+  this->root = -1;
+}
+
+//----------------------------------------------------------------------------
+void USnavOrientationIndex::clear()
+{
+  this->nodes.clear();
+  this->quaternions.clear();
+  this->itemFrames.clear();
+  this->frameItems.clear();
+  this->root = -1;
+}
+
+//----------------------------------------------------------------------------
+void USnavOrientationIndex::matrixToQuaternion(const double m[16], double q[4])
+{
+  // Gram-Schmidt on the first two columns: calibrated matrices carry
+  // pixel spacing
+  double c[3][3];
+  for(int j=0; j<3; j++)
+    for(int i=0; i<3; i++)
+      c[j][i] = m[4*i+j];
+  for(int j=0; j<2; j++)
+  {
+    for(int k=0; k<j; k++)
+    {
+      double d = c[j][0]*c[k][0] + c[j][1]*c[k][1] + c[j][2]*c[k][2];
+      for(int i=0; i<3; i++)
+        c[j][i] -= d*c[k][i];
+    }
+    double n = sqrt(c[j][0]*c[j][0] + c[j][1]*c[j][1] + c[j][2]*c[j][2]);
+    if(n > 0)
+      for(int i=0; i<3; i++)
+        c[j][i] /= n;
+  }
+  // Third axis from the first two: stays a proper rotation even when the
+  // calibration mirrors the image
+  usnavCross3(c[0], c[1], c[2]);
+  // r(i,j) = c[j][i]; Shepperd's method picks the largest pivot
+  double trace = c[0][0] + c[1][1] + c[2][2];
+  if(trace > 0)
+  {
+    double s = 2.0*sqrt(trace + 1.0);
+    q[0] = 0.25*s;
+    q[1] = (c[1][2] - c[2][1]) / s;
+    q[2] = (c[2][0] - c[0][2]) / s;
+    q[3] = (c[0][1] - c[1][0]) / s;
+  }
+  else if(c[0][0] > c[1][1] && c[0][0] > c[2][2])
+  {
+    double s = 2.0*sqrt(1.0 + c[0][0] - c[1][1] - c[2][2]);
+    q[0] = (c[1][2] - c[2][1]) / s;
+    q[1] = 0.25*s;
+    q[2] = (c[1][0] + c[0][1]) / s;
+    q[3] = (c[2][0] + c[0][2]) / s;
+  }
+  else if(c[1][1] > c[2][2])
+  {
+    double s = 2.0*sqrt(1.0 + c[1][1] - c[0][0] - c[2][2]);
+    q[0] = (c[2][0] - c[0][2]) / s;
+    q[1] = (c[1][0] + c[0][1]) / s;
+    q[2] = 0.25*s;
+    q[3] = (c[2][1] + c[1][2]) / s;
+  }
+  else
+  {
+    double s = 2.0*sqrt(1.0 + c[2][2] - c[0][0] - c[1][1]);
+    q[0] = (c[0][1] - c[1][0]) / s;
+    q[1] = (c[2][0] + c[0][2]) / s;
+    q[2] = (c[2][1] + c[1][2]) / s;
+    q[3] = 0.25*s;
+  }
+  double n = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+  for(int i=0; i<4; i++)
+    q[i] /= n;
+}
+
+//----------------------------------------------------------------------------
+double USnavOrientationIndex::angleBetween(const double q1[4], const double q2[4])
+{
+  return geodesic(q1, q2) * radiansToDegrees;
+}
+
+//----------------------------------------------------------------------------
+double USnavOrientationIndex::distance(int item, const double q[4]) const
+{
+  return geodesic(&this->quaternions[4*item], q);
+}
+
+//----------------------------------------------------------------------------
+void USnavOrientationIndex::build(const double* matrices, const std::vector<int>& frames)
+{
+  this->clear();
+  int maxFrame = -1;
+  for(size_t i=0; i<frames.size(); i++)
+    maxFrame = std::max(maxFrame, frames[i]);
+  this->frameItems.assign(maxFrame+1, -1);
+  this->itemFrames = frames;
+  this->quaternions.resize(4*frames.size());
+  for(size_t i=0; i<frames.size(); i++)
+  {
+    matrixToQuaternion(matrices + 16*(size_t)frames[i], &this->quaternions[4*i]);
+    this->frameItems[frames[i]] = (int)i;
+  }
+
+  std::vector<int> items(frames.size());
+  for(size_t i=0; i<items.size(); i++)
+    items[i] = (int)i;
+  std::vector<double> distances(items.size());
+  this->nodes.reserve(items.size());
+  this->root = this->buildNode(items, distances, 0, (int)items.size());
+}
+
+//----------------------------------------------------------------------------
+int USnavOrientationIndex::buildNode(std::vector<int>& items, std::vector<double>& distances, int begin, int end)
+{
+  if(begin >= end)
+    return -1;
+  int index = (int)this->nodes.size();
+  this->nodes.push_back(Node());
+  // Middle item as vantage point: consecutive frames are similar, so this
+  // avoids always picking an extreme of the sweep
+  std::swap(items[begin], items[begin + (end-begin)/2]);
+  int vantage = items[begin];
+  this->nodes[index].item = vantage;
+  this->nodes[index].radius = 0.0;
+  this->nodes[index].inside = -1;
+  this->nodes[index].outside = -1;
+  if(end - begin == 1)
+    return index;
+
+  for(int i=begin+1; i<end; i++)
+    distances[items[i]] = this->distance(items[i], &this->quaternions[4*vantage]);
+  DistanceLess less;
+  less.distances = &distances;
+  int median = begin + 1 + (end - begin - 1)/2;
+  std::nth_element(items.begin()+begin+1, items.begin()+median, items.begin()+end, less);
+  this->nodes[index].radius = distances[items[median]];
+
+  // Inside: [begin+1, median], distance <= radius
+  int inside = this->buildNode(items, distances, begin+1, median+1);
+  int outside = this->buildNode(items, distances, median+1, end);
+  this->nodes[index].inside = inside;
+  this->nodes[index].outside = outside;
+  return index;
+}
+
+//----------------------------------------------------------------------------
+void USnavOrientationIndex::findWithinAngle(const double q[4], double maxDegrees, std::vector<int>& frames) const
+{
+  if(this->root >= 0)
+    this->search(this->root, q, maxDegrees / radiansToDegrees, frames);
+}
+
+//----------------------------------------------------------------------------
+void USnavOrientationIndex::search(int node, const double q[4], double maxRadians, std::vector<int>& frames) const
+{
+  while(node >= 0)
+  {
+    const Node& n = this->nodes[node];
+    double d = this->distance(n.item, q);
+    if(d <= maxRadians)
+      frames.push_back(this->itemFrames[n.item]);
+    // Triangle inequality decides which shells can still hold answers
+    bool visitInside = d - maxRadians <= n.radius;
+    bool visitOutside = d + maxRadians >= n.radius;
+    if(visitInside && visitOutside)
+    {
+      this->search(n.inside, q, maxRadians, frames);
+      node = n.outside;
+    }
+    else
+      node = visitInside ? n.inside : n.outside;
+  }
+}
+
+//----------------------------------------------------------------------------
+bool USnavOrientationIndex::getQuaternion(int frame, double q[4]) const
+{
+  if(frame < 0 || frame >= (int)this->frameItems.size() || this->frameItems[frame] < 0)
+    return false;
+  const double* src = &this->quaternions[4*this->frameItems[frame]];
+  for(int i=0; i<4; i++)
+    q[i] = src[i];
+  return true;
+}
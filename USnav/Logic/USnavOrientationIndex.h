@@ -0,0 +1,76 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavOrientationIndex - frames searchable by orientation
+// .SECTION Description
+// The rotation of each frame is stored as a unit quaternion and the frames
+// are organised in a vantage point tree under the geodesic distance on
+// SO(3), 2*acos(|q1.q2|), which is a true metric (q and -q are the same
+// rotation). "All frames within theta degrees" then only visits the parts
+// of the tree that can hold an answer.
+
+#ifndef __USnavOrientationIndex_h
+#define __USnavOrientationIndex_h
+
+// STD includes
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavOrientationIndex
+{
+public:
+  USnavOrientationIndex();
+
+  /// Indexes `frames`, reading the rotation of each one from 16 row-major
+  /// doubles at matrices + 16*frame. Column scaling is removed first.
+  void build(const double* matrices, const std::vector<int>& frames);
+  void clear();
+  bool isEmpty() const { return this->nodes.empty(); }
+
+  /// Appends every indexed frame whose rotation is within `maxDegrees` of q.
+  void findWithinAngle(const double q[4], double maxDegrees, std::vector<int>& frames) const;
+
+  /// Quaternion (w,x,y,z) of an indexed frame; false if not indexed.
+  bool getQuaternion(int frame, double q[4]) const;
+
+  /// Unit quaternion of the rotation part of a 4x4 row-major matrix.
+  static void matrixToQuaternion(const double m[16], double q[4]);
+  /// Geodesic angle between two rotations, in degrees.
+  static double angleBetween(const double q1[4], const double q2[4]);
+
+private:
+  struct Node
+  {
+    int item;
+    double radius;
+    int inside;
+    int outside;
+  };
+
+  int buildNode(std::vector<int>& items, std::vector<double>& distances, int begin, int end);
+  void search(int node, const double q[4], double maxRadians, std::vector<int>& frames) const;
+  double distance(int item, const double q[4]) const;
+
+  std::vector<Node> nodes;
+  std::vector<double> quaternions; // 4 per item
+  std::vector<int> itemFrames;
+  std::vector<int> frameItems;     // -1 when the frame is not indexed
+  int root;
+};
+
+#endif
@@ -0,0 +1,104 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavParallel.h"
+
+// VTK includes
+#include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
+#include <vtkSmartPointer.h>
+
+namespace
+{
+struct ParallelForData
+{
+  USnavRangeFunction function;
+  void* userData;
+  int count;
+  int grain;
+  int next;
+  vtkSimpleMutexLock lock;
+};
+
+VTK_THREAD_RETURN_TYPE parallelForWorker(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* info = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  ParallelForData* data = static_cast<ParallelForData*>(info->UserData);
+  while(true)
+  {
+    data->lock.Lock();
+    int begin = data->next;
+    data->next += data->grain;
+    data->lock.Unlock();
+    if(begin >= data->count)
+      break;
+    int end = begin + data->grain;
+    if(end > data->count)
+      end = data->count;
+    data->function(begin, end, info->ThreadID, data->userData);
+  }
+  return VTK_THREAD_RETURN_VALUE;
+}
+}
+
+//----------------------------------------------------------------------------
+int usnavDefaultNumberOfThreads()
+{
+  int n = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  if(n < 1)
+    n = 1;
+  if(n > VTK_MAX_THREADS)
+    n = VTK_MAX_THREADS;
+  return n;
+}
+
+//----------------------------------------------------------------------------
+int usnavParallelFor(int count, int grain, USnavRangeFunction function, void* userData, int numberOfThreads)
+{
+  if(count <= 0)
+    return 0;
+  if(grain < 1)
+    grain = 1;
+  if(numberOfThreads <= 0)
+    numberOfThreads = usnavDefaultNumberOfThreads();
+  if(numberOfThreads > VTK_MAX_THREADS)
+    numberOfThreads = VTK_MAX_THREADS;
+  int chunks = (count + grain - 1) / grain;
+  if(numberOfThreads > chunks)
+    numberOfThreads = chunks;
+
+  // Not worth spawning anything for a single chunk or thread
+  if(numberOfThreads == 1)
+  {
+    for(int begin=0; begin<count; begin+=grain)
+      function(begin, begin+grain < count ? begin+grain : count, 0, userData);
+    return 1;
+  }
+
+  ParallelForData data;
+  data.function = function;
+  data.userData = userData;
+  data.count = count;
+  data.grain = grain;
+  data.next = 0;
+
+  vtkSmartPointer<vtkMultiThreader> threader = vtkSmartPointer<vtkMultiThreader>::New();
+  threader->SetNumberOfThreads(numberOfThreads);
+  threader->SetSingleMethod(parallelForWorker, &data);
+  threader->SingleMethodExecute();
+  return numberOfThreads;
+}
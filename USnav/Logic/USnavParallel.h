@@ -0,0 +1,39 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavParallel - small parallel-for helper on top of vtkMultiThreader
+// .SECTION Description
+// Splits [0,count) into chunks of `grain` items that worker threads pull
+// from a shared counter, so uneven per-item costs still balance.
+
+#ifndef __USnavParallel_h
+#define __USnavParallel_h
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+/// Called once per chunk: items [begin,end) on worker `threadId`.
+typedef void (*USnavRangeFunction)(int begin, int end, int threadId, void* userData);
+
+/// Number of worker threads used when 0 is passed to usnavParallelFor.
+VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT int usnavDefaultNumberOfThreads();
+
+/// Runs `function` over [0,count) and returns once every chunk is done.
+/// Returns the number of threads actually used (threadId < that value).
+VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT int usnavParallelFor(int count, int grain,
+  USnavRangeFunction function, void* userData, int numberOfThreads = 0);
+
+#endif
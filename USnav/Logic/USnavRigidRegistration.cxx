@@ -0,0 +1,299 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavRigidRegistration.h"
+#include "USnavFrameROI.h"
+#include "USnavGeometry.h"
+#include "USnavParallel.h"
+#include "USnavVolumeSampler.h"
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+// Points sampled per work item
+const int registrationBlockSize = 1024;
+// Fewest points an evaluation uses, whatever the level
+const int minimumLevelPoints = 2000;
+const double degreesToRadians = 0.017453292519943295;
+
+double entropy(const std::vector<double>& counts, double total)
+{
+  double h = 0.0;
+  for(size_t i=0; i<counts.size(); i++)
+    if(counts[i] > 0)
+    {
+      double p = counts[i] / total;
+      h -= p*log(p);
+    }
+  return h;
+}
+}
+
+//----------------------------------------------------------------------------
+USnavRigidRegistration::USnavRigidRegistration()
+{
+  this->packed = false;
+  this->center[0] = this->center[1] = this->center[2] = 0.0;
+  this->volume = NULL;
+  this->subsampling = 1;
+  this->bins = 32;
+  this->numberOfThreads = 0;
+  for(int k=0; k<16; k++)
+    this->pointsToRAS[k] = (k%5 == 0) ? 1.0 : 0.0;
+}
+
+//----------------------------------------------------------------------------
+void USnavRigidRegistration::clearPoints()
+{
+  this->pointsX.clear();
+  this->pointsY.clear();
+  this->pointsZ.clear();
+  this->intensities.clear();
+  this->x.release();
+  this->y.release();
+  this->z.release();
+  this->packed = false;
+}
+
+//----------------------------------------------------------------------------
+void USnavRigidRegistration::addFrame(const double m[16], const unsigned char* pixels, int width, int height,
+                                      int stride, const USnavFrameROI* roi, int minimumIntensity)
+{
+  if(stride < 1)
+    stride = 1;
+  for(int v=0; v<height; v+=stride)
+    for(int u=0; u<width; u+=stride)
+    {
+      unsigned char value = pixels[(size_t)v*width + u];
+      if(value < minimumIntensity || (roi && !roi->contains(u, v)))
+        continue;
+      this->pointsX.push_back((float)(m[0]*u + m[1]*v + m[3]));
+      this->pointsY.push_back((float)(m[4]*u + m[5]*v + m[7]));
+      this->pointsZ.push_back((float)(m[8]*u + m[9]*v + m[11]));
+      this->intensities.push_back(value);
+    }
+  this->packed = false;
+}
+
+//----------------------------------------------------------------------------
+void USnavRigidRegistration::packPoints()
+{
+  if(this->packed)
+    return;
+  size_t n = this->intensities.size();
+  // Shuffled, so that the first n/s points are an even subsample of the
+  // frames for every s
+  vtkTypeUInt32 seed = 12345u;
+  for(size_t i=n; i>1; i--)
+  {
+    seed = seed*1664525u + 1013904223u;
+    size_t j = seed % i;
+    std::swap(this->pointsX[i-1], this->pointsX[j]);
+    std::swap(this->pointsY[i-1], this->pointsY[j]);
+    std::swap(this->pointsZ[i-1], this->pointsZ[j]);
+    std::swap(this->intensities[i-1], this->intensities[j]);
+  }
+  this->x.resize(n);
+  this->y.resize(n);
+  this->z.resize(n);
+  double sum[3] = { 0.0, 0.0, 0.0 };
+  for(size_t i=0; i<n; i++)
+  {
+    this->x[i] = this->pointsX[i];
+    this->y[i] = this->pointsY[i];
+    this->z[i] = this->pointsZ[i];
+    sum[0] += this->pointsX[i];
+    sum[1] += this->pointsY[i];
+    sum[2] += this->pointsZ[i];
+  }
+  for(int k=0; k<3; k++)
+    this->center[k] = n > 0 ? sum[k]/n : 0.0;
+  this->packed = true;
+}
+
+//----------------------------------------------------------------------------
+void USnavRigidRegistration::histogramChunk(int begin, int end, int threadId, void* userData)
+{
+  USnavRigidRegistration* self = static_cast<USnavRigidRegistration*>(userData);
+  int count = self->getNumberOfPoints() / self->subsampling;
+  int bins = self->bins;
+  double minimum = self->volume->getMinimum();
+  double range = self->volume->getMaximum() - minimum;
+  double scale = range > 0 ? bins / range : 0.0;
+  double* histogram = &self->histograms[threadId][0];
+  float values[registrationBlockSize];
+  unsigned char inside[registrationBlockSize];
+  for(int block=begin; block<end; block++)
+  {
+    int first = block*registrationBlockSize;
+    int n = std::min(registrationBlockSize, count - first);
+    self->volume->samplePoints(self->pointsToRAS, self->x.get() + first, self->y.get() + first,
+                               self->z.get() + first, n, values, inside);
+    const unsigned char* us = &self->intensities[first];
+    for(int p=0; p<n; p++)
+    {
+      if(!inside[p])
+        continue;
+      int mrBin = std::min((int)((values[p] - minimum)*scale), bins-1);
+      int usBin = us[p]*bins/256;
+      histogram[usBin*bins + mrBin] += 1.0;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+double USnavRigidRegistration::evaluate(const USnavVolumeSampler& sampler, const double trackerToRAS[16], int s)
+{
+  this->packPoints();
+  int count = this->getNumberOfPoints() / (s > 0 ? s : 1);
+  if(count <= 0 || sampler.isEmpty())
+    return 0.0;
+  this->volume = &sampler;
+  memcpy(this->pointsToRAS, trackerToRAS, sizeof(this->pointsToRAS));
+  this->subsampling = s > 0 ? s : 1;
+  int threads = this->numberOfThreads > 0 ? this->numberOfThreads : usnavDefaultNumberOfThreads();
+  this->histograms.resize(threads);
+  for(int t=0; t<threads; t++)
+    this->histograms[t].assign((size_t)this->bins*this->bins, 0.0);
+  int blocks = (count + registrationBlockSize - 1) / registrationBlockSize;
+  usnavParallelFor(blocks, 1, &USnavRigidRegistration::histogramChunk, this, threads);
+
+  std::vector<double> joint((size_t)this->bins*this->bins, 0.0);
+  for(int t=0; t<threads; t++)
+    for(size_t i=0; i<joint.size(); i++)
+      joint[i] += this->histograms[t][i];
+  std::vector<double> us(this->bins, 0.0), mr(this->bins, 0.0);
+  double total = 0.0;
+  for(int u=0; u<this->bins; u++)
+    for(int m=0; m<this->bins; m++)
+    {
+      double c = joint[(size_t)u*this->bins + m];
+      us[u] += c;
+      mr[m] += c;
+      total += c;
+    }
+  // Too little overlap says nothing about the alignment
+  if(total < 0.1*count)
+    return 0.0;
+  double jointEntropy = entropy(joint, total);
+  if(jointEntropy <= 0.0)
+    return 0.0;
+  return (entropy(us, total) + entropy(mr, total)) / jointEntropy;
+}
+
+//----------------------------------------------------------------------------
+void USnavRigidRegistration::transformOf(const double p[6], const double initial[16], double trackerToRAS[16]) const
+{
+  // Rotation about the centre of the points, as placed by `initial`
+  double c[3];
+  usnavTransformPoint(initial, this->center, c);
+  double cx = cos(p[0]*degreesToRadians), sx = sin(p[0]*degreesToRadians);
+  double cy = cos(p[1]*degreesToRadians), sy = sin(p[1]*degreesToRadians);
+  double cz = cos(p[2]*degreesToRadians), sz = sin(p[2]*degreesToRadians);
+  // R = Rz * Ry * Rx
+  double rotation[9] = {
+    cz*cy, cz*sy*sx - sz*cx, cz*sy*cx + sz*sx,
+    sz*cy, sz*sy*sx + cz*cx, sz*sy*cx - cz*sx,
+    -sy,   cy*sx,            cy*cx };
+  double delta[16];
+  for(int r=0; r<3; r++)
+  {
+    for(int k=0; k<3; k++)
+      delta[4*r+k] = rotation[3*r+k];
+    delta[4*r+3] = c[r] + p[3+r] - (rotation[3*r]*c[0] + rotation[3*r+1]*c[1] + rotation[3*r+2]*c[2]);
+  }
+  delta[12] = delta[13] = delta[14] = 0.0;
+  delta[15] = 1.0;
+  usnavMultiply4x4(delta, initial, trackerToRAS);
+}
+
+//----------------------------------------------------------------------------
+bool USnavRigidRegistration::run(const USnavVolumeSampler& sampler, const double initial[16],
+                                 const Parameters& parameters, Result& result)
+{
+  memcpy(result.trackerToRAS, initial, sizeof(result.trackerToRAS));
+  result.initialMetric = result.finalMetric = 0.0;
+  result.evaluations = 0;
+  this->packPoints();
+  int count = this->getNumberOfPoints();
+  if(count < 100 || sampler.isEmpty() || parameters.histogramBins < 2)
+    return false;
+  this->bins = parameters.histogramBins;
+  this->numberOfThreads = parameters.numberOfThreads;
+
+  double p[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+  double matrix[16];
+  result.initialMetric = this->evaluate(sampler, initial, 1);
+  int levels = std::max(parameters.levels, 1);
+  for(int level=0; level<levels; level++)
+  {
+    int s = 1;
+    for(int l=level+1; l<levels; l++)
+      s *= 4;
+    s = std::max(1, std::min(s, count/minimumLevelPoints));
+    double scale = pow(0.5, level);
+    double translationStep = parameters.translationStep*scale;
+    double rotationStep = parameters.rotationStep*scale;
+    // Early levels only get close, the last one goes down to the minimum
+    double stop = level == levels-1 ? parameters.minimumTranslationStep : translationStep/4;
+
+    this->transformOf(p, initial, matrix);
+    double best = this->evaluate(sampler, matrix, s);
+    int evaluations = 1;
+    while(translationStep >= stop && evaluations < parameters.maximumEvaluations)
+    {
+      bool improved = false;
+      for(int d=0; d<6; d++)
+        for(int sign=-1; sign<=1; sign+=2)
+        {
+          double q[6];
+          memcpy(q, p, sizeof(q));
+          q[d] += sign*(d < 3 ? rotationStep : translationStep);
+          this->transformOf(q, initial, matrix);
+          double metric = this->evaluate(sampler, matrix, s);
+          evaluations++;
+          if(metric > best)
+          {
+            best = metric;
+            memcpy(p, q, sizeof(p));
+            improved = true;
+            break;
+          }
+        }
+      if(!improved)
+      {
+        translationStep *= 0.5;
+        rotationStep *= 0.5;
+      }
+    }
+    result.evaluations += evaluations;
+  }
+
+  this->transformOf(p, initial, result.trackerToRAS);
+  result.finalMetric = this->evaluate(sampler, result.trackerToRAS, 1);
+  // Keep the starting point if the search only improved a subsample
+  if(result.finalMetric < result.initialMetric)
+  {
+    memcpy(result.trackerToRAS, initial, sizeof(result.trackerToRAS));
+    result.finalMetric = result.initialMetric;
+  }
+  return result.finalMetric > 0.0;
+}
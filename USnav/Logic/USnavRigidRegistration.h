@@ -0,0 +1,119 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavRigidRegistration - rigid alignment of tracked frames to a volume
+// .SECTION Description
+// Pixels of a few tracked frames are gathered once as points in tracker
+// space with their intensity. The registration looks for the rigid
+// TrackerToRAS transform under which these intensities and the volume
+// sampled at the transformed points share the most information, measured
+// by normalized mutual information over a joint histogram.
+//
+// Each evaluation samples the volume in parallel: worker threads fill
+// their own partial histogram over blocks of points, merged at the end.
+// The optimizer is a coordinate pattern search over three rotations about
+// the centre of the points and three translations. It runs coarse to fine:
+// early levels use a fraction of the points and large steps, the last one
+// every point and small steps.
+
+#ifndef __USnavRigidRegistration_h
+#define __USnavRigidRegistration_h
+
+// VTK includes
+#include <vtkType.h>
+
+// STD includes
+#include <vector>
+
+#include "USnavAlignedArray.h"
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class USnavFrameROI;
+class USnavVolumeSampler;
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavRigidRegistration
+{
+public:
+  struct Parameters
+  {
+    int levels;               // each level uses 4 times the points of the previous
+    int histogramBins;
+    double rotationStep;      // degrees, initial step of the first level
+    double translationStep;   // mm, initial step of the first level
+    double minimumTranslationStep; // mm, rotations stop at the matching angle
+    int maximumEvaluations;   // per level
+    int numberOfThreads;      // 0 for every core
+    Parameters() : levels(3), histogramBins(32), rotationStep(4.0), translationStep(8.0),
+                   minimumTranslationStep(0.1), maximumEvaluations(400), numberOfThreads(0) {}
+  };
+
+  struct Result
+  {
+    double trackerToRAS[16];
+    double initialMetric;
+    double finalMetric;
+    int evaluations;
+  };
+
+  USnavRigidRegistration();
+
+  void clearPoints();
+  /// Adds every `stride`-th pixel of a width x height frame placed by
+  /// imageToTracker (16 row-major doubles), inside `roi` when given and
+  /// brighter than `minimumIntensity` (background and shadows carry no
+  /// structure).
+  void addFrame(const double imageToTracker[16], const unsigned char* pixels, int width, int height,
+                int stride, const USnavFrameROI* roi, int minimumIntensity = 8);
+  int getNumberOfPoints() const { return (int)this->intensities.size(); }
+
+  /// Normalized mutual information, in [1,2], between the points and
+  /// `volume` under trackerToRAS, using one point in `subsampling`.
+  double evaluate(const USnavVolumeSampler& volume, const double trackerToRAS[16], int subsampling = 1);
+
+  /// Optimizes from `initial`; false if there are too few points or they
+  /// never overlap the volume.
+  bool run(const USnavVolumeSampler& volume, const double initial[16], const Parameters& parameters, Result& result);
+
+private:
+  USnavRigidRegistration(const USnavRigidRegistration&); // Not implemented
+  void operator=(const USnavRigidRegistration&);         // Not implemented
+
+  void packPoints();
+  void transformOf(const double parameters[6], const double initial[16], double trackerToRAS[16]) const;
+  static void histogramChunk(int begin, int end, int threadId, void* userData);
+
+  // Points are gathered in vectors, then packed to aligned arrays
+  std::vector<float> pointsX;
+  std::vector<float> pointsY;
+  std::vector<float> pointsZ;
+  std::vector<unsigned char> intensities;
+  bool packed;
+  USnavAlignedArray<float> x;
+  USnavAlignedArray<float> y;
+  USnavAlignedArray<float> z;
+  double center[3];
+
+  // Evaluation state shared with the workers
+  const USnavVolumeSampler* volume;
+  double pointsToRAS[16];
+  int subsampling;
+  int bins;
+  int numberOfThreads;
+  std::vector<std::vector<double> > histograms; // one joint histogram per thread
+};
+
+#endif
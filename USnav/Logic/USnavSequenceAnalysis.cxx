@@ -0,0 +1,731 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavSequenceAnalysis.h"
+#include "USnavGeometry.h"
+#include "USnavOrientationIndex.h"
+#include "USnavParallel.h"
+
+// VTK includes
+#include <vtkType.h>
+
+// STD includes
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+
+namespace
+{
+double meanAbsoluteDifference(const std::vector<unsigned char>& a, const std::vector<unsigned char>& b)
+{
+  if(a.empty() || a.size() != b.size())
+    return 0.0;
+  unsigned long sum = 0;
+  for(size_t i=0; i<a.size(); i++)
+    sum += abs((int)a[i] - (int)b[i]);
+  return (double)sum / a.size();
+}
+
+const double radiansToDegrees = 57.29577951308232;
+
+// Blocks tried per axis on the reduced frames; flat ones (outside the fan,
+// shadows) are skipped, and a pair needs a few textured ones
+const int motionBlockColumns = 5;
+const int motionBlockRows = 4;
+const double minBlockDeviation = 4.0;
+const size_t minMotionBlocks = 3;
+// Frame pairs per task
+const int motionGrain = 16;
+
+// Sum of absolute differences of two size x size blocks. Rows are
+// contiguous bytes, which the compiler turns into packed absolute
+// differences (psadbw and the like).
+int blockSAD(const unsigned char* a, const unsigned char* b, int stride, int size)
+{
+  int sum = 0;
+  for(int y=0; y<size; y++, a += stride, b += stride)
+    for(int x=0; x<size; x++)
+      sum += abs((int)a[x] - (int)b[x]);
+  return sum;
+}
+
+double blockDeviation(const unsigned char* a, int stride, int size)
+{
+  double sum = 0.0, squares = 0.0;
+  for(int y=0; y<size; y++, a += stride)
+    for(int x=0; x<size; x++)
+    {
+      sum += a[x];
+      squares += (double)a[x]*a[x];
+    }
+  double n = (double)size*size;
+  double variance = squares/n - (sum/n)*(sum/n);
+  return variance > 0 ? sqrt(variance) : 0.0;
+}
+
+// Pearson correlation of two blocks, 0 when either is flat
+double blockCorrelation(const unsigned char* a, const unsigned char* b, int stride, int size)
+{
+  double sa = 0.0, sb = 0.0, saa = 0.0, sbb = 0.0, sab = 0.0;
+  for(int y=0; y<size; y++, a += stride, b += stride)
+    for(int x=0; x<size; x++)
+    {
+      double va = a[x], vb = b[x];
+      sa += va;
+      sb += vb;
+      saa += va*va;
+      sbb += vb*vb;
+      sab += va*vb;
+    }
+  double n = (double)size*size;
+  double varianceA = saa - sa*sa/n, varianceB = sbb - sb*sb/n;
+  if(varianceA <= 0 || varianceB <= 0)
+    return 0.0;
+  return (sab - sa*sb/n)/sqrt(varianceA*varianceB);
+}
+
+// Vertex of the parabola through (-1,left), (0,centre), (1,right)
+double subpixelOffset(int left, int centre, int right)
+{
+  double curvature = left - 2.0*centre + right;
+  if(curvature <= 0)
+    return 0.0;
+  return std::max(-0.5, std::min(0.5, 0.5*(left - right)/curvature));
+}
+
+double median(std::vector<double>& values)
+{
+  std::nth_element(values.begin(), values.begin() + values.size()/2, values.end());
+  return values[values.size()/2];
+}
+
+// Shift of the content from a to b, in pixels of these w x h images, and
+// the median correlation of the matched blocks; false without enough
+// textured blocks
+bool matchBlocks(const unsigned char* a, const unsigned char* b, int w, int h, int block, int radius,
+                 double shift[2], double& correlation)
+{
+  int spanX = w - 2*radius - block;
+  int spanY = h - 2*radius - block;
+  if(block <= 0 || radius < 0 || spanX < 0 || spanY < 0)
+    return false;
+  int side = 2*radius + 1;
+  std::vector<int> sads((size_t)side*side);
+  std::vector<double> shiftsX, shiftsY, correlations;
+  for(int by=0; by<motionBlockRows; by++)
+    for(int bx=0; bx<motionBlockColumns; bx++)
+    {
+      int x = radius + spanX*bx/(motionBlockColumns - 1);
+      int y = radius + spanY*by/(motionBlockRows - 1);
+      const unsigned char* blockA = a + (size_t)y*w + x;
+      if(blockDeviation(blockA, w, block) < minBlockDeviation)
+        continue;
+      // Exhaustive search; ties go to the smallest shift
+      int best = -1, bestX = 0, bestY = 0;
+      for(int dy=-radius; dy<=radius; dy++)
+        for(int dx=-radius; dx<=radius; dx++)
+        {
+          int sad = blockSAD(blockA, b + (size_t)(y + dy)*w + (x + dx), w, block);
+          sads[(size_t)(dy + radius)*side + dx + radius] = sad;
+          if(best < 0 || sad < best || (sad == best && dx*dx + dy*dy < bestX*bestX + bestY*bestY))
+          {
+            best = sad;
+            bestX = dx;
+            bestY = dy;
+          }
+        }
+      const int* centre = &sads[(size_t)(bestY + radius)*side + bestX + radius];
+      double subX = bestX > -radius && bestX < radius ? subpixelOffset(centre[-1], centre[0], centre[1]) : 0.0;
+      double subY = bestY > -radius && bestY < radius ? subpixelOffset(centre[-side], centre[0], centre[side]) : 0.0;
+      shiftsX.push_back(bestX + subX);
+      shiftsY.push_back(bestY + subY);
+      correlations.push_back(blockCorrelation(blockA, b + (size_t)(y + bestY)*w + (x + bestX), w, block));
+    }
+  if(correlations.size() < minMotionBlocks)
+    return false;
+  shift[0] = median(shiftsX);
+  shift[1] = median(shiftsY);
+  correlation = median(correlations);
+  return true;
+}
+
+double shiftLength(double x, double y)
+{
+  return sqrt(x*x + y*y);
+}
+
+// Shift of the centre of image `from` once seen in image `to`, in pixels
+// of `to`, and its distance to that plane in mm
+void predictShift(const double* imageToTracker, int from, int to, const double centre[3], double shift[2],
+                  double& elevation)
+{
+  const double* toImageToTracker = imageToTracker + 16*(size_t)to;
+  double trackerToImage[16], point[3], local[3], normal[3], offset;
+  usnavTransformPoint(imageToTracker + 16*(size_t)from, centre, point);
+  usnavInvertAffine4x4(toImageToTracker, trackerToImage);
+  usnavTransformPoint(trackerToImage, point, local);
+  usnavImagePlane(toImageToTracker, normal, offset);
+  elevation = fabs(usnavSignedDistanceToPlane(normal, offset, point));
+  shift[0] = local[0] - centre[0];
+  shift[1] = local[1] - centre[1];
+}
+
+struct ImageMotionData
+{
+  const std::vector<int>* frames;
+  USnavFrameContentFunction content;
+  void* userData;
+  int width;  // of the reduced frames
+  int height;
+  int factor;
+  const USnavSequenceAnalysis::ImageMotionParameters* parameters;
+  std::vector<int>* previous;
+  std::vector<float>* shifts;
+  std::vector<float>* correlations;
+};
+
+// Pairs (frames[i], frames[i+1]) for i in [begin,end); each frame's
+// content is fetched once per chunk, and every pair writes its own slots
+void imageMotionChunk(int begin, int end, int vtkNotUsed(threadId), void* userData)
+{
+  ImageMotionData* data = static_cast<ImageMotionData*>(userData);
+  const std::vector<int>& frames = *data->frames;
+  size_t size = (size_t)data->width*data->height;
+  std::vector<unsigned char> before, after;
+  bool hasBefore = data->content(frames[begin], before, data->userData) && before.size() == size;
+  for(int i=begin; i<end; i++)
+  {
+    int frame = frames[i+1];
+    bool hasAfter = data->content(frame, after, data->userData) && after.size() == size;
+    double shift[2], correlation;
+    if(hasBefore && hasAfter && matchBlocks(&before[0], &after[0], data->width, data->height,
+                                            data->parameters->blockSize, data->parameters->searchRadius,
+                                            shift, correlation))
+    {
+      (*data->previous)[frame] = frames[i];
+      (*data->shifts)[2*(size_t)frame] = (float)(shift[0]*data->factor);
+      (*data->shifts)[2*(size_t)frame+1] = (float)(shift[1]*data->factor);
+      (*data->correlations)[frame] = (float)correlation;
+    }
+    before.swap(after);
+    hasBefore = hasAfter;
+  }
+}
+}
+
+//----------------------------------------------------------------------------
+USnavSequenceAnalysis::USnavSequenceAnalysis()
+{
+  this->flaggedFrames = 0;
+  this->imageWidth = 0;
+  this->imageHeight = 0;
+  this->imageFactor = 1;
+  this->imageMismatches = 0;
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::clearKeyframes()
+{
+  this->keyframes.clear();
+  this->groupSizes.clear();
+  this->frameGroups.clear();
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::computeKeyframes(const double* imageToTracker, const std::vector<int>& frames,
+                                             const KeyframeParameters& parameters,
+                                             USnavFrameContentFunction content, void* userData)
+{
+  this->clearKeyframes();
+  if(frames.empty())
+    return;
+  this->frameGroups.assign(frames.back()+1, -1);
+  bool useContent = content && parameters.maxIntensityChange > 0;
+
+  double anchorQ[4];
+  const double* anchor = NULL;
+  std::vector<unsigned char> anchorPixels, pixels;
+  bool anchorHasPixels = false;
+  size_t groupStart = 0;
+  for(size_t i=0; i<=frames.size(); i++)
+  {
+    bool split = i == frames.size();
+    const double* m = NULL;
+    double q[4];
+    bool hasPixels = false;
+    if(!split)
+    {
+      m = imageToTracker + 16*(size_t)frames[i];
+      USnavOrientationIndex::matrixToQuaternion(m, q);
+      if(anchor)
+      {
+        double dx = m[3] - anchor[3], dy = m[7] - anchor[7], dz = m[11] - anchor[11];
+        split = sqrt(dx*dx + dy*dy + dz*dz) > parameters.maxTranslation
+             || USnavOrientationIndex::angleBetween(q, anchorQ) > parameters.maxRotation;
+      }
+      // Pixels are only fetched when the pose alone does not split
+      if(useContent && !split)
+      {
+        hasPixels = content(frames[i], pixels, userData);
+        if(anchor && hasPixels && anchorHasPixels)
+          split = meanAbsoluteDifference(pixels, anchorPixels) > parameters.maxIntensityChange;
+      }
+    }
+    if(split && anchor)
+    {
+      // Close the group [groupStart, i), represented by its middle frame
+      int group = (int)this->keyframes.size();
+      this->keyframes.push_back(frames[(groupStart + i - 1)/2]);
+      this->groupSizes.push_back((int)(i - groupStart));
+      for(size_t g=groupStart; g<i; g++)
+        this->frameGroups[frames[g]] = group;
+      anchor = NULL;
+    }
+    if(i == frames.size())
+      break;
+    if(!anchor)
+    {
+      anchor = m;
+      for(int k=0; k<4; k++)
+        anchorQ[k] = q[k];
+      groupStart = i;
+      if(useContent && !hasPixels)
+        hasPixels = content(frames[i], pixels, userData);
+      anchorPixels.swap(pixels);
+      anchorHasPixels = hasPixels;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+int USnavSequenceAnalysis::getKeyframeOf(int frame) const
+{
+  if(frame < 0 || frame >= (int)this->frameGroups.size() || this->frameGroups[frame] < 0)
+    return -1;
+  return this->keyframes[this->frameGroups[frame]];
+}
+
+//----------------------------------------------------------------------------
+int USnavSequenceAnalysis::getNextKeyframe(int frame) const
+{
+  if(this->keyframes.empty())
+    return -1;
+  std::vector<int>::const_iterator it = std::upper_bound(this->keyframes.begin(), this->keyframes.end(), frame);
+  return it == this->keyframes.end() ? this->keyframes.front() : *it;
+}
+
+//----------------------------------------------------------------------------
+int USnavSequenceAnalysis::getPreviousKeyframe(int frame) const
+{
+  if(this->keyframes.empty())
+    return -1;
+  std::vector<int>::const_iterator it = std::lower_bound(this->keyframes.begin(), this->keyframes.end(), frame);
+  return it == this->keyframes.begin() ? this->keyframes.back() : *(it-1);
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::clearKinematics()
+{
+  this->speeds.release();
+  this->angularSpeeds.release();
+  this->accelerations.release();
+  this->jitters.release();
+  this->motionFlags.clear();
+  this->flaggedFrames = 0;
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::computeKinematics(const double* probeToTracker, const double* imageToTracker,
+                                              const std::vector<int>& frames, int numberOfFrames,
+                                              const double* timestamps, const KinematicsParameters& parameters)
+{
+  this->clearKinematics();
+  if(numberOfFrames <= 0)
+    return;
+  size_t total = (size_t)numberOfFrames;
+  this->speeds.resize(total);
+  this->angularSpeeds.resize(total);
+  this->accelerations.resize(total);
+  this->jitters.resize(total);
+  std::fill(this->speeds.get(), this->speeds.get() + total, 0.0f);
+  std::fill(this->angularSpeeds.get(), this->angularSpeeds.get() + total, 0.0f);
+  std::fill(this->accelerations.get(), this->accelerations.get() + total, 0.0f);
+  std::fill(this->jitters.get(), this->jitters.get() + total, 0.0f);
+  this->motionFlags.assign(total, 0);
+  size_t n = frames.size();
+  if(n < 2)
+    return;
+
+  // Gather positions, orientations and times into contiguous arrays
+  USnavAlignedArray<double> t, px, py, pz, qw, qx, qy, qz;
+  t.resize(n); px.resize(n); py.resize(n); pz.resize(n);
+  qw.resize(n); qx.resize(n); qy.resize(n); qz.resize(n);
+  bool increasing = timestamps != NULL;
+  for(size_t i=0; i<n; i++)
+  {
+    const double* m = probeToTracker + 16*(size_t)frames[i];
+    double q[4];
+    USnavOrientationIndex::matrixToQuaternion(m, q);
+    px[i] = m[3]; py[i] = m[7]; pz[i] = m[11];
+    qw[i] = q[0]; qx[i] = q[1]; qy[i] = q[2]; qz[i] = q[3];
+    if(increasing)
+    {
+      t[i] = timestamps[frames[i]];
+      increasing = i == 0 || t[i] > t[i-1];
+    }
+  }
+  if(!increasing)
+    for(size_t i=0; i<n; i++)
+      t[i] = frames[i] / parameters.frameRate;
+
+  // Steps between consecutive frames: interval, displacement, rotation
+  size_t steps = n-1;
+  USnavAlignedArray<double> dt, dx, dy, dz, rotation;
+  dt.resize(steps); dx.resize(steps); dy.resize(steps); dz.resize(steps); rotation.resize(steps);
+  for(size_t i=0; i<steps; i++)
+  {
+    dt[i] = t[i+1] - t[i];
+    dx[i] = px[i+1] - px[i];
+    dy[i] = py[i+1] - py[i];
+    dz[i] = pz[i+1] - pz[i];
+  }
+  for(size_t i=0; i<steps; i++)
+  {
+    double d = fabs(qw[i]*qw[i+1] + qx[i]*qx[i+1] + qy[i]*qy[i+1] + qz[i]*qz[i+1]);
+    rotation[i] = 2.0*acos(d < 1.0 ? d : 1.0)*radiansToDegrees;
+  }
+  std::vector<double> sortedIntervals(dt.get(), dt.get() + steps);
+  std::nth_element(sortedIntervals.begin(), sortedIntervals.begin() + steps/2, sortedIntervals.end());
+  double maxInterval = parameters.maxGap * sortedIntervals[steps/2];
+
+  // Per frame values from the steps on each side; the first and last
+  // frames only have one
+  for(size_t i=0; i<n; i++)
+  {
+    size_t before = i > 0 ? i-1 : 0;
+    size_t after = i < steps ? i : steps-1;
+    double span = t[after+1] - t[before];
+    double sx = px[after+1] - px[before], sy = py[after+1] - py[before], sz = pz[after+1] - pz[before];
+    double speed = sqrt(sx*sx + sy*sy + sz*sz) / span;
+    double angularSpeed = (i > 0 && i < steps ? rotation[before] + rotation[after] : rotation[before]) / span;
+    double acceleration = 0.0, jitter = 0.0;
+    if(i > 0 && i < steps)
+    {
+      // Change of step velocity, and distance to the point the neighbours
+      // predict at this time
+      double ax = dx[after]/dt[after] - dx[before]/dt[before];
+      double ay = dy[after]/dt[after] - dy[before]/dt[before];
+      double az = dz[after]/dt[after] - dz[before]/dt[before];
+      acceleration = sqrt(ax*ax + ay*ay + az*az) / (0.5*span);
+      double w = dt[before] / span;
+      double jx = dx[before] - w*sx, jy = dy[before] - w*sy, jz = dz[before] - w*sz;
+      jitter = sqrt(jx*jx + jy*jy + jz*jz);
+    }
+    int frame = frames[i];
+    this->speeds[frame] = (float)speed;
+    this->angularSpeeds[frame] = (float)angularSpeed;
+    this->accelerations[frame] = (float)acceleration;
+    this->jitters[frame] = (float)jitter;
+
+    unsigned char flags = 0;
+    if(speed > parameters.maxSpeed || angularSpeed > parameters.maxAngularSpeed)
+      flags |= FastMotion;
+    if(i > 0 && dx[before] == 0.0 && dy[before] == 0.0 && dz[before] == 0.0 && rotation[before] == 0.0)
+      flags |= FrozenPose;
+    if(i > 0 && dt[before] > maxInterval)
+      flags |= TimeGap;
+    this->motionFlags[frame] = flags;
+  }
+
+  // A frame off the path also moves its neighbours' predictions; only the
+  // one furthest off is flagged
+  for(size_t i=0; i<n; i++)
+  {
+    int frame = frames[i];
+    float jitter = this->jitters[frame];
+    if(jitter > parameters.maxJitter
+       && (i == 0 || jitter >= this->jitters[frames[i-1]])
+       && (i == steps || jitter >= this->jitters[frames[i+1]]))
+      this->motionFlags[frame] |= PoseJump;
+    if(this->motionFlags[frame])
+      this->flaggedFrames++;
+  }
+  this->flagImageMotion(imageToTracker, frames);
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::clearSweeps()
+{
+  this->sweepStarts.clear();
+  this->sweepEnds.clear();
+  this->sweepSizes.clear();
+  this->sweepBounds.clear();
+  this->frameSweeps.clear();
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::computeSweeps(const double* probeToTracker, const double* imageToTracker,
+                                          const std::vector<int>& frames, int numberOfFrames,
+                                          const double* timestamps, int width, int height,
+                                          const SweepParameters& parameters)
+{
+  this->clearSweeps();
+  if(numberOfFrames <= 0 || frames.empty())
+    return;
+  this->frameSweeps.assign(numberOfFrames, -1);
+
+  // Cut points: index in `frames` of the first frame of every piece
+  std::vector<size_t> cuts(1, 0);
+  size_t previous = 0; // last frame on the path, glitches skipped
+  double previousQ[4];
+  USnavOrientationIndex::matrixToQuaternion(probeToTracker + 16*(size_t)frames[0], previousQ);
+  for(size_t i=1; i<frames.size(); i++)
+  {
+    int frame = frames[i];
+    if(this->getMotionFlags(frame) & PoseJump)
+      continue;
+    const double* m = probeToTracker + 16*(size_t)frame;
+    const double* p = probeToTracker + 16*(size_t)frames[previous];
+    double q[4];
+    USnavOrientationIndex::matrixToQuaternion(m, q);
+    double dx = m[3] - p[3], dy = m[7] - p[7], dz = m[11] - p[11];
+    bool cut = frame - frames[previous] - 1 > parameters.maxInvalidRun
+            || (timestamps && timestamps[frame] - timestamps[frames[previous]] > parameters.maxTimeGap)
+            || sqrt(dx*dx + dy*dy + dz*dz) > parameters.maxJump
+            || USnavOrientationIndex::angleBetween(q, previousQ) > parameters.maxRotationJump;
+    // A piece starting with glitches starts at the first of them
+    if(cut)
+      cuts.push_back(previous + 1);
+    previous = i;
+    for(int k=0; k<4; k++)
+      previousQ[k] = q[k];
+  }
+  cuts.push_back(frames.size());
+
+  // Pieces too short to be sweeps extend the previous one
+  std::vector<size_t> starts;
+  for(size_t c=0; c+1<cuts.size(); c++)
+    if(starts.empty() || cuts[c+1] - cuts[c] >= (size_t)std::max(parameters.minFrames, 1))
+      starts.push_back(cuts[c]);
+  starts.push_back(frames.size());
+
+  double corners[4][3] = { { 0.0, 0.0, 0.0 }, { width - 1.0, 0.0, 0.0 }, { 0.0, height - 1.0, 0.0 },
+                           { width - 1.0, height - 1.0, 0.0 } };
+  for(size_t s=0; s+1<starts.size(); s++)
+  {
+    int sweep = (int)s;
+    double bounds[6] = { DBL_MAX, -DBL_MAX, DBL_MAX, -DBL_MAX, DBL_MAX, -DBL_MAX };
+    for(size_t i=starts[s]; i<starts[s+1]; i++)
+    {
+      const double* m = imageToTracker + 16*(size_t)frames[i];
+      for(int c=0; c<4; c++)
+      {
+        double p[3];
+        usnavTransformPoint(m, corners[c], p);
+        for(int a=0; a<3; a++)
+        {
+          bounds[2*a] = std::min(bounds[2*a], p[a]);
+          bounds[2*a+1] = std::max(bounds[2*a+1], p[a]);
+        }
+      }
+      this->frameSweeps[frames[i]] = sweep;
+    }
+    this->sweepStarts.push_back(frames[starts[s]]);
+    this->sweepEnds.push_back(frames[starts[s+1]-1]);
+    this->sweepSizes.push_back((int)(starts[s+1] - starts[s]));
+    this->sweepBounds.insert(this->sweepBounds.end(), bounds, bounds + 6);
+  }
+}
+
+//----------------------------------------------------------------------------
+int USnavSequenceAnalysis::getSweepOf(int frame) const
+{
+  if(frame < 0 || frame >= (int)this->frameSweeps.size())
+    return -1;
+  return this->frameSweeps[frame];
+}
+
+//----------------------------------------------------------------------------
+int USnavSequenceAnalysis::getNextSweep(int frame) const
+{
+  if(this->sweepStarts.empty())
+    return -1;
+  std::vector<int>::const_iterator it = std::upper_bound(this->sweepStarts.begin(), this->sweepStarts.end(), frame);
+  return it == this->sweepStarts.end() ? this->sweepStarts.front() : *it;
+}
+
+//----------------------------------------------------------------------------
+int USnavSequenceAnalysis::getPreviousSweep(int frame) const
+{
+  if(this->sweepStarts.empty())
+    return -1;
+  std::vector<int>::const_iterator it = std::lower_bound(this->sweepStarts.begin(), this->sweepStarts.end(), frame);
+  return it == this->sweepStarts.begin() ? this->sweepStarts.back() : *(it-1);
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::clearImageMotion()
+{
+  this->imagePrevious.clear();
+  this->imageShifts.clear();
+  this->imageCorrelations.clear();
+  this->predictedShifts.clear();
+  this->imageMismatches = 0;
+  this->clearImageMismatchFlags();
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::clearImageMismatchFlags()
+{
+  for(size_t i=0; i<this->motionFlags.size(); i++)
+    if(this->motionFlags[i] & ImageMismatch)
+    {
+      this->motionFlags[i] &= ~ImageMismatch;
+      if(!this->motionFlags[i])
+        this->flaggedFrames--;
+    }
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::computeImageMotion(const double* imageToTracker, const std::vector<int>& frames,
+                                               int numberOfFrames, USnavFrameContentFunction content,
+                                               void* userData, int width, int height, int factor,
+                                               const ImageMotionParameters& parameters, int numberOfThreads)
+{
+  this->clearImageMotion();
+  this->imageMotionParameters = parameters;
+  this->imageWidth = width;
+  this->imageHeight = height;
+  this->imageFactor = factor;
+  if(numberOfFrames <= 0 || !content || factor <= 0)
+    return;
+  size_t total = (size_t)numberOfFrames;
+  this->imagePrevious.assign(total, -1);
+  this->imageShifts.assign(2*total, 0.0f);
+  this->imageCorrelations.assign(total, 0.0f);
+  this->predictedShifts.assign(2*total, 0.0f);
+  if(frames.size() < 2)
+    return;
+
+  ImageMotionData data;
+  data.frames = &frames;
+  data.content = content;
+  data.userData = userData;
+  data.width = width/factor;
+  data.height = height/factor;
+  data.factor = factor;
+  data.parameters = &this->imageMotionParameters;
+  data.previous = &this->imagePrevious;
+  data.shifts = &this->imageShifts;
+  data.correlations = &this->imageCorrelations;
+  usnavParallelFor((int)frames.size() - 1, motionGrain, imageMotionChunk, &data, numberOfThreads);
+  this->flagImageMotion(imageToTracker, frames);
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceAnalysis::flagImageMotion(const double* imageToTracker, const std::vector<int>& frames)
+{
+  this->imageMismatches = 0;
+  this->clearImageMismatchFlags();
+  if(!this->hasImageMotion())
+    return;
+  // Flags are only kept along with the kinematics of the same sequence
+  bool flag = this->motionFlags.size() == this->imagePrevious.size();
+
+  const ImageMotionParameters& p = this->imageMotionParameters;
+  double centre[3] = { 0.5*(this->imageWidth - 1), 0.5*(this->imageHeight - 1), 0.0 };
+  // Poses within this shift could have been matched
+  double searchRange = (double)p.searchRadius*this->imageFactor;
+  // Last frame whose pose agreed with the images, and the content shift
+  // measured since
+  int anchor = frames.empty() ? -1 : frames[0];
+  double sinceAnchor[2] = { 0.0, 0.0 };
+  for(size_t i=1; i<frames.size(); i++)
+  {
+    int frame = frames[i];
+    int previous = frames[i-1];
+    // Measured against another frame when the valid frames changed since;
+    // nothing is known against this one
+    if(!this->hasImageShift(frame) || this->imagePrevious[frame] != previous)
+    {
+      anchor = frame;
+      sinceAnchor[0] = sinceAnchor[1] = 0.0;
+      continue;
+    }
+
+    double predicted[2], elevation;
+    predictShift(imageToTracker, previous, frame, centre, predicted, elevation);
+    this->predictedShifts[2*(size_t)frame] = (float)predicted[0];
+    this->predictedShifts[2*(size_t)frame+1] = (float)predicted[1];
+    double measured[2] = { this->imageShifts[2*(size_t)frame], this->imageShifts[2*(size_t)frame+1] };
+    double correlation = this->imageCorrelations[frame];
+    bool matched = correlation >= p.minCorrelation;
+    bool mismatch;
+    if(matched)
+      // The shifts must agree, and a still image keeps its plane
+      mismatch = shiftLength(measured[0] - predicted[0], measured[1] - predicted[1]) > p.maxShiftError
+                 || (correlation >= p.stillCorrelation && elevation > p.maxElevation);
+    else
+      // The content changed beyond matching while the poses stayed within
+      // reach of the search and in the plane
+      mismatch = shiftLength(predicted[0], predicted[1]) <= searchRange && elevation <= p.maxElevation;
+
+    // After a glitch the pose may agree again with the last good frame:
+    // only the frames in between are flagged
+    if(anchor >= 0 && matched)
+    {
+      sinceAnchor[0] += measured[0];
+      sinceAnchor[1] += measured[1];
+      if(mismatch && anchor != previous)
+      {
+        double fromAnchor[2], anchorElevation;
+        predictShift(imageToTracker, anchor, frame, centre, fromAnchor, anchorElevation);
+        mismatch = shiftLength(sinceAnchor[0] - fromAnchor[0], sinceAnchor[1] - fromAnchor[1]) > p.maxShiftError
+                   || anchorElevation > p.maxElevation;
+      }
+    }
+    if(!mismatch)
+    {
+      anchor = frame;
+      sinceAnchor[0] = sinceAnchor[1] = 0.0;
+      continue;
+    }
+    if(!matched)
+      anchor = -1;
+    this->imageMismatches++;
+    if(flag)
+    {
+      if(!this->motionFlags[frame])
+        this->flaggedFrames++;
+      this->motionFlags[frame] |= ImageMismatch;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+bool USnavSequenceAnalysis::getImageShift(int frame, double measured[2], double predicted[2]) const
+{
+  if(!this->hasImageShift(frame))
+    return false;
+  for(int k=0; k<2; k++)
+  {
+    measured[k] = this->imageShifts[2*(size_t)frame+k];
+    predicted[k] = this->predictedShifts[2*(size_t)frame+k];
+  }
+  return true;
+}
@@ -0,0 +1,247 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavSequenceAnalysis - whole sequence summaries computed from poses
+// .SECTION Description
+// Keyframes: one pass over the valid frames groups consecutive frames that
+// stay within a translation, rotation and intensity change of the first
+// frame of their group, and keeps the middle frame of each group as its
+// representative. Comparing against the group's first frame rather than
+// the previous one prevents slow drifts from being folded into one group.
+//
+// Kinematics: probe speed, angular speed, acceleration and jitter of every
+// valid frame from its neighbours, computed over position, quaternion and
+// time arrays so that each step is a plain loop over contiguous values.
+// Positions are the origin of the tracked probe (ProbeToTracker), not an
+// image corner: the image sits at the end of the calibration lever arm,
+// where a pure rotation of the probe would read as speed.
+// Jitter is the distance from the frame to the path through its two
+// neighbours: a tracking glitch moves one frame off the path while a fast
+// but smooth sweep does not. Frames are flagged when they are likely motion
+// blurred, off the path, a repeat of the previous pose (the tracker did not
+// update) or after a gap in the timestamps.
+//
+// Sweeps: the valid frames are cut where tracking was lost for a while,
+// where the timestamps jump, or where the pose jumps between consecutive
+// frames (the probe was lifted and repositioned), measured on the probe
+// poses as well. Frames flagged PoseJump by the kinematics are single
+// glitches and do not cut. Each sweep keeps the bounding box of its image
+// corners in tracker space.
+//
+// Image motion: the content shift between consecutive valid frames is
+// measured by block matching on reduced frames (sums of absolute
+// differences over contiguous rows, which the compiler vectorizes), in
+// parallel over the sequence, and compared with the shift the poses
+// predict at the image centre. A frame is flagged when the two disagree,
+// when the images stay the same while the poses leave the plane, or when
+// the images decorrelate while the poses barely move: the tracker froze or
+// jumped although it reported the pose as OK. A frame whose pose agrees
+// again with the last frame that did is not flagged, so a single glitch
+// flags a single frame.
+
+#ifndef __USnavSequenceAnalysis_h
+#define __USnavSequenceAnalysis_h
+
+// STD includes
+#include <vector>
+
+#include "USnavAlignedArray.h"
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+/// Fills `pixels` with a small, fixed size version of `frame`; false if
+/// it is not available.
+typedef bool (*USnavFrameContentFunction)(int frame, std::vector<unsigned char>& pixels, void* userData);
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavSequenceAnalysis
+{
+public:
+  struct KeyframeParameters
+  {
+    double maxTranslation;    // mm
+    double maxRotation;       // degrees
+    double maxIntensityChange; // mean absolute difference, 0 for poses only
+    KeyframeParameters() : maxTranslation(1.0), maxRotation(2.0), maxIntensityChange(8.0) {}
+  };
+
+  struct KinematicsParameters
+  {
+    double maxSpeed;        // mm/s
+    double maxAngularSpeed; // degrees/s
+    double maxJitter;       // mm off the path through the neighbours
+    double maxGap;          // intervals, in median intervals
+    double frameRate;       // used when the timestamps are missing or not increasing
+    KinematicsParameters() : maxSpeed(40.0), maxAngularSpeed(45.0), maxJitter(1.0), maxGap(3.0), frameRate(30.0) {}
+  };
+
+  struct SweepParameters
+  {
+    int maxInvalidRun;      // frames without tracking inside a sweep
+    double maxTimeGap;      // seconds between consecutive valid frames
+    double maxJump;         // mm between consecutive valid frames
+    double maxRotationJump; // degrees between consecutive valid frames
+    int minFrames;          // shorter pieces join the previous sweep
+    SweepParameters() : maxInvalidRun(15), maxTimeGap(0.5), maxJump(10.0), maxRotationJump(20.0), minFrames(10) {}
+  };
+
+  struct ImageMotionParameters
+  {
+    int blockSize;           // pixels of the reduced frames
+    int searchRadius;        // same
+    double maxShiftError;    // image pixels between measured and predicted shift
+    double minCorrelation;   // below, the images cannot be matched
+    double stillCorrelation; // above, the probe stayed in the plane
+    double maxElevation;     // mm out of plane the poses may move with a still image
+    ImageMotionParameters() : blockSize(16), searchRadius(6), maxShiftError(4.0), minCorrelation(0.5),
+                              stillCorrelation(0.95), maxElevation(1.0) {}
+  };
+
+  enum MotionFlags
+  {
+    FastMotion = 1, // above maxSpeed or maxAngularSpeed
+    PoseJump = 2,   // above maxJitter
+    FrozenPose = 4, // same pose as the previous frame
+    TimeGap = 8,    // after an interval above maxGap
+    ImageMismatch = 16 // image motion disagrees with the poses
+  };
+
+  USnavSequenceAnalysis();
+
+  /// Groups `frames` (sorted, valid) using their ImageToTracker matrices,
+  /// 16 row-major doubles at imageToTracker + 16*frame, and `content`
+  /// when given.
+  void computeKeyframes(const double* imageToTracker, const std::vector<int>& frames,
+                        const KeyframeParameters& parameters,
+                        USnavFrameContentFunction content = 0, void* userData = 0);
+  void clearKeyframes();
+  bool hasKeyframes() const { return !this->keyframes.empty(); }
+
+  /// Representatives, sorted by frame number
+  const std::vector<int>& getKeyframes() const { return this->keyframes; }
+  /// Frames in the group of each keyframe
+  const std::vector<int>& getGroupSizes() const { return this->groupSizes; }
+  /// Representative of the group of `frame`, -1 if not grouped
+  int getKeyframeOf(int frame) const;
+  /// First keyframe after / before `frame`, wrapping around; -1 if none
+  int getNextKeyframe(int frame) const;
+  int getPreviousKeyframe(int frame) const;
+
+  /// Kinematics of `frames` (sorted, valid) out of `numberOfFrames`, with
+  /// one timestamp in seconds per frame or NULL. `probeToTracker` holds
+  /// the tracked transform of every frame, 16 row-major doubles, without
+  /// the image calibration; `imageToTracker` places the images for the
+  /// image motion flags.
+  void computeKinematics(const double* probeToTracker, const double* imageToTracker, const std::vector<int>& frames,
+                         int numberOfFrames, const double* timestamps, const KinematicsParameters& parameters);
+  void clearKinematics();
+  bool hasKinematics() const { return !this->motionFlags.empty(); }
+
+  /// Per frame values, 0 for frames that were not given: mm/s, degrees/s,
+  /// mm/s^2 and mm
+  float getSpeed(int frame) const { return this->isAnalysed(frame) ? this->speeds[frame] : 0.0f; }
+  float getAngularSpeed(int frame) const { return this->isAnalysed(frame) ? this->angularSpeeds[frame] : 0.0f; }
+  float getAcceleration(int frame) const { return this->isAnalysed(frame) ? this->accelerations[frame] : 0.0f; }
+  float getJitter(int frame) const { return this->isAnalysed(frame) ? this->jitters[frame] : 0.0f; }
+  /// MotionFlags of `frame`
+  unsigned int getMotionFlags(int frame) const { return this->isAnalysed(frame) ? this->motionFlags[frame] : 0u; }
+  int getNumberOfFlaggedFrames() const { return this->flaggedFrames; }
+
+  /// Cuts `frames` (sorted, valid) out of `numberOfFrames` into sweeps, with
+  /// one timestamp in seconds per frame or NULL. Uses the kinematics when
+  /// they have been computed. Jumps are measured on `probeToTracker` (as
+  /// for the kinematics), bounds on width x height images placed by
+  /// `imageToTracker`.
+  void computeSweeps(const double* probeToTracker, const double* imageToTracker, const std::vector<int>& frames,
+                     int numberOfFrames, const double* timestamps, int width, int height,
+                     const SweepParameters& parameters);
+  void clearSweeps();
+  int getNumberOfSweeps() const { return (int)this->sweepStarts.size(); }
+  /// Sweep of `frame`, -1 if it is not in one
+  int getSweepOf(int frame) const;
+  /// First and last valid frame of `sweep`, and its number of frames
+  int getSweepFirstFrame(int sweep) const { return this->sweepStarts[sweep]; }
+  int getSweepLastFrame(int sweep) const { return this->sweepEnds[sweep]; }
+  int getSweepSize(int sweep) const { return this->sweepSizes[sweep]; }
+  /// xmin, xmax, ymin, ymax, zmin, zmax of the image corners of `sweep`
+  const double* getSweepBounds(int sweep) const { return &this->sweepBounds[6*(size_t)sweep]; }
+  /// First frame of the next sweep starting after `frame`, or of the last
+  /// one starting before it, wrapping around; -1 if none
+  int getNextSweep(int frame) const;
+  int getPreviousSweep(int frame) const;
+
+  /// Measures the image motion between each of `frames` (sorted, valid)
+  /// out of `numberOfFrames` and the previous one on the `content` of the
+  /// width x height images, reduced `factor` times on each axis, with the
+  /// given number of threads (0 = all cores). Frames that disagree with
+  /// their poses are flagged ImageMismatch once kinematics exist, and again
+  /// by every computeKinematics().
+  void computeImageMotion(const double* imageToTracker, const std::vector<int>& frames, int numberOfFrames,
+                          USnavFrameContentFunction content, void* userData, int width, int height, int factor,
+                          const ImageMotionParameters& parameters, int numberOfThreads = 0);
+  /// New thresholds for the comparison, the measures are kept
+  void setImageMotionParameters(const ImageMotionParameters& parameters) { this->imageMotionParameters = parameters; }
+  void clearImageMotion();
+  bool hasImageMotion() const { return !this->imagePrevious.empty(); }
+  /// Content shift from the previous frame in image pixels, measured and
+  /// predicted by the poses; false where it could not be measured
+  bool getImageShift(int frame, double measured[2], double predicted[2]) const;
+  /// Median correlation of the matched blocks, -1 where not measured
+  float getImageCorrelation(int frame) const { return this->hasImageShift(frame) ? this->imageCorrelations[frame] : -1.0f; }
+  int getNumberOfImageMismatches() const { return this->imageMismatches; }
+
+private:
+  USnavSequenceAnalysis(const USnavSequenceAnalysis&); // Not implemented
+  void operator=(const USnavSequenceAnalysis&);        // Not implemented
+
+  bool isAnalysed(int frame) const { return frame >= 0 && frame < (int)this->motionFlags.size(); }
+  bool hasImageShift(int frame) const
+  {
+    return frame >= 0 && frame < (int)this->imagePrevious.size() && this->imagePrevious[frame] >= 0;
+  }
+  void flagImageMotion(const double* imageToTracker, const std::vector<int>& frames);
+  void clearImageMismatchFlags();
+
+  std::vector<int> keyframes;
+  std::vector<int> groupSizes;
+  std::vector<int> frameGroups; // frame -> group, -1 if not grouped
+
+  // Indexed by frame number
+  USnavAlignedArray<float> speeds;
+  USnavAlignedArray<float> angularSpeeds;
+  USnavAlignedArray<float> accelerations;
+  USnavAlignedArray<float> jitters;
+  std::vector<unsigned char> motionFlags;
+  int flaggedFrames;
+
+  std::vector<int> sweepStarts; // sorted
+  std::vector<int> sweepEnds;
+  std::vector<int> sweepSizes;
+  std::vector<double> sweepBounds;
+  std::vector<int> frameSweeps; // frame -> sweep, -1 if not in one
+
+  // Indexed by frame number, measured against imagePrevious (-1 if not)
+  std::vector<int> imagePrevious;
+  std::vector<float> imageShifts;     // 2 per frame, image pixels
+  std::vector<float> imageCorrelations;
+  std::vector<float> predictedShifts; // 2 per frame, from the poses
+  ImageMotionParameters imageMotionParameters;
+  int imageWidth;
+  int imageHeight;
+  int imageFactor;
+  int imageMismatches;
+};
+
+#endif
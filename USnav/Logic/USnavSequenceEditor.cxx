@@ -0,0 +1,335 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavSequenceEditor.h"
+#include "USnavFileIO.h"
+#include "USnavFrameReader.h"
+#include "USnavNativeSequence.h"
+#include "USnavSequenceLoader.h"
+#include "USnavTransformStore.h"
+
+// STD includes
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+// Bytes per kernel copy call, below the 2GB the calls accept
+const vtkTypeInt64 kernelCopyChunk = 1 << 30;
+// Buffer of the copy through user space
+const size_t bufferedCopyChunk = 1 << 20;
+
+struct Input
+{
+  std::string path;
+  USnavFrameSource source;
+  USnavTransformStore transforms;
+  std::string text; // MHA header, up to the pixels
+  // Lines of the header before the first frame line, the lines of every
+  // frame without their "Seq_FrameNNNN" prefix, then the lines after
+  std::vector<std::string> before;
+  std::vector<std::vector<std::string> > frameLines;
+  std::vector<std::string> after;
+};
+
+bool openInput(const std::string& path, Input& input)
+{
+  input.path = path;
+  if(USnavNativeSequence::isNativeFile(path))
+    return USnavNativeSequence::read(path, input.source, input.transforms, &input.text);
+
+  // The header is parsed the way the module loads it
+  USnavSequenceLoader loader;
+  loader.start(path);
+  loader.wait();
+  if(loader.getState() != USnavSequenceLoader::Done || !loader.getFrameSource(input.source))
+    return false;
+  input.transforms.reset(input.source.frames);
+  loader.mergeTransforms(input.transforms);
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file)
+    return false;
+  vtkTypeInt64 fileSize = usnavFileSize(file);
+  input.text.assign((size_t)input.source.dataOffset, '\0');
+  bool ok = fread(&input.text[0], 1, input.text.size(), file) == input.text.size();
+  fclose(file);
+  // Only 8 bit pixels with nothing after them can be copied as frames
+  return ok && input.text.find("ElementType = MET_UCHAR") != std::string::npos
+            && fileSize == input.source.dataOffset + (vtkTypeInt64)input.source.getFrameSize()*input.source.frames;
+}
+
+// Frame number of a "Seq_FrameNNNN_..." line and where its suffix starts,
+// -1 for other lines
+int frameOfLine(const std::string& line, size_t& suffix)
+{
+  if(line.compare(0, 9, "Seq_Frame") != 0)
+    return -1;
+  size_t end = 9;
+  while(end < line.size() && line[end] >= '0' && line[end] <= '9')
+    end++;
+  if(end == 9 || end >= line.size() || line[end] != '_')
+    return -1;
+  suffix = end;
+  return atoi(line.c_str() + 9);
+}
+
+void splitHeader(Input& input)
+{
+  input.before.clear();
+  input.after.clear();
+  input.frameLines.assign(input.source.frames, std::vector<std::string>());
+  bool framesSeen = false;
+  size_t begin = 0;
+  while(begin < input.text.size())
+  {
+    size_t end = input.text.find('\n', begin);
+    end = end == std::string::npos ? input.text.size() : end + 1;
+    std::string line = input.text.substr(begin, end - begin);
+    begin = end;
+    size_t suffix = 0;
+    int frame = frameOfLine(line, suffix);
+    if(frame >= 0)
+    {
+      framesSeen = true;
+      // Lines of frames past DimSize describe nothing
+      if(frame < input.source.frames)
+        input.frameLines[frame].push_back(line.substr(suffix));
+    }
+    else
+      (framesSeen ? input.after : input.before).push_back(line);
+  }
+}
+
+bool writeAll(FILE* file, const void* data, size_t size)
+{
+  return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+// Copies `length` bytes at `inOffset` of `in` to `outOffset` of `out`;
+// `out` must hold no buffered data. On Linux the bytes stay in the kernel:
+// copy_file_range() lets the file system share or copy the extents
+// itself, sendfile() works between any two files; when both are refused
+// (old kernels, some file systems) the copy goes through a buffer.
+bool copyRange(FILE* in, vtkTypeInt64 inOffset, FILE* out, vtkTypeInt64 outOffset, vtkTypeInt64 length)
+{
+  #ifdef __linux__
+  int inFd = fileno(in);
+  int outFd = fileno(out);
+  #ifdef SYS_copy_file_range
+  while(length > 0)
+  {
+    vtkTypeInt64 inPosition = inOffset;
+    vtkTypeInt64 outPosition = outOffset;
+    long copied = syscall(SYS_copy_file_range, inFd, &inPosition, outFd, &outPosition,
+                          (size_t)std::min(length, kernelCopyChunk), 0u);
+    if(copied <= 0)
+      break;
+    inOffset += copied;
+    outOffset += copied;
+    length -= copied;
+  }
+  #endif
+  if(length > 0 && lseek(outFd, (off_t)outOffset, SEEK_SET) == (off_t)outOffset)
+    while(length > 0)
+    {
+      off_t inPosition = (off_t)inOffset;
+      ssize_t copied = sendfile(outFd, inFd, &inPosition, (size_t)std::min(length, kernelCopyChunk));
+      if(copied <= 0)
+        break;
+      inOffset += copied;
+      outOffset += copied;
+      length -= copied;
+    }
+  if(length == 0)
+    return true;
+  #endif
+  std::vector<unsigned char> buffer((size_t)std::min(length, (vtkTypeInt64)bufferedCopyChunk));
+  if(usnavSeek(in, inOffset) != 0 || usnavSeek(out, outOffset) != 0)
+    return false;
+  while(length > 0)
+  {
+    size_t n = (size_t)std::min(length, (vtkTypeInt64)buffer.size());
+    if(fread(&buffer[0], 1, n, in) != n || !writeAll(out, &buffer[0], n))
+      return false;
+    length -= (vtkTypeInt64)n;
+  }
+  return fflush(out) == 0;
+}
+
+bool writeInputs(std::vector<Input>& inputs, const USnavSequenceEditor::FrameList& frames,
+                 const std::string& outputPath)
+{
+  if(inputs.empty() || frames.empty())
+    return false;
+  for(size_t i=0; i<inputs.size(); i++)
+    if(inputs[i].path == outputPath || inputs[i].source.width != inputs[0].source.width
+       || inputs[i].source.height != inputs[0].source.height)
+      return false;
+  for(size_t f=0; f<frames.size(); f++)
+    if(frames[f].first < 0 || frames[f].first >= (int)inputs.size()
+       || frames[f].second < 0 || frames[f].second >= inputs[frames[f].first].source.frames)
+      return false;
+  for(size_t i=0; i<inputs.size(); i++)
+    splitHeader(inputs[i]);
+
+  // Header: the common lines of the first input, then the frames
+  const Input& first = inputs[0];
+  std::string header;
+  char text[64];
+  for(size_t l=0; l<first.before.size(); l++)
+    if(first.before[l].compare(0, 9, "DimSize =") == 0)
+    {
+      sprintf(text, "DimSize = %d %d %d\n", first.source.width, first.source.height, (int)frames.size());
+      header += text;
+    }
+    else
+      header += first.before[l];
+  for(size_t f=0; f<frames.size(); f++)
+  {
+    const std::vector<std::string>& lines = inputs[frames[f].first].frameLines[frames[f].second];
+    sprintf(text, "Seq_Frame%04d", (int)f);
+    for(size_t l=0; l<lines.size(); l++)
+      header += text + lines[l];
+  }
+  for(size_t l=0; l<first.after.size(); l++)
+    header += first.after[l];
+
+  FILE* outfile = fopen(outputPath.c_str(), "wb");
+  if(!outfile)
+    return false;
+  bool ok = writeAll(outfile, header.c_str(), header.size()) && fflush(outfile) == 0;
+
+  // Pixels: runs of consecutive frames of an MHA input in one copy
+  std::vector<FILE*> files(inputs.size(), (FILE*)NULL);
+  std::vector<USnavFrameReader*> readers(inputs.size(), (USnavFrameReader*)NULL);
+  std::vector<unsigned char> frame(first.source.getFrameSize());
+  vtkTypeInt64 frameSize = (vtkTypeInt64)first.source.getFrameSize();
+  vtkTypeInt64 position = (vtkTypeInt64)header.size();
+  size_t f = 0;
+  while(ok && f < frames.size())
+  {
+    int input = frames[f].first;
+    const USnavFrameSource& source = inputs[input].source;
+    if(source.format == USnavFrameSource::CompressedBlocks)
+    {
+      if(!readers[input])
+        readers[input] = new USnavFrameReader(source);
+      ok = readers[input]->readFrame(frames[f].second, &frame[0]) && usnavSeek(outfile, position) == 0
+        && writeAll(outfile, &frame[0], frame.size()) && fflush(outfile) == 0;
+      position += frameSize;
+      f++;
+      continue;
+    }
+    size_t run = 1;
+    while(f + run < frames.size() && frames[f+run].first == input
+          && frames[f+run].second == frames[f].second + (int)run)
+      run++;
+    if(!files[input])
+      files[input] = fopen(source.path.c_str(), "rb");
+    vtkTypeInt64 length = frameSize*(vtkTypeInt64)run;
+    ok = files[input] && copyRange(files[input], source.dataOffset + frameSize*frames[f].second, outfile, position, length);
+    position += length;
+    f += run;
+  }
+  for(size_t i=0; i<inputs.size(); i++)
+  {
+    if(files[i])
+      fclose(files[i]);
+    delete readers[i];
+  }
+  ok = fclose(outfile) == 0 && ok;
+  if(!ok)
+    remove(outputPath.c_str());
+  return ok;
+}
+}
+
+//----------------------------------------------------------------------------
+bool USnavSequenceEditor::write(const std::vector<std::string>& paths, const FrameList& frames,
+                                const std::string& outputPath)
+{
+  std::vector<Input> inputs(paths.size());
+  for(size_t i=0; i<paths.size(); i++)
+    if(!openInput(paths[i], inputs[i]))
+      return false;
+  return writeInputs(inputs, frames, outputPath);
+}
+
+//----------------------------------------------------------------------------
+bool USnavSequenceEditor::trim(const std::string& path, int first, int last, const std::string& outputPath)
+{
+  std::vector<Input> inputs(1);
+  if(!openInput(path, inputs[0]))
+    return false;
+  first = std::max(first, 0);
+  last = std::min(last, inputs[0].source.frames - 1);
+  FrameList frames;
+  for(int i=first; i<=last; i++)
+    frames.push_back(std::pair<int,int>(0, i));
+  return writeInputs(inputs, frames, outputPath);
+}
+
+//----------------------------------------------------------------------------
+bool USnavSequenceEditor::extractFrames(const std::string& path, const std::vector<int>& selected,
+                                        const std::string& outputPath)
+{
+  FrameList frames;
+  for(size_t i=0; i<selected.size(); i++)
+    frames.push_back(std::pair<int,int>(0, selected[i]));
+  return write(std::vector<std::string>(1, path), frames, outputPath);
+}
+
+//----------------------------------------------------------------------------
+bool USnavSequenceEditor::keepValidFrames(const std::string& path, const std::string& transformName,
+                                          const std::string& outputPath)
+{
+  std::vector<Input> inputs(1);
+  if(!openInput(path, inputs[0]))
+    return false;
+  const USnavTransformStore& transforms = inputs[0].transforms;
+  int id = transforms.findName(transformName);
+  if(id < 0)
+    return false;
+  FrameList frames;
+  for(int i=0; i<transforms.getNumberOfFrames(); i++)
+    if(transforms.hasMatrix(id, i) && transforms.isValid(id, i))
+      frames.push_back(std::pair<int,int>(0, i));
+  return writeInputs(inputs, frames, outputPath);
+}
+
+//----------------------------------------------------------------------------
+bool USnavSequenceEditor::concatenate(const std::vector<std::string>& paths, const std::string& outputPath)
+{
+  std::vector<Input> inputs(paths.size());
+  FrameList frames;
+  for(size_t i=0; i<paths.size(); i++)
+  {
+    if(!openInput(paths[i], inputs[i]))
+      return false;
+    for(int f=0; f<inputs[i].source.frames; f++)
+      frames.push_back(std::pair<int,int>((int)i, f));
+  }
+  return writeInputs(inputs, frames, outputPath);
+}
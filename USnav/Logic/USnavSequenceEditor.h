@@ -0,0 +1,59 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavSequenceEditor - trims, subsets and concatenates sequences
+// .SECTION Description
+// Writes a new MHA sequence made of frames of existing ones. Only the
+// header is rebuilt: the common lines of the first input with a new
+// DimSize, then the Seq_Frame lines of every kept frame renumbered in
+// output order. Runs of consecutive frames of an MHA input are copied
+// inside the kernel on Linux (copy_file_range(), then sendfile()), with a
+// buffered copy elsewhere; frames of a native .usn input are decoded.
+// The inputs are never modified, and a failed edit leaves no output.
+
+#ifndef __USnavSequenceEditor_h
+#define __USnavSequenceEditor_h
+
+// STD includes
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavSequenceEditor
+{
+public:
+  /// (input, frame) pairs, in output order
+  typedef std::vector<std::pair<int,int> > FrameList;
+
+  /// Writes `frames` of `inputs` to `outputPath`. Inputs must share the
+  /// image size; none of them may be the output.
+  static bool write(const std::vector<std::string>& inputs, const FrameList& frames, const std::string& outputPath);
+
+  /// Frames [first, last] of `path`.
+  static bool trim(const std::string& path, int first, int last, const std::string& outputPath);
+  /// The listed frames of `path`, in that order.
+  static bool extractFrames(const std::string& path, const std::vector<int>& frames, const std::string& outputPath);
+  /// Frames of `path` whose `transformName` is present with an OK status.
+  static bool keepValidFrames(const std::string& path, const std::string& transformName,
+                              const std::string& outputPath);
+  /// Every frame of `paths`, one sequence after the other.
+  static bool concatenate(const std::vector<std::string>& paths, const std::string& outputPath);
+};
+
+#endif
@@ -0,0 +1,269 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavSequenceLoader.h"
+#include "USnavFileIO.h"
+#include "USnavNativeSequence.h"
+
+// STD includes
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+// Lines parsed per lock of the transform store
+const int loaderBatchLines = 1024;
+}
+
+//----------------------------------------------------------------------------
+USnavSequenceLoader::USnavSequenceLoader()
+{
+  this->state = Idle;
+  this->cancelled = false;
+  this->hasImageInfo = false;
+  this->bytesRead = 0;
+  this->parsedFrames = 0;
+  this->mergedFrames = 0;
+  this->threadId = -1;
+  this->threader = vtkSmartPointer<vtkMultiThreader>::New();
+}
+
+//----------------------------------------------------------------------------
+USnavSequenceLoader::~USnavSequenceLoader()
+{
+  this->cancel();
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceLoader::start(const std::string& filename)
+{
+  this->cancel();
+  this->path = filename;
+  this->state = Loading;
+  this->cancelled = false;
+  this->hasImageInfo = false;
+  this->source = USnavFrameSource();
+  this->source.path = filename;
+  this->bytesRead = 0;
+  this->parsed.reset(0);
+  this->parsedFrames = 0;
+  this->mergedFrames = 0;
+  this->threadId = this->threader->SpawnThread(&USnavSequenceLoader::run, this);
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceLoader::cancel()
+{
+  this->lock.Lock();
+  this->cancelled = true;
+  this->lock.Unlock();
+  this->wait();
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceLoader::wait()
+{
+  if(this->threadId >= 0)
+  {
+    this->threader->TerminateThread(this->threadId);
+    this->threadId = -1;
+  }
+}
+
+//----------------------------------------------------------------------------
+USnavSequenceLoader::State USnavSequenceLoader::getState()
+{
+  this->lock.Lock();
+  State s = this->state;
+  this->lock.Unlock();
+  return s;
+}
+
+//----------------------------------------------------------------------------
+double USnavSequenceLoader::getProgress()
+{
+  this->lock.Lock();
+  double progress = 0.0;
+  if(this->state == Done)
+    progress = 1.0;
+  else if(this->source.dataOffset > 0)
+    progress = (double)this->bytesRead / this->source.dataOffset;
+  this->lock.Unlock();
+  return progress < 1.0 ? progress : 1.0;
+}
+
+//----------------------------------------------------------------------------
+bool USnavSequenceLoader::getFrameSource(USnavFrameSource& s)
+{
+  this->lock.Lock();
+  bool known = this->hasImageInfo;
+  if(known)
+    s = this->source;
+  this->lock.Unlock();
+  return known;
+}
+
+//----------------------------------------------------------------------------
+int USnavSequenceLoader::mergeTransforms(USnavTransformStore& store)
+{
+  this->lock.Lock();
+  if(this->parsedFrames > this->mergedFrames)
+  {
+    store.mergeFrames(this->parsed, this->mergedFrames, this->parsedFrames);
+    this->mergedFrames = this->parsedFrames;
+  }
+  int merged = this->mergedFrames;
+  this->lock.Unlock();
+  return merged;
+}
+
+//----------------------------------------------------------------------------
+bool USnavSequenceLoader::isCancelled()
+{
+  this->lock.Lock();
+  bool c = this->cancelled;
+  this->lock.Unlock();
+  return c;
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceLoader::finish(State s)
+{
+  this->lock.Lock();
+  this->state = s;
+  if(s == Done)
+    this->parsedFrames = this->source.frames;
+  this->lock.Unlock();
+}
+
+//----------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE USnavSequenceLoader::run(void* arg)
+{
+  vtkMultiThreader::ThreadInfo* info = static_cast<vtkMultiThreader::ThreadInfo*>(arg);
+  USnavSequenceLoader* self = static_cast<USnavSequenceLoader*>(info->UserData);
+  self->load();
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceLoader::load()
+{
+  if(USnavNativeSequence::isNativeFile(this->path))
+  {
+    this->loadNative();
+    return;
+  }
+  FILE* infile = fopen(this->path.c_str(), "rb");
+  if(!infile)
+  {
+    this->finish(Failed);
+    return;
+  }
+  vtkTypeInt64 fileSize = usnavFileSize(infile);
+
+  std::vector<std::string> batch(loaderBatchLines);
+  char buffer[4096];
+  bool endOfHeader = false;
+  while(!endOfHeader)
+  {
+    if(this->isCancelled())
+    {
+      fclose(infile);
+      this->finish(Cancelled);
+      return;
+    }
+
+    // Read a batch without holding the lock
+    int count = 0;
+    while(count < loaderBatchLines && fgets(buffer, sizeof(buffer), infile))
+    {
+      if(strncmp(buffer, "ElementDataFile = LOCAL", 23) == 0)
+      {
+        endOfHeader = true;
+        break;
+      }
+      if(strncmp(buffer, "DimSize =", 9) == 0)
+      {
+        int w = 0, h = 0, n = 0;
+        if(sscanf(buffer, "DimSize = %d %d %d", &w, &h, &n) == 3 && w > 0 && h > 0 && n > 0)
+        {
+          // Pixels end the file; publish now, checked at the end of the header
+          vtkTypeInt64 offset = fileSize - (vtkTypeInt64)w*h*n;
+          this->lock.Lock();
+          this->source.width = w;
+          this->source.height = h;
+          this->source.frames = n;
+          this->source.dataOffset = offset;
+          this->hasImageInfo = offset > 0;
+          this->parsed.reset(n);
+          this->lock.Unlock();
+        }
+        continue;
+      }
+      batch[count++].assign(buffer);
+    }
+    if(count == 0 && !endOfHeader)
+      break; // End of file without ElementDataFile
+
+    vtkTypeInt64 position = usnavTell(infile);
+    this->lock.Lock();
+    int lastFrame = -1;
+    for(int i=0; i<count; i++)
+    {
+      int frame = this->parsed.parseHeaderLine(batch[i].c_str());
+      if(frame > lastFrame)
+        lastFrame = frame;
+    }
+    // Frames are written in order: everything before the last one seen is
+    // complete
+    if(lastFrame > this->parsedFrames)
+      this->parsedFrames = lastFrame;
+    this->bytesRead = position;
+    if(endOfHeader)
+    {
+      this->source.dataOffset = position;
+      this->hasImageInfo = this->source.frames > 0
+                        && position + (vtkTypeInt64)this->source.getFrameSize()*this->source.frames <= fileSize;
+    }
+    bool known = this->hasImageInfo;
+    this->lock.Unlock();
+    if(endOfHeader && !known)
+      break;
+  }
+  fclose(infile);
+  this->finish(endOfHeader && this->hasImageInfo ? Done : Failed);
+}
+
+//----------------------------------------------------------------------------
+void USnavSequenceLoader::loadNative()
+{
+  // Tables are small: read them outside the lock, then publish everything
+  USnavFrameSource native;
+  USnavTransformStore transforms;
+  if(!USnavNativeSequence::read(this->path, native, transforms))
+  {
+    this->finish(Failed);
+    return;
+  }
+  this->lock.Lock();
+  this->source = native;
+  this->parsed = transforms;
+  this->hasImageInfo = true;
+  this->lock.Unlock();
+  this->finish(Done);
+}
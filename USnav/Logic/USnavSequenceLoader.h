@@ -0,0 +1,103 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavSequenceLoader - reads the header of a .mha sequence in the background
+// .SECTION Description
+// The image information is published as soon as the DimSize line is read,
+// with the data offset taken as the file size minus the pixel data size
+// (ElementDataFile = LOCAL puts the pixels at the end of the file), so the
+// first frame can be shown right away. The per-frame transforms are then
+// parsed in batches; the owner pulls the frames parsed so far with
+// mergeTransforms() from its own thread. The offset is checked against the
+// ElementDataFile line at the end of the header.
+//
+// Native .usn files (see USnavNativeSequence) carry their frame table and
+// packed transforms, and load in one step on the same thread.
+
+#ifndef __USnavSequenceLoader_h
+#define __USnavSequenceLoader_h
+
+#include "USnavFrameReader.h"
+#include "USnavTransformStore.h"
+
+// VTK includes
+#include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
+#include <vtkSmartPointer.h>
+
+// STD includes
+#include <string>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavSequenceLoader
+{
+public:
+  enum State
+  {
+    Idle,
+    Loading,
+    Done,
+    Failed,
+    Cancelled
+  };
+
+  USnavSequenceLoader();
+  ~USnavSequenceLoader();
+
+  /// Starts reading the header of `path`; a running load is cancelled.
+  void start(const std::string& path);
+  void cancel();
+  /// Blocks until the load is over.
+  void wait();
+
+  State getState();
+  /// Fraction of the header read, in [0,1].
+  double getProgress();
+  /// Where the frames are; false until the DimSize line has been read.
+  bool getFrameSource(USnavFrameSource& source);
+  /// Copies the transforms of the frames parsed since the last call into
+  /// `store`, which must be sized for the sequence. Returns the number of
+  /// frames merged so far.
+  int mergeTransforms(USnavTransformStore& store);
+
+private:
+  USnavSequenceLoader(const USnavSequenceLoader&); // Not implemented
+  void operator=(const USnavSequenceLoader&);      // Not implemented
+
+  static VTK_THREAD_RETURN_TYPE run(void* arg);
+  void load();
+  void loadNative();
+  void finish(State state);
+  bool isCancelled();
+
+  std::string path;
+  State state;
+  bool cancelled;
+  bool hasImageInfo;
+  USnavFrameSource source;
+  vtkTypeInt64 bytesRead;
+  USnavTransformStore parsed;
+  int parsedFrames; // frames [0,parsedFrames) are complete
+  int mergedFrames;
+
+  vtkSimpleMutexLock lock;
+  vtkSmartPointer<vtkMultiThreader> threader;
+  int threadId;
+};
+
+#endif
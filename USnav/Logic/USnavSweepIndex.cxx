@@ -0,0 +1,197 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavSweepIndex.h"
+#include "USnavSequenceAnalysis.h"
+
+// STD includes
+#include <algorithm>
+
+namespace
+{
+// Candidates are scored a block at a time
+const int candidateBlock = 256;
+}
+
+//----------------------------------------------------------------------------
+USnavSweepIndex::USnavSweepIndex()
+{
+  this->searchMargin = 20.0;
+  this->lastEvaluated = 0;
+  this->lastSearched = 0;
+}
+
+//----------------------------------------------------------------------------
+USnavSweepIndex::~USnavSweepIndex()
+{
+  this->clear();
+}
+
+//----------------------------------------------------------------------------
+void USnavSweepIndex::clear()
+{
+  for(size_t g=0; g<this->groups.size(); g++)
+    delete this->groups[g];
+  this->groups.clear();
+  this->groupBegin.clear();
+  this->frameItems.clear();
+  this->frames.clear();
+  this->bounds.clear();
+}
+
+//----------------------------------------------------------------------------
+void USnavSweepIndex::build(const double* imageToTracker, const std::vector<int>& indexedFrames, int width,
+                            int height, const USnavSequenceAnalysis& analysis)
+{
+  this->clear();
+  int sweeps = analysis.getNumberOfSweeps();
+  std::vector<std::vector<int> > groupFrames(sweeps + 1);
+  for(size_t i=0; i<indexedFrames.size(); i++)
+  {
+    int sweep = analysis.getSweepOf(indexedFrames[i]);
+    groupFrames[sweep >= 0 ? sweep : sweeps].push_back(indexedFrames[i]);
+  }
+  std::vector<int> itemFrames;
+  itemFrames.reserve(indexedFrames.size());
+  this->frameItems.assign(indexedFrames.empty() ? 0 : indexedFrames.back() + 1, -1);
+  for(int g=0; g<=sweeps; g++)
+  {
+    USnavFrameMatcher* matcher = new USnavFrameMatcher;
+    matcher->build(imageToTracker, groupFrames[g]);
+    this->groups.push_back(matcher);
+    this->groupBegin.push_back((int)itemFrames.size());
+    for(size_t i=0; i<groupFrames[g].size(); i++)
+    {
+      this->frameItems[groupFrames[g][i]] = (int)itemFrames.size();
+      itemFrames.push_back(groupFrames[g][i]);
+    }
+  }
+  this->groupBegin.push_back((int)itemFrames.size());
+  this->frames.build(imageToTracker, itemFrames, width, height);
+  for(int s=0; s<sweeps; s++)
+    this->bounds.insert(this->bounds.end(), analysis.getSweepBounds(s), analysis.getSweepBounds(s) + 6);
+}
+
+//----------------------------------------------------------------------------
+int USnavSweepIndex::getNumberOfFrames() const
+{
+  return this->frames.getNumberOfFrames();
+}
+
+//----------------------------------------------------------------------------
+bool USnavSweepIndex::isNear(int sweep, const double tip[3]) const
+{
+  const double* b = &this->bounds[6*(size_t)sweep];
+  double m = this->searchMargin;
+  return this->groups[sweep]->getNumberOfFrames() > 0
+      && tip[0] >= b[0] - m && tip[0] <= b[1] + m
+      && tip[1] >= b[2] - m && tip[1] <= b[3] + m
+      && tip[2] >= b[4] - m && tip[2] <= b[5] + m;
+}
+
+//----------------------------------------------------------------------------
+bool USnavSweepIndex::searchesEverySweep(const double tip[3]) const
+{
+  int sweeps = (int)this->groups.size() - 1;
+  for(int s=0; this->searchMargin > 0 && s<sweeps; s++)
+    if(this->isNear(s, tip))
+      return false;
+  return true;
+}
+
+//----------------------------------------------------------------------------
+bool USnavSweepIndex::isSearched(int group, const double tip[3], bool everySweep) const
+{
+  if(this->groups[group]->getNumberOfFrames() == 0)
+    return false;
+  return everySweep || group == (int)this->groups.size() - 1 || this->isNear(group, tip);
+}
+
+//----------------------------------------------------------------------------
+int USnavSweepIndex::getGroupOf(int item) const
+{
+  return (int)(std::upper_bound(this->groupBegin.begin(), this->groupBegin.end(), item) - this->groupBegin.begin()) - 1;
+}
+
+//----------------------------------------------------------------------------
+void USnavSweepIndex::findBest(const USnavMatchQuery& query, USnavMatchFrames::MatchFunction metric,
+                               const std::vector<int>* candidates, int count, MatchList& matches) const
+{
+  matches.clear();
+  if(!metric || count <= 0)
+    return;
+  bool everySweep = this->searchesEverySweep(query.tip);
+  if(!candidates)
+  {
+    for(int g=0; g<(int)this->groups.size(); g++)
+      if(this->isSearched(g, query.tip, everySweep))
+        metric(this->frames, query, NULL, this->groupBegin[g], this->groupBegin[g+1], count, matches);
+  }
+  else
+  {
+    // One pass over the candidates, whatever sweep they are in
+    int block[candidateBlock];
+    int n = 0;
+    for(size_t c=0; c<candidates->size(); c++)
+    {
+      int frame = (*candidates)[c];
+      if(frame < 0 || frame >= (int)this->frameItems.size() || this->frameItems[frame] < 0)
+        continue;
+      int item = this->frameItems[frame];
+      if(!this->isSearched(this->getGroupOf(item), query.tip, everySweep))
+        continue;
+      block[n++] = item;
+      if(n == candidateBlock)
+      {
+        metric(this->frames, query, block, 0, n, count, matches);
+        n = 0;
+      }
+    }
+    metric(this->frames, query, block, 0, n, count, matches);
+  }
+  std::sort_heap(matches.begin(), matches.end());
+}
+
+//----------------------------------------------------------------------------
+void USnavSweepIndex::findNearestIncremental(const double tip[3], int count, MatchList& matches)
+{
+  matches.clear();
+  this->lastEvaluated = 0;
+  this->lastSearched = 0;
+  if(count <= 0)
+    return;
+  bool everySweep = this->searchesEverySweep(tip);
+  for(int g=0; g<(int)this->groups.size(); g++)
+  {
+    if(!this->isSearched(g, tip, everySweep))
+      continue;
+    USnavFrameMatcher* matcher = this->groups[g];
+    matcher->findNearestIncremental(tip, count, this->found);
+    this->lastEvaluated += matcher->getLastEvaluatedFrames();
+    this->lastSearched++;
+    for(size_t i=0; i<this->found.size(); i++)
+      usnavPushMatch(matches, count, this->found[i].first, this->found[i].second);
+  }
+  std::sort_heap(matches.begin(), matches.end());
+}
+
+//----------------------------------------------------------------------------
+void USnavSweepIndex::resetIncremental()
+{
+  for(size_t g=0; g<this->groups.size(); g++)
+    this->groups[g]->resetIncremental();
+}
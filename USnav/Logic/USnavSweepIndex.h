@@ -0,0 +1,103 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavSweepIndex - matching restricted to the sweeps around the stylus
+// .SECTION Description
+// Frames are indexed by the sweep USnavSequenceAnalysis put them in. A
+// query only searches the sweeps whose image bounds, grown by the search
+// margin, contain the stylus tip: frames of a sweep elsewhere can lie on a
+// plane through the tip without imaging anything near it. When no sweep
+// contains the tip, or the margin is 0, every sweep is searched. Frames
+// without a sweep are indexed together and always searched.
+//
+// Every metric of USnavMatchFrames scores the frames so selected. Items
+// are numbered group after group, so a sweep is a range of items, and one
+// table maps frames to them. Each sweep also has a USnavFrameMatcher to
+// warm start plane distance queries.
+
+#ifndef __USnavSweepIndex_h
+#define __USnavSweepIndex_h
+
+#include "USnavFrameMatcher.h"
+#include "USnavMatchPolicies.h"
+
+// STD includes
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class USnavSequenceAnalysis;
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavSweepIndex
+{
+public:
+  typedef USnavFrameMatcher::MatchList MatchList;
+
+  USnavSweepIndex();
+  ~USnavSweepIndex();
+
+  /// Indexes `frames` (sorted), width x height images, by the sweeps of
+  /// `analysis`.
+  void build(const double* imageToTracker, const std::vector<int>& frames, int width, int height,
+             const USnavSequenceAnalysis& analysis);
+  void clear();
+  int getNumberOfFrames() const;
+
+  /// mm around the bounds of a sweep where it is searched, 0 for all sweeps
+  void setSearchMargin(double mm) { this->searchMargin = mm; }
+  double getSearchMargin() const { return this->searchMargin; }
+
+  /// Fills a query from a 4x4 row-major stylus pose.
+  void makeQuery(const double pose[16], USnavMatchQuery& query) const { this->frames.makeQuery(pose, query); }
+  /// The `count` best frames under `metric` of the sweeps around the tip of
+  /// the query, as (score, frame), best first. `candidates` (frame numbers)
+  /// restricts the search when not NULL.
+  void findBest(const USnavMatchQuery& query, USnavMatchFrames::MatchFunction metric,
+                const std::vector<int>* candidates, int count, MatchList& matches) const;
+  /// Same as findBest() with the plane distance metric, each sweep warm
+  /// started from its last query (see USnavFrameMatcher).
+  void findNearestIncremental(const double tip[3], int count, MatchList& matches);
+  void resetIncremental();
+
+  /// Frames evaluated and sweeps searched by the last incremental query
+  int getLastEvaluatedFrames() const { return this->lastEvaluated; }
+  int getLastSearchedSweeps() const { return this->lastSearched; }
+
+private:
+  USnavSweepIndex(const USnavSweepIndex&); // Not implemented
+  void operator=(const USnavSweepIndex&);  // Not implemented
+
+  // A sweep is searched when near the tip, or when no sweep is; frames
+  // without a sweep always are
+  bool isNear(int sweep, const double tip[3]) const;
+  bool searchesEverySweep(const double tip[3]) const;
+  bool isSearched(int group, const double tip[3], bool everySweep) const;
+  int getGroupOf(int item) const;
+
+  // One group per sweep, then one for frames without a sweep
+  std::vector<USnavFrameMatcher*> groups;
+  std::vector<int> groupBegin; // first item of every group, then the number of items
+  std::vector<int> frameItems; // frame -> item, -1 if not indexed
+  USnavMatchFrames frames;     // by item
+  MatchList found;             // matches of one sweep, incremental queries
+  std::vector<double> bounds; // 6 per sweep
+  double searchMargin;
+  int lastEvaluated;
+  int lastSearched;
+};
+
+#endif
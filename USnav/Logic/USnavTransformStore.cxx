@@ -0,0 +1,274 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavTransformStore.h"
+
+// STD includes
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+template<class T>
+void append(std::vector<unsigned char>& bytes, const T* values, size_t count)
+{
+  if(count == 0)
+    return;
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(values);
+  bytes.insert(bytes.end(), p, p + count*sizeof(T));
+}
+
+template<class T>
+bool extract(const unsigned char*& p, const unsigned char* end, T* values, size_t count)
+{
+  if((size_t)(end - p) < count*sizeof(T))
+    return false;
+  if(count > 0)
+    memcpy(values, p, count*sizeof(T));
+  p += count*sizeof(T);
+  return true;
+}
+}
+
+//----------------------------------------------------------------------------
+USnavTransformStore::USnavTransformStore()
+{
+  this->reset(0);
+}
+
+//----------------------------------------------------------------------------
+void USnavTransformStore::reset(int frames)
+{
+  this->numberOfFrames = frames > 0 ? frames : 0;
+  this->names.clear();
+  this->ids.clear();
+  this->columns.clear();
+  this->present.assign(this->numberOfFrames, 0u);
+  this->valid.assign(this->numberOfFrames, 0u);
+  this->hasStatus = 0u;
+  this->timestamps.assign(this->numberOfFrames, 0.0);
+  this->timestamped.assign(this->numberOfFrames, 0);
+}
+
+//----------------------------------------------------------------------------
+int USnavTransformStore::internName(const std::string& name)
+{
+  std::map<std::string, int>::const_iterator it = this->ids.find(name);
+  if(it != this->ids.end())
+    return it->second;
+  if(this->names.size() >= MaxTransforms)
+    return -1;
+  int id = (int)this->names.size();
+  this->names.push_back(name);
+  this->ids[name] = id;
+  this->columns.push_back(std::vector<float>());
+  this->columns.back().assign(12*(size_t)this->numberOfFrames, 0.f);
+  return id;
+}
+
+//----------------------------------------------------------------------------
+int USnavTransformStore::findName(const std::string& name) const
+{
+  std::map<std::string, int>::const_iterator it = this->ids.find(name);
+  return it == this->ids.end() ? -1 : it->second;
+}
+
+//----------------------------------------------------------------------------
+void USnavTransformStore::setMatrix(int id, int frame, const float matrix[12])
+{
+  memcpy(&this->columns[id][12*(size_t)frame], matrix, 12*sizeof(float));
+  this->present[frame] |= 1u << id;
+}
+
+//----------------------------------------------------------------------------
+bool USnavTransformStore::isValid(int id, int frame) const
+{
+  if(!((this->hasStatus >> id) & 1u))
+    return this->hasMatrix(id, frame);
+  return (this->valid[frame] >> id) & 1u;
+}
+
+//----------------------------------------------------------------------------
+void USnavTransformStore::setValid(int id, int frame, bool isValid)
+{
+  this->hasStatus |= 1u << id;
+  if(isValid)
+    this->valid[frame] |= 1u << id;
+  else
+    this->valid[frame] &= ~(1u << id);
+}
+
+//----------------------------------------------------------------------------
+void USnavTransformStore::setTimestamp(int frame, double seconds)
+{
+  this->timestamps[frame] = seconds;
+  this->timestamped[frame] = 1;
+}
+
+//----------------------------------------------------------------------------
+int USnavTransformStore::parseHeaderLine(const char* line)
+{
+  if( strncmp( line, "Seq_Frame", 9 ) != 0 )
+    return -1;
+  char* end = NULL;
+  long frame = strtol( line + 9, &end, 10 );
+  if( end == line + 9 || *end != '_' || frame < 0 || frame >= this->numberOfFrames )
+    return -1;
+  const char* name = end + 1;
+  const char* equal = strchr( name, '=' );
+  if( equal && strncmp( name, "Timestamp", 9 ) == 0 && ( name[9] == ' ' || name[9] == '=' ) )
+  {
+    char* next = NULL;
+    double seconds = strtod( equal + 1, &next );
+    if( next == equal + 1 )
+      return -1;
+    this->setTimestamp( frame, seconds );
+    return (int)frame;
+  }
+  const char* suffix = strstr( name, "Transform" );
+  if( !equal || !suffix || suffix > equal )
+    return -1;
+  int id = this->internName( std::string(name, suffix-name) );
+  if( id < 0 )
+    return -1;
+
+  if( strncmp( suffix, "TransformStatus", 15 ) == 0 )
+  {
+    this->setValid( id, frame, strstr( equal, "OK" ) != NULL );
+    return (int)frame;
+  }
+  float matrix[12];
+  const char* pch = equal + 1;
+  for( int j =0; j < 12; j++ )
+  {
+    char* next = NULL;
+    matrix[j] = (float)strtod( pch, &next );
+    if( next == pch )
+      return -1;
+    pch = next;
+  }
+  this->setMatrix( id, frame, matrix );
+  return (int)frame;
+}
+
+//----------------------------------------------------------------------------
+void USnavTransformStore::mergeFrames(const USnavTransformStore& other, int begin, int end)
+{
+  if(other.numberOfFrames != this->numberOfFrames)
+    return;
+  if(begin < 0)
+    begin = 0;
+  if(end > this->numberOfFrames)
+    end = this->numberOfFrames;
+  for(int otherId=0; otherId<other.getNumberOfTransforms(); otherId++)
+  {
+    int id = this->internName(other.names[otherId]);
+    if(id < 0)
+      continue;
+    bool status = (other.hasStatus >> otherId) & 1u;
+    for(int frame=begin; frame<end; frame++)
+    {
+      if(other.hasMatrix(otherId, frame))
+        this->setMatrix(id, frame, other.getMatrix(otherId, frame));
+      if(status)
+        this->setValid(id, frame, (other.valid[frame] >> otherId) & 1u);
+    }
+  }
+  for(int frame=begin; frame<end; frame++)
+    if(other.hasTimestamp(frame))
+      this->setTimestamp(frame, other.getTimestamp(frame));
+}
+
+//----------------------------------------------------------------------------
+size_t USnavTransformStore::getMemorySize() const
+{
+  size_t bytes = (this->present.size() + this->valid.size()) * sizeof(vtkTypeUInt32)
+               + this->timestamps.size() * (sizeof(double) + 1);
+  for(size_t i=0; i<this->columns.size(); i++)
+    bytes += this->columns[i].size() * sizeof(float);
+  return bytes;
+}
+
+//----------------------------------------------------------------------------
+void USnavTransformStore::serialize(std::vector<unsigned char>& bytes) const
+{
+  vtkTypeInt32 counts[2] = { this->numberOfFrames, (vtkTypeInt32)this->names.size() };
+  append(bytes, counts, 2);
+  append(bytes, &this->hasStatus, 1);
+  for(size_t i=0; i<this->names.size(); i++)
+  {
+    vtkTypeInt32 length = (vtkTypeInt32)this->names[i].size();
+    append(bytes, &length, 1);
+    append(bytes, this->names[i].c_str(), this->names[i].size());
+    append(bytes, this->columns[i].empty() ? NULL : &this->columns[i][0], this->columns[i].size());
+  }
+  size_t frames = (size_t)this->numberOfFrames;
+  if(frames == 0)
+    return;
+  append(bytes, &this->present[0], frames);
+  append(bytes, &this->valid[0], frames);
+  append(bytes, &this->timestamped[0], frames);
+  append(bytes, &this->timestamps[0], frames);
+}
+
+//----------------------------------------------------------------------------
+bool USnavTransformStore::deserialize(const unsigned char* bytes, size_t size)
+{
+  const unsigned char* p = bytes;
+  const unsigned char* end = bytes + size;
+  vtkTypeInt32 counts[2];
+  vtkTypeUInt32 status = 0;
+  if(!extract(p, end, counts, 2) || counts[0] < 0 || counts[1] < 0 || counts[1] > MaxTransforms
+     || !extract(p, end, &status, 1))
+  {
+    this->reset(0);
+    return false;
+  }
+  // Every frame takes a matrix per transform, two masks and a timestamp:
+  // a frame count the bytes cannot hold is not allocated
+  size_t frameBytes = (size_t)counts[1]*12*sizeof(float) + 2*sizeof(vtkTypeUInt32) + sizeof(unsigned char)
+                    + sizeof(double);
+  if((size_t)counts[0] > (size_t)(end - p) / frameBytes)
+  {
+    this->reset(0);
+    return false;
+  }
+  this->reset(counts[0]);
+  size_t frames = (size_t)this->numberOfFrames;
+  bool ok = true;
+  for(int i=0; ok && i<counts[1]; i++)
+  {
+    vtkTypeInt32 length = 0;
+    ok = extract(p, end, &length, 1) && length >= 0 && (size_t)(end - p) >= (size_t)length;
+    if(!ok)
+      break;
+    std::string name(reinterpret_cast<const char*>(p), (size_t)length);
+    p += length;
+    int id = this->internName(name);
+    ok = id == i && extract(p, end, frames ? &this->columns[id][0] : NULL, 12*frames);
+  }
+  ok = ok && (frames == 0
+              || (extract(p, end, &this->present[0], frames) && extract(p, end, &this->valid[0], frames)
+                  && extract(p, end, &this->timestamped[0], frames) && extract(p, end, &this->timestamps[0], frames)));
+  if(!ok)
+  {
+    this->reset(0);
+    return false;
+  }
+  this->hasStatus = status;
+  return true;
+}
@@ -0,0 +1,104 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavTransformStore - every Seq_Frame*Transform of a sequence
+// .SECTION Description
+// Transform names (ProbeToTracker, StylusToTracker, ...) are interned to a
+// small integer id. Each id owns one contiguous column holding the 3x4
+// row-major matrix of every frame, and each frame owns two bit masks telling
+// which transforms it carries and which of them have an OK status.
+// Frame timestamps (Seq_FrameNNNN_Timestamp, in seconds) are kept alongside.
+
+#ifndef __USnavTransformStore_h
+#define __USnavTransformStore_h
+
+// VTK includes
+#include <vtkType.h>
+
+// STD includes
+#include <map>
+#include <string>
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavTransformStore
+{
+public:
+  /// One bit per transform in the per-frame masks
+  enum { MaxTransforms = 32 };
+
+  USnavTransformStore();
+
+  /// Drops every transform and sizes the store for `frames` frames.
+  void reset(int frames);
+  int getNumberOfFrames() const { return this->numberOfFrames; }
+
+  /// Returns the id of `name`, adding an empty column the first time.
+  /// Returns -1 once MaxTransforms names are in use.
+  int internName(const std::string& name);
+  /// Returns the id of `name` or -1 if the sequence does not have it.
+  int findName(const std::string& name) const;
+  int getNumberOfTransforms() const { return (int)this->names.size(); }
+  const std::string& getName(int id) const { return this->names[id]; }
+
+  /// 3x4 row-major matrix of transform `id` at `frame`.
+  const float* getMatrix(int id, int frame) const { return &this->columns[id][12*(size_t)frame]; }
+  void setMatrix(int id, int frame, const float matrix[12]);
+  bool hasMatrix(int id, int frame) const { return (this->present[frame] >> id) & 1u; }
+
+  /// Status as written in the file. Transforms that never carry a status
+  /// line are valid wherever they are present.
+  bool isValid(int id, int frame) const;
+  void setValid(int id, int frame, bool valid);
+
+  /// Acquisition time in seconds, when the frame has one.
+  bool hasTimestamp(int frame) const { return this->timestamped[frame] != 0; }
+  double getTimestamp(int frame) const { return this->timestamps[frame]; }
+  void setTimestamp(int frame, double seconds);
+
+  /// Stores a "Seq_FrameNNNN_<Name>Transform = ...", "...TransformStatus
+  /// = OK" or "Seq_FrameNNNN_Timestamp = ..." header line. Returns the
+  /// frame number, or -1 for other lines.
+  int parseHeaderLine(const char* line);
+
+  /// Copies frames [begin,end) of `other` (same number of frames),
+  /// interning its names here.
+  void mergeFrames(const USnavTransformStore& other, int begin, int end);
+
+  /// Bytes used by the columns and masks.
+  size_t getMemorySize() const;
+
+  /// Appends the whole store to `bytes`, in native byte order.
+  void serialize(std::vector<unsigned char>& bytes) const;
+  /// Replaces the store by one written by serialize(); false, and an empty
+  /// store, if `bytes` is not one.
+  bool deserialize(const unsigned char* bytes, size_t size);
+
+private:
+  int numberOfFrames;
+  std::vector<std::string> names;
+  std::map<std::string, int> ids;
+  std::vector<std::vector<float> > columns;
+  std::vector<vtkTypeUInt32> present;
+  std::vector<vtkTypeUInt32> valid;
+  vtkTypeUInt32 hasStatus;
+  std::vector<double> timestamps;
+  std::vector<unsigned char> timestamped;
+};
+
+#endif
@@ -0,0 +1,225 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "USnavVolumeSampler.h"
+#include "USnavGeometry.h"
+
+// VTK includes
+#include <vtkImageData.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+template<class T>
+void copyToFloat(const T* src, int components, size_t count, float* dst)
+{
+  for(size_t i=0; i<count; i++)
+    dst[i] = static_cast<float>(src[i*components]);
+}
+
+// Points transformed per block before the interpolation
+const int sampleBlockSize = 256;
+}
+
+//----------------------------------------------------------------------------
+USnavVolumeSampler::USnavVolumeSampler()
+{
+  this->clear();
+}
+
+//----------------------------------------------------------------------------
+void USnavVolumeSampler::clear()
+{
+  this->voxels.clear();
+  this->dimensions[0] = this->dimensions[1] = this->dimensions[2] = 0;
+  this->minimum = this->maximum = 0.0;
+  for(int k=0; k<16; k++)
+    this->rasToIJK[k] = (k%5 == 0) ? 1.0 : 0.0;
+}
+
+//----------------------------------------------------------------------------
+void USnavVolumeSampler::setVolume(vtkImageData* image, const double matrix[16])
+{
+  this->clear();
+  if(!image || !image->GetScalarPointer())
+    return;
+  image->GetDimensions(this->dimensions);
+  size_t count = (size_t)this->dimensions[0]*this->dimensions[1]*this->dimensions[2];
+  if(count == 0)
+    return;
+  this->voxels.resize(count);
+  int components = image->GetNumberOfScalarComponents();
+  void* scalars = image->GetScalarPointer();
+  switch(image->GetScalarType())
+  {
+    vtkTemplateMacro(copyToFloat(static_cast<VTK_TT*>(scalars), components, count, &this->voxels[0]));
+    default:
+      this->clear();
+      return;
+  }
+  memcpy(this->rasToIJK, matrix, 16*sizeof(double));
+  this->minimum = *std::min_element(this->voxels.begin(), this->voxels.end());
+  this->maximum = *std::max_element(this->voxels.begin(), this->voxels.end());
+}
+
+//----------------------------------------------------------------------------
+float USnavVolumeSampler::sample(double i, double j, double k, unsigned char& inside) const
+{
+  const int nx = this->dimensions[0];
+  const int ny = this->dimensions[1];
+  const int nz = this->dimensions[2];
+  // Single slice volumes are sampled bilinearly
+  if(i < 0 || j < 0 || k < 0 || i > nx-1 || j > ny-1 || k > nz-1)
+  {
+    inside = 0;
+    return 0.0f;
+  }
+  inside = 1;
+  int i0 = (int)i, j0 = (int)j, k0 = (int)k;
+  if(i0 >= nx-1) i0 = nx > 1 ? nx-2 : 0;
+  if(j0 >= ny-1) j0 = ny > 1 ? ny-2 : 0;
+  if(k0 >= nz-1) k0 = nz > 1 ? nz-2 : 0;
+  double fi = nx > 1 ? i - i0 : 0.0;
+  double fj = ny > 1 ? j - j0 : 0.0;
+  double fk = nz > 1 ? k - k0 : 0.0;
+  size_t di = nx > 1 ? 1 : 0;
+  size_t dj = ny > 1 ? (size_t)nx : 0;
+  size_t dk = nz > 1 ? (size_t)nx*ny : 0;
+  const float* p = &this->voxels[(size_t)i0 + (size_t)j0*nx + (size_t)k0*nx*ny];
+  double c00 = p[0]*(1-fi) + p[di]*fi;
+  double c10 = p[dj]*(1-fi) + p[dj+di]*fi;
+  double c01 = p[dk]*(1-fi) + p[dk+di]*fi;
+  double c11 = p[dk+dj]*(1-fi) + p[dk+dj+di]*fi;
+  double c0 = c00*(1-fj) + c10*fj;
+  double c1 = c01*(1-fj) + c11*fj;
+  return (float)(c0*(1-fk) + c1*fk);
+}
+
+//----------------------------------------------------------------------------
+void USnavVolumeSampler::samplePlane(const double imageToRAS[16], int columns, int rows, int stride, float* values, unsigned char* inside) const
+{
+  if(this->isEmpty())
+  {
+    memset(values, 0, sizeof(float)*columns*rows);
+    memset(inside, 0, (size_t)columns*rows);
+    return;
+  }
+  // imageToIJK = rasToIJK * imageToRAS; grid points are then
+  // origin + x*du + y*dv in voxel coordinates
+  double m[16];
+  usnavMultiply4x4(this->rasToIJK, imageToRAS, m);
+  double du[3] = { m[0]*stride, m[4]*stride, m[8]*stride };
+  double dv[3] = { m[1]*stride, m[5]*stride, m[9]*stride };
+  for(int y=0; y<rows; y++)
+  {
+    double p[3] = { m[3] + y*dv[0], m[7] + y*dv[1], m[11] + y*dv[2] };
+    float* out = values + (size_t)y*columns;
+    unsigned char* in = inside + (size_t)y*columns;
+    for(int x=0; x<columns; x++)
+    {
+      out[x] = this->sample(p[0], p[1], p[2], in[x]);
+      p[0] += du[0];
+      p[1] += du[1];
+      p[2] += du[2];
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+void USnavVolumeSampler::samplePoints(const double pointsToRAS[16], const float* x, const float* y, const float* z,
+                                      int count, float* values, unsigned char* inside) const
+{
+  if(this->isEmpty())
+  {
+    memset(values, 0, sizeof(float)*count);
+    memset(inside, 0, (size_t)count);
+    return;
+  }
+  double m[16];
+  usnavMultiply4x4(this->rasToIJK, pointsToRAS, m);
+  // Voxel coordinates of a whole block first, a straight loop the
+  // compiler vectorizes, then the interpolation
+  double i[sampleBlockSize], j[sampleBlockSize], k[sampleBlockSize];
+  for(int begin=0; begin<count; begin+=sampleBlockSize)
+  {
+    int n = std::min(sampleBlockSize, count - begin);
+    const float* bx = x + begin;
+    const float* by = y + begin;
+    const float* bz = z + begin;
+    for(int p=0; p<n; p++)
+    {
+      i[p] = m[0]*bx[p] + m[1]*by[p] + m[2]*bz[p] + m[3];
+      j[p] = m[4]*bx[p] + m[5]*by[p] + m[6]*bz[p] + m[7];
+      k[p] = m[8]*bx[p] + m[9]*by[p] + m[10]*bz[p] + m[11];
+    }
+    for(int p=0; p<n; p++)
+      values[begin+p] = this->sample(i[p], j[p], k[p], inside[begin+p]);
+  }
+}
+
+//----------------------------------------------------------------------------
+double usnavNormalizedCrossCorrelation(const float* a, const float* b, const unsigned char* mask, int n)
+{
+  // Branch free so the compiler can vectorize the accumulation
+  double count = 0, sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+  for(int i=0; i<n; i++)
+  {
+    double w = mask[i];
+    double x = a[i]*w;
+    double y = b[i]*w;
+    count += w;
+    sa += x;
+    sb += y;
+    saa += x*x;
+    sbb += y*y;
+    sab += x*y;
+  }
+  if(count < 2)
+    return 0.0;
+  double va = saa - sa*sa/count;
+  double vb = sbb - sb*sb/count;
+  if(va <= 0 || vb <= 0)
+    return 0.0;
+  return (sab - sa*sb/count) / sqrt(va*vb);
+}
+
+//----------------------------------------------------------------------------
+double usnavGradientCorrelation(const float* a, const float* b, const unsigned char* mask, int columns, int rows)
+{
+  if(columns < 3 || rows < 3)
+    return 0.0;
+  size_t n = (size_t)columns*rows;
+  std::vector<float> ga(n, 0.0f), gb(n, 0.0f);
+  std::vector<unsigned char> gmask(n, 0);
+  for(int y=1; y<rows-1; y++)
+    for(int x=1; x<columns-1; x++)
+    {
+      size_t i = (size_t)y*columns + x;
+      if(!(mask[i] && mask[i-1] && mask[i+1] && mask[i-columns] && mask[i+columns]))
+        continue;
+      float ax = a[i+1] - a[i-1], ay = a[i+columns] - a[i-columns];
+      float bx = b[i+1] - b[i-1], by = b[i+columns] - b[i-columns];
+      ga[i] = sqrt(ax*ax + ay*ay);
+      gb[i] = sqrt(bx*bx + by*by);
+      gmask[i] = 1;
+    }
+  return usnavNormalizedCrossCorrelation(&ga[0], &gb[0], &gmask[0], (int)n);
+}
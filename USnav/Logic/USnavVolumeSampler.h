@@ -0,0 +1,86 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavVolumeSampler - trilinear sampling of a volume along image planes
+// .SECTION Description
+// The first component of the volume is copied once to floats so that any
+// number of threads can then resample it along the plane of an ultrasound
+// frame: samplePlane() walks a regular grid of the frame and returns the
+// volume intensity under every grid point, plus whether it fell inside.
+// Similarity measures between a frame and such a resampled plane are free
+// functions below.
+
+#ifndef __USnavVolumeSampler_h
+#define __USnavVolumeSampler_h
+
+// STD includes
+#include <vector>
+
+#include "vtkSlicerUSnavModuleLogicExport.h"
+
+class vtkImageData;
+
+enum USnavSimilarityMeasure
+{
+  USNAV_NORMALIZED_CROSS_CORRELATION,
+  USNAV_GRADIENT_CORRELATION
+};
+
+class VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT USnavVolumeSampler
+{
+public:
+  USnavVolumeSampler();
+
+  /// Copies the volume; rasToIJK is 16 row-major doubles. Volumes whose
+  /// extent does not start at 0 are not supported.
+  void setVolume(vtkImageData* image, const double rasToIJK[16]);
+  void clear();
+  bool isEmpty() const { return this->voxels.empty(); }
+
+  /// Samples the volume at imageToRAS * (x*stride, y*stride, 0) for a
+  /// columns x rows grid, row by row. `inside` is 0 where the point falls
+  /// outside the volume (and the value is 0).
+  void samplePlane(const double imageToRAS[16], int columns, int rows, int stride, float* values, unsigned char* inside) const;
+  /// Samples the volume at pointsToRAS * (x[i], y[i], z[i]) for `count`
+  /// points, same conventions as samplePlane().
+  void samplePoints(const double pointsToRAS[16], const float* x, const float* y, const float* z, int count,
+                    float* values, unsigned char* inside) const;
+  /// Smallest and largest voxel values
+  double getMinimum() const { return this->minimum; }
+  double getMaximum() const { return this->maximum; }
+
+private:
+  float sample(double i, double j, double k, unsigned char& inside) const;
+
+  std::vector<float> voxels;
+  int dimensions[3];
+  double rasToIJK[16];
+  double minimum;
+  double maximum;
+};
+
+/// Pearson correlation of a and b over the n entries where mask is set,
+/// in [-1,1]; 0 when either is constant or fewer than 2 entries count.
+VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT
+double usnavNormalizedCrossCorrelation(const float* a, const float* b, const unsigned char* mask, int n);
+
+/// Correlation of the gradient magnitudes of two columns x rows grids,
+/// over the points where the mask is set for the point and its neighbours.
+VTK_SLICER_USNAV_MODULE_LOGIC_EXPORT
+double usnavGradientCorrelation(const float* a, const float* b, const unsigned char* mask, int columns, int rows);
+
+#endif
@@ -17,177 +17,71 @@ limitations under the License.
 
 // USnav Logic includes
 #include "vtkSlicerUSnavLogic.h"
+#include "USnavGeometry.h"
+#include "USnavParallel.h"
+#include "USnavSequenceEditor.h"
 
 // MRML includes
 
 // VTK includes
 #include <vtkNew.h>
 #include <vtkImageImport.h>
-#include <vtkTransform.h>
+#include <vtkTimerLog.h>
 
 // STD includes
+#include <sstream>
 #include <cassert>
 #include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstring>
 #include <algorithm>
 
-// vnl include
-#include <vnl/vnl_double_3.h>
-#include <vnl/vnl_trace.h>
-
-
-// ==============================================
-// Helpers - conversion functions
-// ==============================================
-vnl_matrix<double> convertVnlVectorToMatrix(const vnl_double_3& v)
-{
-  vnl_matrix<double> result(3,1);
-  result(0,0) = v[0];
-  result(1,0) = v[1];
-  result(2,0) = v[2];
-  return result;
-}
-
-vnl_double_3 convertVnlMatrixToVector(const vnl_matrix<double>& m)
-{
-  vnl_double_3 result;
-  if(m.rows()==1 && m.cols()==3) {
-    for(int i=0; i<3; i++)
-      result[i] = m(0,i);
-  }
-  else if(m.rows()==3 && m.cols()==1) {
-    for(int i=0; i<3; i++)
-      result[i] = m(i,0);
-  }
-  return result;
-}
-
-vnl_double_3 arrayToVnlDouble(double arr[4])
-{
-  vnl_double_3 result;
-  result[0]=arr[0];
-  result[1]=arr[1];
-  result[2]=arr[2];
-  return result;
-}
-
-void vnlToArrayDouble(vnl_double_3 v, double arr[4])
-{
-  arr[0]=v[0];
-  arr[1]=v[1];
-  arr[2]=v[2];
-  arr[3]=1.0;
-}
-
-std::vector<float> vtkToStdMatrix(vtkMatrix4x4* matrix)
-{
-  std::vector<float> result;
-  for(int i=0; i<3; i++)
-  {
-    for(int j=0; j<4; j++)
-      result.push_back(matrix->GetElement(i,j));
-  }
-  return result;
-}
-
-
-
-void vnlToVtkMatrix(const vnl_matrix<double> vnlMatrix , vtkMatrix4x4* vtkMatrix)
-{
-  vtkMatrix->Identity();
-  int rows = vnlMatrix.rows();
-  int cols = vnlMatrix.cols();
-  if(rows > 4)
-    rows = 4;
-  if(cols > 4)
-    cols = 4;
-  for(int i=0; i<rows; i++)
-  {
-    for(int j=0; j<cols; j++)
-      vtkMatrix->SetElement(i,j,vnlMatrix(i,j));
-  }
-}
-
-void getVtkMatrixFromVector(const std::vector<float>& vec, vtkMatrix4x4* vtkMatrix)
-{
-  vtkMatrix->Identity();
-  if(vec.size() < 12)
-    return;
-  for(int i=0; i<3; i++)
-    for(int j=0; j<4; j++)
-    vtkMatrix->SetElement(i,j,vec[i*4+j]);
-}
-
-vnl_matrix<double> vtkToVnlMatrix(vtkMatrix4x4* vtkMatrix)
-{
-  vnl_matrix<double> vnlMatrix(4,4);
-  for(int i=0; i<4; i++) {
-    for(int j=0; j<4; j++)
-    vnlMatrix(i,j)=vtkMatrix->GetElement(i,j);
-  }
-  return vnlMatrix;
-}
-
 // =======================================================
-// Geometry functions
-// =======================================================
-vnl_double_3 projectPoint(vnl_double_3 point, vnl_double_3 normalToPlane, double offset)
-{
-  normalToPlane.normalize();
-  double dist = dot_product(point, normalToPlane) + offset;
-  vnl_double_3 vec = dist*normalToPlane;
-  return point - vec;
-}
-
-// ======================================================= 
-// Similarity measure between two matrices
+// Reading functions
 // =======================================================
-double matriceDistance(vtkMatrix4x4* m1, vtkMatrix4x4* m2)
-{
-  vnl_matrix<double> vm1 = vtkToVnlMatrix(m1);
-  vnl_matrix<double> vm2 = vtkToVnlMatrix(m2);
-  vnl_matrix<double> diff = vm1 - vm2;
-  double dist = vnl_trace(diff.inplace_transpose() * diff);
-  return dist;
-}
-
-double orientationDistance(vtkMatrix4x4* m1, vtkMatrix4x4* m2)
+// Calibration file: either a bare 3x4 or 4x4 row-major matrix, or a
+// "ImageToProbeTransform = ..." line as found in Plus configurations.
+bool readCalibration(const std::string& filename, vtkMatrix4x4* matrix)
 {
-  vnl_matrix<double> vm1 = vtkToVnlMatrix(m1);
-  vnl_matrix<double> vm2 = vtkToVnlMatrix(m2);
-  vnl_matrix<double> sub1 = vm1.extract(3,3);
-  vnl_matrix<double> sub2 = vm1.extract(3,3);
-  sub1.normalize_columns(); sub2.normalize_columns();
-  vnl_matrix<double> diff = sub1 - sub2;
-  double dist = vnl_trace(diff.inplace_transpose() * diff);
-  return dist;
-}
+  ifstream file( filename.c_str() );
+  if ( !file.is_open() )
+    return false;
 
-double pointToSliceDistance(vtkMatrix4x4* pointerTransform, vtkMatrix4x4* UStransform)
-{
-  vnl_matrix<double> pointerTransform_vnl = vtkToVnlMatrix(pointerTransform);
-  vnl_matrix<double> UStransform_vnl = vtkToVnlMatrix(UStransform);
-  vnl_matrix<double> wm = UStransform_vnl.extract(3,1,0,2);
-  vnl_matrix<double> tm = UStransform_vnl.extract(3,1,0,3);
-  vnl_matrix<double> pm = pointerTransform_vnl.extract(3,1,0,3);
-  
-  // Vector normal to the US image
-  vnl_double_3 w = convertVnlMatrixToVector(wm);
-  // Translation vector (a point of the plane)
-  vnl_double_3 t = convertVnlMatrixToVector(tm);
-  // Position of the pointer tip
-  vnl_double_3 p = convertVnlMatrixToVector(pm);
-  
-  w.normalize();
-  double d = -dot_product(t,w);
-  vnl_double_3 p_proj = projectPoint(p,w,d);
-  double dist = (p-p_proj).two_norm();
-  return dist;
+  vector<double> values;
+  bool named = false;
+  while( !file.eof() )
+  {
+    string str; getline( file, str );
+    const char* pch = str.c_str();
+    const char* equal = strchr( pch, '=' );
+    bool isNamed = equal && strstr( pch, "ImageToProbe" ) && strstr( pch, "ImageToProbe" ) < equal;
+    if( named && !isNamed )
+      continue;
+    if( isNamed )
+    {
+      values.clear();
+      named = true;
+      pch = equal + 1;
+    }
+    while( true )
+    {
+      char* next = NULL;
+      double v = strtod( pch, &next );
+      if( next == pch )
+        break;
+      values.push_back( v );
+      pch = next;
+    }
+  }
+  if( values.size() != 12 && values.size() != 16 )
+    return false;
+  matrix->Identity();
+  for( int i=0; i<(int)values.size(); i++ )
+    matrix->SetElement( i/4, i%4, values[i] );
+  return true;
 }
 
-
-// =======================================================
-// Reading functions
-// =======================================================
 std::string getDir(const std::string& filename)
 {
   #ifdef WIN32
@@ -202,6 +96,13 @@ std::string getDir(const std::string& filename)
   return dirName;
 }
 
+// Frames are named after their tracked transform, as Plus does
+std::string frameBasename(int frame, const std::string& transformName)
+{
+  char name[64];
+  sprintf(name, "Seq_Frame%04d_", frame);
+  return name + transformName + "Transform";
+}
 
 void readTrainFilenames( const string& filename, string& dirName, vector<string>& trainFilenames )
 {
@@ -222,159 +123,144 @@ void readTrainFilenames( const string& filename, string& dirName, vector<string>
   file.close();
 }
 
-int readImageDimensions_mha(const std::string& filename, int& cols, int& rows, int& count)
+void vtkSlicerUSnavLogic::readImage_mha()
 {
-  ifstream file( filename.c_str() );
-  if ( !file.is_open() )
-    return 1;
-
-  // Read until get dimensions
-  while( !file.eof() )
+  // Keep the frame on screen resident whatever else gets cached
+  USnavFrameCache::Key key = this->getFrameKey(this->currentFrame);
+  if(this->pinnedKey != key)
   {
-    string str; getline( file, str );
-    if( str.empty() ) break;
-    char *pch = &(str[0]);
-    if( !pch )
-    {
-      return 1;
-      file.close();
-    }
-
-    if( strstr( pch, "DimSize =" ) )
-    {
-      if( sscanf( pch, "DimSize = %d %d %d", &cols, &rows, &count ) != 3 )
-      {
-        printf( "Error: could not read dimensions\n" );
-        file.close();
-        return 1;
-      }
-      file.close();
-      return 0;
-    }
+    this->frameCache.unpin(this->pinnedKey);
+    this->frameCache.pin(key);
+    this->pinnedKey = key;
   }
-  file.close();
-  return 1;
+  this->readFrame(this->currentFrame, this->dataPointer);
 }
 
-void readImageTransforms_mha(const std::string& filename, std::vector<std::vector<float> >& transforms, set<string>& availableTransforms,  std::vector<bool>& transformsValidity, std::vector<std::string>& filenames)
+// Full frames and packed ROI frames are cached under different variants
+USnavFrameCache::Key vtkSlicerUSnavLogic::getFrameKey(int frame)
 {
-  std::string dirName = getDir(filename);
-  filenames.clear();
-  transforms.clear();
-
-  // Vector for reading in transforms
-  vector< float > vfTrans;
-  vfTrans.resize(12);
-  std::string pngFilename;
+  return USnavFrameCache::makeKey(frame, this->roi.isFullFrame() ? 0 : 1);
+}
 
-  ifstream file( filename.c_str() );
-  if ( !file.is_open() )
+// Processed frames are cached next to the raw ones, under a variant made of
+// the processing hash and whether the frame is packed
+void vtkSlicerUSnavLogic::enhanceFrame(int frame, unsigned char* pixels)
+{
+  if(!this->enhancement.isEnabled())
     return;
-
-  while( !file.eof() )
+  size_t frameSize = (size_t)this->imageWidth*this->imageHeight;
+  bool packed = !this->roi.isFullFrame();
+  size_t cachedSize = packed ? this->roi.getPackedSize() : frameSize;
+  USnavFrameCache::Key key = USnavFrameCache::makeKey(frame, (this->enhancement.getHash() << 1) | (packed ? 1 : 0));
+  this->enhancedBuffer.resize(frameSize + 1);
+  if(this->frameCache.fetch(key, &this->enhancedBuffer[0], cachedSize))
   {
-    string str; getline( file, str );
-    if( str.empty() ) break;
-    char *pch = &(str[0]);
-    if( !pch )
-      return;
-      
-    if(strstr(pch, "Seq_Frame") && strstr(pch, "Transform")){
-      char* transformName = strstr(pch, "Seq_Frame")+string("Seq_Frame").size()+5;
-      char* endTransformName = strstr(pch, "Transform");
-      std::string transformNameCpy = string(transformName, endTransformName-transformName);
-      availableTransforms.insert(transformNameCpy);
-    }
-
-    if( strstr( pch, "ProbeToTrackerTransform =" )
-      || strstr( pch, "UltrasoundToTrackerTransform =" ) )
-    {
-       // Parse name and transform
-       // Seq_Frame0000_ProbeToTrackerTransform = -0.224009 -0.529064 0.818481 212.75 0.52031 0.6452 0.559459 -14.0417 -0.824074 0.551188 0.130746 -26.1193 0 0 0 1 
-
-      char *pcName = pch;
-      char *pcTrans = strstr( pch, "=" );
-      pcTrans[-1] = 0; // End file name string pcName
-       //pcTrans++; // Increment to just after equal sign
-
-      pngFilename = dirName + pcName + ".png";// + pcTrans;
-
-      char *pch = pcTrans;
-
-      for( int j =0; j < 12; j++ )
-      {
-        pch = strchr( pch + 1, ' ' );
-        if( !pch )
-          return;
-        vfTrans[j] = atof( pch );
-        pch++;
-      }
-      transforms.push_back( vfTrans );
-      filenames.push_back(pngFilename);
-    }
-    else if(strstr(pch, "UltrasoundToTrackerTransformStatus") || strstr(pch, "ProbeToTrackerTransformStatus")) {
-      if(strstr(pch, "OK")){
-        transformsValidity.push_back(true);
-      }
-      else if(strstr(pch, "INVALID"))
-        transformsValidity.push_back(false);
-    }
-    if( strstr( pch, "ElementDataFile = LOCAL" ) )
-    {
-       // Done reading
-      break;
-    }
+    if(packed)
+      this->roi.unpack(&this->enhancedBuffer[0], pixels);
+    else
+      memcpy(pixels, &this->enhancedBuffer[0], frameSize);
+    return;
   }
-  for(set<string>::iterator it=availableTransforms.begin(); it!=availableTransforms.end(); it++)
-    cout << *it << endl;
+
+  double start = vtkTimerLog::GetUniversalTime();
+  this->enhancement.apply(pixels, &this->enhancedBuffer[0], this->imageWidth, this->imageHeight);
+  if(packed)
+    this->roi.mask(&this->enhancedBuffer[0]);
+  memcpy(pixels, &this->enhancedBuffer[0], frameSize);
+  if(packed)
+    this->roi.pack(pixels, &this->enhancedBuffer[0]);
+  this->frameCache.insert(key, &this->enhancedBuffer[0], cachedSize, vtkTimerLog::GetUniversalTime() - start);
 }
 
-void vtkSlicerUSnavLogic::readImage_mha()
+bool vtkSlicerUSnavLogic::readFrame(int frame, unsigned char* pixels)
 {
-
-  FILE *infile = fopen( this->mhaPath.c_str(), "rb" );
-  char buffer[400];
-  
-  // Just move the pointer where data starts
-  while( fgets( buffer, 400, infile ) )
+  size_t frameSize = (size_t)this->imageWidth*this->imageHeight;
+  bool packed = !this->roi.isFullFrame();
+  size_t cachedSize = packed ? this->roi.getPackedSize() : frameSize;
+  vector<unsigned char> packedPixels;
+  unsigned char* cached = pixels;
+  if(packed)
   {
-    if( strstr( buffer, "ElementDataFile = LOCAL" ) )
-    {
-       // Done reading
-      break;
-    }
-  } 
-
-  #ifdef WIN32
-  _fseeki64(infile, (__int64)this->imageHeight*(__int64)this->imageWidth*(__int64)this->currentFrame, SEEK_CUR);
-  #else
-  fseek(infile, (long int)this->imageHeight*(long int)this->imageWidth*(long int)this->currentFrame, SEEK_CUR);
-  #endif
+    // One spare byte so that an empty region still has a buffer
+    packedPixels.resize(cachedSize + 1);
+    cached = &packedPixels[0];
+  }
+  USnavFrameCache::Key key = this->getFrameKey(frame);
+  if(this->frameCache.fetch(key, cached, cachedSize))
+  {
+    if(packed)
+      this->roi.unpack(cached, pixels);
+    return true;
+  }
 
-  fread( this->dataPointer, 1, this->imageHeight*this->imageWidth, infile );
-  fclose( infile );
+  double start = vtkTimerLog::GetUniversalTime();
+  // Frame source is found once in pollLoading(); rows outside the ROI
+  // are not read
+  int firstRow = packed ? this->roi.getFirstRow() : 0;
+  int endRow = packed ? this->roi.getEndRow() : this->imageHeight;
+  USnavFrameReader reader(this->frameSource);
+  if(!reader.readRows(frame, firstRow, endRow, pixels + (size_t)firstRow*this->imageWidth))
+    return false;
+  if(packed)
+  {
+    this->roi.mask(pixels);
+    this->roi.pack(pixels, cached);
+  }
+  this->frameCache.insert(key, cached, cachedSize, vtkTimerLog::GetUniversalTime() - start);
+  return true;
 }
 
-
-
 //----------------------------------------------------------------------------
 vtkStandardNewMacro(vtkSlicerUSnavLogic);
 
 //----------------------------------------------------------------------------
 vtkSlicerUSnavLogic::vtkSlicerUSnavLogic()
 {
-  this->imgData = NULL;
+  this->importer = vtkSmartPointer<vtkImageImport>::New();
+  this->importer->SetDataScalarTypeToUnsignedChar();
+  this->imgData = this->importer->GetOutput();
+  this->pendingChanges = 0;
   this->dataPointer = NULL;
   this->imageNode = vtkMRMLScalarVolumeNode::New();
   this->imageNode->SetName("mha image");
   this->mrimageNode = NULL;
   this->stylusTransform = NULL;
+  this->calibrationTransform = NULL;
   this->imageWidth = 0;
   this->imageHeight = 0;
   this->numberOfFrames = 0;
+  this->currentFrame = 0;
+  this->displayedLevel = 0;
+  this->memoryBudget = 512*1024*1024;
+  this->pinnedKey = ~(USnavFrameCache::Key)0;
+  this->autoDetectROI = true;
+  this->trackedTransform = -1;
+  this->matchingMaxAngle = 0.0;
+  this->matchingResultCount = 10;
+  this->incrementalMatching = true;
+  this->matchingMetric = 0;
+  this->rerankCount = 5;
+  this->rerankStride = 4;
+  this->similarityMeasure = USNAV_NORMALIZED_CROSS_CORRELATION;
+  this->mrSamplerOutdated = true;
+  this->coverageCellSize = 5.0;
+  this->coverageOutdated = true;
+  this->keyframesOnly = false;
+  this->skipUnstableFrames = false;
+  this->loading = false;
+  this->imageInfoLoaded = false;
+  this->loadedFrames = 0;
+  this->indexedFrames = 0;
+  this->console = NULL;
   
   // Initialize Image to Probe transform
+  this->TrackerToRASTransform = vtkSmartPointer<vtkMatrix4x4>::New();
+  this->TrackerToRASTransform->Identity();
+  this->registrationFrames = 16;
+  this->registrationStride = 4;
+  this->registrationMetric = 0.0;
   this->ImageToProbeTransform = vtkSmartPointer<vtkMatrix4x4>::New();
+  this->IJKToRASTransform = vtkSmartPointer<vtkMatrix4x4>::New();
   this->ImageToProbeTransform->Identity();
   this->ImageToProbeTransform->SetElement(0,0,0.107535);
   this->ImageToProbeTransform->SetElement(0,1,0.00094824);
@@ -405,6 +291,15 @@ vtkSlicerUSnavLogic::~vtkSlicerUSnavLogic()
 void vtkSlicerUSnavLogic::PrintSelf(ostream& os, vtkIndent indent)
 {
   this->Superclass::PrintSelf(os, indent);
+  USnavFrameCache::Statistics stats = this->frameCache.getStatistics();
+  os << indent << "MemoryBudget: " << this->memoryBudget << "\n";
+  os << indent << "PyramidBytes: " << this->pyramid.getMemorySize() << "\n";
+  os << indent << "FrameCacheBudget: " << stats.budget << "\n";
+  os << indent << "FrameCacheResidentBytes: " << stats.residentBytes << "\n";
+  os << indent << "FrameCacheEntries: " << stats.entries << "\n";
+  os << indent << "FrameCacheHits: " << stats.hits << "\n";
+  os << indent << "FrameCacheMisses: " << stats.misses << "\n";
+  os << indent << "FrameCacheEvictions: " << stats.evictions << "\n";
 }
 
 //---------------------------------------------------------------------------
@@ -423,11 +318,23 @@ void vtkSlicerUSnavLogic::ProcessMRMLNodesEvents( vtkObject* caller, unsigned lo
   {
     return;
   }
+  if(this->mrimageNode && caller == this->mrimageNode)
+  {
+    // Resampled from the node the next time it is needed
+    this->mrSamplerOutdated = true;
+    this->coverageOutdated = true;
+    return;
+  }
   if(event == vtkMRMLTransformableNode::TransformModifiedEvent)
   {
     vtkMRMLLinearTransformNode* tnode = vtkMRMLLinearTransformNode::SafeDownCast( caller );
-    if(tnode) {
-      this->console->insertPlainText("Transform Node Modified\n");
+    if(tnode && tnode == this->calibrationTransform) {
+      this->setImageToProbeMatrix(tnode->GetMatrixTransformToParent());
+      return;
+    }
+    if(tnode && tnode == this->stylusTransform) {
+      if(this->console)
+        this->console->insertPlainText("Transform Node Modified\n");
       this->findMatchingUS(tnode->GetMatrixTransformToParent());
       return;
     }
@@ -464,209 +371,1405 @@ void vtkSlicerUSnavLogic::removeStylusTransform()
   this->stylusTransform = NULL;
 }
 
-//-----------------------------------------------------------------------------
-void vtkSlicerUSnavLogic::RegisterNodes()
+void vtkSlicerUSnavLogic::setCalibrationTransform(vtkMRMLLinearTransformNode *tnode)
 {
-  assert(this->GetMRMLScene() != 0);
+  if(tnode==this->calibrationTransform)
+    return;
+
+  int wasModifying = this->StartModify();
+  if(this->calibrationTransform)
+    vtkSetAndObserveMRMLNodeMacro( this->calibrationTransform, 0 );
+  this->calibrationTransform = NULL;
+  if(tnode)
+  {
+    vtkMRMLLinearTransformNode* newNode = NULL;
+    vtkSmartPointer< vtkIntArray > events = vtkSmartPointer< vtkIntArray >::New();
+    events->InsertNextValue(vtkMRMLTransformableNode::TransformModifiedEvent);
+    vtkSetAndObserveMRMLNodeEventsMacro( newNode, tnode, events );
+    this->calibrationTransform = newNode;
+    this->setImageToProbeMatrix(tnode->GetMatrixTransformToParent());
+  }
+  this->EndModify( wasModifying );
 }
 
-//---------------------------------------------------------------------------
-void vtkSlicerUSnavLogic::UpdateFromMRMLScene()
+bool vtkSlicerUSnavLogic::loadCalibrationFile(const string& path)
 {
-  assert(this->GetMRMLScene() != 0);
+  vtkSmartPointer<vtkMatrix4x4> matrix = vtkSmartPointer<vtkMatrix4x4>::New();
+  if(!readCalibration(path, matrix))
+    return false;
+  this->setImageToProbeMatrix(matrix);
+  return true;
 }
 
-//---------------------------------------------------------------------------
-void vtkSlicerUSnavLogic::OnMRMLSceneNodeAdded(vtkMRMLNode* vtkNotUsed(node))
+void vtkSlicerUSnavLogic::setImageToProbeMatrix(vtkMatrix4x4* matrix)
 {
+  if(!matrix)
+    return;
+  this->ImageToProbeTransform->DeepCopy(matrix);
+  this->updateImageToTrackerMatrices();
+  if(this->numberOfFrames > 0)
+  {
+    this->updateImage();
+    this->notifyChanges();
+  }
 }
 
-//---------------------------------------------------------------------------
-void vtkSlicerUSnavLogic
-  ::OnMRMLSceneNodeRemoved(vtkMRMLNode* vtkNotUsed(node))
+void vtkSlicerUSnavLogic::updateImageToTrackerMatrices()
 {
+  int frames = this->trackedTransform >= 0 ? this->numberOfFrames : 0;
+  this->imageToTracker.resize(16*(size_t)frames);
+  this->trackerToImage.resize(16*(size_t)frames);
+  this->computeImageToTracker(0, frames);
+
+  // Poses changed, the keyframes and the coverage no longer hold
+  this->analysis.clearKeyframes();
+  this->coverageOutdated = true;
+  this->updateKinematics();
+  this->updateMatchingIndex();
 }
 
-void vtkSlicerUSnavLogic::setMhaPath(string path)
+void vtkSlicerUSnavLogic::computeImageToTracker(int begin, int end)
 {
-  if(path != this->mhaPath){
-    this->mhaPath = path;
-    this->transforms.clear();
-    this->filenames.clear();
-    this->transformsValidity.clear();
-    this->currentFrame = 0;
-    int iImgCols = -1;
-    int iImgRows = -1;
-    int iImgCount = -1;
-    if(readImageDimensions_mha(this->mhaPath, iImgCols, iImgRows, iImgCount))
-      return;
-    this->imageWidth = iImgCols;
-    this->imageHeight = iImgRows;
-    this->numberOfFrames = iImgCount;
-    if(this->dataPointer)
-      delete [] this->dataPointer;
-    this->dataPointer = new unsigned char[iImgRows*iImgCols];
-    readImageTransforms_mha(this->mhaPath, this->transforms, this->availableTransforms, this->transformsValidity, this->filenames);
-    this->updateImage();
-    this->Modified();
+  end = min(end, (int)(this->imageToTracker.size()/16));
+  double imageToProbe[16];
+  vtkMatrix4x4::DeepCopy(imageToProbe, this->ImageToProbeTransform);
+  for(int i=begin; i<end; i++)
+  {
+    double* out = &this->imageToTracker[16*(size_t)i];
+    double* inv = &this->trackerToImage[16*(size_t)i];
+    usnavIdentity4x4(out);
+    usnavIdentity4x4(inv);
+    if(!this->transformStore.hasMatrix(this->trackedTransform, i))
+      continue;
+    double probeToTracker[16];
+    usnavMatrixFromFloat12(this->transformStore.getMatrix(this->trackedTransform, i), probeToTracker);
+    usnavMultiply4x4(probeToTracker, imageToProbe, out);
+    usnavInvertAffine4x4(out, inv);
   }
 }
 
-
-string vtkSlicerUSnavLogic::getCurrentTransformStatus()
+void vtkSlicerUSnavLogic::getValidFrames(vector<int>& validFrames)
 {
-  if(this->transformsValidity[this->currentFrame])
-    return "OK";
-  else
-    return "INVALID";
+  validFrames.clear();
+  int frames = (int)(this->imageToTracker.size()/16);
+  for(int i=0; i<frames; i++)
+    if(this->isFrameValid(i) && this->transformStore.hasMatrix(this->trackedTransform, i))
+      validFrames.push_back(i);
 }
 
-void vtkSlicerUSnavLogic::updateImage()
+void vtkSlicerUSnavLogic::updateKinematics()
 {
-  checkFrame();
-  readImage_mha();
-  vtkSmartPointer<vtkImageImport> importer = vtkSmartPointer<vtkImageImport>::New();
-  importer->SetDataScalarTypeToUnsignedChar();
-  importer->SetImportVoidPointer(dataPointer,1); // Save argument to 1 won't destroy the pointer when importer destroyed
-  importer->SetWholeExtent(0,this->imageWidth-1,0, this->imageHeight-1, 0, 0);
-  importer->SetDataExtentToWholeExtent();
-  importer->Update();
-  this->imgData = importer->GetOutput();
-
-  if(this->transforms.size() > 0)
-  {
-    vtkSmartPointer<vtkMatrix4x4> transform = vtkSmartPointer<vtkMatrix4x4>::New();
-    vtkSmartPointer<vtkTransform> combinedTransform = vtkSmartPointer<vtkTransform>::New();
-    getVtkMatrixFromVector(this->transforms[this->currentFrame], transform);
-    combinedTransform->Concatenate(transform);
-    combinedTransform->Concatenate(this->ImageToProbeTransform);
-    vtkSmartPointer<vtkMatrix4x4> matrix = combinedTransform->GetMatrix();
-    this->imageNode->SetIJKToRASMatrix(matrix);
-  }
-  
-  this->imageNode->SetAndObserveImageData(this->imgData);
+  vector<int> validFrames;
+  this->getValidFrames(validFrames);
+  // Timestamps are only used when every frame has one
+  int frames = this->transformStore.getNumberOfFrames();
+  vector<double> timestamps;
+  for(int i=0; i<frames && this->transformStore.hasTimestamp(i); i++)
+    timestamps.push_back(this->transformStore.getTimestamp(i));
+  const double* times = frames > 0 && (int)timestamps.size() == frames ? &timestamps[0] : NULL;
+  // Motion of the probe itself, not of the image at the end of the
+  // calibration lever arm
+  vector<double> probeToTracker(max(this->imageToTracker.size(), (size_t)16));
+  for(size_t i=0; i<validFrames.size(); i++)
+    usnavMatrixFromFloat12(this->transformStore.getMatrix(this->trackedTransform, validFrames[i]),
+                           &probeToTracker[16*(size_t)validFrames[i]]);
+  this->analysis.computeKinematics(&probeToTracker[0], this->imageToTracker.get(), validFrames, frames, times,
+                                   this->kinematicsParameters);
+  this->analysis.computeSweeps(&probeToTracker[0], this->imageToTracker.get(), validFrames, frames, times,
+                               this->imageWidth, this->imageHeight, this->sweepParameters);
+}
 
+bool vtkSlicerUSnavLogic::isFrameUsable(int frame)
+{
+  return this->isFrameValid(frame) && !(this->skipUnstableFrames && this->analysis.getMotionFlags(frame));
+}
 
+void vtkSlicerUSnavLogic::updateMatchingIndex()
+{
+  vector<int> indexedFrames;
+  if(this->keyframesOnly && this->analysis.hasKeyframes())
+    indexedFrames = this->analysis.getKeyframes();
+  else
+    this->getValidFrames(indexedFrames);
+  if(this->skipUnstableFrames)
+  {
+    vector<int> stableFrames;
+    for(size_t i=0; i<indexedFrames.size(); i++)
+      if(!this->analysis.getMotionFlags(indexedFrames[i]))
+        stableFrames.push_back(indexedFrames[i]);
+    indexedFrames.swap(stableFrames);
+  }
+  this->orientationIndex.build(this->imageToTracker.get(), indexedFrames);
+  this->sweepIndex.build(this->imageToTracker.get(), indexedFrames, this->imageWidth, this->imageHeight, this->analysis);
+}
 
+// Pyramid level frames are compared on
+static const int contentLevel = 2;
 
-  if(this->GetMRMLScene()) {
-    if(!this->GetMRMLScene()->IsNodePresent(this->imageNode))
-      this->GetMRMLScene()->AddNode(this->imageNode);
+// Frames are compared on their 1/16 thumbnail. When the pyramid does not
+// have it yet, the whole frame is read (no ROI mask, not cached) and reduced
+// the same way. Thread safe.
+bool vtkSlicerUSnavLogic::keyframeContent(int frame, vector<unsigned char>& pixels, void* userData)
+{
+  vtkSlicerUSnavLogic* self = static_cast<vtkSlicerUSnavLogic*>(userData);
+  const int level = contentLevel;
+  int width = 0, height = 0;
+  const unsigned char* thumbnail = self->getThumbnail(frame, level, width, height);
+  if(thumbnail)
+  {
+    pixels.assign(thumbnail, thumbnail + (size_t)width*height);
+    return true;
   }
+  if(self->imageWidth <= 0 || self->imageHeight <= 0)
+    return false;
+  vector<unsigned char> full((size_t)self->imageWidth*self->imageHeight);
+  USnavFrameReader reader(self->frameSource);
+  if(!reader.readFrame(frame, &full[0]))
+    return false;
+  self->pyramid.reduceFrame(&full[0], self->imageWidth, self->imageHeight, level, pixels, width, height);
+  return true;
 }
 
-// =======================================================
-// Interface for navigating through frames
-// =======================================================
-void vtkSlicerUSnavLogic::nextImage()
+void vtkSlicerUSnavLogic::setKeyframeThresholds(double maxTranslation, double maxRotation, double maxIntensityChange)
 {
-  this->currentFrame += 1;
-  this->updateImage();
-  this->Modified();
+  this->keyframeParameters.maxTranslation = maxTranslation;
+  this->keyframeParameters.maxRotation = maxRotation;
+  this->keyframeParameters.maxIntensityChange = maxIntensityChange;
 }
 
-void vtkSlicerUSnavLogic::previousImage()
+void vtkSlicerUSnavLogic::computeKeyframes()
 {
-  this->currentFrame -= 1;
-  this->updateImage();
-  this->Modified();
+  vector<int> validFrames;
+  this->getValidFrames(validFrames);
+  this->analysis.computeKeyframes(this->imageToTracker.get(), validFrames, this->keyframeParameters,
+                                  &vtkSlicerUSnavLogic::keyframeContent, this);
+  if(this->keyframesOnly)
+    this->updateMatchingIndex();
+  if(this->console)
+  {
+    ostringstream oss;
+    oss << this->analysis.getKeyframes().size() << " keyframes for " << validFrames.size() << " valid frames\n";
+    this->console->insertPlainText(oss.str().c_str());
+  }
+  this->stateChanged(KeyframesChanged);
 }
 
-void vtkSlicerUSnavLogic::goToFrame(int frame)
+void vtkSlicerUSnavLogic::setKeyframesOnly(bool only)
 {
-  this->currentFrame = frame;
-  this->updateImage();
-  this->Modified();
+  if(only == this->keyframesOnly)
+    return;
+  this->keyframesOnly = only;
+  this->updateMatchingIndex();
+  this->stateChanged(KeyframesChanged);
 }
 
-void vtkSlicerUSnavLogic::nextValidFrame()
+bool vtkSlicerUSnavLogic::computeImageMotion(int numberOfThreads, bool readFullFrames)
 {
-  int frame = 0;
-  for(int i=0; i<this->getNumberOfFrames(); i++)
+  if(!readFullFrames && !this->pyramid.isComplete())
   {
-    frame = (this->currentFrame + i + 1)%this->getNumberOfFrames();
-    if(this->transformsValidity[frame])
-      break;
+    if(this->console)
+    {
+      ostringstream oss;
+      if(this->pyramid.getMemorySize() > 0)
+        oss << "Image motion: the frame pyramid is not built yet (" << (int)(100*this->pyramid.getProgress())
+            << "%), try again when it is\n";
+      else
+        oss << "Image motion: the sequence has no frame pyramid (memory budget), use USnavBatch validate"
+            << " --image-motion\n";
+      this->console->insertPlainText(oss.str().c_str());
+    }
+    return false;
   }
-  this->currentFrame = frame;
-  this->updateImage();
-  this->Modified();
+  vector<int> validFrames;
+  this->getValidFrames(validFrames);
+  double start = vtkTimerLog::GetUniversalTime();
+  this->analysis.computeImageMotion(this->imageToTracker.get(), validFrames, this->transformStore.getNumberOfFrames(),
+                                    &vtkSlicerUSnavLogic::keyframeContent, this, this->imageWidth,
+                                    this->imageHeight, this->pyramid.getLevelFactor(contentLevel),
+                                    this->imageMotionParameters, numberOfThreads);
+  if(this->skipUnstableFrames)
+    this->updateMatchingIndex();
+  if(this->console)
+  {
+    ostringstream oss;
+    oss << "Image motion: " << this->analysis.getNumberOfImageMismatches() << " of " << validFrames.size()
+        << " valid frames disagree with their poses (" << vtkTimerLog::GetUniversalTime() - start << " s)\n";
+    this->console->insertPlainText(oss.str().c_str());
+  }
+  this->stateChanged(TransformsChanged);
+  return true;
 }
 
-void vtkSlicerUSnavLogic::previousValidFrame()
+void vtkSlicerUSnavLogic::setImageMotionThresholds(double maxShiftError, double minCorrelation, double maxElevation)
 {
-  int frame = 0;
-  for(int i=0; i<this->getNumberOfFrames(); i++)
-  {
-    frame = this->currentFrame-i-1;
-    if(frame < 0)
-      frame = this->getNumberOfFrames() + frame;
-    if(this->transformsValidity[frame])
-      break;
-  }
-  this->currentFrame = frame;
-  this->updateImage();
-  this->Modified();
+  this->imageMotionParameters.maxShiftError = maxShiftError;
+  this->imageMotionParameters.minCorrelation = minCorrelation;
+  this->imageMotionParameters.maxElevation = maxElevation;
+  this->analysis.setImageMotionParameters(this->imageMotionParameters);
+  // The flags are applied again with the kinematics
+  this->updateKinematics();
+  this->updateMatchingIndex();
+  this->stateChanged(TransformsChanged);
 }
 
-void vtkSlicerUSnavLogic::nextInvalidFrame()
+void vtkSlicerUSnavLogic::setKinematicsThresholds(double maxSpeed, double maxAngularSpeed, double maxJitter)
 {
-  int frame = 0;
-  for(int i=0; i<this->getNumberOfFrames(); i++)
-  {
-    frame = (this->currentFrame + i + 1)%this->getNumberOfFrames();
-    if(!this->transformsValidity[frame])
-      break;
-  }
-  this->currentFrame = frame;
-  this->updateImage();
-  this->Modified();
+  this->kinematicsParameters.maxSpeed = maxSpeed;
+  this->kinematicsParameters.maxAngularSpeed = maxAngularSpeed;
+  this->kinematicsParameters.maxJitter = maxJitter;
+  // Glitches no longer cut sweeps, or now do
+  this->updateKinematics();
+  this->updateMatchingIndex();
+  this->stateChanged(TransformsChanged);
 }
 
-void vtkSlicerUSnavLogic::previousInvalidFrame()
+void vtkSlicerUSnavLogic::setSweepThresholds(int maxInvalidRun, double maxTimeGap, double maxJump, double maxRotationJump)
 {
-  int frame = 0;
-  for(int i=0; i<this->getNumberOfFrames(); i++)
-  {
-    frame = this->currentFrame-i-1;
-    if(frame < 0)
-      frame = this->getNumberOfFrames() + frame;
-    if(!this->transformsValidity[frame])
-      break;
-  }
-  this->currentFrame = frame;
-  this->updateImage();
-  this->Modified();
+  this->sweepParameters.maxInvalidRun = maxInvalidRun;
+  this->sweepParameters.maxTimeGap = maxTimeGap;
+  this->sweepParameters.maxJump = maxJump;
+  this->sweepParameters.maxRotationJump = maxRotationJump;
+  this->updateKinematics();
+  this->updateMatchingIndex();
+  this->stateChanged(TransformsChanged);
 }
 
-void vtkSlicerUSnavLogic::checkFrame()
+void vtkSlicerUSnavLogic::setSkipUnstableFrames(bool skip)
 {
-  if(this->currentFrame >= this->numberOfFrames)
-    this->currentFrame = 0;
-  if(this->currentFrame < 0)
-    this->currentFrame = this->getNumberOfFrames()-1;
+  if(skip == this->skipUnstableFrames)
+    return;
+  this->skipUnstableFrames = skip;
+  this->updateMatchingIndex();
+  this->stateChanged(TransformsChanged);
 }
 
-bool pairlt(const pair<double,int>& p1, const pair<double,int>& p2) {
-  return p1.first < p2.first;
+bool vtkSlicerUSnavLogic::setMatchingMetric(const string& name)
+{
+  int metric = USnavMatchFrames::findMetric(name.c_str());
+  if(metric < 0)
+    return false;
+  this->matchingMetric = metric;
+  return true;
 }
 
-void vtkSlicerUSnavLogic::findMatchingUS(vtkMatrix4x4* stylusMatrix)
+const double* vtkSlicerUSnavLogic::getImageToTrackerMatrix(int frame)
 {
-  vector<pair<double,int> > distToSlice;
-  vector<double> orientationDist;
-  for(int i=0; i<this->transforms.size(); i++)
-  {
-    if(!this->transformsValidity[i]){
-      distToSlice.push_back(pair<double,int>(DBL_MAX,i));
-      orientationDist.push_back(DBL_MAX);
-      continue;
-    }
-    vtkSmartPointer<vtkMatrix4x4> t = vtkSmartPointer<vtkMatrix4x4>::New();
-    getVtkMatrixFromVector(transforms[i], t);
-    distToSlice.push_back(pair<double,int>(pointToSliceDistance(stylusMatrix, t),i));
-    orientationDist.push_back(orientationDistance(stylusMatrix, t));
-  }
-  vector<pair<double,int> > sortedDistToSlice = distToSlice;
-  sort(sortedDistToSlice.begin(),sortedDistToSlice.end(),pairlt);
+  if(frame < 0 || 16*(size_t)frame >= this->imageToTracker.size())
+    return NULL;
+  return &this->imageToTracker[16*(size_t)frame];
+}
+
+const double* vtkSlicerUSnavLogic::getTrackerToImageMatrix(int frame)
+{
+  if(frame < 0 || 16*(size_t)frame >= this->trackerToImage.size())
+    return NULL;
+  return &this->trackerToImage[16*(size_t)frame];
+}
+
+//-----------------------------------------------------------------------------
+void vtkSlicerUSnavLogic::RegisterNodes()
+{
+  assert(this->GetMRMLScene() != 0);
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerUSnavLogic::UpdateFromMRMLScene()
+{
+  assert(this->GetMRMLScene() != 0);
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerUSnavLogic::OnMRMLSceneNodeAdded(vtkMRMLNode* vtkNotUsed(node))
+{
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerUSnavLogic
+  ::OnMRMLSceneNodeRemoved(vtkMRMLNode* vtkNotUsed(node))
+{
+}
+
+void vtkSlicerUSnavLogic::setMhaPath(string path)
+{
+  this->loadMhaPath(path);
+  this->loader.wait();
+  this->pollLoading();
+}
+
+void vtkSlicerUSnavLogic::loadMhaPath(string path)
+{
+  // A cancelled or failed load of the same file starts over
+  if(path == this->mhaPath && (this->loading || this->isLoaded()))
+    return;
+  this->cinePlayer.stop();
+  this->mhaPath = path;
+  this->transformStore.reset(0);
+  this->availableTransforms.clear();
+  this->trackedTransform = -1;
+  this->currentFrame = 0;
+  this->pyramid.stop();
+  this->frameCache.clear();
+  this->frameCache.resetStatistics();
+  this->imageInfoLoaded = false;
+  this->frameSource = USnavFrameSource();
+  // Nothing of the previous sequence survives a load that fails
+  this->numberOfFrames = 0;
+  this->imageWidth = 0;
+  this->imageHeight = 0;
+  this->updateImageToTrackerMatrices();
+  this->loadedFrames = 0;
+  this->indexedFrames = 0;
+  this->loading = true;
+  this->loader.start(this->mhaPath);
+}
+
+bool vtkSlicerUSnavLogic::pollLoading()
+{
+  if(!this->loading)
+    return false;
+  // State first: once the loader is seen as over, everything it parsed is
+  // published
+  USnavSequenceLoader::State state = this->loader.getState();
+  bool changed = false;
+  USnavFrameSource source;
+  if(this->loader.getFrameSource(source))
+  {
+    int width = source.width;
+    int height = source.height;
+    if(!this->imageInfoLoaded)
+    {
+      // Enough to show the first frame
+      this->imageInfoLoaded = true;
+      this->imageWidth = width;
+      this->imageHeight = height;
+      this->numberOfFrames = source.frames;
+      this->frameSource = source;
+      if(this->dataPointer)
+        delete [] this->dataPointer;
+      this->dataPointer = new unsigned char[height*width];
+      this->roi.reset(this->imageWidth, this->imageHeight);
+      if(this->autoDetectROI)
+        this->findROI(16);
+      this->transformStore.reset(this->numberOfFrames);
+      this->startPyramid();
+      this->markChanged(SequenceChanged);
+      changed = true;
+    }
+    else if(source.dataOffset != this->frameSource.dataOffset)
+    {
+      // The header did not end where the pixel data size said
+      this->frameSource = source;
+      this->pyramid.stop();
+      this->frameCache.clear();
+      if(this->autoDetectROI)
+        this->findROI(16);
+      this->startPyramid();
+      this->markChanged(SequenceChanged);
+      changed = true;
+    }
+  }
+  if(this->imageInfoLoaded)
+  {
+    int merged = this->loader.mergeTransforms(this->transformStore);
+    bool rebuild = false;
+    if(merged > this->loadedFrames)
+    {
+      for(int i=0; i<this->transformStore.getNumberOfTransforms(); i++)
+        this->availableTransforms.insert(this->transformStore.getName(i));
+      int tracked = this->trackedTransform;
+      this->selectTrackedTransform();
+      // Poses of the new frames right away; the indexes are rebuilt each
+      // time the parsed frames double, and once more at the end
+      if(this->trackedTransform == tracked)
+        this->computeImageToTracker(this->loadedFrames, merged);
+      rebuild = this->trackedTransform != tracked || merged >= 2*this->indexedFrames;
+      this->loadedFrames = merged;
+    }
+    if(rebuild || (state != USnavSequenceLoader::Loading && this->loadedFrames > this->indexedFrames))
+    {
+      this->indexedFrames = this->loadedFrames;
+      this->updateImageToTrackerMatrices();
+      this->markChanged(TransformsChanged);
+      changed = true;
+    }
+  }
+  if(state != USnavSequenceLoader::Loading)
+  {
+    this->loading = false;
+    if(this->console && state == USnavSequenceLoader::Failed)
+      this->console->insertPlainText(("Could not read the sequence header of " + this->mhaPath + "\n").c_str());
+    else if(this->console && state == USnavSequenceLoader::Cancelled)
+    {
+      ostringstream oss;
+      oss << "Loading cancelled, " << this->loadedFrames << " of " << this->numberOfFrames << " frames indexed\n";
+      this->console->insertPlainText(oss.str().c_str());
+    }
+  }
+  if(changed)
+  {
+    this->updateImage();
+    this->notifyChanges();
+  }
+  return this->loading;
+}
+
+bool vtkSlicerUSnavLogic::isLoaded()
+{
+  return !this->loading && this->loader.getState() == USnavSequenceLoader::Done;
+}
+
+void vtkSlicerUSnavLogic::cancelLoading()
+{
+  if(!this->loading)
+    return;
+  this->loader.cancel();
+  this->pollLoading();
+}
+
+double vtkSlicerUSnavLogic::getLoadingProgress()
+{
+  return this->loading ? this->loader.getProgress() : 1.0;
+}
+
+void vtkSlicerUSnavLogic::startPyramid()
+{
+  if(this->pyramid.estimateMemorySize(this->imageWidth, this->imageHeight, this->numberOfFrames) <= this->memoryBudget/2)
+    this->pyramid.start(this->frameSource);
+  else if(this->console)
+    this->console->insertPlainText("Sequence too large for the memory budget, scrubbing at full resolution\n");
+  this->applyMemoryBudget();
+}
+
+
+string vtkSlicerUSnavLogic::getCurrentTransformStatus()
+{
+  if(!this->isFrameValid(this->currentFrame))
+    return "INVALID";
+  unsigned int flags = this->analysis.getMotionFlags(this->currentFrame);
+  string status = "OK";
+  if(flags & USnavSequenceAnalysis::FastMotion)
+    status += ", fast motion";
+  if(flags & USnavSequenceAnalysis::PoseJump)
+    status += ", pose jump";
+  if(flags & USnavSequenceAnalysis::FrozenPose)
+    status += ", repeated pose";
+  if(flags & USnavSequenceAnalysis::TimeGap)
+    status += ", after a gap";
+  if(flags & USnavSequenceAnalysis::ImageMismatch)
+    status += ", image mismatch";
+  return status;
+}
+
+void vtkSlicerUSnavLogic::selectTrackedTransform()
+{
+  this->trackedTransform = this->transformStore.findName(this->trackedTransformName);
+  if(this->trackedTransform < 0)
+    this->trackedTransform = this->transformStore.findName("ProbeToTracker");
+  if(this->trackedTransform < 0)
+    this->trackedTransform = this->transformStore.findName("UltrasoundToTracker");
+}
+
+void vtkSlicerUSnavLogic::setTrackedTransformName(string name)
+{
+  this->trackedTransformName = name;
+  int previous = this->trackedTransform;
+  this->selectTrackedTransform();
+  if(previous != this->trackedTransform && this->numberOfFrames > 0)
+  {
+    this->updateImageToTrackerMatrices();
+    this->updateImage();
+    this->stateChanged(TransformsChanged);
+  }
+}
+
+string vtkSlicerUSnavLogic::getTrackedTransformName()
+{
+  if(this->trackedTransform < 0)
+    return "";
+  return this->transformStore.getName(this->trackedTransform);
+}
+
+bool vtkSlicerUSnavLogic::isFrameValid(int frame)
+{
+  if(this->trackedTransform < 0 || frame < 0 || frame >= this->transformStore.getNumberOfFrames())
+    return false;
+  return this->transformStore.isValid(this->trackedTransform, frame);
+}
+
+bool vtkSlicerUSnavLogic::getFrameTimestamp(int frame, double& seconds)
+{
+  if(frame < 0 || frame >= this->transformStore.getNumberOfFrames() || !this->transformStore.hasTimestamp(frame))
+    return false;
+  seconds = this->transformStore.getTimestamp(frame);
+  return true;
+}
+
+bool vtkSlicerUSnavLogic::getTransformMatrix(const string& name, int frame, vtkMatrix4x4* matrix)
+{
+  int id = this->transformStore.findName(name);
+  if(id < 0 || frame < 0 || frame >= this->transformStore.getNumberOfFrames() || !this->transformStore.hasMatrix(id, frame))
+    return false;
+  double m[16];
+  usnavMatrixFromFloat12(this->transformStore.getMatrix(id, frame), m);
+  matrix->DeepCopy(m);
+  return true;
+}
+
+string vtkSlicerUSnavLogic::getFrameFilename(int frame)
+{
+  return getDir(this->mhaPath) + frameBasename(frame, this->getTrackedTransformName()) + ".png";
+}
+
+bool vtkSlicerUSnavLogic::exportFrames(const string& directory, bool tiff, bool validOnly)
+{
+  if(this->numberOfFrames <= 0 || this->loading || directory.empty() || this->exporter.isRunning())
+    return false;
+
+  USnavFrameExporter::Job job;
+  job.source = this->frameSource;
+  job.format = tiff ? USnavFrameExporter::TIFF : USnavFrameExporter::PNG;
+  job.numberOfEncoders = 0;
+  string dir = directory;
+  if(dir[dir.size()-1] != '/' && dir[dir.size()-1] != '\\')
+    dir += '/';
+  job.sidecarFilename = dir + "poses.csv";
+  string transformName = this->getTrackedTransformName();
+  for(int i=0; i<this->numberOfFrames; i++)
+  {
+    bool valid = this->isFrameValid(i);
+    if(validOnly && !valid)
+      continue;
+    job.frames.push_back(i);
+    job.filenames.push_back(dir + frameBasename(i, transformName) + USnavFrameExporter::getExtension(job.format));
+    job.valid.push_back(valid ? 1 : 0);
+    const double* m = this->getImageToTrackerMatrix(i);
+    for(int k=0; k<12; k++)
+      job.poses.push_back(m ? m[k] : (k%5 == 0 ? 1.0 : 0.0));
+  }
+  return this->exporter.start(job);
+}
+
+bool vtkSlicerUSnavLogic::saveFrameRange(int first, int last, const string& path)
+{
+  if(this->numberOfFrames <= 0 || this->loading)
+    return false;
+  return USnavSequenceEditor::trim(this->mhaPath, first, last, path);
+}
+
+bool vtkSlicerUSnavLogic::saveValidFrames(const string& path)
+{
+  if(this->numberOfFrames <= 0 || this->loading)
+    return false;
+  vector<int> validFrames;
+  this->getValidFrames(validFrames);
+  return USnavSequenceEditor::extractFrames(this->mhaPath, validFrames, path);
+}
+
+void vtkSlicerUSnavLogic::cancelExport()
+{
+  this->exporter.cancel();
+}
+
+bool vtkSlicerUSnavLogic::isExporting()
+{
+  return this->exporter.isRunning();
+}
+
+double vtkSlicerUSnavLogic::getExportProgress()
+{
+  return this->exporter.getProgress();
+}
+
+int vtkSlicerUSnavLogic::getExportFailures()
+{
+  return this->exporter.getNumberOfFailures();
+}
+
+void vtkSlicerUSnavLogic::updateImage()
+{
+  checkFrame();
+  readImage_mha();
+  this->enhanceFrame(this->currentFrame, this->dataPointer);
+  this->displayImage(this->dataPointer, this->imageWidth, this->imageHeight, 1);
+  this->displayedLevel = 0;
+  this->markChanged(FrameChanged | CacheChanged);
+}
+
+void vtkSlicerUSnavLogic::displayImage(unsigned char* pixels, int width, int height, int factor)
+{
+  // Placement and pixels reach the node as one modification
+  int wasModifying = this->imageNode->StartModify();
+  this->importer->SetImportVoidPointer(pixels,1); // Save argument to 1 won't destroy the pointer when importer destroyed
+  this->importer->SetWholeExtent(0,width-1,0, height-1, 0, 0);
+  this->importer->SetDataExtentToWholeExtent();
+  // The buffer is usually the same with new content
+  this->importer->Modified();
+  this->importer->Update();
+
+  double imageToRAS[16];
+  if(this->getImageToRASMatrix(this->currentFrame, imageToRAS))
+  {
+    if(factor > 1)
+    {
+      // A reduced pixel covers factor x factor full resolution pixels,
+      // centered on the middle of that block
+      double levelToImage[16];
+      usnavIdentity4x4(levelToImage);
+      levelToImage[0] = levelToImage[5] = factor;
+      levelToImage[3] = levelToImage[7] = 0.5*(factor-1);
+      usnavMultiply4x4(imageToRAS, levelToImage, imageToRAS);
+    }
+    this->IJKToRASTransform->DeepCopy(imageToRAS);
+    this->imageNode->SetIJKToRASMatrix(this->IJKToRASTransform);
+  }
+  
+  if(this->imageNode->GetImageData() != this->imgData)
+    this->imageNode->SetAndObserveImageData(this->imgData);
+  this->imageNode->EndModify(wasModifying);
+
+  if(this->GetMRMLScene()) {
+    if(!this->GetMRMLScene()->IsNodePresent(this->imageNode))
+      this->GetMRMLScene()->AddNode(this->imageNode);
+  }
+  this->markChanged(ImageChanged);
+}
+
+void vtkSlicerUSnavLogic::notifyChanges()
+{
+  if(!this->pendingChanges)
+    return;
+  unsigned int changes = this->pendingChanges;
+  this->pendingChanges = 0;
+  this->Modified();
+  this->InvokeEvent(StateChangedEvent, &changes);
+}
+
+// =======================================================
+// Interface for navigating through frames
+// =======================================================
+void vtkSlicerUSnavLogic::nextImage()
+{
+  if(this->keyframesOnly && this->analysis.hasKeyframes())
+    this->currentFrame = this->analysis.getNextKeyframe(this->currentFrame);
+  else
+    this->currentFrame += 1;
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::previousImage()
+{
+  if(this->keyframesOnly && this->analysis.hasKeyframes())
+    this->currentFrame = this->analysis.getPreviousKeyframe(this->currentFrame);
+  else
+    this->currentFrame -= 1;
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::goToFrame(int frame)
+{
+  this->currentFrame = frame;
+  checkFrame();
+  // Seeking while playing carries on from there
+  if(this->cinePlayer.isPlaying())
+    this->cinePlayer.play(this->currentFrame, vtkTimerLog::GetUniversalTime());
+  this->updateImage();
+  this->notifyChanges();
+}
+
+bool vtkSlicerUSnavLogic::startCine()
+{
+  if(this->numberOfFrames <= 0 || this->loading)
+    return false;
+  this->cinePlayer.setSource(this->frameSource);
+  vector<double> timestamps;
+  for(int i=0; i<this->numberOfFrames; i++)
+  {
+    if(!this->transformStore.hasTimestamp(i))
+    {
+      timestamps.clear();
+      break;
+    }
+    timestamps.push_back(this->transformStore.getTimestamp(i));
+  }
+  this->cinePlayer.setTimestamps(timestamps);
+  if(this->console && !this->cinePlayer.hasTimestamps())
+    this->console->insertPlainText("No frame timestamps, playing at 30 fps\n");
+  this->cinePlayer.play(this->currentFrame, vtkTimerLog::GetUniversalTime());
+  return true;
+}
+
+void vtkSlicerUSnavLogic::stopCine()
+{
+  if(!this->cinePlayer.isPlaying())
+    return;
+  this->cinePlayer.stop();
+  this->updateImage();
+  this->notifyChanges();
+}
+
+int vtkSlicerUSnavLogic::updateCine()
+{
+  int frame = this->cinePlayer.update(vtkTimerLog::GetUniversalTime());
+  if(frame >= 0)
+  {
+    // Frames read ahead bypass the cache, which they would only flush
+    this->currentFrame = frame;
+    if(this->cinePlayer.copyFrame(this->dataPointer))
+    {
+      if(!this->roi.isFullFrame())
+        this->roi.mask(this->dataPointer);
+    }
+    else if(this->readFrame(frame, this->dataPointer))
+      this->markChanged(CacheChanged);
+    this->enhanceFrame(frame, this->dataPointer);
+    this->displayImage(this->dataPointer, this->imageWidth, this->imageHeight, 1);
+    this->displayedLevel = 0;
+    this->stateChanged(FrameChanged);
+  }
+  if(!this->cinePlayer.isPlaying())
+    return -1;
+  double wait = this->cinePlayer.getNextDueTime() - vtkTimerLog::GetUniversalTime();
+  return wait > 0.0 ? (int)(1000*wait) : 0;
+}
+
+void vtkSlicerUSnavLogic::setCineSpeed(double speed)
+{
+  this->cinePlayer.setSpeed(speed);
+}
+
+void vtkSlicerUSnavLogic::previewFrame(int frame)
+{
+  this->currentFrame = frame;
+  checkFrame();
+  const int level = 1;
+  const unsigned char* pixels = this->pyramid.getFrame(level, this->currentFrame);
+  if(!pixels)
+  {
+    // Not built yet, fall back to full resolution
+    this->updateImage();
+    this->notifyChanges();
+    return;
+  }
+  int width = this->pyramid.getLevelWidth(level);
+  int height = this->pyramid.getLevelHeight(level);
+  this->previewBuffer.assign(pixels, pixels + width*height);
+  if(this->enhancement.isEnabled())
+  {
+    // Small enough to process every time
+    vector<unsigned char> level(this->previewBuffer);
+    this->enhancement.apply(&level[0], &this->previewBuffer[0], width, height);
+  }
+  this->displayImage(&this->previewBuffer[0], width, height, this->pyramid.getLevelFactor(level));
+  this->displayedLevel = level;
+  this->stateChanged(FrameChanged);
+}
+
+void vtkSlicerUSnavLogic::setEnhancement(const USnavImageEnhancement::Parameters& parameters)
+{
+  this->enhancement.setParameters(parameters);
+  if(this->numberOfFrames <= 0 || this->cinePlayer.isPlaying())
+    return; // The next frame played is processed with them
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::refineFrame()
+{
+  if(this->displayedLevel == 0)
+    return;
+  this->updateImage();
+  this->notifyChanges();
+}
+
+double vtkSlicerUSnavLogic::getPyramidProgress()
+{
+  return this->pyramid.getProgress();
+}
+
+bool vtkSlicerUSnavLogic::waitForPyramid()
+{
+  this->pyramid.wait();
+  return this->pyramid.isComplete();
+}
+
+void vtkSlicerUSnavLogic::setMemoryBudget(size_t bytes)
+{
+  this->memoryBudget = bytes;
+  if(this->pyramid.getMemorySize() > bytes/2)
+    this->pyramid.stop();
+  this->applyMemoryBudget();
+  this->stateChanged(CacheChanged);
+}
+
+void vtkSlicerUSnavLogic::applyMemoryBudget()
+{
+  size_t pyramidBytes = this->pyramid.getMemorySize();
+  this->frameCache.setBudget(this->memoryBudget > pyramidBytes ? this->memoryBudget - pyramidBytes : 0);
+}
+
+bool vtkSlicerUSnavLogic::detectROI(int samples)
+{
+  bool found = this->findROI(samples);
+  this->updateImage();
+  this->notifyChanges();
+  return found;
+}
+
+bool vtkSlicerUSnavLogic::findROI(int samples)
+{
+  if(this->numberOfFrames < 2 || samples < 2)
+    return false;
+  samples = min(samples, this->numberOfFrames);
+  USnavFrameROI detected;
+  detected.reset(this->imageWidth, this->imageHeight);
+  this->roi.reset(this->imageWidth, this->imageHeight);
+  vector<vector<unsigned char> > frames(samples, vector<unsigned char>((size_t)this->imageWidth*this->imageHeight));
+  vector<const unsigned char*> pointers;
+  for(int s=0; s<samples; s++)
+  {
+    int frame = (int)(((vtkTypeInt64)s*(this->numberOfFrames-1))/(samples-1));
+    if(this->readFrame(frame, &frames[s][0]))
+      pointers.push_back(&frames[s][0]);
+  }
+  // Not worth packing when the fan fills the frame
+  bool found = detected.detect(pointers) && detected.getCoverage() < 0.95;
+  if(found)
+    this->roi = detected;
+  this->roiChanged();
+  return found;
+}
+
+void vtkSlicerUSnavLogic::setROIRectangle(int x0, int y0, int x1, int y1)
+{
+  this->roi.reset(this->imageWidth, this->imageHeight);
+  this->roi.setRectangle(x0, y0, x1, y1);
+  this->roiChanged();
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::resetROI()
+{
+  this->roi.reset(this->imageWidth, this->imageHeight);
+  this->roiChanged();
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::roiChanged()
+{
+  // Cached frames were stored for the previous region
+  this->frameCache.clear();
+  if(this->console && !this->roi.isFullFrame())
+  {
+    ostringstream oss;
+    oss << "Frame ROI: rows " << this->roi.getFirstRow() << "-" << this->roi.getEndRow()
+        << ", " << (int)(100*this->roi.getCoverage()) << "% of the frame\n";
+    this->console->insertPlainText(oss.str().c_str());
+  }
+}
+
+USnavFrameCache::Statistics vtkSlicerUSnavLogic::getFrameCacheStatistics()
+{
+  return this->frameCache.getStatistics();
+}
+
+const unsigned char* vtkSlicerUSnavLogic::getThumbnail(int frame, int level, int& width, int& height)
+{
+  width = this->pyramid.getLevelWidth(level);
+  height = this->pyramid.getLevelHeight(level);
+  return this->pyramid.getFrame(level, frame);
+}
+
+void vtkSlicerUSnavLogic::nextValidFrame()
+{
+  int frame = 0;
+  for(int i=0; i<this->getNumberOfFrames(); i++)
+  {
+    frame = (this->currentFrame + i + 1)%this->getNumberOfFrames();
+    if(this->isFrameUsable(frame))
+      break;
+  }
+  this->currentFrame = frame;
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::previousValidFrame()
+{
+  int frame = 0;
+  for(int i=0; i<this->getNumberOfFrames(); i++)
+  {
+    frame = this->currentFrame-i-1;
+    if(frame < 0)
+      frame = this->getNumberOfFrames() + frame;
+    if(this->isFrameUsable(frame))
+      break;
+  }
+  this->currentFrame = frame;
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::nextSweep()
+{
+  int frame = this->analysis.getNextSweep(this->currentFrame);
+  if(frame < 0)
+    return;
+  this->currentFrame = frame;
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::previousSweep()
+{
+  int frame = this->analysis.getPreviousSweep(this->currentFrame);
+  if(frame < 0)
+    return;
+  this->currentFrame = frame;
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::nextInvalidFrame()
+{
+  int frame = 0;
+  for(int i=0; i<this->getNumberOfFrames(); i++)
+  {
+    frame = (this->currentFrame + i + 1)%this->getNumberOfFrames();
+    if(!this->isFrameValid(frame))
+      break;
+  }
+  this->currentFrame = frame;
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::previousInvalidFrame()
+{
+  int frame = 0;
+  for(int i=0; i<this->getNumberOfFrames(); i++)
+  {
+    frame = this->currentFrame-i-1;
+    if(frame < 0)
+      frame = this->getNumberOfFrames() + frame;
+    if(!this->isFrameValid(frame))
+      break;
+  }
+  this->currentFrame = frame;
+  this->updateImage();
+  this->notifyChanges();
+}
+
+void vtkSlicerUSnavLogic::checkFrame()
+{
+  if(this->currentFrame >= this->numberOfFrames)
+    this->currentFrame = 0;
+  if(this->currentFrame < 0)
+    this->currentFrame = this->getNumberOfFrames()-1;
+}
+
+void vtkSlicerUSnavLogic::findMatchingUS(vtkMatrix4x4* stylusMatrix)
+{
+  double tip[3] = { stylusMatrix->GetElement(0,3), stylusMatrix->GetElement(1,3), stylusMatrix->GetElement(2,3) };
+
+  // Restrict to frames seen from the same direction when asked to
+  bool restricted = this->matchingMaxAngle > 0 && !this->orientationIndex.isEmpty();
+  if(restricted)
+    this->findFramesWithOrientation(stylusMatrix, this->matchingMaxAngle, this->matchCandidates);
+
+  // Same sweeps and frames for every metric; the plane distance can be warm
+  // started from the previous query, with the same result
+  if(this->incrementalMatching && this->matchingMetric == 0 && !restricted)
+    this->sweepIndex.findNearestIncremental(tip, this->matchingResultCount, this->matches);
+  else
+  {
+    double pose[16];
+    vtkMatrix4x4::DeepCopy(pose, stylusMatrix);
+    USnavMatchQuery query;
+    this->sweepIndex.makeQuery(pose, query);
+    this->sweepIndex.findBest(query, USnavMatchFrames::getMetricFunction(this->matchingMetric),
+                              restricted ? &this->matchCandidates : NULL, this->matchingResultCount, this->matches);
+  }
+
+  this->matchScores.clear();
+  if(this->rerankCount > 1 && this->mrimageNode)
+    this->rerankMatches();
+
+  if(this->console && !this->matches.empty())
+  {
+    ostringstream oss;
+    oss << "Best match: frame " << this->matches[0].second << " (" << this->matches[0].first
+        << (this->matchingMetric == 0 ? " mm" : "");
+    if(!this->matchScores.empty())
+      oss << ", similarity " << this->matchScores[0];
+    oss << ")\n";
+    this->console->insertPlainText(oss.str().c_str());
+  }
+}
+
+void vtkSlicerUSnavLogic::setMrimageNode(vtkMRMLScalarVolumeNode* node)
+{
+  if(node != this->mrimageNode)
+  {
+    int wasModifying = this->StartModify();
+    if(this->mrimageNode)
+      vtkSetAndObserveMRMLNodeMacro( this->mrimageNode, 0 );
+    this->mrimageNode = NULL;
+    if(node)
+    {
+      // New voxels, geometry or parent transform invalidate the sampler's copy
+      vtkMRMLScalarVolumeNode* newNode = NULL;
+      vtkSmartPointer< vtkIntArray > events = vtkSmartPointer< vtkIntArray >::New();
+      events->InsertNextValue(vtkCommand::ModifiedEvent);
+      events->InsertNextValue(vtkMRMLVolumeNode::ImageDataModifiedEvent);
+      events->InsertNextValue(vtkMRMLTransformableNode::TransformModifiedEvent);
+      vtkSetAndObserveMRMLNodeEventsMacro( newNode, node, events );
+      this->mrimageNode = newNode;
+    }
+    this->EndModify( wasModifying );
+  }
+  this->mrSamplerOutdated = true;
+  this->coverageOutdated = true;
+}
+
+void vtkSlicerUSnavLogic::updateMrSampler()
+{
+  if(!this->mrSamplerOutdated)
+    return;
+  this->mrSamplerOutdated = false;
+  this->mrSampler.clear();
+  if(!this->mrimageNode || !this->mrimageNode->GetImageData())
+    return;
+  vtkSmartPointer<vtkMatrix4x4> rasToIJK = vtkSmartPointer<vtkMatrix4x4>::New();
+  this->mrimageNode->GetRASToIJKMatrix(rasToIJK);
+  double matrix[16];
+  vtkMatrix4x4::DeepCopy(matrix, rasToIJK);
+  this->mrSampler.setVolume(this->mrimageNode->GetImageData(), matrix);
+}
+
+bool vtkSlicerUSnavLogic::getImageToRASMatrix(int frame, double imageToRAS[16])
+{
+  const double* imageToTracker = this->getImageToTrackerMatrix(frame);
+  if(!imageToTracker)
+    return false;
+  double trackerToRAS[16];
+  vtkMatrix4x4::DeepCopy(trackerToRAS, this->TrackerToRASTransform);
+  usnavMultiply4x4(trackerToRAS, imageToTracker, imageToRAS);
+  return true;
+}
+
+void vtkSlicerUSnavLogic::setCoverageCellSize(double mm)
+{
+  if(mm <= 0 || mm == this->coverageCellSize)
+    return;
+  this->coverageCellSize = mm;
+  this->coverageOutdated = true;
+}
+
+// The grid follows the MR voxels, a whole number of them per cell and
+// axis: cell (i,j,k) is centred between voxels i*c .. (i+1)*c-1 on each axis
+void vtkSlicerUSnavLogic::updateCoverageIndex()
+{
+  if(!this->coverageOutdated)
+    return;
+  this->coverageOutdated = false;
+  this->coverageIndex.clear();
+  if(!this->mrimageNode || !this->mrimageNode->GetImageData())
+    return;
+  double start = vtkTimerLog::GetUniversalTime();
+  int dimensions[3];
+  double spacing[3];
+  this->mrimageNode->GetImageData()->GetDimensions(dimensions);
+  this->mrimageNode->GetSpacing(spacing);
+  int size[3];
+  double ijkToGrid[16];
+  usnavIdentity4x4(ijkToGrid);
+  for(int k=0; k<3; k++)
+  {
+    int voxels = max(1, (int)floor(this->coverageCellSize/max(fabs(spacing[k]), 1e-6) + 0.5));
+    size[k] = (dimensions[k] + voxels - 1)/voxels;
+    ijkToGrid[5*k] = 1.0/voxels;
+    ijkToGrid[4*k+3] = 0.5/voxels - 0.5;
+  }
+  vtkSmartPointer<vtkMatrix4x4> rasToIJK = vtkSmartPointer<vtkMatrix4x4>::New();
+  this->mrimageNode->GetRASToIJKMatrix(rasToIJK);
+  double matrix[16], trackerToRAS[16], trackerToGrid[16];
+  vtkMatrix4x4::DeepCopy(matrix, rasToIJK);
+  usnavMultiply4x4(ijkToGrid, matrix, this->rasToCoverage);
+  vtkMatrix4x4::DeepCopy(trackerToRAS, this->TrackerToRASTransform);
+  usnavMultiply4x4(this->rasToCoverage, trackerToRAS, trackerToGrid);
+
+  vector<int> validFrames;
+  this->getValidFrames(validFrames);
+  this->coverageIndex.build(this->imageToTracker.get(), validFrames, this->imageWidth, this->imageHeight,
+                            trackerToGrid, size);
+  if(this->console)
+  {
+    ostringstream oss;
+    oss << "Coverage: " << validFrames.size() << " frames over " << this->coverageIndex.getNumberOfCoveredCells()
+        << " of " << this->coverageIndex.getNumberOfCells() << " cells in "
+        << vtkTimerLog::GetUniversalTime() - start << " s\n";
+    this->console->insertPlainText(oss.str().c_str());
+  }
+}
+
+void vtkSlicerUSnavLogic::findFramesCoveringRegion(const double rasBounds[6], vector<int>& frames)
+{
+  frames.clear();
+  this->updateCoverageIndex();
+  if(this->coverageIndex.isEmpty())
+    return;
+  // Cells overlapping the grid aligned box around the 8 corners
+  int lo[3] = { INT_MAX, INT_MAX, INT_MAX };
+  int hi[3] = { INT_MIN, INT_MIN, INT_MIN };
+  int size[3];
+  this->coverageIndex.getSize(size);
+  for(int c=0; c<8; c++)
+  {
+    double corner[3] = { rasBounds[c & 1], rasBounds[2 + ((c >> 1) & 1)], rasBounds[4 + ((c >> 2) & 1)] };
+    double p[3];
+    usnavTransformPoint(this->rasToCoverage, corner, p);
+    for(int k=0; k<3; k++)
+    {
+      // Clamped first, the box may reach far outside the grid
+      double x = max(-1.0, min(p[k], (double)size[k]));
+      lo[k] = min(lo[k], (int)floor(x + 0.5));
+      hi[k] = max(hi[k], (int)floor(x + 0.5));
+    }
+  }
+  this->coverageIndex.findFramesInCells(lo, hi, frames);
+}
+
+void vtkSlicerUSnavLogic::findFramesCoveringPoint(const double ras[3], vector<int>& frames)
+{
+  frames.clear();
+  this->updateCoverageIndex();
+  if(this->coverageIndex.isEmpty())
+    return;
+  double p[3];
+  usnavTransformPoint(this->rasToCoverage, ras, p);
+  int cell = this->coverageIndex.findCell(p);
+  if(cell >= 0)
+    frames.assign(this->coverageIndex.getCellFrames(cell),
+                  this->coverageIndex.getCellFrames(cell) + this->coverageIndex.getCellCount(cell));
+}
+
+bool vtkSlicerUSnavLogic::getCoverageMap(vector<unsigned short>& counts, int dimensions[3], vtkMatrix4x4* ijkToRAS)
+{
+  this->updateCoverageIndex();
+  if(this->coverageIndex.isEmpty())
+    return false;
+  this->coverageIndex.getSize(dimensions);
+  counts.resize((size_t)this->coverageIndex.getNumberOfCells());
+  this->coverageIndex.getCoverage(&counts[0]);
+  double gridToRAS[16];
+  usnavInvertAffine4x4(this->rasToCoverage, gridToRAS);
+  ijkToRAS->DeepCopy(gridToRAS);
+  return true;
+}
+
+bool vtkSlicerUSnavLogic::registerToMR()
+{
+  this->updateMrSampler();
+  if(this->mrSampler.isEmpty() || this->numberOfFrames <= 0)
+    return false;
+  vector<int> candidates, frames;
+  if(this->analysis.hasKeyframes())
+    candidates = this->analysis.getKeyframes();
+  else
+    this->getValidFrames(candidates);
+  for(size_t i=0; i<candidates.size(); i++)
+    if(this->isFrameUsable(candidates[i]))
+      frames.push_back(candidates[i]);
+  int count = min((int)frames.size(), max(this->registrationFrames, 1));
+  if(count <= 0)
+    return false;
+
+  double start = vtkTimerLog::GetUniversalTime();
+  USnavRigidRegistration registration;
+  vector<unsigned char> pixels((size_t)this->imageWidth*this->imageHeight);
+  for(int i=0; i<count; i++)
+  {
+    int frame = frames[(size_t)i*frames.size()/count];
+    if(this->readFrame(frame, &pixels[0]))
+      registration.addFrame(this->getImageToTrackerMatrix(frame), &pixels[0], this->imageWidth, this->imageHeight,
+                            this->registrationStride, this->roi.isFullFrame() ? NULL : &this->roi);
+  }
+  double initial[16];
+  vtkMatrix4x4::DeepCopy(initial, this->TrackerToRASTransform);
+  USnavRigidRegistration::Result result;
+  bool ok = registration.run(this->mrSampler, initial, this->registrationParameters, result);
+  if(this->console)
+  {
+    ostringstream oss;
+    if(ok)
+      oss << "Registration to MR: " << count << " frames, " << registration.getNumberOfPoints() << " points, NMI "
+          << result.initialMetric << " -> " << result.finalMetric << " after " << result.evaluations
+          << " evaluations in " << vtkTimerLog::GetUniversalTime() - start << " s\n";
+    else
+      oss << "Registration to MR failed: the frames do not overlap the volume\n";
+    this->console->insertPlainText(oss.str().c_str());
+  }
+  if(!ok)
+    return false;
+  this->TrackerToRASTransform->DeepCopy(result.trackerToRAS);
+  this->registrationMetric = result.finalMetric;
+  this->coverageOutdated = true;
+  this->updateImage();
+  this->markChanged(TransformsChanged);
+  this->notifyChanges();
+  return result.finalMetric > result.initialMetric;
+}
+
+void vtkSlicerUSnavLogic::resetRegistration()
+{
+  this->TrackerToRASTransform->Identity();
+  this->registrationMetric = 0.0;
+  this->coverageOutdated = true;
+  if(this->numberOfFrames > 0)
+    this->updateImage();
+  this->stateChanged(TransformsChanged);
+}
+
+double vtkSlicerUSnavLogic::getFrameSimilarity(int frame)
+{
+  this->updateMrSampler();
+  return this->computeFrameSimilarity(frame);
+}
+
+// Thread safe once updateMrSampler() has run: frames come from the cache
+double vtkSlicerUSnavLogic::computeFrameSimilarity(int frame)
+{
+  double imageToRAS[16];
+  if(!this->getImageToRASMatrix(frame, imageToRAS) || this->mrSampler.isEmpty() || frame >= this->numberOfFrames)
+    return 0.0;
+  int stride = this->rerankStride > 0 ? this->rerankStride : 1;
+  int columns = this->imageWidth / stride;
+  int rows = this->imageHeight / stride;
+  vector<unsigned char> pixels((size_t)this->imageWidth*this->imageHeight);
+  if(columns <= 0 || rows <= 0 || !this->readFrame(frame, &pixels[0]))
+    return 0.0;
+
+  size_t n = (size_t)columns*rows;
+  vector<float> us(n), mr(n);
+  vector<unsigned char> inside(n);
+  for(int y=0; y<rows; y++)
+  {
+    const unsigned char* line = &pixels[(size_t)y*stride*this->imageWidth];
+    for(int x=0; x<columns; x++)
+      us[(size_t)y*columns + x] = line[x*stride];
+  }
+  this->mrSampler.samplePlane(imageToRAS, columns, rows, stride, &mr[0], &inside[0]);
+  // Only the fan is ultrasound data
+  if(!this->roi.isFullFrame())
+    for(int y=0; y<rows; y++)
+      for(int x=0; x<columns; x++)
+        if(!this->roi.contains(x*stride, y*stride))
+          inside[(size_t)y*columns + x] = 0;
+  if(this->similarityMeasure == USNAV_GRADIENT_CORRELATION)
+    return usnavGradientCorrelation(&us[0], &mr[0], &inside[0], columns, rows);
+  return usnavNormalizedCrossCorrelation(&us[0], &mr[0], &inside[0], (int)n);
+}
+
+struct RerankData
+{
+  vtkSlicerUSnavLogic* logic;
+  const vector<pair<double,int> >* matches;
+  vector<double>* scores;
+};
+
+void vtkSlicerUSnavLogic::rerankChunk(int begin, int end, int vtkNotUsed(threadId), void* userData)
+{
+  RerankData* data = static_cast<RerankData*>(userData);
+  for(int i=begin; i<end; i++)
+    (*data->scores)[i] = data->logic->computeFrameSimilarity((*data->matches)[i].second);
+}
+
+void vtkSlicerUSnavLogic::rerankMatches()
+{
+  this->updateMrSampler();
+  if(this->mrSampler.isEmpty())
+    return;
+  int n = min(this->rerankCount, (int)this->matches.size());
+  vector<double> scores(n);
+  RerankData data;
+  data.logic = this;
+  data.matches = &this->matches;
+  data.scores = &scores;
+  usnavParallelFor(n, 1, &vtkSlicerUSnavLogic::rerankChunk, &data);
+
+  // Most similar first; ties keep the geometric order
+  vector<pair<double,int> > order(n);
+  for(int i=0; i<n; i++)
+    order[i] = pair<double,int>(-scores[i], i);
+  sort(order.begin(), order.end());
+  vector<pair<double,int> > reranked(this->matches.begin(), this->matches.begin()+n);
+  this->matchScores.resize(n);
+  for(int i=0; i<n; i++)
+  {
+    this->matches[i] = reranked[order[i].second];
+    this->matchScores[i] = scores[order[i].second];
+  }
+}
+
+struct BatchMatchData
+{
+  const double* poses;
+  int count;
+  double maxAngle;
+  const USnavSweepIndex* sweepIndex;
+  USnavMatchFrames::MatchFunction metric;
+  const USnavOrientationIndex* orientationIndex;
+  vector<vector<pair<double,int> > >* results;
+};
+
+// Matches poses [begin,end); every thread only reads the shared frame
+// geometry and writes its own result slots
+void batchMatchChunk(int begin, int end, int vtkNotUsed(threadId), void* userData)
+{
+  BatchMatchData* data = static_cast<BatchMatchData*>(userData);
+  vector<int> candidates;
+  for(int p=begin; p<end; p++)
+  {
+    const double* pose = data->poses + 16*(size_t)p;
+    bool restricted = data->maxAngle > 0 && !data->orientationIndex->isEmpty();
+    if(restricted)
+    {
+      double q[4];
+      USnavOrientationIndex::matrixToQuaternion(pose, q);
+      candidates.clear();
+      data->orientationIndex->findWithinAngle(q, data->maxAngle, candidates);
+    }
+    USnavMatchQuery query;
+    data->sweepIndex->makeQuery(pose, query);
+    data->sweepIndex->findBest(query, data->metric, restricted ? &candidates : NULL, data->count, (*data->results)[p]);
+  }
+}
+
+void vtkSlicerUSnavLogic::findMatchingUSBatch(const double* stylusPoses, int numberOfPoses, vector<vector<pair<double,int> > >& results, int numberOfThreads)
+{
+  results.assign(numberOfPoses > 0 ? numberOfPoses : 0, vector<pair<double,int> >());
+  BatchMatchData data;
+  data.poses = stylusPoses;
+  data.count = this->matchingResultCount;
+  data.maxAngle = this->matchingMaxAngle;
+  data.sweepIndex = &this->sweepIndex;
+  data.metric = USnavMatchFrames::getMetricFunction(this->matchingMetric);
+  data.orientationIndex = &this->orientationIndex;
+  data.results = &results;
+  usnavParallelFor(numberOfPoses, 16, batchMatchChunk, &data, numberOfThreads);
+}
+
+void vtkSlicerUSnavLogic::findFramesWithOrientation(vtkMatrix4x4* orientation, double maxDegrees, vector<int>& frames)
+{
+  frames.clear();
+  double m[16];
+  double q[4];
+  vtkMatrix4x4::DeepCopy(m, orientation);
+  USnavOrientationIndex::matrixToQuaternion(m, q);
+  this->orientationIndex.findWithinAngle(q, maxDegrees, frames);
+  sort(frames.begin(), frames.end());
 }
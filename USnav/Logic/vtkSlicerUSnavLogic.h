@@ -36,7 +36,9 @@
 #include <set>
 
 // VTK includes
+#include <vtkCommand.h>
 #include <vtkImageData.h>
+#include <vtkImageImport.h>
 #include <vtkMatrix4x4.h>
 #include <vtkMRMLLinearTransformNode.h>
 
@@ -44,6 +46,24 @@
 #include <QTextEdit>
 
 #include "vtkSlicerUSnavModuleLogicExport.h"
+#include "USnavAlignedArray.h"
+#include "USnavCinePlayer.h"
+#include "USnavCoverageIndex.h"
+#include "USnavFrameCache.h"
+#include "USnavFrameExporter.h"
+#include "USnavFrameROI.h"
+#include "USnavFrameMatcher.h"
+#include "USnavFrameReader.h"
+#include "USnavFramePyramid.h"
+#include "USnavImageEnhancement.h"
+#include "USnavMatchPolicies.h"
+#include "USnavOrientationIndex.h"
+#include "USnavRigidRegistration.h"
+#include "USnavSequenceAnalysis.h"
+#include "USnavSequenceLoader.h"
+#include "USnavSweepIndex.h"
+#include "USnavTransformStore.h"
+#include "USnavVolumeSampler.h"
 
 #include "util_macros.h"
 
@@ -59,6 +79,20 @@ public:
   vtkTypeMacro(vtkSlicerUSnavLogic, vtkSlicerModuleLogic);
   void PrintSelf(ostream& os, vtkIndent indent);
 
+  // Invoked once per user action with the StateChange bits of what changed
+  // as call data (unsigned int*)
+  enum { StateChangedEvent = vtkCommand::UserEvent + 1 };
+  enum StateChange
+  {
+    FrameChanged = 1,       // current frame and its transform status
+    ImageChanged = 2,       // pixels or placement of the displayed image
+    SequenceChanged = 4,    // image dimensions and number of frames
+    TransformsChanged = 8,  // available and tracked transforms
+    CacheChanged = 16,      // frame cache statistics
+    KeyframesChanged = 32,
+    AllChanged = 63
+  };
+
 protected:
   vtkSlicerUSnavLogic();
   virtual ~vtkSlicerUSnavLogic();
@@ -80,27 +114,145 @@ private:
   
   // Attributes
   string mhaPath;
-  vector<vector<float> > transforms;
-  vector<string> filenames;
-  vector<bool> transformsValidity;
+  USnavTransformStore transformStore;
+  // Transform placing the image: ProbeToTracker unless chosen otherwise
+  int trackedTransform;
+  string trackedTransformName;
   set<string> availableTransforms;
   
   vtkSmartPointer<vtkMatrix4x4> ImageToProbeTransform;
+  // Placement of the displayed frame, refilled for every frame
+  vtkSmartPointer<vtkMatrix4x4> IJKToRASTransform;
+  // Reused for every frame; only the imported pointer and extent change
+  vtkSmartPointer<vtkImageImport> importer;
   vtkSmartPointer<vtkImageData> imgData;
   vtkMRMLScalarVolumeNode* imageNode;
   vtkMRMLScalarVolumeNode* mrimageNode;
   vtkMRMLLinearTransformNode* stylusTransform;
+  vtkMRMLLinearTransformNode* calibrationTransform;
+  // ImageToTracker = ProbeToTracker * ImageToProbe for every frame, and its
+  // inverse, as 16 row-major doubles per frame. Identity where no pose.
+  USnavAlignedArray<double> imageToTracker;
+  USnavAlignedArray<double> trackerToImage;
+  // Image plane orientation of every valid frame
+  USnavOrientationIndex orientationIndex;
+  // Every valid frame by sweep, for stylus matching under any metric
+  USnavSweepIndex sweepIndex;
+  // Metric of USnavMatchFrames, 0 being the plane distance
+  int matchingMetric;
+  // The matchingResultCount frames closest to the stylus tip, closest first
+  vector<pair<double,int> > matches;
+  // Frames within matchingMaxAngle of the last query; kept so that queries
+  // reuse its storage
+  vector<int> matchCandidates;
+  int matchingResultCount;
+  // Warm start each query from the previous one (same result, less work)
+  bool incrementalMatching;
+  // Only frames within this angle of the stylus are matched, 0 for all
+  double matchingMaxAngle;
+  // The first rerankCount matches are reordered by image similarity with
+  // the MR volume resampled on their plane, every rerankStride pixels.
+  // 0 or 1 keeps the geometric order.
+  int rerankCount;
+  int rerankStride;
+  int similarityMeasure;
+  vector<double> matchScores;
+  USnavVolumeSampler mrSampler;
+  bool mrSamplerOutdated;
+  // Correction from tracker to MR space found by registerToMR(), applied
+  // where frames meet the MR volume: the image placement and similarity
+  vtkSmartPointer<vtkMatrix4x4> TrackerToRASTransform;
+  // Valid frames crossing each cell of a coarse grid over the MR volume,
+  // coverageCellSize mm wide; rebuilt on first use after the poses, the
+  // calibration, the registration or the volume change
+  USnavCoverageIndex coverageIndex;
+  double coverageCellSize;
+  bool coverageOutdated;
+  double rasToCoverage[16];
+  USnavRigidRegistration::Parameters registrationParameters;
+  int registrationFrames;
+  int registrationStride;
+  double registrationMetric;
+  // Keyframes of the valid frames; with keyframesOnly, matching and
+  // previous/next frame only consider them
+  USnavSequenceAnalysis analysis;
+  USnavSequenceAnalysis::KeyframeParameters keyframeParameters;
+  bool keyframesOnly;
+  // Kinematics are recomputed with the poses; with skipUnstableFrames,
+  // flagged frames are left out of matching and valid frame navigation
+  USnavSequenceAnalysis::KinematicsParameters kinematicsParameters;
+  bool skipUnstableFrames;
+  // Sweeps are cut with the kinematics; matching searches the sweeps
+  // around the stylus
+  USnavSequenceAnalysis::SweepParameters sweepParameters;
+  // Block matching between consecutive frames checks the poses; frames
+  // that disagree are flagged like unstable ones
+  USnavSequenceAnalysis::ImageMotionParameters imageMotionParameters;
   unsigned char* dataPointer;
+  vector<unsigned char> previewBuffer;
+  // Display only: analysis, matching and export see the raw frames
+  USnavImageEnhancement enhancement;
+  vector<unsigned char> enhancedBuffer;
+  USnavFrameSource frameSource;
   int imageWidth;
   int imageHeight;
   int currentFrame;
   int numberOfFrames;
+  int displayedLevel;
+  
+  USnavFramePyramid pyramid;
+  // Every decoded frame goes through this cache; the pyramid is charged to
+  // the same budget
+  USnavFrameCache frameCache;
+  size_t memoryBudget;
+  USnavFrameCache::Key pinnedKey;
+  // Only this part of the frames is read and cached, zero elsewhere
+  USnavFrameROI roi;
+  bool autoDetectROI;
+  USnavFrameExporter exporter;
+  // Header parsing runs in the background; pollLoading() brings in what it
+  // has read so far
+  USnavSequenceLoader loader;
+  bool loading;
+  bool imageInfoLoaded;
+  int loadedFrames;
+  // Frames the indexes were last rebuilt with while loading
+  int indexedFrames;
+  USnavCinePlayer cinePlayer;
+  // StateChange bits not notified yet
+  unsigned int pendingChanges;
   
   QTextEdit* console;
   
   
   // Private function
   void checkFrame();
+  void markChanged(unsigned int changes) { this->pendingChanges |= changes; }
+  // Modified() and one StateChangedEvent for everything marked so far
+  void notifyChanges();
+  void stateChanged(unsigned int changes) { this->markChanged(changes); this->notifyChanges(); }
+  void selectTrackedTransform();
+  void updateImageToTrackerMatrices();
+  // Matrices of frames [begin,end) only, the indexes are left as they are
+  void computeImageToTracker(int begin, int end);
+  void updateMatchingIndex();
+  void getValidFrames(vector<int>& frames);
+  void updateKinematics();
+  bool isFrameUsable(int frame);
+  static bool keyframeContent(int frame, vector<unsigned char>& pixels, void* userData);
+  void displayImage(unsigned char* pixels, int width, int height, int factor);
+  bool readFrame(int frame, unsigned char* pixels);
+  USnavFrameCache::Key getFrameKey(int frame);
+  void enhanceFrame(int frame, unsigned char* pixels);
+  bool findROI(int samples);
+  void roiChanged();
+  void applyMemoryBudget();
+  void startPyramid();
+  void updateMrSampler();
+  void rerankMatches();
+  double computeFrameSimilarity(int frame);
+  bool getImageToRASMatrix(int frame, double imageToRAS[16]);
+  static void rerankChunk(int begin, int end, int threadId, void* userData);
 public:
   // Read image logic
   void readImage_mha();
@@ -114,14 +266,187 @@ public:
   GET(int, currentFrame, CurrentFrame);
   GET(int, numberOfFrames, NumberOfFrames);
   GET(set<string>, availableTransforms, AvailableTransforms);
-  GETSET(vtkMRMLScalarVolumeNode*, mrimageNode, MrimageNode);
+  GET(vtkMRMLScalarVolumeNode*, mrimageNode, MrimageNode);
+  void setMrimageNode(vtkMRMLScalarVolumeNode*);
   GETSET(QTextEdit*, console, Console);
+  // Loads the whole header before returning
   void setMhaPath(string path);
+  // Returns at once; call pollLoading() until it returns false. The first
+  // frame is shown as soon as the image dimensions are known, and frames
+  // become valid as their transforms are parsed. The same path is loaded
+  // again unless it is loading or was loaded completely.
+  void loadMhaPath(string path);
+  bool pollLoading();
+  void cancelLoading();
+  GET(bool, loading, Loading);
+  // The whole sequence was read: not loading, cancelled or failed
+  bool isLoaded();
+  double getLoadingProgress();
   string getCurrentTransformStatus();
+  // Status of the tracked transform at `frame`
+  bool isFrameValid(int frame);
+  // Seq_FrameNNNN_Timestamp in seconds; false if the frame has none
+  bool getFrameTimestamp(int frame, double& seconds);
+  void setTrackedTransformName(string name);
+  string getTrackedTransformName();
+  // Any transform of the sequence, e.g. "StylusToTracker"; false if absent
+  bool getTransformMatrix(const string& name, int frame, vtkMatrix4x4* matrix);
+  string getFrameFilename(int frame);
+  // Writes every frame, or only the valid ones, into `directory` as PNG or
+  // TIFF named like getFrameFilename(), with a poses.csv sidecar holding
+  // each ImageToTracker matrix. Runs in the background; false if it could
+  // not start.
+  bool exportFrames(const string& directory, bool tiff, bool validOnly);
+  void cancelExport();
+  bool isExporting();
+  double getExportProgress();
+  int getExportFailures();
+  // Writes frames [first,last], or the valid frames, of the loaded
+  // sequence as a new MHA file, the original untouched (see
+  // USnavSequenceEditor)
+  bool saveFrameRange(int first, int last, const string& path);
+  bool saveValidFrames(const string& path);
+  // Calibration (ImageToProbe) from a 3x4/4x4 matrix file or a scene node
+  bool loadCalibrationFile(const string& path);
+  void setCalibrationTransform(vtkMRMLLinearTransformNode*);
+  void setImageToProbeMatrix(vtkMatrix4x4*);
+  const double* getImageToTrackerMatrix(int frame);
+  const double* getTrackerToImageMatrix(int frame);
+  // Frames whose image plane is within maxDegrees of the rotation of
+  // `orientation` (tracker space), sorted by frame number
+  void findFramesWithOrientation(vtkMatrix4x4* orientation, double maxDegrees, vector<int>& frames);
+  GETSET(double, matchingMaxAngle, MatchingMaxAngle);
+  GETSET(int, matchingResultCount, MatchingResultCount);
+  GETSET(bool, incrementalMatching, IncrementalMatching);
+  // Metric by name (see USnavMatchFrames), false if unknown
+  bool setMatchingMetric(const string& name);
+  string getMatchingMetric() const { return USnavMatchFrames::getMetricName(this->matchingMetric); }
+  // Offline review: ranks frames for each of numberOfPoses stylus poses
+  // (16 row-major doubles each), spread over a thread pool. Uses the same
+  // settings as findMatchingUS() except the warm start. 0 threads = all cores.
+  void findMatchingUSBatch(const double* stylusPoses, int numberOfPoses, vector<vector<pair<double,int> > >& results, int numberOfThreads = 0);
+  // Frames the last incremental query had to evaluate
+  int getLastMatchingCost() const { return this->sweepIndex.getLastEvaluatedFrames(); }
+  const vector<pair<double,int> >& getMatches() const { return this->matches; }
+  // Similarity of each re-ranked match, parallel to the start of getMatches()
+  const vector<double>& getMatchScores() const { return this->matchScores; }
+  GETSET(int, rerankCount, RerankCount);
+  GETSET(int, rerankStride, RerankStride);
+  // A USnavSimilarityMeasure
+  GETSET(int, similarityMeasure, SimilarityMeasure);
+  // Similarity between a frame and the MR volume resampled on its plane
+  double getFrameSimilarity(int frame);
+  // Rigid registration of registrationFrames frames spread over the
+  // keyframes (or the valid frames) with the MR volume, sampling every
+  // registrationStride pixels of the fan. False without MR volume or
+  // tracked frames, or when no better alignment was found.
+  bool registerToMR();
+  void resetRegistration();
+  vtkMatrix4x4* getTrackerToRASMatrix() { return this->TrackerToRASTransform; }
+  // Valid frames whose image crosses the grid cells overlapping RAS bounds
+  // (xmin,xmax,ymin,ymax,zmin,zmax), or the cell of a point: a superset at
+  // the grid resolution, sorted. Empty without MR volume.
+  void findFramesCoveringRegion(const double rasBounds[6], vector<int>& frames);
+  void findFramesCoveringPoint(const double ras[3], vector<int>& frames);
+  // Frames per grid cell as a heat map, x fastest, with its IJK to RAS
+  // matrix. False without MR volume.
+  bool getCoverageMap(vector<unsigned short>& counts, int dimensions[3], vtkMatrix4x4* ijkToRAS);
+  void setCoverageCellSize(double mm);
+  GET(double, coverageCellSize, CoverageCellSize);
+  void updateCoverageIndex();
+  GETSET(int, registrationFrames, RegistrationFrames);
+  GETSET(int, registrationStride, RegistrationStride);
+  // Normalized mutual information reached by the last registration
+  GET(double, registrationMetric, RegistrationMetric);
+  // Groups redundant valid frames (see USnavSequenceAnalysis); 0 disables
+  // the intensity criterion
+  void setKeyframeThresholds(double maxTranslation, double maxRotation, double maxIntensityChange);
+  void computeKeyframes();
+  const vector<int>& getKeyframes() const { return this->analysis.getKeyframes(); }
+  void setKeyframesOnly(bool);
+  GET(bool, keyframesOnly, KeyframesOnly);
+  // Frames moving faster than maxSpeed (mm/s) or maxAngularSpeed
+  // (degrees/s), or further than maxJitter (mm) from the path through
+  // their neighbours are flagged, along with repeated poses and timestamp
+  // gaps (see USnavSequenceAnalysis)
+  void setKinematicsThresholds(double maxSpeed, double maxAngularSpeed, double maxJitter);
+  // USnavSequenceAnalysis::MotionFlags of `frame`
+  unsigned int getFrameMotionFlags(int frame) { return this->analysis.getMotionFlags(frame); }
+  double getFrameSpeed(int frame) { return this->analysis.getSpeed(frame); }
+  double getFrameAngularSpeed(int frame) { return this->analysis.getAngularSpeed(frame); }
+  double getFrameAcceleration(int frame) { return this->analysis.getAcceleration(frame); }
+  double getFrameJitter(int frame) { return this->analysis.getJitter(frame); }
+  int getNumberOfUnstableFrames() { return this->analysis.getNumberOfFlaggedFrames(); }
+  // Measures the image motion between consecutive valid frames and flags
+  // the frames whose poses disagree by more than maxShiftError (pixels),
+  // whose images stay above stillCorrelation while the poses leave the
+  // plane by more than maxElevation (mm), or whose images decorrelate below
+  // minCorrelation while the poses stay (see USnavSequenceAnalysis).
+  // Frames are compared on their pyramid thumbnails; until the pyramid is
+  // complete it returns false, unless readFullFrames lets it read and
+  // reduce the missing frames itself (batch use, not on the GUI thread)
+  bool computeImageMotion(int numberOfThreads = 0, bool readFullFrames = false);
+  void setImageMotionThresholds(double maxShiftError, double minCorrelation, double maxElevation);
+  int getNumberOfImageMismatches() { return this->analysis.getNumberOfImageMismatches(); }
+  // Median block correlation with the previous valid frame, -1 if not measured
+  float getFrameImageCorrelation(int frame) { return this->analysis.getImageCorrelation(frame); }
+  void setSkipUnstableFrames(bool);
+  GET(bool, skipUnstableFrames, SkipUnstableFrames);
+  // Sweeps end where tracking is lost for more than maxInvalidRun frames,
+  // the timestamps jump by more than maxTimeGap (s) or the pose by more
+  // than maxJump (mm) or maxRotationJump (degrees)
+  void setSweepThresholds(int maxInvalidRun, double maxTimeGap, double maxJump, double maxRotationJump);
+  int getNumberOfSweeps() const { return this->analysis.getNumberOfSweeps(); }
+  // Sweep of `frame`, -1 if none
+  int getSweepOf(int frame) const { return this->analysis.getSweepOf(frame); }
+  int getSweepFirstFrame(int sweep) const { return this->analysis.getSweepFirstFrame(sweep); }
+  int getSweepLastFrame(int sweep) const { return this->analysis.getSweepLastFrame(sweep); }
+  // Only sweeps within this distance (mm) of the stylus are matched, 0 for
+  // all of them
+  void setSweepSearchMargin(double mm) { this->sweepIndex.setSearchMargin(mm); }
+  double getSweepSearchMargin() const { return this->sweepIndex.getSearchMargin(); }
+  void nextSweep();
+  void previousSweep();
   void updateImage();
   void nextImage();
   void nextValidFrame();
   void goToFrame(int);
+  // Scrubbing: show the frame from the pyramid, then refine once at rest
+  void previewFrame(int);
+  void refineFrame();
+  GET(int, displayedLevel, DisplayedLevel);
+  // Speckle median, gain, TGC and window applied to the frames shown (see
+  // USnavImageEnhancement); processed frames are cached too
+  void setEnhancement(const USnavImageEnhancement::Parameters& parameters);
+  const USnavImageEnhancement::Parameters& getEnhancement() const { return this->enhancement.getParameters(); }
+  // Cine: plays from the current frame at the recorded rate times the
+  // speed. Call updateCine() when it asks, it shows the frame due and
+  // returns the milliseconds until the next one, -1 once stopped.
+  bool startCine();
+  void stopCine();
+  bool isCinePlaying() { return this->cinePlayer.isPlaying(); }
+  int updateCine();
+  void setCineSpeed(double speed);
+  double getCineSpeed() { return this->cinePlayer.getSpeed(); }
+  USnavCinePlayer::Statistics getCineStatistics() { return this->cinePlayer.getStatistics(); }
+  double getPyramidProgress();
+  // Blocks until the pyramid is loaded or built and saved; false if it was
+  // not started (too large for the memory budget) or is incomplete
+  bool waitForPyramid();
+  // Downsampled pixels for filmstrips, NULL until the frame is built
+  const unsigned char* getThumbnail(int frame, int level, int& width, int& height);
+  // Bytes shared by the frame cache and the pyramid. The pyramid is only
+  // built when it takes at most half of it.
+  void setMemoryBudget(size_t bytes);
+  GET(size_t, memoryBudget, MemoryBudget);
+  USnavFrameCache::Statistics getFrameCacheStatistics();
+  // Fan detection on `samples` frames spread over the sequence, done on
+  // load when autoDetectROI is set; false if nothing was found
+  bool detectROI(int samples = 16);
+  void setROIRectangle(int x0, int y0, int x1, int y1);
+  void resetROI();
+  const USnavFrameROI& getROI() const { return this->roi; }
+  GETSET(bool, autoDetectROI, AutoDetectROI);
   void previousValidFrame();
   void nextInvalidFrame();
   void previousInvalidFrame();
@@ -0,0 +1,260 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// USnav includes
+#include "USnavFrameCache.h"
+#include "USnavParallel.h"
+
+// VTK includes
+#include <vtkType.h>
+
+// STD includes
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+const size_t entryBytes = 100;
+
+// Contents that tell frames and variants apart
+void makeEntry(int frame, unsigned int variant, std::vector<unsigned char>& data)
+{
+  data.resize(entryBytes);
+  for(size_t i=0; i<data.size(); i++)
+    data[i] = (unsigned char)(frame*31 + variant*7 + i);
+}
+
+void insert(USnavFrameCache& cache, int frame, double cost, unsigned int variant = 0)
+{
+  std::vector<unsigned char> data;
+  makeEntry(frame, variant, data);
+  cache.insert(USnavFrameCache::makeKey(frame, variant), &data[0], data.size(), cost);
+}
+
+bool fetchMatches(USnavFrameCache& cache, int frame, unsigned int variant = 0)
+{
+  std::vector<unsigned char> data, expected;
+  makeEntry(frame, variant, expected);
+  data.resize(entryBytes);
+  return cache.fetch(USnavFrameCache::makeKey(frame, variant), &data[0], data.size()) && data == expected;
+}
+
+// Frames in `present` are cached and frames in `absent` are not
+bool check(USnavFrameCache& cache, const char* name, const int* present, int presentCount, const int* absent,
+           int absentCount)
+{
+  for(int i=0; i<presentCount; i++)
+    if(!cache.contains(USnavFrameCache::makeKey(present[i])))
+    {
+      std::cerr << name << ": frame " << present[i] << " was evicted" << std::endl;
+      return false;
+    }
+  for(int i=0; i<absentCount; i++)
+    if(cache.contains(USnavFrameCache::makeKey(absent[i])))
+    {
+      std::cerr << name << ": frame " << absent[i] << " is still cached" << std::endl;
+      return false;
+    }
+  return true;
+}
+
+// With equal costs the least recently used entry goes first
+bool testLeastRecentlyUsed()
+{
+  USnavFrameCache cache;
+  cache.setBudget(4*entryBytes);
+  for(int i=0; i<4; i++)
+    insert(cache, i, 1);
+  insert(cache, 4, 1);
+  if(!fetchMatches(cache, 1))
+  {
+    std::cerr << "LRU: frame 1 does not read back" << std::endl;
+    return false;
+  }
+  // Frame 1 was used after 2 and 3, so 2 is the oldest now
+  insert(cache, 5, 1);
+  const int present[4] = { 1, 3, 4, 5 };
+  const int absent[2] = { 0, 2 };
+  if(!check(cache, "LRU", present, 4, absent, 2))
+    return false;
+  USnavFrameCache::Statistics stats = cache.getStatistics();
+  if(stats.evictions != 2 || stats.entries != 4 || stats.residentBytes != 4*entryBytes)
+  {
+    std::cerr << "LRU: " << stats.evictions << " evictions, " << stats.entries << " entries, "
+              << stats.residentBytes << " bytes" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Recency also decides the first eviction, before L has risen
+bool testFirstEviction()
+{
+  USnavFrameCache cache;
+  cache.setBudget(4*entryBytes);
+  for(int i=0; i<4; i++)
+    insert(cache, i, 1);
+  if(!fetchMatches(cache, 0))
+  {
+    std::cerr << "first eviction: frame 0 does not read back" << std::endl;
+    return false;
+  }
+  insert(cache, 4, 1);
+  const int present[4] = { 0, 2, 3, 4 };
+  const int absent[1] = { 1 };
+  return check(cache, "first eviction", present, 4, absent, 1);
+}
+
+// An entry that is expensive to recompute outlives many cheap ones
+bool testCost()
+{
+  USnavFrameCache cache;
+  cache.setBudget(4*entryBytes);
+  insert(cache, 0, 100);
+  for(int i=1; i<40; i++)
+    insert(cache, i, 1);
+  const int present[4] = { 0, 37, 38, 39 };
+  const int absent[3] = { 1, 2, 36 };
+  return check(cache, "cost", present, 4, absent, 3);
+}
+
+// Pinned entries survive eviction and a smaller budget until unpinned
+bool testPinning()
+{
+  USnavFrameCache cache;
+  cache.setBudget(3*entryBytes);
+  cache.pin(USnavFrameCache::makeKey(0));
+  insert(cache, 0, 1);
+  for(int i=1; i<10; i++)
+    insert(cache, i, 1);
+  const int present[3] = { 0, 8, 9 };
+  const int absent[2] = { 1, 7 };
+  if(!check(cache, "pinned", present, 3, absent, 2))
+    return false;
+
+  cache.setBudget(entryBytes);
+  USnavFrameCache::Statistics stats = cache.getStatistics();
+  if(stats.entries != 1 || stats.residentBytes != entryBytes || !fetchMatches(cache, 0))
+  {
+    std::cerr << "pinned: shrinking the budget left " << stats.entries << " entries" << std::endl;
+    return false;
+  }
+  cache.unpin(USnavFrameCache::makeKey(0));
+  insert(cache, 1, 1);
+  const int unpinned[1] = { 1 };
+  const int evicted[1] = { 0 };
+  return check(cache, "unpinned", unpinned, 1, evicted, 1);
+}
+
+// Hits, misses, sizes and ignored inserts are counted exactly
+bool testStatistics()
+{
+  USnavFrameCache cache;
+  cache.setBudget(4*entryBytes);
+  std::vector<unsigned char> large(5*entryBytes, 1);
+  cache.insert(USnavFrameCache::makeKey(0), &large[0], large.size(), 1);
+  cache.insert(USnavFrameCache::makeKey(1), &large[0], 0, 1);
+  insert(cache, 2, 1);
+  insert(cache, 2, 1, 1);
+  // Replacing an entry does not count its old bytes twice
+  insert(cache, 2, 1);
+
+  std::vector<unsigned char> small(entryBytes/2);
+  bool ok = !cache.contains(USnavFrameCache::makeKey(0)) && !cache.contains(USnavFrameCache::makeKey(1))
+         && fetchMatches(cache, 2) && fetchMatches(cache, 2, 1) && !fetchMatches(cache, 3)
+         && !cache.fetch(USnavFrameCache::makeKey(2), &small[0], small.size());
+  USnavFrameCache::Statistics stats = cache.getStatistics();
+  if(!ok || stats.hits != 2 || stats.misses != 2 || stats.hitRate() != 0.5 || stats.evictions != 0
+     || stats.entries != 2 || stats.residentBytes != 2*entryBytes || stats.budget != 4*entryBytes)
+  {
+    std::cerr << "statistics: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.entries
+              << " entries, " << stats.residentBytes << " bytes" << std::endl;
+    return false;
+  }
+
+  cache.remove(USnavFrameCache::makeKey(2, 1));
+  cache.resetStatistics();
+  stats = cache.getStatistics();
+  if(stats.hits != 0 || stats.misses != 0 || stats.entries != 1 || stats.residentBytes != entryBytes)
+  {
+    std::cerr << "statistics: remove or reset is wrong" << std::endl;
+    return false;
+  }
+  cache.clear();
+  stats = cache.getStatistics();
+  if(stats.entries != 0 || stats.residentBytes != 0)
+  {
+    std::cerr << "statistics: clear() left " << stats.entries << " entries" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+struct ConcurrentData
+{
+  USnavFrameCache* cache;
+  std::vector<int> corrupt;
+};
+
+void concurrentChunk(int begin, int end, int threadId, void* userData)
+{
+  ConcurrentData* data = static_cast<ConcurrentData*>(userData);
+  for(int i=begin; i<end; i++)
+  {
+    int frame = (i*7) % 64;
+    std::vector<unsigned char> pixels, expected;
+    makeEntry(frame, 0, expected);
+    pixels.resize(entryBytes);
+    if(data->cache->fetch(USnavFrameCache::makeKey(frame), &pixels[0], pixels.size()))
+    {
+      if(pixels != expected)
+        data->corrupt[threadId]++;
+    }
+    else
+      data->cache->insert(USnavFrameCache::makeKey(frame), &expected[0], expected.size(), 1);
+  }
+}
+
+// Concurrent fetches and inserts keep the contents and the budget
+bool testConcurrent()
+{
+  USnavFrameCache cache;
+  cache.setBudget(16*entryBytes);
+  ConcurrentData data;
+  data.cache = &cache;
+  data.corrupt.resize(usnavDefaultNumberOfThreads(), 0);
+  int threads = usnavParallelFor(20000, 16, concurrentChunk, &data, (int)data.corrupt.size());
+  USnavFrameCache::Statistics stats = cache.getStatistics();
+  int corrupt = 0;
+  for(int t=0; t<threads; t++)
+    corrupt += data.corrupt[t];
+  if(corrupt > 0 || stats.residentBytes > stats.budget || stats.hits + stats.misses != 20000)
+  {
+    std::cerr << "concurrent: " << corrupt << " corrupt fetches, " << stats.residentBytes << " bytes" << std::endl;
+    return false;
+  }
+  return true;
+}
+}
+
+int USnavFrameCacheTest(int vtkNotUsed(argc), char* vtkNotUsed(argv)[])
+{
+  if(!testLeastRecentlyUsed() || !testFirstEviction() || !testCost() || !testPinning() || !testStatistics() || !testConcurrent())
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
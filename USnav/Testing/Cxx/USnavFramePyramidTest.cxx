@@ -0,0 +1,107 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// USnav includes
+#include "USnavFramePyramid.h"
+#include "USnavTestingUtilities.h"
+
+// STD includes
+#include <cstdlib>
+#include <iostream>
+
+namespace
+{
+const int width = 64;
+const int height = 48;
+const int frames = 40;
+
+bool fileExists(const std::string& path)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if(file)
+    fclose(file);
+  return file != NULL;
+}
+}
+
+int USnavFramePyramidTest(int argc, char* argv[])
+{
+  if(argc < 2)
+  {
+    std::cerr << "Usage: USnavFramePyramidTest <temporary directory>" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string mhaPath = std::string(argv[1]) + "/USnavFramePyramidTest.mha";
+  std::string cachePath = USnavFramePyramid::getCacheFilename(mhaPath);
+  std::string bytes;
+  remove(cachePath.c_str());
+  if(!usnavWriteTestSequence(mhaPath, width, height, frames) || !usnavReadTestFile(mhaPath, bytes))
+  {
+    std::cerr << "could not write " << mhaPath << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  USnavFrameSource source;
+  source.path = mhaPath;
+  source.format = USnavFrameSource::RawFrames;
+  source.width = width;
+  source.height = height;
+  source.frames = frames;
+  source.dataOffset = (vtkTypeInt64)(bytes.size() - source.getFrameSize()*frames);
+
+  // A complete build is cached
+  USnavFramePyramid pyramid;
+  pyramid.start(source);
+  pyramid.wait();
+  if(!pyramid.isComplete() || !pyramid.getFrame(1, frames-1) || !fileExists(cachePath))
+  {
+    std::cerr << "the pyramid of " << mhaPath << " was not built and cached" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // The last frames of a truncated file cannot be read: they stay missing
+  // and the now stale cache is removed rather than replaced
+  FILE* file = fopen(mhaPath.c_str(), "wb");
+  if(!file)
+    return EXIT_FAILURE;
+  fwrite(bytes.data(), 1, bytes.size() - 5*source.getFrameSize()/2, file);
+  fclose(file);
+  pyramid.start(source);
+  pyramid.wait();
+  if(pyramid.isComplete() || !pyramid.getFrame(2, 0) || !pyramid.getFrame(2, frames-4)
+     || pyramid.getFrame(2, frames-3) || pyramid.getFrame(1, frames-1))
+  {
+    std::cerr << "frames of the truncated " << mhaPath << " are wrong" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if(fileExists(cachePath))
+  {
+    std::cerr << cachePath << " was kept for an incomplete pyramid" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Reopening does not take the missing frames for built ones either
+  USnavFramePyramid reopened;
+  reopened.start(source);
+  reopened.wait();
+  if(reopened.isComplete() || reopened.getFrame(1, frames-1))
+  {
+    std::cerr << "the truncated " << mhaPath << " reopened as complete" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
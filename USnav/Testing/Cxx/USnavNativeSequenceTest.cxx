@@ -0,0 +1,134 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// USnav includes
+#include "USnavFrameReader.h"
+#include "USnavNativeSequence.h"
+#include "USnavTestingUtilities.h"
+#include "USnavTransformStore.h"
+
+// STD includes
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+const int width = 37;
+const int height = 11;
+const int frames = 23;
+
+// MHA -> native -> MHA gives the original bytes, and the native frames are
+// the MHA ones
+bool testRoundTrip(const std::string& directory, const USnavNativeSequence::Options& options, const char* name)
+{
+  std::string mhaPath = directory + "/USnavNativeSequenceTest.mha";
+  std::string nativePath = directory + "/USnavNativeSequenceTest" + USnavNativeSequence::getExtension();
+  std::string backPath = directory + "/USnavNativeSequenceTestBack.mha";
+  std::string original, back;
+  if(!usnavWriteTestSequence(mhaPath, width, height, frames) || !usnavReadTestFile(mhaPath, original))
+  {
+    std::cerr << name << ": could not write " << mhaPath << std::endl;
+    return false;
+  }
+  if(!USnavNativeSequence::convertFromMha(mhaPath, nativePath, options)
+     || !USnavNativeSequence::isNativeFile(nativePath))
+  {
+    std::cerr << name << ": conversion to " << nativePath << " failed" << std::endl;
+    return false;
+  }
+
+  USnavFrameSource source;
+  USnavTransformStore transforms;
+  if(!USnavNativeSequence::read(nativePath, source, transforms)
+     || source.width != width || source.height != height || source.frames != frames
+     || transforms.getNumberOfFrames() != frames)
+  {
+    std::cerr << name << ": " << nativePath << " does not read back" << std::endl;
+    return false;
+  }
+  // Frames in reverse order, so that blocks are not only read sequentially
+  USnavFrameReader reader(source);
+  std::vector<unsigned char> pixels(source.getFrameSize());
+  size_t dataOffset = original.size() - (size_t)width*height*frames;
+  for(int i=frames-1; i>=0; i--)
+  {
+    if(!reader.readFrame(i, &pixels[0])
+       || memcmp(&pixels[0], original.data() + dataOffset + (size_t)i*width*height, pixels.size()) != 0)
+    {
+      std::cerr << name << ": frame " << i << " differs" << std::endl;
+      return false;
+    }
+  }
+
+  if(!USnavNativeSequence::convertToMha(nativePath, backPath) || !usnavReadTestFile(backPath, back)
+     || back != original)
+  {
+    std::cerr << name << ": " << backPath << " differs from " << mhaPath << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// A metadata size the compressed record cannot decode to is not allocated
+bool testCorruptMetadataSize(const std::string& directory)
+{
+  std::string nativePath = directory + "/USnavNativeSequenceTest" + USnavNativeSequence::getExtension();
+  std::string bytes;
+  if(!usnavReadTestFile(nativePath, bytes) || bytes.size() < 64)
+    return false;
+  // Decoded metadata size, the last of the header fields
+  vtkTypeInt64 decodedSize = (vtkTypeInt64)1 << 50;
+  memcpy(&bytes[56], &decodedSize, sizeof(decodedSize));
+  std::string corruptPath = directory + "/USnavNativeSequenceTestCorrupt" + USnavNativeSequence::getExtension();
+  FILE* file = fopen(corruptPath.c_str(), "wb");
+  if(!file)
+    return false;
+  fwrite(bytes.data(), 1, bytes.size(), file);
+  fclose(file);
+
+  USnavFrameSource source;
+  USnavTransformStore transforms;
+  if(USnavNativeSequence::read(corruptPath, source, transforms))
+  {
+    std::cerr << "corrupt metadata size: " << corruptPath << " was accepted" << std::endl;
+    return false;
+  }
+  return true;
+}
+}
+
+int USnavNativeSequenceTest(int argc, char* argv[])
+{
+  if(argc < 2)
+  {
+    std::cerr << "Usage: USnavNativeSequenceTest <temporary directory>" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string directory = argv[1];
+
+  USnavNativeSequence::Options raw;
+  raw.framesPerBlock = 1;
+  raw.delta = false;
+  USnavNativeSequence::Options delta;
+  delta.framesPerBlock = 4;
+  delta.delta = true;
+  if(!testRoundTrip(directory, raw, "raw") || !testRoundTrip(directory, delta, "delta")
+     || !testCorruptMetadataSize(directory))
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,180 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// USnav includes
+#include "USnavOrientationIndex.h"
+
+// VTK includes
+#include <vtkType.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+unsigned int seed = 7;
+
+double uniform()
+{
+  seed = seed*1103515245u + 12345u;
+  return ((seed >> 8) & 0xffff) / 65535.0;
+}
+
+// Uniformly distributed unit quaternion, by rejection
+void randomQuaternion(double q[4])
+{
+  double norm = 0;
+  do
+  {
+    norm = 0;
+    for(int k=0; k<4; k++)
+    {
+      q[k] = 2*uniform() - 1;
+      norm += q[k]*q[k];
+    }
+  } while(norm > 1 || norm < 1e-6);
+  for(int k=0; k<4; k++)
+    q[k] /= sqrt(norm);
+}
+
+// Row-major 4x4 with the rotation of q, columns scaled like image spacing
+void quaternionToMatrix(const double q[4], double m[16])
+{
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  double r[9] = { 1 - 2*(y*y + z*z), 2*(x*y - w*z), 2*(x*z + w*y),
+                  2*(x*y + w*z), 1 - 2*(x*x + z*z), 2*(y*z - w*x),
+                  2*(x*z - w*y), 2*(y*z + w*x), 1 - 2*(x*x + y*y) };
+  double scale[3] = { 0.2, 0.3, 1.0 };
+  for(int i=0; i<3; i++)
+  {
+    for(int j=0; j<3; j++)
+      m[4*i+j] = r[3*i+j]*scale[j];
+    m[4*i+3] = 100*uniform();
+    m[12+i] = 0;
+  }
+  m[15] = 1;
+}
+
+bool testConversions()
+{
+  // 30 degrees about z, then the same rotation as -q
+  const double a = 30/57.29577951308232;
+  double m[16] = { cos(a), -sin(a), 0, 5,
+                   sin(a), cos(a), 0, 6,
+                   0, 0, 1, 7,
+                   0, 0, 0, 1 };
+  double identity[4] = { 1, 0, 0, 0 };
+  double q[4], negated[4];
+  USnavOrientationIndex::matrixToQuaternion(m, q);
+  for(int k=0; k<4; k++)
+    negated[k] = -q[k];
+  if(fabs(USnavOrientationIndex::angleBetween(identity, q) - 30) > 1e-9
+     || fabs(USnavOrientationIndex::angleBetween(q, negated)) > 1e-6)
+  {
+    std::cerr << "matrixToQuaternion or angleBetween is wrong" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Every query returns exactly the frames a linear scan finds
+bool testQueries()
+{
+  const int numberOfFrames = 600;
+  std::vector<double> matrices(16*numberOfFrames);
+  std::vector<double> rotations(4*numberOfFrames);
+  std::vector<int> frames;
+  for(int i=0; i<numberOfFrames; i++)
+  {
+    // Runs of nearby orientations, as in a sweep, and some frames left out
+    if(i % 50 == 0 || uniform() < 0.2)
+      randomQuaternion(&rotations[4*i]);
+    else
+    {
+      double* q = &rotations[4*i];
+      double norm = 0;
+      for(int k=0; k<4; k++)
+      {
+        q[k] = rotations[4*(i-1)+k] + 0.02*(uniform() - 0.5);
+        norm += q[k]*q[k];
+      }
+      for(int k=0; k<4; k++)
+        q[k] /= sqrt(norm);
+    }
+    quaternionToMatrix(&rotations[4*i], &matrices[16*i]);
+    if(i % 7 != 3)
+      frames.push_back(i);
+  }
+
+  USnavOrientationIndex index;
+  index.build(&matrices[0], frames);
+  double q[4];
+  if(index.isEmpty() || !index.getQuaternion(frames[0], q) || index.getQuaternion(3, q))
+  {
+    std::cerr << "indexed frames are wrong" << std::endl;
+    return false;
+  }
+
+  const double angles[5] = { 0.5, 5, 20, 90, 180 };
+  for(int t=0; t<100; t++)
+  {
+    double query[4];
+    if(t % 2)
+      randomQuaternion(query);
+    else
+      index.getQuaternion(frames[(t*37) % frames.size()], query);
+    double maxDegrees = angles[t % 5];
+
+    std::vector<int> found, expected;
+    index.findWithinAngle(query, maxDegrees, found);
+    for(size_t i=0; i<frames.size(); i++)
+    {
+      index.getQuaternion(frames[i], q);
+      if(USnavOrientationIndex::angleBetween(query, q) <= maxDegrees)
+        expected.push_back(frames[i]);
+    }
+    std::sort(found.begin(), found.end());
+    if(found != expected)
+    {
+      std::cerr << "query " << t << " within " << maxDegrees << " degrees: " << found.size() << " frames instead of "
+                << expected.size() << std::endl;
+      return false;
+    }
+  }
+
+  index.clear();
+  std::vector<int> found;
+  index.findWithinAngle(q, 180, found);
+  if(!index.isEmpty() || !found.empty())
+  {
+    std::cerr << "clear() left frames indexed" << std::endl;
+    return false;
+  }
+  return true;
+}
+}
+
+int USnavOrientationIndexTest(int vtkNotUsed(argc), char* vtkNotUsed(argv)[])
+{
+  if(!testConversions() || !testQueries())
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// USnav includes
+#include "USnavRigidRegistration.h"
+#include "USnavVolumeSampler.h"
+
+// VTK includes
+#include <vtkImageData.h>
+#include <vtkNew.h>
+#include <vtkType.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+const int volumeSize = 80;
+const int width = 120;
+const int height = 100;
+const int frames = 12;
+
+// Smooth blobs of different brightness, in 1 mm voxels
+double blobs(const double p[3])
+{
+  const double centers[5][3] = { { 20, 30, 40 }, { 50, 40, 30 }, { 40, 60, 50 }, { 30, 45, 25 }, { 55, 25, 55 } };
+  double value = 0;
+  for(int b=0; b<5; b++)
+  {
+    double dx = p[0] - centers[b][0], dy = p[1] - centers[b][1], dz = p[2] - centers[b][2];
+    value += (b + 1)*40*exp(-(dx*dx + dy*dy + dz*dz)/60.0);
+  }
+  return value;
+}
+
+void transformPoint(const double m[16], const double in[3], double out[3])
+{
+  for(int r=0; r<3; r++)
+    out[r] = m[4*r]*in[0] + m[4*r+1]*in[1] + m[4*r+2]*in[2] + m[4*r+3];
+}
+
+// Frame f lies in an x-z plane of the tracker, 0.5 mm pixels
+void frameToTracker(int f, double m[16])
+{
+  const double matrix[16] = { 0.5, 0, 0, 10,
+                              0, 0, 0.5, 20 + f*3.0,
+                              0, 0.5, 0, 10 + f*0.5,
+                              0, 0, 0, 1 };
+  std::copy(matrix, matrix + 16, m);
+}
+}
+
+// Frames whose intensities are a nonlinear function of the volume under a
+// known TrackerToRAS are registered from identity back to that transform
+int USnavRigidRegistrationTest(int vtkNotUsed(argc), char* vtkNotUsed(argv)[])
+{
+  vtkNew<vtkImageData> image;
+  image->SetDimensions(volumeSize, volumeSize, volumeSize);
+  image->AllocateScalars(VTK_FLOAT, 1);
+  float* voxels = static_cast<float*>(image->GetScalarPointer());
+  for(int k=0; k<volumeSize; k++)
+    for(int j=0; j<volumeSize; j++)
+      for(int i=0; i<volumeSize; i++)
+      {
+        double p[3] = { (double)i, (double)j, (double)k };
+        voxels[i + volumeSize*(j + volumeSize*k)] = (float)blobs(p);
+      }
+  const double identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+  USnavVolumeSampler volume;
+  volume.setVolume(image.GetPointer(), identity);
+
+  // 3 degrees about z and 3.9 mm away from identity
+  const double a = 3/57.29577951308232;
+  const double trackerToRAS[16] = { cos(a), -sin(a), 0, 3,
+                                    sin(a), cos(a), 0, -2,
+                                    0, 0, 1, 1.5,
+                                    0, 0, 0, 1 };
+  USnavRigidRegistration registration;
+  std::vector<unsigned char> pixels(width*height);
+  for(int f=0; f<frames; f++)
+  {
+    double m[16];
+    frameToTracker(f, m);
+    for(int v=0; v<height; v++)
+      for(int u=0; u<width; u++)
+      {
+        double pixel[3] = { (double)u, (double)v, 0 }, tracker[3], ras[3];
+        transformPoint(m, pixel, tracker);
+        transformPoint(trackerToRAS, tracker, ras);
+        pixels[v*width + u] = (unsigned char)std::min(255.0, 20 + 200*sqrt(blobs(ras)/300.0));
+      }
+    registration.addFrame(m, &pixels[0], width, height, 2, NULL);
+  }
+
+  USnavRigidRegistration::Parameters parameters;
+  USnavRigidRegistration::Result result;
+  if(!registration.run(volume, identity, parameters, result) || result.finalMetric <= result.initialMetric)
+  {
+    std::cerr << "registration failed: metric " << result.initialMetric << " -> " << result.finalMetric << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Largest displacement of a frame corner between the found and the true
+  // transform
+  double error = 0;
+  for(int f=0; f<frames; f++)
+  {
+    double m[16];
+    frameToTracker(f, m);
+    for(int c=0; c<4; c++)
+    {
+      double pixel[3] = { (double)(c%2)*(width-1), (double)(c/2)*(height-1), 0 }, tracker[3], found[3], expected[3];
+      transformPoint(m, pixel, tracker);
+      transformPoint(result.trackerToRAS, tracker, found);
+      transformPoint(trackerToRAS, tracker, expected);
+      double dx = found[0] - expected[0], dy = found[1] - expected[1], dz = found[2] - expected[2];
+      error = std::max(error, sqrt(dx*dx + dy*dy + dz*dz));
+    }
+  }
+  if(error > 0.05)
+  {
+    std::cerr << "registration is " << error << " mm off after " << result.evaluations << " evaluations" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
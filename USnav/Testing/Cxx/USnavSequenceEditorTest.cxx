@@ -0,0 +1,154 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// USnav includes
+#include "USnavSequenceEditor.h"
+#include "USnavTestingUtilities.h"
+
+// STD includes
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+const int width = 37;
+const int height = 11;
+const int frames = 23;
+
+// Lines of `frame` in an MHA header, without their "Seq_FrameNNNN" prefix
+std::string frameLines(const std::string& bytes, int frame)
+{
+  char prefix[32];
+  sprintf(prefix, "\nSeq_Frame%04d_", frame);
+  std::string lines;
+  size_t position = 0;
+  while((position = bytes.find(prefix, position)) != std::string::npos)
+  {
+    size_t end = bytes.find('\n', position + 1);
+    lines += bytes.substr(position + 14, end - position - 14) + "\n";
+    position = end;
+  }
+  return lines;
+}
+
+// `output` holds the listed frames of `input`, headers renumbered from 0
+// and pixels in that order
+bool checkFrames(const std::string& inputPath, const std::string& outputPath, const std::vector<int>& selected,
+                 const char* name)
+{
+  std::string input, output;
+  if(!usnavReadTestFile(inputPath, input) || !usnavReadTestFile(outputPath, output))
+  {
+    std::cerr << name << ": " << outputPath << " was not written" << std::endl;
+    return false;
+  }
+  char dimensions[64];
+  sprintf(dimensions, "\nDimSize = %d %d %d\n", width, height, (int)selected.size());
+  if(output.find(dimensions) == std::string::npos || !frameLines(output, (int)selected.size()).empty())
+  {
+    std::cerr << name << ": DimSize or the number of frame headers is wrong" << std::endl;
+    return false;
+  }
+  const size_t frameSize = (size_t)width*height;
+  size_t inputData = input.size() - frameSize*frames;
+  size_t outputData = output.size() - frameSize*selected.size();
+  for(size_t i=0; i<selected.size(); i++)
+  {
+    if(frameLines(output, (int)i).empty() || frameLines(output, (int)i) != frameLines(input, selected[i]))
+    {
+      std::cerr << name << ": header of frame " << i << " is not that of input frame " << selected[i] << std::endl;
+      return false;
+    }
+    if(memcmp(output.data() + outputData + i*frameSize, input.data() + inputData + selected[i]*frameSize,
+              frameSize) != 0)
+    {
+      std::cerr << name << ": pixels of frame " << i << " are not those of input frame " << selected[i] << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+}
+
+int USnavSequenceEditorTest(int argc, char* argv[])
+{
+  if(argc < 2)
+  {
+    std::cerr << "Usage: USnavSequenceEditorTest <temporary directory>" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string directory = argv[1];
+  std::string inputPath = directory + "/USnavSequenceEditorTest.mha";
+  std::string outputPath = directory + "/USnavSequenceEditorTestOut.mha";
+  if(!usnavWriteTestSequence(inputPath, width, height, frames))
+  {
+    std::cerr << "could not write " << inputPath << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // A run of consecutive frames, a frame from before it and the last one
+  std::vector<int> selected;
+  selected.push_back(5);
+  selected.push_back(6);
+  selected.push_back(7);
+  selected.push_back(2);
+  selected.push_back(frames - 1);
+  if(!USnavSequenceEditor::extractFrames(inputPath, selected, outputPath)
+     || !checkFrames(inputPath, outputPath, selected, "extract"))
+    return EXIT_FAILURE;
+
+  selected.clear();
+  for(int i=3; i<=frames-1; i++)
+    selected.push_back(i);
+  if(!USnavSequenceEditor::trim(inputPath, 3, frames + 10, outputPath)
+     || !checkFrames(inputPath, outputPath, selected, "trim"))
+    return EXIT_FAILURE;
+
+  // Every seventh pose of the test sequence is INVALID
+  selected.clear();
+  for(int i=0; i<frames; i++)
+    if(i%7)
+      selected.push_back(i);
+  if(!USnavSequenceEditor::keepValidFrames(inputPath, "ProbeToTracker", outputPath)
+     || !checkFrames(inputPath, outputPath, selected, "valid"))
+    return EXIT_FAILURE;
+
+  std::string output;
+  std::vector<std::string> paths(2, inputPath);
+  if(!USnavSequenceEditor::concatenate(paths, outputPath) || !usnavReadTestFile(outputPath, output)
+     || frameLines(output, frames + 4) != frameLines(output, 4) || frameLines(output, 2*frames - 1).empty()
+     || !frameLines(output, 2*frames).empty())
+  {
+    std::cerr << "concatenate: the second sequence is not renumbered after the first" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Failed edits leave the input alone and no output behind
+  std::string before, after;
+  selected.assign(1, frames);
+  remove(outputPath.c_str());
+  if(!usnavReadTestFile(inputPath, before)
+     || USnavSequenceEditor::extractFrames(inputPath, selected, outputPath)
+     || USnavSequenceEditor::trim(inputPath, 0, 1, inputPath)
+     || !usnavReadTestFile(inputPath, after) || after != before || usnavReadTestFile(outputPath, output))
+  {
+    std::cerr << "a failed edit changed " << inputPath << " or wrote " << outputPath << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME USnavTestingUtilities - synthetic sequences for the USnav tests
+// .SECTION Description
+// Writes small uncompressed MHA sequences: a static background with a
+// bright bar that moves from frame to frame plus a little noise, a probe
+// pose sliding along x, every seventh pose INVALID, and a timestamp.
+
+#ifndef __USnavTestingUtilities_h
+#define __USnavTestingUtilities_h
+
+// STD includes
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+inline bool usnavWriteTestSequence(const std::string& path, int width, int height, int frames)
+{
+  std::ostringstream header;
+  header << "ObjectType = Image\nNDims = 3\nDimSize = " << width << " " << height << " " << frames
+         << "\nElementType = MET_UCHAR\n";
+  for(int i=0; i<frames; i++)
+  {
+    char name[32];
+    sprintf(name, "Seq_Frame%04d_", i);
+    header << name << "ProbeToTrackerTransform = 1 0 0 " << 0.5*i << " 0 1 0 0 0 0 1 0 0 0 0 1\n"
+           << name << "ProbeToTrackerTransformStatus = " << (i%7 ? "OK" : "INVALID") << "\n"
+           << name << "Timestamp = " << i/30.0 << "\n";
+  }
+  header << "ElementDataFile = LOCAL\n";
+
+  std::vector<unsigned char> pixels((size_t)width*height*frames);
+  unsigned int seed = 1;
+  for(int i=0; i<frames; i++)
+    for(int y=0; y<height; y++)
+      for(int x=0; x<width; x++)
+      {
+        seed = seed*1103515245u + 12345u;
+        int value = (x + 2*y) % 64 + (int)((seed >> 16) & 3);
+        if(x > width/2 && (y + i) % height < 3)
+          value = 200;
+        pixels[((size_t)i*height + y)*width + x] = (unsigned char)value;
+      }
+
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file)
+    return false;
+  std::string text = header.str();
+  bool ok = fwrite(text.data(), 1, text.size(), file) == text.size()
+         && fwrite(&pixels[0], 1, pixels.size(), file) == pixels.size();
+  return fclose(file) == 0 && ok;
+}
+
+inline bool usnavReadTestFile(const std::string& path, std::string& bytes)
+{
+  bytes.clear();
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file)
+    return false;
+  char buffer[4096];
+  size_t count;
+  while((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    bytes.append(buffer, count);
+  fclose(file);
+  return true;
+}
+
+#endif
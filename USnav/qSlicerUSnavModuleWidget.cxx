@@ -17,6 +17,8 @@
 
 // Qt includes
 #include <QDebug>
+#include <QFileDialog>
+#include <QTimer>
 
 // SlicerQt includes
 #include "qSlicerUSnavModuleWidget.h"
@@ -25,6 +27,7 @@
 #include "vtkSlicerUSnavLogic.h"
 
 // STL includes
+#include <algorithm>
 #include <set>
 
 //-----------------------------------------------------------------------------
@@ -38,6 +41,15 @@ public:
   ~qSlicerUSnavModuleWidgetPrivate();
   qSlicerUSnavModuleWidgetPrivate(qSlicerUSnavModuleWidget& object);
   vtkSlicerUSnavLogic* logic() const;
+
+  // Refines the scrubbing preview once the slider rests
+  QTimer refineTimer;
+  // Polls the background frame export
+  QTimer exportTimer;
+  // Polls the background sequence loading
+  QTimer loadTimer;
+  // Fires when the next cine frame is due
+  QTimer cineTimer;
 };
 
 //-----------------------------------------------------------------------------
@@ -81,6 +93,9 @@ void qSlicerUSnavModuleWidget::setup()
   this->Superclass::setup();
   
   connect(d->filePathLineEdit, SIGNAL(currentPathChanged(const QString&)), this, SLOT(onFileChanged(const QString&)));
+  connect(d->cancelLoadingButton, SIGNAL(clicked()), this, SLOT(onCancelLoading()));
+  d->loadTimer.setInterval(100);
+  connect(&d->loadTimer, SIGNAL(timeout()), this, SLOT(onLoadingProgress()));
   connect(d->nextPushButton, SIGNAL(clicked()), this, SLOT(onNextImage()));
   connect(d->previousPushButton, SIGNAL(clicked()), this, SLOT(onPreviousImage()));
   
@@ -88,46 +103,221 @@ void qSlicerUSnavModuleWidget::setup()
   connect(d->nextValidFrameButton, SIGNAL(clicked()), this, SLOT(onNextValidFrame()));
   connect(d->previousInvalidFrameButton, SIGNAL(clicked()), this, SLOT(onPreviousInvalidFrame()));
   connect(d->nextInvalidFrameButton, SIGNAL(clicked()), this, SLOT(onNextInvalidFrame()));
+  connect(d->previousSweepButton, SIGNAL(clicked()), this, SLOT(onPreviousSweep()));
+  connect(d->nextSweepButton, SIGNAL(clicked()), this, SLOT(onNextSweep()));
   
   connect(d->frameSlider, SIGNAL(valueChanged(int)), this, SLOT(onFrameSliderChanged(int)));
+  connect(d->frameSlider, SIGNAL(sliderReleased()), this, SLOT(onRefineFrame()));
+  connect(d->playButton, SIGNAL(toggled(bool)), this, SLOT(onPlayToggled(bool)));
+  connect(d->cineSpeedSpinBox, SIGNAL(valueChanged(double)), this, SLOT(onCineSpeedChanged(double)));
+  connect(d->speckleFilterCheckBox, SIGNAL(toggled(bool)), this, SLOT(onEnhancementChanged()));
+  connect(d->gainSpinBox, SIGNAL(valueChanged(double)), this, SLOT(onEnhancementChanged()));
+  connect(d->tgcSpinBox, SIGNAL(valueChanged(double)), this, SLOT(onEnhancementChanged()));
+  connect(d->windowMinimumSpinBox, SIGNAL(valueChanged(int)), this, SLOT(onEnhancementChanged()));
+  connect(d->windowMaximumSpinBox, SIGNAL(valueChanged(int)), this, SLOT(onEnhancementChanged()));
+  d->cineTimer.setSingleShot(true);
+  connect(&d->cineTimer, SIGNAL(timeout()), this, SLOT(onCineFrame()));
+  d->refineTimer.setSingleShot(true);
+  d->refineTimer.setInterval(150);
+  connect(&d->refineTimer, SIGNAL(timeout()), this, SLOT(onRefineFrame()));
   
   connect(d->MRImageNodeComboBox, SIGNAL(currentNodeChanged(vtkMRMLNode*)), this, SLOT(onMrimageSelected(vtkMRMLNode*)));
   connect(d->stylusTransformNodeComboBox, SIGNAL(currentNodeChanged(vtkMRMLNode*)), this, SLOT(onStylusTransformChanged(vtkMRMLNode*)));
+  connect(d->calibrationTransformNodeComboBox, SIGNAL(currentNodeChanged(vtkMRMLNode*)), this, SLOT(onCalibrationTransformChanged(vtkMRMLNode*)));
+  connect(d->calibrationPathLineEdit, SIGNAL(currentPathChanged(const QString&)), this, SLOT(onCalibrationFileChanged(const QString&)));
+  
+  connect(d->computeKeyframesButton, SIGNAL(clicked()), this, SLOT(onComputeKeyframes()));
+  connect(d->checkImageMotionButton, SIGNAL(clicked()), this, SLOT(onCheckImageMotion()));
+  connect(d->keyframesOnlyCheckBox, SIGNAL(toggled(bool)), this, SLOT(onKeyframesOnlyToggled(bool)));
+  connect(d->skipUnstableFramesCheckBox, SIGNAL(toggled(bool)), this, SLOT(onSkipUnstableFramesToggled(bool)));
+  connect(d->detectROIButton, SIGNAL(clicked()), this, SLOT(onDetectROI()));
+  connect(d->registerToMRButton, SIGNAL(clicked()), this, SLOT(onRegisterToMR()));
+  connect(d->resetRegistrationButton, SIGNAL(clicked()), this, SLOT(onResetRegistration()));
+  
+  connect(d->exportPushButton, SIGNAL(clicked()), this, SLOT(onExportFrames()));
+  d->exportTimer.setInterval(250);
+  connect(&d->exportTimer, SIGNAL(timeout()), this, SLOT(onExportProgress()));
   
   d->logic()->setConsole(d->consoleTextEdit);
   
-  qvtkConnect(d->logic(), vtkCommand::ModifiedEvent, this, SLOT(updateState()));
+  qvtkConnect(d->logic(), vtkSlicerUSnavLogic::StateChangedEvent, this, SLOT(onLogicStateChanged(vtkObject*, void*)));
 }
 
 void qSlicerUSnavModuleWidget::onFileChanged(const QString& path)
 {
   Q_D(qSlicerUSnavModuleWidget);
   vtkSlicerUSnavLogic* logic = d->logic();
-  logic->setMhaPath(path.toStdString());
+  logic->loadMhaPath(path.toStdString());
+  if(!logic->getLoading())
+    return;
+  d->loadProgressBar->setValue(0);
+  d->cancelLoadingButton->setText("Cancel");
+  d->cancelLoadingButton->setEnabled(true);
+  d->loadTimer.start();
+}
+
+void qSlicerUSnavModuleWidget::onLoadingProgress()
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  vtkSlicerUSnavLogic* logic = d->logic();
+  bool loading = logic->pollLoading();
+  d->loadProgressBar->setValue((int)(100*logic->getLoadingProgress()));
+  if(loading)
+    return;
+  d->loadTimer.stop();
+  // Picking the same file again does not change the path, so a load that
+  // was cancelled or failed is restarted from the button
+  bool loaded = logic->isLoaded();
+  d->cancelLoadingButton->setText(loaded ? "Cancel" : "Reload");
+  d->cancelLoadingButton->setEnabled(!loaded);
+}
+
+void qSlicerUSnavModuleWidget::onCancelLoading()
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  vtkSlicerUSnavLogic* logic = d->logic();
+  if(!logic->getLoading())
+  {
+    this->onFileChanged(logic->getMhaPath().c_str());
+    return;
+  }
+  logic->cancelLoading();
+  this->onLoadingProgress();
 }
 
 void qSlicerUSnavModuleWidget::updateState()
+{
+  this->updateFields(vtkSlicerUSnavLogic::AllChanged);
+}
+
+void qSlicerUSnavModuleWidget::onLogicStateChanged(vtkObject* vtkNotUsed(caller), void* callData)
+{
+  unsigned int* changes = static_cast<unsigned int*>(callData);
+  this->updateFields(changes ? *changes : (unsigned int)vtkSlicerUSnavLogic::AllChanged);
+}
+
+void qSlicerUSnavModuleWidget::updateFields(unsigned int changes)
 {
   Q_D(qSlicerUSnavModuleWidget);
   vtkSlicerUSnavLogic* logic = d->logic();
   ostringstream oss;
   if(logic->getMhaPath().empty())
     return;
-  oss << logic->getCurrentFrame() << "/" << logic->getNumberOfFrames();
-  d->currentFrameLabel->setText(oss.str().c_str());
-  d->transformStatusLabel->setText(logic->getCurrentTransformStatus().c_str());
-  oss.clear(); oss.str("");
-  oss << logic->getImageWidth() << "x" << logic->getImageHeight();
-  d->imageDimensionsLabel->setText(oss.str().c_str());
-  d->frameSlider->setMaximum(logic->getNumberOfFrames());
-  d->frameSlider->setValue(logic->getCurrentFrame());
-  std::set<std::string> availableTransforms = logic->getAvailableTransforms();
-  std::string avTransText;
-  for(std::set<std::string>::iterator it=availableTransforms.begin(); it!=availableTransforms.end(); it++)
+  if(changes & vtkSlicerUSnavLogic::SequenceChanged)
+  {
+    oss << logic->getImageWidth() << "x" << logic->getImageHeight();
+    d->imageDimensionsLabel->setText(oss.str().c_str());
+  }
+  if(changes & (vtkSlicerUSnavLogic::FrameChanged | vtkSlicerUSnavLogic::SequenceChanged))
+  {
+    oss.clear(); oss.str("");
+    oss << logic->getCurrentFrame() << "/" << logic->getNumberOfFrames();
+    d->currentFrameLabel->setText(oss.str().c_str());
+    // Reflects the logic, must not call back into it
+    d->frameSlider->blockSignals(true);
+    d->frameSlider->setMaximum(logic->getNumberOfFrames());
+    d->frameSlider->setValue(logic->getCurrentFrame());
+    d->frameSlider->blockSignals(false);
+  }
+  if(changes & (vtkSlicerUSnavLogic::FrameChanged | vtkSlicerUSnavLogic::TransformsChanged))
+  {
+    d->transformStatusLabel->setText(logic->getCurrentTransformStatus().c_str());
+    oss.clear(); oss.str("");
+    int sweep = logic->getSweepOf(logic->getCurrentFrame());
+    if(sweep >= 0)
+      oss << "Sweep " << sweep + 1 << "/" << logic->getNumberOfSweeps();
+    else
+      oss << "No sweep";
+    d->sweepLabel->setText(oss.str().c_str());
+  }
+  if(changes & vtkSlicerUSnavLogic::TransformsChanged)
+  {
+    std::set<std::string> availableTransforms = logic->getAvailableTransforms();
+    std::string avTransText;
+    for(std::set<std::string>::iterator it=availableTransforms.begin(); it!=availableTransforms.end(); it++)
+    {
+      avTransText+=*it + ", ";
+    }
+    d->availableTransformsLabel->setText(avTransText.c_str());
+    oss.clear(); oss.str("");
+    if(logic->getRegistrationMetric() > 0)
+      oss << "Registered, NMI " << logic->getRegistrationMetric();
+    else
+      oss << "Not registered";
+    d->registrationLabel->setText(oss.str().c_str());
+  }
+  if(changes & vtkSlicerUSnavLogic::CacheChanged)
+  {
+    USnavFrameCache::Statistics stats = logic->getFrameCacheStatistics();
+    oss.clear(); oss.str("");
+    oss << stats.residentBytes/(1024*1024) << "/" << logic->getMemoryBudget()/(1024*1024) << " MB, "
+        << (int)(100*stats.hitRate()) << "% hits, " << stats.evictions << " evictions";
+    d->frameCacheStatisticsLabel->setText(oss.str().c_str());
+  }
+}
+
+void qSlicerUSnavModuleWidget::onFrameSliderChanged(int frame)
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  vtkSlicerUSnavLogic* logic = d->logic();
+  if(!d->frameSlider->isSliderDown())
+  {
+    d->refineTimer.stop();
+    logic->goToFrame(frame);
+    return;
+  }
+  // Dragging: show the low resolution level right away
+  logic->previewFrame(frame);
+  d->refineTimer.start();
+}
+
+void qSlicerUSnavModuleWidget::onRefineFrame()
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  d->refineTimer.stop();
+  d->logic()->refineFrame();
+}
+
+void qSlicerUSnavModuleWidget::onPlayToggled(bool play)
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  vtkSlicerUSnavLogic* logic = d->logic();
+  if(!play)
+  {
+    d->cineTimer.stop();
+    logic->stopCine();
+    d->playButton->setText("Play");
+    return;
+  }
+  logic->setCineSpeed(d->cineSpeedSpinBox->value());
+  if(!logic->startCine())
+  {
+    d->playButton->setChecked(false);
+    return;
+  }
+  d->playButton->setText("Stop");
+  this->onCineFrame();
+}
+
+void qSlicerUSnavModuleWidget::onCineFrame()
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  vtkSlicerUSnavLogic* logic = d->logic();
+  int wait = logic->updateCine();
+  USnavCinePlayer::Statistics stats = logic->getCineStatistics();
+  ostringstream oss;
+  oss.setf(ios::fixed);
+  oss.precision(1);
+  oss << stats.framesPerSecond << " fps, " << stats.droppedFrames << " dropped, "
+      << 1000*stats.jitter << " ms jitter";
+  d->cineStatisticsLabel->setText(oss.str().c_str());
+  if(wait < 0)
   {
-    avTransText+=*it + ", ";
+    // Reached the end or stopped elsewhere
+    d->playButton->setChecked(false);
+    return;
   }
-  d->availableTransformsLabel->setText(avTransText.c_str());
+  d->cineTimer.start(wait);
 }
 
 void qSlicerUSnavModuleWidget::onMrimageSelected(vtkMRMLNode* node)
@@ -150,11 +340,89 @@ void qSlicerUSnavModuleWidget::onStylusTransformChanged(vtkMRMLNode* node)
     d->logic()->setStylusTransform(tnode);
 }
 
+void qSlicerUSnavModuleWidget::onCalibrationTransformChanged(vtkMRMLNode* node)
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  d->logic()->setCalibrationTransform(vtkMRMLLinearTransformNode::SafeDownCast(node));
+}
+
+void qSlicerUSnavModuleWidget::onCalibrationFileChanged(const QString& path)
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  if(path.isEmpty())
+    return;
+  if(!d->logic()->loadCalibrationFile(path.toStdString()))
+    d->consoleTextEdit->insertPlainText("Could not read calibration from " + path + "\n");
+}
+
+void qSlicerUSnavModuleWidget::onExportFrames()
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  vtkSlicerUSnavLogic* logic = d->logic();
+  if(logic->isExporting())
+  {
+    logic->cancelExport();
+    return;
+  }
+  QString directory = QFileDialog::getExistingDirectory(this, "Export frames to");
+  if(directory.isEmpty())
+    return;
+  bool tiff = d->exportFormatComboBox->currentIndex() == 1;
+  if(!logic->exportFrames(directory.toStdString(), tiff, d->exportValidOnlyCheckBox->isChecked()))
+  {
+    d->consoleTextEdit->insertPlainText("Could not start the export\n");
+    return;
+  }
+  d->exportPushButton->setText("Cancel Export");
+  d->exportProgressBar->setValue(0);
+  d->exportTimer.start();
+}
+
+void qSlicerUSnavModuleWidget::onExportProgress()
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  vtkSlicerUSnavLogic* logic = d->logic();
+  d->exportProgressBar->setValue((int)(100*logic->getExportProgress()));
+  if(logic->isExporting())
+    return;
+  d->exportTimer.stop();
+  d->exportPushButton->setText("Export Frames...");
+  ostringstream oss;
+  if(logic->getExportProgress() < 1.0)
+    oss << "Export cancelled\n";
+  else
+    oss << "Export done, " << logic->getExportFailures() << " failures\n";
+  d->consoleTextEdit->insertPlainText(oss.str().c_str());
+}
+
+void qSlicerUSnavModuleWidget::onEnhancementChanged()
+{
+  Q_D(qSlicerUSnavModuleWidget);
+  USnavImageEnhancement::Parameters parameters;
+  parameters.median = d->speckleFilterCheckBox->isChecked();
+  parameters.gain = d->gainSpinBox->value();
+  // Linear from the top of the frame to the bottom
+  parameters.tgc.push_back(0.0);
+  parameters.tgc.push_back(d->tgcSpinBox->value());
+  parameters.windowMinimum = d->windowMinimumSpinBox->value();
+  parameters.windowMaximum = std::max(d->windowMaximumSpinBox->value(), d->windowMinimumSpinBox->value() + 1);
+  d->logic()->setEnhancement(parameters);
+}
+
 SLOTDEF_0(onNextImage, nextImage);
 SLOTDEF_0(onPreviousImage, previousImage);
 SLOTDEF_0(onPreviousValidFrame, previousValidFrame);
 SLOTDEF_0(onNextValidFrame, nextValidFrame);
 SLOTDEF_0(onPreviousInvalidFrame, previousInvalidFrame);
 SLOTDEF_0(onNextInvalidFrame, nextInvalidFrame);
-SLOTDEF_1(int, onFrameSliderChanged, goToFrame);
+SLOTDEF_0(onPreviousSweep, previousSweep);
+SLOTDEF_0(onNextSweep, nextSweep);
+SLOTDEF_0(onComputeKeyframes, computeKeyframes);
+SLOTDEF_0(onCheckImageMotion, computeImageMotion);
+SLOTDEF_0(onDetectROI, detectROI);
+SLOTDEF_0(onRegisterToMR, registerToMR);
+SLOTDEF_0(onResetRegistration, resetRegistration);
+SLOTDEF_1(bool, onKeyframesOnlyToggled, setKeyframesOnly);
+SLOTDEF_1(bool, onSkipUnstableFramesToggled, setSkipUnstableFrames);
+SLOTDEF_1(double, onCineSpeedChanged, setCineSpeed);
 
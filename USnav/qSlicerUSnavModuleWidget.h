@@ -25,6 +25,7 @@
 
 class qSlicerUSnavModuleWidgetPrivate;
 class vtkMRMLNode;
+class vtkObject;
 
 /// \ingroup Slicer_QtModules_ExtensionTemplate
 class Q_SLICER_QTMODULES_USNAV_EXPORT qSlicerUSnavModuleWidget :
@@ -40,21 +41,44 @@ public:
 
 public slots:
   void onFileChanged(const QString&);
+  void onLoadingProgress();
+  void onCancelLoading();
   void onFrameSliderChanged(int);
+  void onRefineFrame();
+  void onPlayToggled(bool);
+  void onCineFrame();
+  void onCineSpeedChanged(double);
+  void onEnhancementChanged();
   void onNextImage();
+  void onComputeKeyframes();
+  void onCheckImageMotion();
+  void onDetectROI();
+  void onRegisterToMR();
+  void onResetRegistration();
   void onPreviousImage();
   void onNextValidFrame();
   void onPreviousValidFrame();
   void onNextInvalidFrame();
   void onPreviousInvalidFrame();
+  void onNextSweep();
+  void onPreviousSweep();
   void updateState();
+  void onLogicStateChanged(vtkObject*, void*);
   void onMrimageSelected(vtkMRMLNode*);
   void onStylusTransformChanged(vtkMRMLNode*);
+  void onCalibrationTransformChanged(vtkMRMLNode*);
+  void onCalibrationFileChanged(const QString&);
+  void onExportFrames();
+  void onKeyframesOnlyToggled(bool);
+  void onSkipUnstableFramesToggled(bool);
+  void onExportProgress();
 
 protected:
   QScopedPointer<qSlicerUSnavModuleWidgetPrivate> d_ptr;
   
   virtual void setup();
+  // Refreshes the fields for the vtkSlicerUSnavLogic::StateChange bits
+  void updateFields(unsigned int changes);
 
 private:
   Q_DECLARE_PRIVATE(qSlicerUSnavModuleWidget);